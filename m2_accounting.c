@@ -1,8 +1,19 @@
 
+// m2_various.c
+static int m2_shadow_call_check(const char *uniqueid);
+static void m2_shadow_call_remove(const char *uniqueid);
+
 static int m2_accounting(calldata_t *cd) {
 
     m2_log(M2_NOTICE, "----------------------------------- ACCOUNTING ------------------------------------\n");
 
+    // copy of the call sent by FreeSWITCH shadow mode, the call is billed by the primary server
+    if (m2_shadow_call_check(cd->uniqueid)) {
+        m2_log(M2_NOTICE, "Shadow call will not be charged and its CDR will not be saved\n");
+        m2_shadow_call_remove(cd->uniqueid);
+        return 0;
+    }
+
     int connection = 0;
     char query[2048] = "";
 
@@ -207,6 +218,11 @@ static int m2_log_cdr(calldata_t *cd, int main_cdr) {
         return 0;
     }
 
+    // shadow call is saved by the primary server
+    if (m2_shadow_call_check(cd->uniqueid)) {
+        return 0;
+    }
+
     // should we log this cdr?
     if (do_not_log_failed_cdrs && strcmp(cd->dialstatus, "ANSWERED") != 0) {
         m2_log(M2_NOTICE, "Failed CDR will not be saved to database (do_not_log_failed_cdrs = 1)\n");
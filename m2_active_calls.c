@@ -110,6 +110,7 @@ static void m2_set_active_call(calldata_t *cd) {
 }
 
 
+static void m2_interim_call_remove(const char *uniqueid);
 
 static void m2_unset_active_call(calldata_t *cd) {
 
@@ -153,6 +154,8 @@ static void m2_unset_active_call(calldata_t *cd) {
         pthread_rwlock_unlock(&cd_hash_lock);
     }
 
+    m2_interim_call_remove(cd->uniqueid);
+
 
     active_calls_array[cd->active_call_id].status = -1;   // finished but not yet marked as free space (ac db table not updated for this call yet)
 
@@ -173,6 +176,232 @@ static void m2_unset_active_call(calldata_t *cd) {
 */
 
 
+/*
+    Media server status
+
+    FreeSWITCH sends Accounting-On/Off when it starts or stops (freeswitch-server-id tells which server), all calls
+    of that server which started before are gone. Periodic heartbeat (Interim-Update with freeswitch-heartbeat=<seq>/<part>/<parts>)
+    lists uuids of all live channels in freeswitch-live-calls, calls of that server which started well before the heartbeat
+    and are not in the list are gone too. Such calls are closed together on the next active calls check (causes 314/315,
+    the same as accounting timeouts) without sending hangup to the server, instead of waiting for accounting timeouts
+*/
+
+
+#define M2_MEDIA_SERVERS_MAX 1024
+#define M2_HEARTBEAT_MARGIN 60
+
+static struct {
+    double reset_time;          // calls started before Accounting-On/Off are gone
+    double heartbeat_time;      // start of the last complete heartbeat
+    double pending_time;        // start of the heartbeat which is being received
+    unsigned int pending_seq;
+    int pending_part;
+} m2_media_servers[M2_MEDIA_SERVERS_MAX];
+
+typedef struct {
+    char uniqueid[64];
+    int server_id;
+    double seen_time;
+    UT_hash_handle hh;
+} m2_live_call_t;
+
+static m2_live_call_t *m2_live_calls = NULL;
+static pthread_mutex_t m2_media_servers_lock = PTHREAD_MUTEX_INITIALIZER;
+static int media_server_check_requested = 0;
+
+static void m2_radius_get_attribute_value_by_name(REQUEST *request, char *attribute, char *value, long unsigned int len, int attr_type);
+static void m2_radius_foreach_attribute_value(REQUEST *request, char *attribute, void (*func)(char *value, void *arg), void *arg);
+
+static int m2_media_server_id(REQUEST *request) {
+
+    calldata_t *cd = NULL;
+    char server_id_str[10] = "";
+    int id = 0;
+
+    m2_radius_get_attribute_value_by_name(request, "freeswitch-server-id", server_id_str, sizeof(server_id_str), M2_CISCO_AVP);
+
+    if (strlen(server_id_str)) {
+        id = atoi(server_id_str);
+    }
+
+    if (id <= 0 || id >= M2_MEDIA_SERVERS_MAX) {
+        m2_log(M2_WARNING, "Media server status without valid freeswitch-server-id [%s]\n", server_id_str);
+        return 0;
+    }
+
+    return id;
+
+}
+
+// Accounting-On (7) or Accounting-Off (8)
+
+static void m2_media_server_status(REQUEST *request, int type) {
+
+    calldata_t *cd = NULL;
+    int id = m2_media_server_id(request);
+
+    if (!id) return;
+
+    pthread_mutex_lock(&m2_media_servers_lock);
+    m2_media_servers[id].reset_time = m2_get_current_time();
+    media_server_check_requested = 1;
+    pthread_mutex_unlock(&m2_media_servers_lock);
+
+    m2_log(M2_WARNING, "Media server [%d] sent Accounting-%s, its older calls will be closed\n", id, type == 7 ? "On" : "Off");
+
+}
+
+typedef struct {
+    int server_id;
+    double seen_time;
+} m2_live_calls_arg_t;
+
+// value is comma separated list of uuids, called with m2_media_servers_lock locked
+
+static void m2_live_calls_add(char *value, void *arg) {
+
+    m2_live_calls_arg_t *live = (m2_live_calls_arg_t *) arg;
+    char *uniqueid = NULL;
+    char *saveptr = NULL;
+    m2_live_call_t *call = NULL;
+
+    for (uniqueid = strtok_r(value, ",", &saveptr); uniqueid; uniqueid = strtok_r(NULL, ",", &saveptr)) {
+        HASH_FIND_STR(m2_live_calls, uniqueid, call);
+        if (call == NULL) {
+            if ((call = (m2_live_call_t *) malloc(sizeof(m2_live_call_t))) == NULL) return;
+            strlcpy(call->uniqueid, uniqueid, sizeof(call->uniqueid));
+            HASH_ADD_STR(m2_live_calls, uniqueid, call);
+        }
+        call->server_id = live->server_id;
+        call->seen_time = live->seen_time;
+    }
+
+}
+
+static void m2_media_server_heartbeat(REQUEST *request, char *heartbeat) {
+
+    calldata_t *cd = NULL;
+    int id = m2_media_server_id(request);
+    unsigned int seq = 0;
+    int part = 0;
+    int parts = 0;
+    m2_live_calls_arg_t live;
+    m2_live_call_t *call = NULL, *tmp = NULL;
+
+    if (!id) return;
+
+    if (sscanf(heartbeat, "%u/%d/%d", &seq, &part, &parts) != 3 || part < 1 || part > parts) {
+        m2_log(M2_WARNING, "Media server [%d] sent bad heartbeat [%s]\n", id, heartbeat);
+        return;
+    }
+
+    pthread_mutex_lock(&m2_media_servers_lock);
+
+    // parts come in order, heartbeat with missing part is dropped
+    if (part == 1) {
+        m2_media_servers[id].pending_seq = seq;
+        m2_media_servers[id].pending_time = m2_get_current_time();
+        m2_media_servers[id].pending_part = 0;
+    }
+
+    if (m2_media_servers[id].pending_seq != seq || m2_media_servers[id].pending_part != part - 1) {
+        m2_media_servers[id].pending_seq = 0;
+        pthread_mutex_unlock(&m2_media_servers_lock);
+        m2_log(M2_WARNING, "Media server [%d] heartbeat [%s] is incomplete, dropped\n", id, heartbeat);
+        return;
+    }
+
+    m2_media_servers[id].pending_part = part;
+    live.server_id = id;
+    live.seen_time = m2_media_servers[id].pending_time;
+    m2_radius_foreach_attribute_value(request, "freeswitch-live-calls", m2_live_calls_add, &live);
+
+    if (part == parts) {
+        m2_media_servers[id].heartbeat_time = m2_media_servers[id].pending_time;
+        media_server_check_requested = 1;
+
+        // calls which were not listed are closed by this heartbeat, they do not need to be remembered
+        HASH_ITER(hh, m2_live_calls, call, tmp) {
+            if (call->server_id == id && call->seen_time < m2_media_servers[id].heartbeat_time) {
+                HASH_DEL(m2_live_calls, call);
+                free(call);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&m2_media_servers_lock);
+
+}
+
+// call is gone from its media server, called with AC_ARRAY_LOCK locked
+
+static int m2_media_server_orphan(calldata_t *node) {
+
+    int id = node->server_id;
+    int orphan = 0;
+    m2_live_call_t *call = NULL;
+
+    if (id <= 0 || id >= M2_MEDIA_SERVERS_MAX) return 0;
+
+    pthread_mutex_lock(&m2_media_servers_lock);
+
+    if (node->start_time < m2_media_servers[id].reset_time) {
+        orphan = 1;
+    } else if (m2_media_servers[id].heartbeat_time > 0 && node->start_time < m2_media_servers[id].heartbeat_time - M2_HEARTBEAT_MARGIN) {
+        HASH_FIND_STR(m2_live_calls, node->uniqueid, call);
+        if (call == NULL || call->seen_time < m2_media_servers[id].heartbeat_time) {
+            orphan = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&m2_media_servers_lock);
+
+    return orphan;
+
+}
+
+static void m2_close_orphaned_calls() {
+
+    // this variable is used by m2_log function
+    calldata_t *cd = NULL;
+    calldata_t *node = NULL;
+    int closed = 0;
+    int i;
+
+    pthread_mutex_lock(&m2_media_servers_lock);
+    media_server_check_requested = 0;
+    pthread_mutex_unlock(&m2_media_servers_lock);
+
+    m2_mutex_lock(AC_ARRAY_LOCK);
+
+    for (i = 1; i < ACTIVE_CALLS_ARRAY_COUNT; i++) {
+
+        if (active_calls_array[i].status > 0 && active_calls_array[i].cd != NULL) {
+            node = active_calls_array[i].cd;
+
+            if (node->call_state > M2_NEW_STATE && node->call_state < M2_FINISHED_STATE && !node->system_hangup_reason && m2_media_server_orphan(node)) {
+                if (node->call_state < M2_ANSWERED_STATE) {
+                    node->system_hangup_reason = M2_HANGUP_ACCT_START_TIMEOUT;
+                    m2_set_hangupcause(node, 314);
+                } else {
+                    node->system_hangup_reason = M2_HANGUP_ACCT_STOP_TIMEOUT;
+                    m2_set_hangupcause(node, 315);
+                }
+                hangup_requested = 1;
+                closed++;
+            }
+        }
+    }
+
+    m2_mutex_unlock(AC_ARRAY_LOCK);
+
+    if (closed) {
+        m2_log(M2_WARNING, "Closing %d call(s) which are gone from their media servers\n", closed);
+    }
+
+}
+
+
 static void *m2_handle_active_calls() {
 
     int auth_resp_counter = 0;
@@ -208,6 +437,11 @@ static void *m2_handle_active_calls() {
             acct_timeout_check_counter = 0;
         }
 
+        // Close calls of media servers which restarted or did not list them in heartbeat
+        if (media_server_check_requested) {
+            m2_close_orphaned_calls();
+        }
+
         // Check if internal active calls need to be updated to database
         if (active_calls_check_timer_period && (active_calls_check_counter >= active_calls_check_timer_period)) {
 
@@ -271,6 +505,10 @@ static void *m2_handle_active_calls() {
 */
 
 
+// m2_various.c
+static int m2_hedged_call_check(const char *uniqueid);
+static int m2_shadow_call_check(const char *uniqueid);
+
 static void m2_check_accounting_timeouts() {
 
     if (!active_calls_count) return; // nothing to check if no calls
@@ -306,7 +544,15 @@ static void m2_check_accounting_timeouts() {
             if (node->call_state > M2_NEW_STATE) {
 
                 // protection from not receiving acct start packet
-                if (node->call_state < M2_ANSWERED_STATE && ((int)(current_time - node->start_time) > start_timeout)) {
+                // hedged call could be answered by other rating server, so release it here without hangup
+                if (node->call_state < M2_ANSWERED_STATE && ((int)(current_time - node->start_time) > start_timeout) && m2_hedged_call_check(node->uniqueid)) {
+                    m2_log(M2_NOTICE, "Hedged call did not receive START packet (timeout: %d), it is handled by other server. "
+                        "User_id: %d, uniqueid: %s, channel: %s, Call will be released without hangup\n",
+                        start_timeout, node->op->user_id, node->uniqueid, node->chan_name);
+                    hangup_requested = 1;
+                    node->system_hangup_reason = M2_HANGUP_ACCT_START_TIMEOUT;
+                    m2_set_hangupcause(node, 314);
+                } else if (node->call_state < M2_ANSWERED_STATE && ((int)(current_time - node->start_time) > start_timeout)) {
                     m2_log(M2_ERROR, "Current user's call reached START packet timeout (timeout: %d, current wait time: %d). "
                         "User_id: %d, uniqueid: %s, channel: %s, Call should be terminated (HANG)\n",
                         start_timeout, (int)(current_time - node->start_time), node->op->user_id,
@@ -515,6 +761,146 @@ static void m2_check_active_calls() {
 }
 
 
+/*
+    Interim accounting updates
+
+    FreeSWITCH can send Interim-Update packets (accounting type 3) with current billsec of answered call
+    in Acct-Session-Time. Reported billsec is remembered here together with the last calculated price of the call,
+    realtime balance check then counts billsec from the last report and re-prices the call only when it passes
+    already priced time (next increment). Calls which never reported are priced from answer time as before.
+    Reported calls are kept in a hash until the call is removed from active calls, balance check copies the entry
+    of each call under a short lock, so call teardown never waits for the whole pass
+*/
+
+
+typedef struct {
+    char uniqueid[64];
+    double reported_time;
+    int billsec;
+    int calculated_billsec;
+    double calculated_call_price;
+    UT_hash_handle hh;
+} m2_interim_call_t;
+
+static m2_interim_call_t *m2_interim_calls = NULL;
+static pthread_mutex_t m2_interim_calls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// called with m2_interim_calls_lock locked
+
+static m2_interim_call_t *m2_interim_call_find(const char *uniqueid) {
+
+    m2_interim_call_t *call = NULL;
+    char key[64] = "";
+
+    strlcpy(key, uniqueid, sizeof(key));
+    HASH_FIND_STR(m2_interim_calls, key, call);
+
+    return call;
+
+}
+
+static calldata_t *m2_get_session_by_uniqueid(char *uniqueid);
+
+static void m2_interim_update(REQUEST *request) {
+
+    char uniqueid[256] = "";
+    char session_time[20] = "";
+    char heartbeat[64] = "";
+    calldata_t *cd = NULL;
+    m2_interim_call_t *call = NULL;
+    struct timeb tp;
+
+    // media server heartbeat is sent as interim update without call-id
+    m2_radius_get_attribute_value_by_name(request, "freeswitch-heartbeat", heartbeat, sizeof(heartbeat), M2_CISCO_AVP);
+    if (strlen(heartbeat)) {
+        m2_media_server_heartbeat(request, heartbeat);
+        return;
+    }
+
+    m2_radius_get_attribute_value_by_name(request, "call-id", uniqueid, sizeof(uniqueid), M2_CISCO_AVP);
+    m2_radius_get_attribute_value_by_name(request, "Acct-Session-Time", session_time, sizeof(session_time), M2_STANDARD_AVP);
+
+    if (!strlen(uniqueid) || !strlen(session_time)) {
+        m2_log(M2_WARNING, "Interim update without call-id or Acct-Session-Time\n");
+        return;
+    }
+
+    cd = m2_get_session_by_uniqueid(uniqueid);
+
+    if (cd == NULL || cd->call_state != M2_ANSWERED_STATE) {
+        m2_log(M2_NOTICE, "Interim update for unknown or not answered call [%s]\n", uniqueid);
+        return;
+    }
+
+    ftime(&tp);
+
+    pthread_mutex_lock(&m2_interim_calls_lock);
+    if ((call = m2_interim_call_find(uniqueid)) == NULL) {
+        if ((call = (m2_interim_call_t *) calloc(1, sizeof(m2_interim_call_t))) == NULL) {
+            pthread_mutex_unlock(&m2_interim_calls_lock);
+            m2_log(M2_ERROR, "Failed to remember interim update of call [%s]\n", uniqueid);
+            return;
+        }
+        strlcpy(call->uniqueid, uniqueid, sizeof(call->uniqueid));
+        HASH_ADD_STR(m2_interim_calls, uniqueid, call);
+    }
+    call->reported_time = tp.time + (tp.millitm / 1000.0);
+    call->billsec = atoi(session_time);
+    pthread_mutex_unlock(&m2_interim_calls_lock);
+
+    m2_log(M2_NOTICE, "Interim update, billsec: %d\n", atoi(session_time));
+
+}
+
+// billsec and last price of reported call, returns 0 if call did not report
+
+static int m2_interim_call_get(const char *uniqueid, double current_time, int *billsec, int *calculated_billsec, double *calculated_call_price) {
+
+    m2_interim_call_t *call = NULL;
+    int found = 0;
+
+    pthread_mutex_lock(&m2_interim_calls_lock);
+    if (m2_interim_calls && strlen(uniqueid) && (call = m2_interim_call_find(uniqueid))) {
+        *billsec = call->billsec + (int)ceil(current_time - call->reported_time);
+        *calculated_billsec = call->calculated_billsec;
+        *calculated_call_price = call->calculated_call_price;
+        found = 1;
+    }
+    pthread_mutex_unlock(&m2_interim_calls_lock);
+
+    return found;
+
+}
+
+static void m2_interim_call_set_price(const char *uniqueid, int calculated_billsec, double calculated_call_price) {
+
+    m2_interim_call_t *call = NULL;
+
+    pthread_mutex_lock(&m2_interim_calls_lock);
+    if (m2_interim_calls && (call = m2_interim_call_find(uniqueid))) {
+        call->calculated_billsec = calculated_billsec;
+        call->calculated_call_price = calculated_call_price;
+    }
+    pthread_mutex_unlock(&m2_interim_calls_lock);
+
+}
+
+// called when the call is removed from active calls
+
+static void m2_interim_call_remove(const char *uniqueid) {
+
+    m2_interim_call_t *call = NULL;
+
+    pthread_mutex_lock(&m2_interim_calls_lock);
+    if (m2_interim_calls && (call = m2_interim_call_find(uniqueid))) {
+        HASH_DEL(m2_interim_calls, call);
+        free(call);
+    }
+    pthread_mutex_unlock(&m2_interim_calls_lock);
+
+}
+
+
 /*
     Realtime balance check
 
@@ -569,6 +955,11 @@ static void m2_realtime_balance_check() {
                 if (node->answer_time == 0) goto check_next_node;
 
                 int billsec = (int)ceil(current_time - node->answer_time);
+                int cached_billsec = 0;
+                double cached_call_price = 0;
+
+                // media server knows real billsec of the call better than answer time here
+                int reported = m2_interim_call_get(node->uniqueid, current_time, &billsec, &cached_billsec, &cached_call_price);
 
                 if (billsec < 1) goto check_next_node;
 
@@ -577,9 +968,17 @@ static void m2_realtime_balance_check() {
                     billsec = 0;
                 }
 
-                // calculate current call price
+                // calculate current call price, reported call keeps its price until it passes priced time
                 if (billsec) {
-                    m2_calculate_call_price((billsec + balance_check_timer_period + 1), rate, min_time, increment, connection_fee, &calculated_billsec, &calculated_call_price);
+                    if (reported && cached_billsec && cached_billsec >= (billsec + balance_check_timer_period + 1)) {
+                        calculated_billsec = cached_billsec;
+                        calculated_call_price = cached_call_price;
+                    } else {
+                        m2_calculate_call_price((billsec + balance_check_timer_period + 1), rate, min_time, increment, connection_fee, &calculated_billsec, &calculated_call_price);
+                        if (reported) {
+                            m2_interim_call_set_price(node->uniqueid, calculated_billsec, calculated_call_price);
+                        }
+                    }
                 }
 
                 // convert to default currency
@@ -648,10 +1047,14 @@ static void m2_system_hangup_calls() {
             // Hangup all calls that were requested to be hangup by the system
             if (node->system_hangup_reason && node->call_state < M2_FINISHED_STATE) {
 
-                //fill the buffer array which calls needs to hang
-                hangup_calls_array[hangup_calls_count].server_id = node->server_id;
-                strncpy(hangup_calls_array[hangup_calls_count].uniqueid, node->uniqueid, sizeof(hangup_calls_array[hangup_calls_count].uniqueid));
-                hangup_calls_count++;
+                //fill the buffer array which calls needs to hang (hedged call without START is alive on the other server, shadow call is handled by the other server,
+                //orphaned call is already gone from its media server)
+                if (!(node->system_hangup_reason == M2_HANGUP_ACCT_START_TIMEOUT && m2_hedged_call_check(node->uniqueid)) && !m2_shadow_call_check(node->uniqueid) &&
+                    !m2_media_server_orphan(node)) {
+                    hangup_calls_array[hangup_calls_count].server_id = node->server_id;
+                    strncpy(hangup_calls_array[hangup_calls_count].uniqueid, node->uniqueid, sizeof(hangup_calls_array[hangup_calls_count].uniqueid));
+                    hangup_calls_count++;
+                }
 
                 m2_do_accounting_routine(&node, NULL);
 
@@ -63,53 +63,287 @@ static void m2_radius_add_attribute_value_pair(calldata_t *cd, char *attribute,
 
 
 /*
-    Get value from radius attribute-value pair by name
+    Indexed attribute lookup
+
+    Attributes of the request are indexed in one pass on the first lookup: the first value of every known name
+    (standard attributes and keys of Cisco-AVPair key=value pairs) is stored in a slot found by perfect hash
+    of the name. Later lookups for the same request only hash the name and copy the value. Index is kept per thread,
+    request is handled by one thread from start to end, so there is no locking. Names which are not in the list
+    are searched in the packet as before. Cisco-AVPair key must be at the start of the value.
+    Time of building the index is metered as attr_index (count, time, max) like the other core meters.
 */
 
 
-static void m2_radius_get_attribute_value_by_name(REQUEST *request, char *attribute, char *value, long unsigned int len, int attr_type)
+typedef struct {
+    const char *name;
+    int attr_type;
+} m2_radius_attr_key_t;
+
+static const m2_radius_attr_key_t m2_radius_attr_keys[] = {
+    { "User-Name", M2_STANDARD_AVP },
+    { "Calling-Station-Id", M2_STANDARD_AVP },
+    { "Called-Station-Id", M2_STANDARD_AVP },
+    { "Acct-Status-Type", M2_STANDARD_AVP },
+    { "Acct-Session-Time", M2_STANDARD_AVP },
+    { "h323-remote-address", M2_STANDARD_AVP },
+    { "h323-setup-time", M2_STANDARD_AVP },
+    { "h323-connect-time", M2_STANDARD_AVP },
+    { "h323-disconnect-time", M2_STANDARD_AVP },
+    { "h323-disconnect-cause", M2_STANDARD_AVP },
+    { "call-id", M2_CISCO_AVP },
+    { "freeswitch-bypass-early-media", M2_CISCO_AVP },
+    { "freeswitch-callerid-name", M2_CISCO_AVP },
+    { "freeswitch-codec-list", M2_CISCO_AVP },
+    { "freeswitch-endpnt-disp", M2_CISCO_AVP },
+    { "freeswitch-hangup-disp", M2_CISCO_AVP },
+    { "freeswitch-hangupcause", M2_CISCO_AVP },
+    { "freeswitch-heartbeat", M2_CISCO_AVP },
+    { "freeswitch-hedged", M2_CISCO_AVP },
+    { "freeswitch-invite-destination", M2_CISCO_AVP },
+    { "freeswitch-lnp", M2_CISCO_AVP },
+    { "freeswitch-media-pdd", M2_CISCO_AVP },
+    { "freeswitch-op-codec", M2_CISCO_AVP },
+    { "freeswitch-pai", M2_CISCO_AVP },
+    { "freeswitch-pdd", M2_CISCO_AVP },
+    { "freeswitch-proxy-op-ip", M2_CISCO_AVP },
+    { "freeswitch-proxy-op-port", M2_CISCO_AVP },
+    { "freeswitch-server-id", M2_CISCO_AVP },
+    { "freeswitch-shadow", M2_CISCO_AVP },
+    { "freeswitch-src-channel", M2_CISCO_AVP },
+    { "freeswitch-src-port", M2_CISCO_AVP },
+    { "freeswitch-tp-codec", M2_CISCO_AVP },
+    { "originator-sip-hangupcause", M2_CISCO_AVP },
+    { "terminator-sip-hangupcause", M2_CISCO_AVP }
+};
+
+#define M2_RADIUS_ATTR_KEY_COUNT (sizeof(m2_radius_attr_keys) / sizeof(m2_radius_attr_keys[0]))
+#define M2_RADIUS_ATTR_TABLE_SIZE 256
+
+typedef struct {
+    REQUEST *request;
+    RADIUS_PACKET *packet;
+    VALUE_PAIR *vps;
+    unsigned int number;
+    VALUE_PAIR *values[M2_RADIUS_ATTR_KEY_COUNT];
+} m2_radius_attr_index_t;
+
+static pthread_once_t m2_radius_attr_table_once = PTHREAD_ONCE_INIT;
+static int m2_radius_attr_table[M2_RADIUS_ATTR_TABLE_SIZE];
+static uint32_t m2_radius_attr_seed = 0;
+static __thread m2_radius_attr_index_t m2_radius_attr_index;
+
+
+static uint32_t m2_radius_attr_hash(const char *name, size_t len, int attr_type, uint32_t seed)
 {
-    if (!request) return;
+    uint32_t hash = 2166136261u ^ seed;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+
+    return ((hash ^ (uint32_t) attr_type) * 16777619u) & (M2_RADIUS_ATTR_TABLE_SIZE - 1);
+}
+
+// find seed for which names of all keys land in different slots (table holds key index + 1)
+
+static void m2_radius_attr_table_init(void)
+{
+    calldata_t *cd = NULL;
+    uint32_t seed;
+    size_t i;
+
+    for (seed = 1; seed < 100000; seed++) {
+        memset(m2_radius_attr_table, 0, sizeof(m2_radius_attr_table));
+
+        for (i = 0; i < M2_RADIUS_ATTR_KEY_COUNT; i++) {
+            uint32_t slot = m2_radius_attr_hash(m2_radius_attr_keys[i].name, strlen(m2_radius_attr_keys[i].name), m2_radius_attr_keys[i].attr_type, seed);
+
+            if (m2_radius_attr_table[slot]) break;
+            m2_radius_attr_table[slot] = (int)i + 1;
+        }
+
+        if (i == M2_RADIUS_ATTR_KEY_COUNT) {
+            m2_radius_attr_seed = seed;
+            return;
+        }
+    }
+
+    // should not happen with this table size, every lookup falls back to packet search
+    memset(m2_radius_attr_table, 0, sizeof(m2_radius_attr_table));
+    m2_log(M2_ERROR, "Failed to build attribute lookup table, attributes will be searched in the packet\n");
+}
+
+// index of the key or -1 if name is not in the list
+
+static int m2_radius_attr_key_find(const char *name, size_t len, int attr_type)
+{
+    pthread_once(&m2_radius_attr_table_once, m2_radius_attr_table_init);
+
+    int key = m2_radius_attr_table[m2_radius_attr_hash(name, len, attr_type, m2_radius_attr_seed)] - 1;
+
+    if (key < 0 || m2_radius_attr_keys[key].attr_type != attr_type ||
+        strncmp(m2_radius_attr_keys[key].name, name, len) != 0 || m2_radius_attr_keys[key].name[len] != '\0') {
+        return -1;
+    }
+
+    return key;
+}
+
+static const char *m2_radius_attr_name(VALUE_PAIR *vp)
+{
+#ifdef FREERADIUS3
+    return vp->da->name;
+#else
+    return vp->name;
+#endif
+}
+
+static m2_radius_attr_index_t *m2_radius_attr_index_get(REQUEST *request)
+{
+    m2_radius_attr_index_t *index = &m2_radius_attr_index;
+
+    // request structures are reused, so the same pointer is not enough
+    if (index->request == request && index->packet == request->packet && index->vps == request->packet->vps && index->number == request->number) {
+        return index;
+    }
+
+    meter.attr_index_count_start++;
+    double start_time = m2_get_current_time();
+
+    memset(index, 0, sizeof(m2_radius_attr_index_t));
+    index->request = request;
+    index->packet = request->packet;
+    index->vps = request->packet->vps;
+    index->number = request->number;
+
+    VALUE_PAIR *item_vp;
+    int key;
+
+    for (item_vp = request->packet->vps; item_vp != NULL; item_vp = item_vp->next) {
+        const char *name = m2_radius_attr_name(item_vp);
+
+        if (strcmp(name, "Cisco-AVPair") == 0) {
+            const char *eq = strchr(item_vp->vp_strvalue, '=');
+
+            if (eq == NULL) continue;
+            key = m2_radius_attr_key_find(item_vp->vp_strvalue, eq - item_vp->vp_strvalue, M2_CISCO_AVP);
+        } else {
+            key = m2_radius_attr_key_find(name, strlen(name), M2_STANDARD_AVP);
+        }
+
+        // the first value wins, the same as packet search
+        if (key >= 0 && index->values[key] == NULL) {
+            index->values[key] = item_vp;
+        }
+    }
+
+    // saving metering stats
+    double run_time = m2_get_current_time() - start_time;
+    meter.attr_index_time += run_time;
+    meter.attr_index_count++;
+    if (run_time > meter.attr_index_time_max) meter.attr_index_time_max = run_time;
+    if (run_time > meter.attr_index_time_maxps) meter.attr_index_time_maxps = run_time;
+
+    return index;
+}
+
+static void m2_radius_copy_attribute_value(VALUE_PAIR *item_vp, char *value, long unsigned int len)
+{
+#ifdef FREERADIUS3
+    if (item_vp->da->type == PW_TYPE_STRING && item_vp->vp_strvalue) {
+        strlcpy(value, item_vp->vp_strvalue, len);
+    } else if (item_vp->da->type == PW_TYPE_INTEGER) {
+        snprintf(value, len, "%d", item_vp->vp_integer);
+    }
+#else
+    strlcpy(value, item_vp->vp_strvalue, len);
+#endif
+}
+
+
+/*
+    Get value from radius attribute-value pair by name
+*/
+
+
+// packet search, used for names which are not in the index
 
+static void m2_radius_scan_attribute_value(REQUEST *request, char *attribute, char *value, long unsigned int len, int attr_type)
+{
     VALUE_PAIR *item_vp;
     item_vp = request->packet->vps;
 
     // Parse packet and look for specified attribute
     while (item_vp != NULL) {
 
-#ifdef FREERADIUS3
         if (attr_type == M2_STANDARD_AVP) {
-            if (strcmp(item_vp->da->name, attribute) == 0) {
-                if (item_vp->da->type == PW_TYPE_STRING && item_vp->vp_strvalue) {
-                    strlcpy(value, item_vp->vp_strvalue, len);
-                } else if (item_vp->da->type == PW_TYPE_INTEGER) {
-                    sprintf(value, "%d", item_vp->vp_integer);
-                }
+            if (strcmp(m2_radius_attr_name(item_vp), attribute) == 0) {
+                m2_radius_copy_attribute_value(item_vp, value, len);
                 break;
             }
         } else if (attr_type == M2_CISCO_AVP) {
-            if (strcmp(item_vp->da->name, "Cisco-AVPair") == 0) {
+            if (strcmp(m2_radius_attr_name(item_vp), "Cisco-AVPair") == 0) {
                 if (strstr(item_vp->vp_strvalue, attribute)) {
                     strlcpy(value, item_vp->vp_strvalue + strlen(attribute) + 1, len);
                     break;
                 }
             }
         }
+
+        item_vp = item_vp->next;
+    }
+}
+
+static void m2_radius_get_attribute_value_by_name(REQUEST *request, char *attribute, char *value, long unsigned int len, int attr_type)
+{
+    if (!request) return;
+
+    int key = m2_radius_attr_key_find(attribute, strlen(attribute), attr_type);
+
+    if (key < 0) {
+        m2_radius_scan_attribute_value(request, attribute, value, len, attr_type);
+        return;
+    }
+
+    VALUE_PAIR *item_vp = m2_radius_attr_index_get(request)->values[key];
+
+    if (item_vp == NULL) return;
+
+    if (attr_type == M2_CISCO_AVP) {
+        strlcpy(value, item_vp->vp_strvalue + strlen(attribute) + 1, len);
+    } else {
+        m2_radius_copy_attribute_value(item_vp, value, len);
+    }
+}
+
+
+/*
+    Call func for every value of Cisco-AVPair attribute which can be repeated in the packet
+*/
+
+
+static void m2_radius_foreach_attribute_value(REQUEST *request, char *attribute, void (*func)(char *value, void *arg), void *arg)
+{
+    if (!request) return;
+
+    VALUE_PAIR *item_vp;
+    char value[256] = "";
+    size_t attribute_length = strlen(attribute);
+    item_vp = request->packet->vps;
+
+    while (item_vp != NULL) {
+
+#ifdef FREERADIUS3
+        if (strcmp(item_vp->da->name, "Cisco-AVPair") == 0) {
 #else
-        if (attr_type == M2_STANDARD_AVP) {
-            if (strcmp(item_vp->name, attribute) == 0) {
-                strlcpy(value, item_vp->vp_strvalue, len);
-                break;
-            }
-        } else if (attr_type == M2_CISCO_AVP) {
-            if (strcmp(item_vp->name, "Cisco-AVPair") == 0) {
-                if (strstr(item_vp->vp_strvalue, attribute)) {
-                    strlcpy(value, item_vp->vp_strvalue + strlen(attribute) + 1, len);
-                    break;
-                }
+        if (strcmp(item_vp->name, "Cisco-AVPair") == 0) {
+#endif
+            if (strncmp(item_vp->vp_strvalue, attribute, attribute_length) == 0 && item_vp->vp_strvalue[attribute_length] == '=') {
+                strlcpy(value, item_vp->vp_strvalue + attribute_length + 1, sizeof(value));
+                func(value, arg);
             }
         }
-#endif
 
         item_vp = item_vp->next;
     }
@@ -118,9 +352,16 @@ static void m2_radius_get_attribute_value_by_name(REQUEST *request, char *attrib
 
 /*
     Get accounting type (either START or STOP)
+
+    Interim-Update (3), Accounting-On (7) and Accounting-Off (8) are handled right here and 0 is returned,
+    so accounting hook still processes only START (1) and STOP (2) and answers other packets as before
 */
 
 
+// m2_active_calls.c
+static void m2_interim_update(REQUEST *request);
+static void m2_media_server_status(REQUEST *request, int type);
+
 static int m2_radius_get_accounting_type(REQUEST *request)
 {
     char status_type[100] = "";
@@ -131,6 +372,12 @@ static int m2_radius_get_accounting_type(REQUEST *request)
         return 1;
     } else if (strcmp(status_type, "Stop") == 0 || strcmp(status_type, "2") == 0) {
         return 2;
+    } else if (strcmp(status_type, "Interim-Update") == 0 || strcmp(status_type, "Alive") == 0 || strcmp(status_type, "3") == 0) {
+        m2_interim_update(request);
+    } else if (strcmp(status_type, "Accounting-On") == 0 || strcmp(status_type, "7") == 0) {
+        m2_media_server_status(request, 7);
+    } else if (strcmp(status_type, "Accounting-Off") == 0 || strcmp(status_type, "8") == 0) {
+        m2_media_server_status(request, 8);
     }
 
     return 0;
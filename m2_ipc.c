@@ -0,0 +1,583 @@
+
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <grp.h>
+
+
+/*
+    Local IPC listener
+
+    mod_xml_m2_radius running on the same host connects to unix socket and receives shared memory segment
+    and two eventfds (request and reply wakeups). Requests are written by FreeSWITCH to slots of shared memory
+    as radius attributes (without packet header, authenticator and password hiding), they are converted
+    to REQUEST here and passed to the same handler as radius packets. Reply attributes are written back
+    to the same slot. When listener is not running FreeSWITCH sends radius packets as before.
+
+    Slot layout must match mod_xml_m2_radius.c. Only one FreeSWITCH can be connected, new connection
+    replaces the old one.
+
+    Socket is created with 0600 permissions, or 0660 owned by socket_group when FreeSWITCH runs as other user.
+    Peer credentials are checked on accept, only root, the same user or process running with socket_group is served.
+
+    rlm_m2.c starts listener with m2_ipc_start(socket_path, socket_group, process), process is called with
+    PW_AUTHENTICATION_REQUEST or PW_ACCOUNTING_REQUEST and returns RLM_MODULE_* code
+*/
+
+
+#define M2_IPC_MAGIC 0x4d324950
+#define M2_IPC_VERSION 1
+#define M2_IPC_SLOTS 1024
+#define M2_IPC_PAYLOAD 4096
+#define M2_IPC_WORKERS 16
+
+enum {
+    M2_IPC_SLOT_FREE,
+    M2_IPC_SLOT_WRITING,
+    M2_IPC_SLOT_REQUEST,
+    M2_IPC_SLOT_PROCESSING,
+    M2_IPC_SLOT_REPLY,
+    M2_IPC_SLOT_ABANDONED
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t payload;
+    volatile uint32_t generation;
+    uint32_t reserved;
+} m2_ipc_header_t;
+
+typedef struct {
+    volatile uint32_t state;
+    uint32_t code;
+    uint32_t length;
+    uint32_t reserved;
+    unsigned char data[M2_IPC_PAYLOAD];
+} m2_ipc_slot_t;
+
+typedef int (*m2_ipc_process_t)(REQUEST *request, int code);
+
+static struct {
+    char socket_path[256];
+    int listen_fd;
+    int client_fd;
+    gid_t socket_gid;
+    int shm_fd;
+    int request_fd;
+    int reply_fd;
+    unsigned char *map;
+    size_t map_size;
+    m2_ipc_process_t process;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int queue[M2_IPC_SLOTS];
+    int queue_head;
+    int queue_count;
+} m2_ipc = { .listen_fd = -1, .client_fd = -1, .socket_gid = (gid_t) -1, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+
+static m2_ipc_slot_t *m2_ipc_slot(int index) {
+
+    return (m2_ipc_slot_t *)(m2_ipc.map + sizeof(m2_ipc_header_t) + (size_t)index * sizeof(m2_ipc_slot_t));
+
+}
+
+
+/*
+    Convert slot attributes to request value pairs
+*/
+
+
+static void m2_ipc_add_attribute(REQUEST *request, unsigned int attr, unsigned int vendor, const unsigned char *data, int len) {
+
+    char value[256] = "";
+
+#ifdef FREERADIUS3
+    const DICT_ATTR *da = dict_attrbyvalue(attr, vendor);
+#else
+    DICT_ATTR *da = dict_attrbyvalue(attr, vendor);
+#endif
+
+    if (!da || len < 0 || len > 253) return;
+
+    if (da->type == PW_TYPE_INTEGER && len == 4) {
+        sprintf(value, "%u", ((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) | ((unsigned int)data[2] << 8) | (unsigned int)data[3]);
+    } else if (da->type == PW_TYPE_IPADDR && len == 4) {
+        sprintf(value, "%u.%u.%u.%u", data[0], data[1], data[2], data[3]);
+    } else {
+        memcpy(value, data, len);
+        value[len] = 0;
+    }
+
+#ifdef FREERADIUS3
+    pair_make_request(da->name, value, T_OP_EQ);
+#else
+    pairadd(&request->packet->vps, pairmake(da->name, value, T_OP_EQ));
+#endif
+
+}
+
+static REQUEST *m2_ipc_request_create(int code, const unsigned char *data, int length) {
+
+    REQUEST *request = NULL;
+    int offset = 0;
+
+#ifdef FREERADIUS3
+    request = request_alloc(NULL);
+    request->packet = rad_alloc(request, false);
+    request->reply = rad_alloc(request, false);
+#else
+    request = request_alloc();
+    request->packet = rad_alloc(0);
+    request->reply = rad_alloc(0);
+#endif
+
+    request->packet->code = code;
+
+    while (offset + 2 <= length) {
+        const unsigned char *attr = data + offset;
+        int attr_len = attr[1];
+
+        if (attr_len < 2 || offset + attr_len > length) break;
+
+        // Cisco-AVPair and other vendor attributes
+        if (attr[0] == PW_VENDOR_SPECIFIC && attr_len > 8) {
+            unsigned int vendor = ((unsigned int)attr[2] << 24) | ((unsigned int)attr[3] << 16) | ((unsigned int)attr[4] << 8) | (unsigned int)attr[5];
+            int sub_offset = 6;
+
+            while (sub_offset + 2 <= attr_len && attr[sub_offset + 1] >= 2 && sub_offset + attr[sub_offset + 1] <= attr_len) {
+                m2_ipc_add_attribute(request, attr[sub_offset], vendor, attr + sub_offset + 2, attr[sub_offset + 1] - 2);
+                sub_offset += attr[sub_offset + 1];
+            }
+        } else {
+            m2_ipc_add_attribute(request, attr[0], 0, attr + 2, attr_len - 2);
+        }
+
+        offset += attr_len;
+    }
+
+    return request;
+
+}
+
+
+/*
+    Write reply value pairs to slot, returns length or -1 if reply does not fit
+*/
+
+
+static int m2_ipc_encode_reply(REQUEST *request, unsigned char *data) {
+
+    VALUE_PAIR *vp = NULL;
+    int length = 0;
+
+    for (vp = request->reply->vps; vp != NULL; vp = vp->next) {
+        unsigned char value[256];
+        unsigned int attr = 0, vendor = 0;
+        int type = 0;
+        int value_len = 0;
+        int header_len = 2;
+
+#ifdef FREERADIUS3
+        attr = vp->da->attr;
+        vendor = vp->da->vendor;
+        type = vp->da->type;
+#else
+        attr = vp->attribute;
+        vendor = vp->vendor;
+        type = vp->type;
+#endif
+
+        if (type == PW_TYPE_INTEGER || type == PW_TYPE_IPADDR) {
+            unsigned int number = type == PW_TYPE_INTEGER ? vp->vp_integer : ntohl(vp->vp_ipaddr);
+            value[0] = (number >> 24) & 0xff;
+            value[1] = (number >> 16) & 0xff;
+            value[2] = (number >> 8) & 0xff;
+            value[3] = number & 0xff;
+            value_len = 4;
+        } else {
+            value_len = strlen(vp->vp_strvalue);
+            if (value_len > 247) value_len = 247;
+            memcpy(value, vp->vp_strvalue, value_len);
+        }
+
+        if (vendor) header_len = 8;
+        if (length + header_len + value_len > M2_IPC_PAYLOAD) return -1;
+
+        if (vendor) {
+            data[length] = PW_VENDOR_SPECIFIC;
+            data[length + 1] = 8 + value_len;
+            data[length + 2] = (vendor >> 24) & 0xff;
+            data[length + 3] = (vendor >> 16) & 0xff;
+            data[length + 4] = (vendor >> 8) & 0xff;
+            data[length + 5] = vendor & 0xff;
+            data[length + 6] = attr & 0xff;
+            data[length + 7] = 2 + value_len;
+        } else {
+            data[length] = attr & 0xff;
+            data[length + 1] = 2 + value_len;
+        }
+
+        memcpy(data + length + header_len, value, value_len);
+        length += header_len + value_len;
+    }
+
+    return length;
+
+}
+
+
+/*
+    Worker takes slot from the queue, processes request and writes reply. Slot data is copied under the lock
+    (slots are reset on reconnect), REQUEST is built from the copy without holding the lock
+*/
+
+
+static void *m2_ipc_worker() {
+
+    // this variable is used by m2_log function
+    calldata_t *cd = NULL;
+
+    unsigned char *data = NULL;
+
+    if ((data = malloc(M2_IPC_PAYLOAD)) == NULL) {
+        m2_log(M2_ERROR, "Failed to start local IPC worker\n");
+        pthread_exit(NULL);
+    }
+
+    while (1) {
+        m2_ipc_slot_t *slot = NULL;
+        REQUEST *request = NULL;
+        uint32_t generation = 0;
+        uint64_t counter = 1;
+        int rcode = 0;
+        int length = 0;
+        int code = 0;
+
+        pthread_mutex_lock(&m2_ipc.lock);
+        while (m2_ipc.queue_count == 0) {
+            pthread_cond_wait(&m2_ipc.cond, &m2_ipc.lock);
+        }
+        slot = m2_ipc_slot(m2_ipc.queue[m2_ipc.queue_head]);
+        m2_ipc.queue_head = (m2_ipc.queue_head + 1) % M2_IPC_SLOTS;
+        m2_ipc.queue_count--;
+        generation = ((m2_ipc_header_t *)m2_ipc.map)->generation;
+        code = slot->code;
+        length = slot->length > M2_IPC_PAYLOAD ? M2_IPC_PAYLOAD : slot->length;
+        memcpy(data, slot->data, length);
+        pthread_mutex_unlock(&m2_ipc.lock);
+
+        request = m2_ipc_request_create(code, data, length);
+
+        rcode = m2_ipc.process(request, code);
+
+        pthread_mutex_lock(&m2_ipc.lock);
+
+        // FreeSWITCH has reconnected while request was processed, slot belongs to the new connection
+        if (generation != ((m2_ipc_header_t *)m2_ipc.map)->generation) {
+            pthread_mutex_unlock(&m2_ipc.lock);
+            m2_log(M2_WARNING, "Local IPC client has reconnected, reply is dropped\n");
+            goto done;
+        }
+
+        if (rcode == RLM_MODULE_OK || rcode == RLM_MODULE_UPDATED || rcode == RLM_MODULE_NOOP || rcode == RLM_MODULE_HANDLED) {
+            slot->code = code == PW_ACCOUNTING_REQUEST ? PW_ACCOUNTING_RESPONSE : PW_AUTHENTICATION_ACK;
+        } else {
+            slot->code = code == PW_ACCOUNTING_REQUEST ? 0 : PW_AUTHENTICATION_REJECT;
+        }
+
+        if ((length = m2_ipc_encode_reply(request, slot->data)) < 0) {
+            m2_log(M2_ERROR, "Reply is too big for local IPC\n");
+            slot->code = 0;
+            length = 0;
+        }
+        slot->length = length;
+        __sync_synchronize();
+
+        // FreeSWITCH did not wait for reply
+        if (!__sync_bool_compare_and_swap(&slot->state, M2_IPC_SLOT_PROCESSING, M2_IPC_SLOT_REPLY)) {
+            slot->state = M2_IPC_SLOT_FREE;
+        } else if (write(m2_ipc.reply_fd, &counter, sizeof(counter)) < 0) {
+            m2_log(M2_ERROR, "Failed to wake up local IPC client: %s\n", strerror(errno));
+        }
+
+        pthread_mutex_unlock(&m2_ipc.lock);
+
+done:
+
+#ifdef FREERADIUS3
+        talloc_free(request);
+#else
+        request_free(&request);
+#endif
+    }
+
+    pthread_exit(NULL);
+
+}
+
+
+/*
+    Check that client runs as root, as the same user or with socket group
+*/
+
+
+static int m2_ipc_peer_allowed(int client_fd) {
+
+    // this variable is used by m2_log function
+    calldata_t *cd = NULL;
+
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || cred_len != sizeof(cred)) {
+        m2_log(M2_ERROR, "Failed to get local IPC client credentials: %s\n", strerror(errno));
+        return 0;
+    }
+
+    if (cred.uid == 0 || cred.uid == getuid() || (m2_ipc.socket_gid != (gid_t) -1 && cred.gid == m2_ipc.socket_gid)) {
+        return 1;
+    }
+
+    m2_log(M2_WARNING, "Local IPC client (pid %d, uid %d, gid %d) is not allowed\n", (int)cred.pid, (int)cred.uid, (int)cred.gid);
+
+    return 0;
+
+}
+
+
+/*
+    Pass shared memory and eventfds to new client
+*/
+
+
+static void m2_ipc_accept() {
+
+    // this variable is used by m2_log function
+    calldata_t *cd = NULL;
+
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg = NULL;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    char byte = 0;
+    int fds[3];
+    int client_fd = -1;
+    int i;
+
+    if ((client_fd = accept(m2_ipc.listen_fd, NULL, NULL)) < 0) {
+        return;
+    }
+
+    if (!m2_ipc_peer_allowed(client_fd)) {
+        close(client_fd);
+        return;
+    }
+
+    pthread_mutex_lock(&m2_ipc.lock);
+
+    if (m2_ipc.client_fd >= 0) {
+        m2_log(M2_WARNING, "Local IPC client is replaced by new connection\n");
+        close(m2_ipc.client_fd);
+    }
+
+    // requests of previous connection are forgotten
+    ((m2_ipc_header_t *)m2_ipc.map)->generation++;
+    for (i = 0; i < M2_IPC_SLOTS; i++) {
+        m2_ipc_slot(i)->state = M2_IPC_SLOT_FREE;
+    }
+    m2_ipc.queue_count = 0;
+    m2_ipc.client_fd = client_fd;
+
+    pthread_mutex_unlock(&m2_ipc.lock);
+
+    fds[0] = m2_ipc.shm_fd;
+    fds[1] = m2_ipc.request_fd;
+    fds[2] = m2_ipc.reply_fd;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(client_fd, &msg, 0) != 1) {
+        m2_log(M2_ERROR, "Failed to send local IPC handshake: %s\n", strerror(errno));
+        pthread_mutex_lock(&m2_ipc.lock);
+        if (m2_ipc.client_fd == client_fd) {
+            m2_ipc.client_fd = -1;
+        }
+        pthread_mutex_unlock(&m2_ipc.lock);
+        close(client_fd);
+        return;
+    }
+
+    m2_log(M2_NOTICE, "Local IPC client connected\n");
+
+}
+
+
+/*
+    Listener thread accepts clients and queues requests for workers
+*/
+
+
+static void *m2_ipc_listener() {
+
+    // this variable is used by m2_log function
+    calldata_t *cd = NULL;
+
+    struct pollfd fds[3];
+    uint64_t counter = 0;
+    int i;
+
+    while (1) {
+        fds[0].fd = m2_ipc.listen_fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = m2_ipc.request_fd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        fds[2].fd = m2_ipc.client_fd;
+        fds[2].events = POLLIN;
+        fds[2].revents = 0;
+
+        if (poll(fds, m2_ipc.client_fd >= 0 ? 3 : 2, 1000) <= 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            m2_ipc_accept();
+        }
+
+        if (m2_ipc.client_fd >= 0 && (fds[2].revents & (POLLIN | POLLHUP | POLLERR))) {
+            pthread_mutex_lock(&m2_ipc.lock);
+            close(m2_ipc.client_fd);
+            m2_ipc.client_fd = -1;
+            pthread_mutex_unlock(&m2_ipc.lock);
+            m2_log(M2_WARNING, "Local IPC client disconnected\n");
+        }
+
+        if (fds[1].revents & POLLIN) {
+            if (read(m2_ipc.request_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+                m2_log(M2_ERROR, "Failed to read local IPC request eventfd: %s\n", strerror(errno));
+            }
+
+            pthread_mutex_lock(&m2_ipc.lock);
+            for (i = 0; i < M2_IPC_SLOTS && m2_ipc.queue_count < M2_IPC_SLOTS; i++) {
+                if (__sync_bool_compare_and_swap(&m2_ipc_slot(i)->state, M2_IPC_SLOT_REQUEST, M2_IPC_SLOT_PROCESSING)) {
+                    m2_ipc.queue[(m2_ipc.queue_head + m2_ipc.queue_count) % M2_IPC_SLOTS] = i;
+                    m2_ipc.queue_count++;
+                    pthread_cond_signal(&m2_ipc.cond);
+                }
+            }
+            pthread_mutex_unlock(&m2_ipc.lock);
+        }
+    }
+
+    pthread_exit(NULL);
+
+}
+
+
+/*
+    Create shared memory, eventfds and unix socket, start listener and workers.
+    socket_group can be empty, then only root and the same user can connect
+*/
+
+
+static int m2_ipc_start(const char *socket_path, const char *socket_group, m2_ipc_process_t process) {
+
+    // this variable is used by m2_log function
+    calldata_t *cd = NULL;
+
+    struct sockaddr_un addr;
+    char shm_path[] = "/dev/shm/m2_ipc.XXXXXX";
+    m2_ipc_header_t *header = NULL;
+    pthread_t thread_id;
+    pthread_attr_t thread_attr;
+    int i;
+
+    if (socket_path == NULL || !strlen(socket_path)) return 0;
+
+    strlcpy(m2_ipc.socket_path, socket_path, sizeof(m2_ipc.socket_path));
+    m2_ipc.process = process;
+
+    if (socket_group && strlen(socket_group)) {
+        struct group *group = getgrnam(socket_group);
+
+        if (group == NULL) {
+            m2_log(M2_ERROR, "Local IPC socket group %s does not exist\n", socket_group);
+            return -1;
+        }
+        m2_ipc.socket_gid = group->gr_gid;
+    }
+    m2_ipc.map_size = sizeof(m2_ipc_header_t) + M2_IPC_SLOTS * sizeof(m2_ipc_slot_t);
+
+    // shared memory file is removed right away, it is passed to client as file descriptor
+    if ((m2_ipc.shm_fd = mkstemp(shm_path)) < 0) {
+        m2_log(M2_ERROR, "Failed to create local IPC shared memory: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(shm_path);
+
+    if (ftruncate(m2_ipc.shm_fd, m2_ipc.map_size) < 0 ||
+        (m2_ipc.map = mmap(NULL, m2_ipc.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, m2_ipc.shm_fd, 0)) == MAP_FAILED) {
+        m2_log(M2_ERROR, "Failed to map local IPC shared memory: %s\n", strerror(errno));
+        close(m2_ipc.shm_fd);
+        m2_ipc.map = NULL;
+        return -1;
+    }
+
+    header = (m2_ipc_header_t *)m2_ipc.map;
+    header->magic = M2_IPC_MAGIC;
+    header->version = M2_IPC_VERSION;
+    header->slots = M2_IPC_SLOTS;
+    header->payload = M2_IPC_PAYLOAD;
+
+    m2_ipc.request_fd = eventfd(0, EFD_NONBLOCK);
+    m2_ipc.reply_fd = eventfd(0, EFD_NONBLOCK);
+    if (m2_ipc.request_fd < 0 || m2_ipc.reply_fd < 0) {
+        m2_log(M2_ERROR, "Failed to create local IPC eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, socket_path, sizeof(addr.sun_path));
+    unlink(socket_path);
+
+    // nobody can connect before listen, so permissions are set in between
+    if ((m2_ipc.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(m2_ipc.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        (m2_ipc.socket_gid != (gid_t) -1 && chown(socket_path, (uid_t) -1, m2_ipc.socket_gid) < 0) ||
+        chmod(socket_path, m2_ipc.socket_gid != (gid_t) -1 ? 0660 : 0600) < 0 || listen(m2_ipc.listen_fd, 4) < 0) {
+        m2_log(M2_ERROR, "Failed to listen on local IPC socket %s: %s\n", socket_path, strerror(errno));
+        return -1;
+    }
+
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&thread_id, &thread_attr, m2_ipc_listener, NULL);
+    for (i = 0; i < M2_IPC_WORKERS; i++) {
+        pthread_create(&thread_id, &thread_attr, m2_ipc_worker, NULL);
+    }
+    pthread_attr_destroy(&thread_attr);
+
+    m2_log(M2_NOTICE, "Local IPC listener started on %s\n", socket_path);
+
+    return 0;
+
+}
@@ -0,0 +1,626 @@
+/*
+ * m2_radius_fake_server.c -- fake M2 rating server for mod_xml_m2_radius benchmarks
+ *
+ * Answers Access-Request with Access-Accept (routes, terminators, h323-credit-time and extra variables)
+ * or Access-Reject with m2_hangupcause, and every Accounting-Request with Accounting-Response.
+ * Reply latency, loss, reject share and reply size are set from the command line, so the module can be
+ * measured (m2_bench) without FreeRADIUS and MySQL. Nothing is stored, calls are not tracked.
+ *
+ * Build: gcc -O2 -o m2_radius_fake_server m2_radius_fake_server.c -lfreeradius-client
+ *
+ * Usage: m2_radius_fake_server -s <secret> [-a address] [-p auth port] [-P acct port] [-d delay ms] [-j jitter ms]
+ *                              [-l loss %] [-r reject %] [-c reject cause] [-n routes] [-v variables] [-t credit time]
+ *
+ * Dynamic authorization client: sends one Disconnect-Request (-d) or CoA-Request with new time limit (-t seconds)
+ * for call uuid to the module listener (coa-listen) and prints the reply. -e shifts Event-Timestamp by given seconds
+ * (-E leaves it out) and -r sends the same packet again, so replay protection of the listener can be checked.
+ *
+ *        m2_radius_fake_server coa -s <secret> -u <uuid> [-a address] [-p port] [-d | -t seconds] [-e offset | -E] [-r]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <freeradius-client.h>
+
+#define M2_FAKE_PACKET_MAX 4096
+#define M2_FAKE_PENDING_MAX 65536
+
+#define M2_FAKE_ACCESS_REQUEST 1
+#define M2_FAKE_ACCESS_ACCEPT 2
+#define M2_FAKE_ACCESS_REJECT 3
+#define M2_FAKE_ACCOUNTING_REQUEST 4
+#define M2_FAKE_ACCOUNTING_RESPONSE 5
+#define M2_FAKE_DISCONNECT_REQUEST 40
+#define M2_FAKE_COA_REQUEST 43
+
+#define M2_FAKE_ATTR_SESSION_TIMEOUT 27
+#define M2_FAKE_ATTR_CALLED_STATION_ID 30
+#define M2_FAKE_ATTR_ACCT_SESSION_ID 44
+#define M2_FAKE_ATTR_EVENT_TIMESTAMP 55
+#define M2_FAKE_ATTR_ERROR_CAUSE 101
+#define M2_FAKE_ATTR_VENDOR_SPECIFIC 26
+#define M2_FAKE_VENDOR_CISCO 9
+#define M2_FAKE_CISCO_AVPAIR 1
+#define M2_FAKE_CISCO_CREDIT_TIME 102
+#define M2_FAKE_CISCO_COMMAND_CODE 252
+
+// reply waiting for its send time
+
+typedef struct {
+    int64_t due;
+    int fd;
+    struct sockaddr_in addr;
+    int length;
+    unsigned char packet[M2_FAKE_PACKET_MAX + 256];
+} m2_fake_reply_t;
+
+static struct {
+    char secret[256];
+    char address[64];
+    int auth_port;
+    int acct_port;
+    int delay;
+    int jitter;
+    int loss;
+    int reject;
+    int reject_cause;
+    int routes;
+    int variables;
+    int credit_time;
+} config;
+
+static struct {
+    uint64_t auth;
+    uint64_t acct;
+    uint64_t accepted;
+    uint64_t rejected;
+    uint64_t responded;
+    uint64_t dropped;
+    uint64_t overflow;
+    uint64_t bad;
+} meter;
+
+// delayed replies, binary heap ordered by due time
+
+static m2_fake_reply_t **pending = NULL;
+static int pending_count = 0;
+static volatile sig_atomic_t running = 1;
+
+
+static int64_t m2_fake_now(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+}
+
+static void m2_fake_stop(int sig) {
+
+    running = 0;
+
+}
+
+static void m2_fake_pending_push(m2_fake_reply_t *reply) {
+
+    int i = pending_count++;
+
+    while (i > 0 && pending[(i - 1) / 2]->due > reply->due) {
+        pending[i] = pending[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    pending[i] = reply;
+
+}
+
+static m2_fake_reply_t *m2_fake_pending_pop(void) {
+
+    m2_fake_reply_t *top = pending[0];
+    m2_fake_reply_t *last = pending[--pending_count];
+    int i = 0;
+
+    while (2 * i + 1 < pending_count) {
+        int child = 2 * i + 1;
+
+        if (child + 1 < pending_count && pending[child + 1]->due < pending[child]->due) {
+            child++;
+        }
+        if (last->due <= pending[child]->due) {
+            break;
+        }
+        pending[i] = pending[child];
+        i = child;
+    }
+    if (pending_count) {
+        pending[i] = last;
+    }
+
+    return top;
+
+}
+
+// append Cisco vendor attribute, returns new length or -1 if packet is full
+
+static int m2_fake_add_cisco(unsigned char *packet, int length, int attribute, const char *value) {
+
+    int value_length = strlen(value);
+
+    if (value_length > 247 || length + value_length + 8 > M2_FAKE_PACKET_MAX) {
+        return -1;
+    }
+
+    packet[length] = M2_FAKE_ATTR_VENDOR_SPECIFIC;
+    packet[length + 1] = (unsigned char) (value_length + 8);
+    packet[length + 2] = 0;
+    packet[length + 3] = 0;
+    packet[length + 4] = 0;
+    packet[length + 5] = M2_FAKE_VENDOR_CISCO;
+    packet[length + 6] = (unsigned char) attribute;
+    packet[length + 7] = (unsigned char) (value_length + 2);
+    memcpy(packet + length + 8, value, value_length);
+
+    return length + value_length + 8;
+
+}
+
+// copy string attribute of the request, empty string if it is missing
+
+static void m2_fake_get_attr(const unsigned char *packet, int length, int attribute, char *value, int value_size) {
+
+    int offset = 20;
+
+    *value = '\0';
+
+    while (offset + 2 <= length && packet[offset + 1] >= 2 && offset + packet[offset + 1] <= length) {
+        int attr_length = packet[offset + 1] - 2;
+
+        if (packet[offset] == attribute) {
+            if (attr_length >= value_size) attr_length = value_size - 1;
+            memcpy(value, packet + offset + 2, attr_length);
+            value[attr_length] = '\0';
+            return;
+        }
+        offset += packet[offset + 1];
+    }
+
+}
+
+static int m2_fake_build_reply(const unsigned char *request, int request_length, unsigned char *packet) {
+
+    char value[256] = "";
+    char destination[128] = "";
+    int secret_length = strlen(config.secret);
+    int length = 20;
+    int i;
+
+    if (request[0] == M2_FAKE_ACCOUNTING_REQUEST) {
+        packet[0] = M2_FAKE_ACCOUNTING_RESPONSE;
+        meter.acct++;
+    } else if (config.reject > 0 && rand() % 100 < config.reject) {
+        packet[0] = M2_FAKE_ACCESS_REJECT;
+        snprintf(value, sizeof(value), "m2_hangupcause=%d", config.reject_cause);
+        length = m2_fake_add_cisco(packet, length, M2_FAKE_CISCO_AVPAIR, value);
+        meter.auth++;
+        meter.rejected++;
+    } else {
+        packet[0] = M2_FAKE_ACCESS_ACCEPT;
+        m2_fake_get_attr(request, request_length, M2_FAKE_ATTR_CALLED_STATION_ID, destination, sizeof(destination));
+
+        // same format as the rating core: cid number/cid name/destination/ip:port/timeout/ringing timeout
+        for (i = 1; i <= config.routes && length > 0; i++) {
+            snprintf(value, sizeof(value), "-/-/%s/127.0.0.1:%d/60/30", *destination ? destination : "37060000001", 5060 + i);
+            length = m2_fake_add_cisco(packet, length, M2_FAKE_CISCO_COMMAND_CODE, value);
+            if (length > 0) {
+                snprintf(value, sizeof(value), "terminator=%d", i);
+                length = m2_fake_add_cisco(packet, length, M2_FAKE_CISCO_AVPAIR, value);
+            }
+        }
+        for (i = 1; i <= config.variables && length > 0; i++) {
+            snprintf(value, sizeof(value), "bench_%d=%032d", i, i);
+            length = m2_fake_add_cisco(packet, length, M2_FAKE_CISCO_AVPAIR, value);
+        }
+        if (length > 0) {
+            snprintf(value, sizeof(value), "%d", config.credit_time);
+            length = m2_fake_add_cisco(packet, length, M2_FAKE_CISCO_CREDIT_TIME, value);
+        }
+        meter.auth++;
+        meter.accepted++;
+    }
+
+    if (length < 0) {
+        fprintf(stderr, "Reply does not fit into %d bytes, use less routes or variables\n", M2_FAKE_PACKET_MAX);
+        exit(1);
+    }
+
+    packet[1] = request[1];
+    packet[2] = (unsigned char) ((length >> 8) & 0xff);
+    packet[3] = (unsigned char) (length & 0xff);
+    memcpy(packet + 4, request + 4, 16);
+
+    // response authenticator: MD5(code + id + length + request authenticator + attributes + secret)
+    memcpy(packet + length, config.secret, secret_length);
+    rc_md5_calc(packet + 4, packet, length + secret_length);
+
+    return length;
+
+}
+
+static void m2_fake_handle(int fd) {
+
+    unsigned char request[M2_FAKE_PACKET_MAX];
+    m2_fake_reply_t *reply = NULL;
+    socklen_t addr_length = sizeof(struct sockaddr_in);
+    struct sockaddr_in addr;
+    int length = 0;
+
+    if ((length = recvfrom(fd, request, sizeof(request), MSG_DONTWAIT, (struct sockaddr *) &addr, &addr_length)) <= 0) {
+        return;
+    }
+
+    if (length < 20 || length < ((request[2] << 8) | request[3]) ||
+        (request[0] != M2_FAKE_ACCESS_REQUEST && request[0] != M2_FAKE_ACCOUNTING_REQUEST)) {
+        meter.bad++;
+        return;
+    }
+
+    // lost requests are not counted as auth or acct, the client retries them
+    if (config.loss > 0 && rand() % 100 < config.loss) {
+        meter.dropped++;
+        return;
+    }
+
+    if (pending_count >= M2_FAKE_PENDING_MAX || (reply = malloc(sizeof(m2_fake_reply_t))) == NULL) {
+        meter.overflow++;
+        return;
+    }
+
+    reply->fd = fd;
+    reply->addr = addr;
+    reply->length = m2_fake_build_reply(request, ((request[2] << 8) | request[3]), reply->packet);
+    reply->due = m2_fake_now() + (int64_t) config.delay * 1000;
+    if (config.jitter > 0) {
+        reply->due += (int64_t) (rand() % (config.jitter * 1000 + 1));
+    }
+
+    m2_fake_pending_push(reply);
+
+}
+
+static void m2_fake_send_due(void) {
+
+    int64_t now = m2_fake_now();
+
+    while (pending_count && pending[0]->due <= now) {
+        m2_fake_reply_t *reply = m2_fake_pending_pop();
+
+        if (sendto(reply->fd, reply->packet, reply->length, 0, (struct sockaddr *) &reply->addr, sizeof(reply->addr)) == reply->length) {
+            meter.responded++;
+        }
+        free(reply);
+    }
+
+}
+
+static int m2_fake_socket(const char *address, int port) {
+
+    struct sockaddr_in addr;
+    int buffer = 4 * 1024 * 1024;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+
+    return fd;
+
+}
+
+/*
+    Dynamic authorization client
+*/
+
+
+static int m2_fake_add_attr(unsigned char *packet, int length, int attribute, const void *value, int value_length) {
+
+    packet[length] = (unsigned char) attribute;
+    packet[length + 1] = (unsigned char) (value_length + 2);
+    memcpy(packet + length + 2, value, value_length);
+
+    return length + value_length + 2;
+
+}
+
+static int m2_fake_add_integer(unsigned char *packet, int length, int attribute, uint32_t value) {
+
+    unsigned char buffer[4];
+
+    buffer[0] = (unsigned char) ((value >> 24) & 0xff);
+    buffer[1] = (unsigned char) ((value >> 16) & 0xff);
+    buffer[2] = (unsigned char) ((value >> 8) & 0xff);
+    buffer[3] = (unsigned char) (value & 0xff);
+
+    return m2_fake_add_attr(packet, length, attribute, buffer, 4);
+
+}
+
+static void m2_fake_coa_usage(const char *name) {
+
+    fprintf(stderr, "Usage: %s coa -s <secret> -u <uuid> [-a address] [-p port] [-d | -t seconds] [-e offset | -E] [-r]\n", name);
+    exit(1);
+
+}
+
+// wait for reply to the request and print it, returns 0 for ACK
+
+static int m2_fake_coa_reply(int fd, const unsigned char *request) {
+
+    unsigned char packet[M2_FAKE_PACKET_MAX + 256];
+    unsigned char authenticator[16];
+    unsigned char digest[16];
+    struct pollfd pfd;
+    int secret_length = strlen(config.secret);
+    int length = 0;
+    int offset = 20;
+    uint32_t error_cause = 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, 3000) <= 0 || (length = recv(fd, packet, M2_FAKE_PACKET_MAX, 0)) < 20 || length < ((packet[2] << 8) | packet[3])) {
+        printf("No reply\n");
+        return 1;
+    }
+
+    length = (packet[2] << 8) | packet[3];
+    if (packet[1] != request[1]) {
+        printf("Reply to other request (identifier %d)\n", packet[1]);
+        return 1;
+    }
+
+    // response authenticator: MD5(code + id + length + request authenticator + attributes + secret)
+    memcpy(authenticator, packet + 4, 16);
+    memcpy(packet + 4, request + 4, 16);
+    memcpy(packet + length, config.secret, secret_length);
+    rc_md5_calc(digest, packet, length + secret_length);
+    if (memcmp(digest, authenticator, 16)) {
+        printf("Reply has bad authenticator\n");
+        return 1;
+    }
+
+    while (offset + 2 <= length && packet[offset + 1] >= 2 && offset + packet[offset + 1] <= length) {
+        if (packet[offset] == M2_FAKE_ATTR_ERROR_CAUSE && packet[offset + 1] == 6) {
+            error_cause = ((uint32_t) packet[offset + 2] << 24) | ((uint32_t) packet[offset + 3] << 16) | ((uint32_t) packet[offset + 4] << 8) | packet[offset + 5];
+        }
+        offset += packet[offset + 1];
+    }
+
+    if (packet[0] == request[0] + 1) {
+        printf("%s-ACK\n", request[0] == M2_FAKE_DISCONNECT_REQUEST ? "Disconnect" : "CoA");
+        return 0;
+    }
+
+    printf("%s-NAK, error cause %u\n", request[0] == M2_FAKE_DISCONNECT_REQUEST ? "Disconnect" : "CoA", error_cause);
+
+    return 1;
+
+}
+
+static int m2_fake_coa(int argc, char **argv, const char *name) {
+
+    unsigned char packet[M2_FAKE_PACKET_MAX + 256];
+    struct sockaddr_in addr;
+    char uuid[254] = "";
+    int port = 3799;
+    int disconnect = 0;
+    int timeout = -1;
+    int event_offset = 0;
+    int event_time = 1;
+    int repeat = 0;
+    int secret_length = 0;
+    int length = 20;
+    int opt = 0;
+    int res = 0;
+    int fd = -1;
+
+    snprintf(config.address, sizeof(config.address), "127.0.0.1");
+
+    while ((opt = getopt(argc, argv, "s:u:a:p:dt:e:Er")) != -1) {
+        switch (opt) {
+            case 's': snprintf(config.secret, sizeof(config.secret), "%s", optarg); break;
+            case 'u': snprintf(uuid, sizeof(uuid), "%s", optarg); break;
+            case 'a': snprintf(config.address, sizeof(config.address), "%s", optarg); break;
+            case 'p': port = atoi(optarg); break;
+            case 'd': disconnect = 1; break;
+            case 't': timeout = atoi(optarg); break;
+            case 'e': event_offset = atoi(optarg); break;
+            case 'E': event_time = 0; break;
+            case 'r': repeat = 1; break;
+            default: m2_fake_coa_usage(name);
+        }
+    }
+
+    if (!*config.secret || !*uuid || (!disconnect && timeout < 0)) {
+        m2_fake_coa_usage(name);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, config.address, &addr.sin_addr) != 1 || (fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Failed to connect to %s:%d\n", config.address, port);
+        return 1;
+    }
+
+    srand(time(NULL));
+    packet[0] = disconnect ? M2_FAKE_DISCONNECT_REQUEST : M2_FAKE_COA_REQUEST;
+    packet[1] = (unsigned char) (rand() & 0xff);
+    memset(packet + 4, 0, 16);
+
+    length = m2_fake_add_attr(packet, length, M2_FAKE_ATTR_ACCT_SESSION_ID, uuid, strlen(uuid));
+    if (!disconnect) {
+        length = m2_fake_add_integer(packet, length, M2_FAKE_ATTR_SESSION_TIMEOUT, (uint32_t) timeout);
+    }
+    if (event_time) {
+        length = m2_fake_add_integer(packet, length, M2_FAKE_ATTR_EVENT_TIMESTAMP, (uint32_t) (time(NULL) + event_offset));
+    }
+    packet[2] = (unsigned char) ((length >> 8) & 0xff);
+    packet[3] = (unsigned char) (length & 0xff);
+
+    // request authenticator (RFC 5176 3.5): MD5(code + id + length + 16 zero octets + attributes + secret)
+    secret_length = strlen(config.secret);
+    memcpy(packet + length, config.secret, secret_length);
+    rc_md5_calc(packet + 4, packet, length + secret_length);
+
+    if (send(fd, packet, length, 0) != length) {
+        fprintf(stderr, "Failed to send request\n");
+        close(fd);
+        return 1;
+    }
+    res = m2_fake_coa_reply(fd, packet);
+
+    if (repeat) {
+        printf("Sending the same request again\n");
+        if (send(fd, packet, length, 0) == length) {
+            res |= m2_fake_coa_reply(fd, packet);
+        }
+    }
+
+    close(fd);
+
+    return res;
+
+}
+
+static void m2_fake_usage(const char *name) {
+
+    fprintf(stderr, "Usage: %s -s <secret> [-a address] [-p auth port] [-P acct port] [-d delay ms] [-j jitter ms]\n"
+        "       [-l loss %%] [-r reject %%] [-c reject cause] [-n routes] [-v variables] [-t credit time]\n"
+        "       %s coa -s <secret> -u <uuid> [-a address] [-p port] [-d | -t seconds] [-e offset | -E] [-r]\n", name, name);
+    exit(1);
+
+}
+
+int main(int argc, char **argv) {
+
+    struct pollfd fds[2];
+    int64_t last_report = 0;
+    uint64_t last_responded = 0;
+    int opt = 0;
+    int i;
+
+    if (argc > 1 && !strcmp(argv[1], "coa")) {
+        return m2_fake_coa(argc - 1, argv + 1, argv[0]);
+    }
+
+    snprintf(config.address, sizeof(config.address), "127.0.0.1");
+    config.auth_port = 1812;
+    config.acct_port = 1813;
+    config.reject_cause = 311;
+    config.routes = 3;
+    config.credit_time = 3600;
+
+    while ((opt = getopt(argc, argv, "s:a:p:P:d:j:l:r:c:n:v:t:")) != -1) {
+        switch (opt) {
+            case 's': snprintf(config.secret, sizeof(config.secret), "%s", optarg); break;
+            case 'a': snprintf(config.address, sizeof(config.address), "%s", optarg); break;
+            case 'p': config.auth_port = atoi(optarg); break;
+            case 'P': config.acct_port = atoi(optarg); break;
+            case 'd': config.delay = atoi(optarg); break;
+            case 'j': config.jitter = atoi(optarg); break;
+            case 'l': config.loss = atoi(optarg); break;
+            case 'r': config.reject = atoi(optarg); break;
+            case 'c': config.reject_cause = atoi(optarg); break;
+            case 'n': config.routes = atoi(optarg); break;
+            case 'v': config.variables = atoi(optarg); break;
+            case 't': config.credit_time = atoi(optarg); break;
+            default: m2_fake_usage(argv[0]);
+        }
+    }
+
+    if (!*config.secret || config.delay < 0 || config.jitter < 0 || config.routes < 0 || config.variables < 0) {
+        m2_fake_usage(argv[0]);
+    }
+
+    if ((fds[0].fd = m2_fake_socket(config.address, config.auth_port)) < 0 || (fds[1].fd = m2_fake_socket(config.address, config.acct_port)) < 0) {
+        fprintf(stderr, "Failed to bind %s:%d and %s:%d\n", config.address, config.auth_port, config.address, config.acct_port);
+        return 1;
+    }
+    fds[0].events = fds[1].events = POLLIN;
+
+    if ((pending = malloc(sizeof(m2_fake_reply_t *) * M2_FAKE_PENDING_MAX)) == NULL) {
+        return 1;
+    }
+
+    signal(SIGINT, m2_fake_stop);
+    signal(SIGTERM, m2_fake_stop);
+    srand(time(NULL));
+
+    printf("Listening on %s:%d (auth) and %s:%d (acct), delay %d ms, jitter %d ms, loss %d%%, reject %d%%, routes %d, variables %d\n",
+        config.address, config.auth_port, config.address, config.acct_port, config.delay, config.jitter, config.loss, config.reject,
+        config.routes, config.variables);
+
+    last_report = m2_fake_now();
+
+    while (running) {
+        int timeout = 1000;
+
+        // wake up for the first delayed reply
+        if (pending_count) {
+            int64_t wait = pending[0]->due - m2_fake_now();
+
+            timeout = wait <= 0 ? 0 : (int) ((wait + 999) / 1000);
+            if (timeout > 1000) timeout = 1000;
+        }
+
+        if (poll(fds, 2, timeout) > 0) {
+            for (i = 0; i < 2; i++) {
+                if (fds[i].revents & POLLIN) {
+                    m2_fake_handle(fds[i].fd);
+                }
+            }
+        }
+
+        m2_fake_send_due();
+
+        if (m2_fake_now() - last_report >= 1000000) {
+            printf("auth %llu (accepted %llu, rejected %llu), acct %llu, replies %llu/s, pending %d, dropped %llu, overflow %llu, bad %llu\n",
+                (unsigned long long) meter.auth, (unsigned long long) meter.accepted, (unsigned long long) meter.rejected,
+                (unsigned long long) meter.acct, (unsigned long long) (meter.responded - last_responded), pending_count,
+                (unsigned long long) meter.dropped, (unsigned long long) meter.overflow, (unsigned long long) meter.bad);
+            fflush(stdout);
+            last_responded = meter.responded;
+            last_report = m2_fake_now();
+        }
+    }
+
+    printf("Total: auth %llu (accepted %llu, rejected %llu), acct %llu, replies %llu, dropped %llu\n",
+        (unsigned long long) meter.auth, (unsigned long long) meter.accepted, (unsigned long long) meter.rejected,
+        (unsigned long long) meter.acct, (unsigned long long) meter.responded, (unsigned long long) meter.dropped);
+
+    return 0;
+
+}
@@ -0,0 +1,798 @@
+/*
+ * m2_radius_replay.c -- replay of mod_xml_m2_radius capture file to a test rating core
+ *
+ * Requests from the capture (capture-file setting of the module) are sent at the same pace they were captured,
+ * or faster (-x 1..50). Requests of the same call keep their order: next request of a call is sent only after
+ * the previous one was answered or timed out, other calls are not held back by it. Replies are compared with
+ * the captured ones (result, routes, h323-credit-time and m2_hangupcause, the same digest shadow mode uses)
+ * and latency percentiles of the replay and of the capture are printed per connection type.
+ *
+ * Build: gcc -O2 -o m2_radius_replay m2_radius_replay.c -lfreeradius-client
+ *
+ * Usage: m2_radius_replay -f <capture file> -s <secret> [-a address] [-p auth port] [-P acct port] [-x speed]
+ *                         [-t timeout ms] [-m mismatches to print]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <freeradius-client.h>
+
+// layout must match capture file of mod_xml_m2_radius.c
+
+#define M2_REPLAY_CAPTURE_MAGIC 0x4d324346
+#define M2_REPLAY_CAPTURE_RECORD_MAGIC 0x4d324352
+#define M2_REPLAY_CAPTURE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t start_time;
+} m2_replay_capture_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t length;
+    int64_t send_time;
+    int64_t rtt;
+    int32_t code;
+    int32_t conn;
+    int32_t result;
+    int32_t route_count;
+    uint32_t route_hash;
+    uint32_t reserved;
+    char timeout[32];
+    char cause[16];
+    char call_uuid[64];
+} m2_replay_capture_record_t;
+
+#define M2_REPLAY_PACKET_MAX 4096
+#define M2_REPLAY_SOCKETS 16
+#define M2_REPLAY_CONN_COUNT 6
+
+#define M2_REPLAY_ACCESS_REQUEST 1
+#define M2_REPLAY_ACCESS_ACCEPT 2
+#define M2_REPLAY_ACCESS_REJECT 3
+#define M2_REPLAY_ACCOUNTING_REQUEST 4
+#define M2_REPLAY_ACCOUNTING_RESPONSE 5
+
+#define M2_REPLAY_ATTR_VENDOR_SPECIFIC 26
+#define M2_REPLAY_ATTR_ACCT_DELAY_TIME 41
+#define M2_REPLAY_VENDOR_CISCO 9
+#define M2_REPLAY_CISCO_AVPAIR 1
+#define M2_REPLAY_CISCO_CREDIT_TIME 102
+#define M2_REPLAY_CISCO_COMMAND_CODE 252
+
+// result codes of the radius client library, as they are stored in the capture
+
+#define M2_REPLAY_OK_RC 0
+#define M2_REPLAY_TIMEOUT_RC 1
+#define M2_REPLAY_REJECT_RC 2
+#define M2_REPLAY_BADRESP_RC -2
+
+static const char *m2_replay_conn_names[M2_REPLAY_CONN_COUNT] = {
+    "auth",
+    "acct_start",
+    "acct_stop",
+    "acct_start_secondary",
+    "acct_stop_secondary",
+    "auth_secondary"
+};
+
+typedef enum {
+    M2_REPLAY_PENDING,
+    M2_REPLAY_BLOCKED,
+    M2_REPLAY_READY,
+    M2_REPLAY_SENT,
+    M2_REPLAY_DONE
+} m2_replay_state_t;
+
+typedef struct {
+    m2_replay_capture_record_t *record;
+    m2_replay_state_t state;
+    int prev;
+    int next;
+    int64_t due;
+    int64_t sent_at;
+    int64_t rtt;
+    int result;
+    unsigned char vector[16];
+} m2_replay_request_t;
+
+// the parts of the reply which decide how the call is routed
+
+typedef struct {
+    int result;
+    int route_count;
+    uint32_t route_hash;
+    char timeout[32];
+    char cause[16];
+} m2_replay_digest_t;
+
+static struct {
+    char file[512];
+    char secret[256];
+    char address[64];
+    int auth_port;
+    int acct_port;
+    int speed;
+    int timeout;
+    int print_mismatches;
+} config;
+
+static struct {
+    uint64_t replies;
+    uint64_t timeouts;
+    uint64_t bad;
+    uint64_t late;
+    uint64_t diff_result;
+    uint64_t diff_routes;
+    uint64_t diff_timeout;
+    uint64_t diff_cause;
+    uint64_t match;
+} meter;
+
+static m2_replay_request_t *requests = NULL;
+static int request_count = 0;
+static int *ready = NULL;
+static int ready_head = 0;
+static int ready_tail = 0;
+static int outstanding[M2_REPLAY_SOCKETS][256];
+static int outstanding_count = 0;
+static int next_socket = 0;
+static int sockets[M2_REPLAY_SOCKETS];
+static struct sockaddr_in auth_addr;
+static struct sockaddr_in acct_addr;
+static volatile sig_atomic_t running = 1;
+
+
+static int64_t m2_replay_now(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+}
+
+static void m2_replay_stop(int sig) {
+
+    running = 0;
+
+}
+
+static uint32_t m2_replay_hash_string(const char *str) {
+
+    uint32_t hash = 5381;
+
+    while (*str) {
+        hash = ((hash << 5) + hash) + (unsigned char) *str++;
+    }
+
+    return hash;
+
+}
+
+static int m2_replay_time_compare(const void *a, const void *b) {
+
+    const m2_replay_request_t *x = a;
+    const m2_replay_request_t *y = b;
+
+    if (x->record->send_time != y->record->send_time) {
+        return x->record->send_time < y->record->send_time ? -1 : 1;
+    }
+
+    // capture is in reply order, keep it for requests sent in the same microsecond
+    return x->record < y->record ? -1 : (x->record > y->record ? 1 : 0);
+
+}
+
+static int m2_replay_int64_compare(const void *a, const void *b) {
+
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+
+}
+
+// read the whole capture, requests are sorted by send time and chained by call
+
+static int m2_replay_load(const char *file) {
+
+    m2_replay_capture_header_t *header = NULL;
+    unsigned char *data = NULL;
+    int *calls = NULL;
+    size_t size = 0;
+    size_t offset = sizeof(m2_replay_capture_header_t);
+    size_t call_table = 1;
+    FILE *fp = NULL;
+    int i;
+
+    if ((fp = fopen(file, "rb")) == NULL) {
+        fprintf(stderr, "Failed to open %s\n", file);
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = (size_t) ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (size < sizeof(m2_replay_capture_header_t) || (data = malloc(size)) == NULL || fread(data, 1, size, fp) != size) {
+        fprintf(stderr, "Failed to read %s\n", file);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    header = (m2_replay_capture_header_t *) data;
+    if (header->magic != M2_REPLAY_CAPTURE_MAGIC || header->version != M2_REPLAY_CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not a capture file of version %d\n", file, M2_REPLAY_CAPTURE_VERSION);
+        return -1;
+    }
+
+    if ((requests = malloc(sizeof(m2_replay_request_t) * (size / sizeof(m2_replay_capture_record_t) + 1))) == NULL) {
+        return -1;
+    }
+
+    while (offset + sizeof(m2_replay_capture_record_t) <= size) {
+        m2_replay_capture_record_t *record = (m2_replay_capture_record_t *) (data + offset);
+
+        // the last record can be cut if the module was writing it when the file was copied
+        if (record->magic != M2_REPLAY_CAPTURE_RECORD_MAGIC || offset + sizeof(m2_replay_capture_record_t) + record->length > size) {
+            fprintf(stderr, "Capture is damaged at offset %zu, using %d requests before it\n", offset, request_count);
+            break;
+        }
+
+        record->call_uuid[sizeof(record->call_uuid) - 1] = '\0';
+        memset(&requests[request_count], 0, sizeof(m2_replay_request_t));
+        requests[request_count].record = record;
+        request_count++;
+        offset += sizeof(m2_replay_capture_record_t) + record->length;
+    }
+
+    if (request_count == 0) {
+        fprintf(stderr, "Capture %s has no requests\n", file);
+        return -1;
+    }
+
+    qsort(requests, request_count, sizeof(m2_replay_request_t), m2_replay_time_compare);
+
+    // open addressing table of the last request of every call
+    while (call_table < (size_t) request_count * 2) {
+        call_table <<= 1;
+    }
+    if ((calls = malloc(sizeof(int) * call_table)) == NULL || (ready = malloc(sizeof(int) * request_count)) == NULL) {
+        return -1;
+    }
+    memset(calls, -1, sizeof(int) * call_table);
+
+    for (i = 0; i < request_count; i++) {
+        m2_replay_request_t *request = &requests[i];
+        size_t slot = 0;
+
+        request->prev = -1;
+        request->next = -1;
+        request->due = (request->record->send_time - requests[0].record->send_time) / config.speed;
+
+        if (!*request->record->call_uuid) {
+            continue;
+        }
+
+        slot = m2_replay_hash_string(request->record->call_uuid) & (call_table - 1);
+        while (calls[slot] >= 0 && strcmp(requests[calls[slot]].record->call_uuid, request->record->call_uuid)) {
+            slot = (slot + 1) & (call_table - 1);
+        }
+
+        if (calls[slot] >= 0) {
+            request->prev = calls[slot];
+            requests[calls[slot]].next = i;
+        }
+        calls[slot] = i;
+    }
+
+    free(calls);
+
+    return 0;
+
+}
+
+static int m2_replay_add_attr(unsigned char *packet, int length, int attribute, const unsigned char *value, int value_length) {
+
+    if (length + 2 + value_length > M2_REPLAY_PACKET_MAX) {
+        return -1;
+    }
+
+    packet[length] = (unsigned char) attribute;
+    packet[length + 1] = (unsigned char) (2 + value_length);
+    memcpy(packet + length + 2, value, value_length);
+
+    return length + 2 + value_length;
+
+}
+
+static int m2_replay_has_attr(const unsigned char *attrs, int length, int attribute) {
+
+    int offset = 0;
+
+    while (offset + 2 <= length && attrs[offset + 1] >= 2) {
+        if (attrs[offset] == attribute) {
+            return 1;
+        }
+        offset += attrs[offset + 1];
+    }
+
+    return 0;
+
+}
+
+static int m2_replay_send(int index) {
+
+    m2_replay_request_t *request = &requests[index];
+    m2_replay_capture_record_t *record = request->record;
+    const unsigned char *attrs = (const unsigned char *) record + sizeof(m2_replay_capture_record_t);
+    unsigned char packet[M2_REPLAY_PACKET_MAX + 256];
+    struct sockaddr_in *addr = record->code == M2_REPLAY_ACCESS_REQUEST ? &auth_addr : &acct_addr;
+    int secret_length = strlen(config.secret);
+    int length = 20 + record->length;
+    int sock = -1;
+    int id = -1;
+    int i, j;
+
+    for (i = 0; i < M2_REPLAY_SOCKETS && id < 0; i++) {
+        int s = (next_socket + i) % M2_REPLAY_SOCKETS;
+
+        for (j = 0; j < 256; j++) {
+            if (outstanding[s][j] < 0) {
+                sock = s;
+                id = j;
+                break;
+            }
+        }
+    }
+
+    // all identifiers are in use, request waits for a reply
+    if (id < 0) {
+        return 0;
+    }
+    next_socket = (sock + 1) % M2_REPLAY_SOCKETS;
+
+    if (length > M2_REPLAY_PACKET_MAX) {
+        length = M2_REPLAY_PACKET_MAX;
+    }
+
+    packet[0] = (unsigned char) record->code;
+    packet[1] = (unsigned char) id;
+    memcpy(packet + 20, attrs, length - 20);
+
+    // transport of the module adds Acct-Delay-Time to every accounting request
+    if (record->code == M2_REPLAY_ACCOUNTING_REQUEST && !m2_replay_has_attr(attrs, record->length, M2_REPLAY_ATTR_ACCT_DELAY_TIME)) {
+        unsigned char zero[4] = { 0, 0, 0, 0 };
+        int new_length = m2_replay_add_attr(packet, length, M2_REPLAY_ATTR_ACCT_DELAY_TIME, zero, 4);
+
+        if (new_length > 0) {
+            length = new_length;
+        }
+    }
+
+    packet[2] = (unsigned char) ((length >> 8) & 0xff);
+    packet[3] = (unsigned char) (length & 0xff);
+
+    if (record->code == M2_REPLAY_ACCESS_REQUEST) {
+        for (i = 0; i < 16; i++) {
+            request->vector[i] = (unsigned char) (rand() & 0xff);
+        }
+    } else {
+        // accounting request authenticator (RFC 2866 3)
+        memset(packet + 4, 0, 16);
+        memcpy(packet + length, config.secret, secret_length);
+        rc_md5_calc(request->vector, packet, length + secret_length);
+    }
+    memcpy(packet + 4, request->vector, 16);
+
+    request->sent_at = m2_replay_now();
+    if (request->sent_at - request->due > 10000) {
+        meter.late++;
+    }
+
+    sendto(sockets[sock], packet, length, 0, (struct sockaddr *) addr, sizeof(*addr));
+
+    request->state = M2_REPLAY_SENT;
+    outstanding[sock][id] = index;
+    outstanding_count++;
+
+    return 1;
+
+}
+
+static void m2_replay_ready(int index) {
+
+    requests[index].state = M2_REPLAY_READY;
+    ready[ready_tail++] = index;
+
+}
+
+static void m2_replay_digest(const unsigned char *reply, int length, m2_replay_digest_t *digest) {
+
+    int offset = 20;
+
+    memset(digest, 0, sizeof(*digest));
+    digest->result = reply[0] == M2_REPLAY_ACCESS_REJECT ? M2_REPLAY_REJECT_RC : M2_REPLAY_OK_RC;
+    digest->route_hash = 5381;
+
+    while (offset + 2 <= length && reply[offset + 1] >= 2 && offset + reply[offset + 1] <= length) {
+        int end = offset + reply[offset + 1];
+        int sub = offset + 6;
+
+        if (reply[offset] == M2_REPLAY_ATTR_VENDOR_SPECIFIC && reply[offset + 1] > 8 &&
+            ((reply[offset + 2] << 24) | (reply[offset + 3] << 16) | (reply[offset + 4] << 8) | reply[offset + 5]) == M2_REPLAY_VENDOR_CISCO) {
+            while (sub + 2 <= end && reply[sub + 1] >= 2 && sub + reply[sub + 1] <= end) {
+                char value[256] = "";
+                const char *cause = NULL;
+                int value_length = reply[sub + 1] - 2;
+                int i;
+
+                memcpy(value, reply + sub + 2, value_length);
+                value[value_length] = '\0';
+
+                if (reply[sub] == M2_REPLAY_CISCO_COMMAND_CODE) {
+                    // order of routes matters, so hash them as one list
+                    for (i = 0; value[i]; i++) {
+                        digest->route_hash = ((digest->route_hash << 5) + digest->route_hash) + (unsigned char) value[i];
+                    }
+                    digest->route_hash = ((digest->route_hash << 5) + digest->route_hash) + '\n';
+                    digest->route_count++;
+                } else if (reply[sub] == M2_REPLAY_CISCO_AVPAIR && (cause = strstr(value, "m2_hangupcause="))) {
+                    snprintf(digest->cause, sizeof(digest->cause), "%s", cause + strlen("m2_hangupcause="));
+                } else if (reply[sub] == M2_REPLAY_CISCO_CREDIT_TIME) {
+                    snprintf(digest->timeout, sizeof(digest->timeout), "%s", value);
+                }
+
+                sub += reply[sub + 1];
+            }
+        }
+
+        offset = end;
+    }
+
+}
+
+static void m2_replay_compare(m2_replay_request_t *request, m2_replay_digest_t *digest) {
+
+    m2_replay_capture_record_t *record = request->record;
+    int diff = 0;
+
+    // requests which were not answered during capture have nothing to compare with
+    if (record->result != M2_REPLAY_OK_RC && record->result != M2_REPLAY_REJECT_RC) {
+        return;
+    }
+
+    if (record->result != digest->result) {
+        meter.diff_result++;
+        diff = 1;
+    } else if (record->code == M2_REPLAY_ACCESS_REQUEST) {
+        if (record->route_count != digest->route_count || record->route_hash != digest->route_hash) {
+            meter.diff_routes++;
+            diff = 1;
+        }
+        if (strcmp(record->timeout, digest->timeout)) {
+            meter.diff_timeout++;
+            diff = 1;
+        }
+        if (strcmp(record->cause, digest->cause)) {
+            meter.diff_cause++;
+            diff = 1;
+        }
+    }
+
+    if (!diff) {
+        meter.match++;
+        return;
+    }
+
+    if (config.print_mismatches > 0) {
+        config.print_mismatches--;
+        printf("Mismatch [%s] %s: result %d/%d, routes %d/%d%s, timeout '%s'/'%s', cause '%s'/'%s'\n",
+            record->conn >= 0 && record->conn < M2_REPLAY_CONN_COUNT ? m2_replay_conn_names[record->conn] : "?", record->call_uuid,
+            record->result, digest->result, record->route_count, digest->route_count, record->route_hash != digest->route_hash ? " (changed)" : "",
+            record->timeout, digest->timeout, record->cause, digest->cause);
+    }
+
+}
+
+static void m2_replay_done(int index, int result) {
+
+    m2_replay_request_t *request = &requests[index];
+    int next = request->next;
+
+    request->state = M2_REPLAY_DONE;
+    request->result = result;
+    request->rtt = m2_replay_now() - request->sent_at;
+
+    // next request of the call was due already and waited for this one
+    if (next >= 0 && requests[next].state == M2_REPLAY_BLOCKED) {
+        m2_replay_ready(next);
+    }
+
+}
+
+static void m2_replay_receive(int sock) {
+
+    unsigned char reply[M2_REPLAY_PACKET_MAX + 256];
+    unsigned char digest_md5[16];
+    unsigned char request_vector[16];
+    m2_replay_digest_t digest;
+    int secret_length = strlen(config.secret);
+    int length = 0;
+    int index = 0;
+
+    while ((length = recv(sockets[sock], reply, M2_REPLAY_PACKET_MAX, MSG_DONTWAIT)) > 0) {
+        if (length < 20 || length < ((reply[2] << 8) | reply[3]) || (index = outstanding[sock][reply[1]]) < 0) {
+            meter.bad++;
+            continue;
+        }
+        length = (reply[2] << 8) | reply[3];
+
+        // response authenticator check (RFC 2865 3)
+        memcpy(request_vector, reply + 4, 16);
+        memcpy(reply + 4, requests[index].vector, 16);
+        memcpy(reply + length, config.secret, secret_length);
+        rc_md5_calc(digest_md5, reply, length + secret_length);
+
+        outstanding[sock][reply[1]] = -1;
+        outstanding_count--;
+
+        if (memcmp(digest_md5, request_vector, 16)) {
+            meter.bad++;
+            m2_replay_done(index, M2_REPLAY_BADRESP_RC);
+            continue;
+        }
+
+        meter.replies++;
+        m2_replay_digest(reply, length, &digest);
+        m2_replay_done(index, digest.result);
+        m2_replay_compare(&requests[index], &digest);
+    }
+
+}
+
+static void m2_replay_expire(int64_t now) {
+
+    m2_replay_digest_t digest;
+    int sock, id;
+
+    memset(&digest, 0, sizeof(digest));
+    digest.result = M2_REPLAY_TIMEOUT_RC;
+
+    for (sock = 0; sock < M2_REPLAY_SOCKETS; sock++) {
+        for (id = 0; id < 256; id++) {
+            int index = outstanding[sock][id];
+
+            if (index >= 0 && now - requests[index].sent_at > (int64_t) config.timeout * 1000) {
+                outstanding[sock][id] = -1;
+                outstanding_count--;
+                meter.timeouts++;
+                m2_replay_done(index, M2_REPLAY_TIMEOUT_RC);
+                requests[index].rtt = 0;
+                m2_replay_compare(&requests[index], &digest);
+            }
+        }
+    }
+
+}
+
+static void m2_replay_percentiles(const char *name, int64_t *values, int count) {
+
+    if (count == 0) {
+        return;
+    }
+
+    qsort(values, count, sizeof(int64_t), m2_replay_int64_compare);
+    printf("  %-10s p50 %lld us, p90 %lld us, p99 %lld us, max %lld us (%d)\n", name, (long long) values[count / 2], (long long) values[count * 90 / 100],
+        (long long) values[count * 99 / 100], (long long) values[count - 1], count);
+
+}
+
+static void m2_replay_report(int64_t elapsed) {
+
+    int64_t *replay = malloc(sizeof(int64_t) * request_count);
+    int64_t *capture = malloc(sizeof(int64_t) * request_count);
+    int conn, i;
+
+    printf("Replayed %d requests at %dx in %.1f s, replies %llu, timeouts %llu, bad %llu, sent late %llu\n", request_count, config.speed, elapsed / 1000000.0,
+        (unsigned long long) meter.replies, (unsigned long long) meter.timeouts, (unsigned long long) meter.bad, (unsigned long long) meter.late);
+    printf("Replies: match %llu, result differs %llu, routes differ %llu, timeout differs %llu, cause differs %llu\n",
+        (unsigned long long) meter.match, (unsigned long long) meter.diff_result, (unsigned long long) meter.diff_routes,
+        (unsigned long long) meter.diff_timeout, (unsigned long long) meter.diff_cause);
+
+    if (replay == NULL || capture == NULL) {
+        return;
+    }
+
+    // answered requests only, timeouts would only show the timeout
+    for (conn = 0; conn < M2_REPLAY_CONN_COUNT; conn++) {
+        int replay_count = 0;
+        int capture_count = 0;
+
+        for (i = 0; i < request_count; i++) {
+            if (requests[i].record->conn != conn) {
+                continue;
+            }
+            if (requests[i].state == M2_REPLAY_DONE && (requests[i].result == M2_REPLAY_OK_RC || requests[i].result == M2_REPLAY_REJECT_RC)) {
+                replay[replay_count++] = requests[i].rtt;
+            }
+            if (requests[i].record->result == M2_REPLAY_OK_RC || requests[i].record->result == M2_REPLAY_REJECT_RC) {
+                capture[capture_count++] = requests[i].record->rtt;
+            }
+        }
+
+        if (replay_count || capture_count) {
+            printf("Latency [%s]:\n", m2_replay_conn_names[conn]);
+            m2_replay_percentiles("replay", replay, replay_count);
+            m2_replay_percentiles("capture", capture, capture_count);
+        }
+    }
+
+    free(replay);
+    free(capture);
+
+}
+
+static int m2_replay_resolve(const char *address, int port, struct sockaddr_in *addr) {
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+
+    return inet_pton(AF_INET, address, &addr->sin_addr) == 1;
+
+}
+
+static void m2_replay_usage(const char *name) {
+
+    fprintf(stderr, "Usage: %s -f <capture file> -s <secret> [-a address] [-p auth port] [-P acct port] [-x speed 1-50]\n"
+        "       [-t timeout ms] [-m mismatches to print]\n", name);
+    exit(1);
+
+}
+
+int main(int argc, char **argv) {
+
+    struct pollfd fds[M2_REPLAY_SOCKETS];
+    int64_t start = 0;
+    int64_t last_report = 0;
+    int64_t last_expire = 0;
+    int cursor = 0;
+    int done = 0;
+    int opt = 0;
+    int i;
+
+    snprintf(config.address, sizeof(config.address), "127.0.0.1");
+    config.auth_port = 1812;
+    config.acct_port = 1813;
+    config.speed = 1;
+    config.timeout = 3000;
+    config.print_mismatches = 10;
+
+    while ((opt = getopt(argc, argv, "f:s:a:p:P:x:t:m:")) != -1) {
+        switch (opt) {
+            case 'f': snprintf(config.file, sizeof(config.file), "%s", optarg); break;
+            case 's': snprintf(config.secret, sizeof(config.secret), "%s", optarg); break;
+            case 'a': snprintf(config.address, sizeof(config.address), "%s", optarg); break;
+            case 'p': config.auth_port = atoi(optarg); break;
+            case 'P': config.acct_port = atoi(optarg); break;
+            case 'x': config.speed = atoi(optarg); break;
+            case 't': config.timeout = atoi(optarg); break;
+            case 'm': config.print_mismatches = atoi(optarg); break;
+            default: m2_replay_usage(argv[0]);
+        }
+    }
+
+    if (!*config.file || !*config.secret || config.speed < 1 || config.speed > 50 || config.timeout < 1) {
+        m2_replay_usage(argv[0]);
+    }
+
+    if (!m2_replay_resolve(config.address, config.auth_port, &auth_addr) || !m2_replay_resolve(config.address, config.acct_port, &acct_addr)) {
+        fprintf(stderr, "Invalid address %s\n", config.address);
+        return 1;
+    }
+
+    if (m2_replay_load(config.file) < 0) {
+        return 1;
+    }
+
+    for (i = 0; i < M2_REPLAY_SOCKETS; i++) {
+        int buffer = 4 * 1024 * 1024;
+
+        if ((sockets[i] = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+            fprintf(stderr, "Failed to create socket\n");
+            return 1;
+        }
+        setsockopt(sockets[i], SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+        fds[i].fd = sockets[i];
+        fds[i].events = POLLIN;
+    }
+    memset(outstanding, -1, sizeof(outstanding));
+
+    signal(SIGINT, m2_replay_stop);
+    signal(SIGTERM, m2_replay_stop);
+    srand(time(NULL));
+
+    printf("Replaying %d requests from %s to %s:%d/%d at %dx\n", request_count, config.file, config.address, config.auth_port, config.acct_port, config.speed);
+
+    start = last_report = last_expire = m2_replay_now();
+
+    // due times are relative until replay starts
+    for (i = 0; i < request_count; i++) {
+        requests[i].due += start;
+    }
+
+    while (running) {
+        int64_t now = m2_replay_now();
+        int timeout = 10;
+
+        while (cursor < request_count && requests[cursor].due <= now) {
+            int prev = requests[cursor].prev;
+
+            if (prev < 0 || requests[prev].state == M2_REPLAY_DONE) {
+                m2_replay_ready(cursor);
+            } else {
+                requests[cursor].state = M2_REPLAY_BLOCKED;
+            }
+            cursor++;
+        }
+
+        while (ready_head < ready_tail && m2_replay_send(ready[ready_head])) {
+            ready_head++;
+        }
+
+        if (now - last_expire >= 10000) {
+            m2_replay_expire(now);
+            last_expire = now;
+        }
+
+        done = (int) (meter.replies + meter.timeouts + meter.bad);
+        if (cursor == request_count && ready_head == ready_tail && outstanding_count == 0) {
+            break;
+        }
+
+        if (ready_head == ready_tail && cursor < request_count) {
+            int64_t wait = requests[cursor].due - now;
+
+            if (wait < timeout * 1000) {
+                timeout = wait <= 0 ? 0 : (int) ((wait + 999) / 1000);
+            }
+        }
+
+        if (poll(fds, M2_REPLAY_SOCKETS, timeout) > 0) {
+            for (i = 0; i < M2_REPLAY_SOCKETS; i++) {
+                if (fds[i].revents & POLLIN) {
+                    m2_replay_receive(i);
+                }
+            }
+        }
+
+        if (now - last_report >= 1000000) {
+            printf("sent %d/%d, replies %llu, timeouts %llu, outstanding %d, mismatches %llu\n", done + outstanding_count, request_count,
+                (unsigned long long) meter.replies, (unsigned long long) meter.timeouts, outstanding_count,
+                (unsigned long long) (meter.diff_result + meter.diff_routes + meter.diff_timeout + meter.diff_cause));
+            fflush(stdout);
+            last_report = now;
+        }
+    }
+
+    m2_replay_report(m2_replay_now() - start);
+
+    return 0;
+
+}
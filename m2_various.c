@@ -679,6 +679,141 @@ static void m2_mutex_unlock(int lock) {
 
 }
 
+/*
+    Hedged authentication requests and shadow calls
+
+    FreeSWITCH can send the same authentication request to two rating servers (freeswitch-hedged=1),
+    accounting packets for such call may go to the other server. These calls are remembered here
+    so that missing START packet does not hang up the call which is handled by the other server.
+    Copies sent by FreeSWITCH shadow mode (freeswitch-shadow=1) are remembered in separate table, such calls
+    are never hung up, charged or saved to CDRs by this server
+*/
+
+
+#define M2_HEDGED_CALL_EXPIRE 3600     // seconds, longer than any START timeout
+#define M2_SHADOW_CALL_EXPIRE 86400    // seconds, longer than any call
+#define M2_MARKED_CALLS_CLEAN_PERIOD 10
+
+typedef struct {
+    char uniqueid[64];
+    time_t timestamp;
+    UT_hash_handle hh;
+} m2_marked_call_t;
+
+typedef struct {
+    m2_marked_call_t *calls;
+    int expire;
+    time_t cleaned;
+    pthread_mutex_t lock;
+} m2_marked_calls_t;
+
+static m2_marked_calls_t m2_hedged_calls = { NULL, M2_HEDGED_CALL_EXPIRE, 0, PTHREAD_MUTEX_INITIALIZER };
+static m2_marked_calls_t m2_shadow_calls = { NULL, M2_SHADOW_CALL_EXPIRE, 0, PTHREAD_MUTEX_INITIALIZER };
+
+// called with marked->lock locked
+
+static void m2_marked_calls_expire(m2_marked_calls_t *marked, time_t now) {
+
+    m2_marked_call_t *call = NULL, *tmp = NULL;
+
+    if (now - marked->cleaned < M2_MARKED_CALLS_CLEAN_PERIOD) return;
+
+    marked->cleaned = now;
+
+    HASH_ITER(hh, marked->calls, call, tmp) {
+        if (now - call->timestamp > marked->expire) {
+            HASH_DEL(marked->calls, call);
+            free(call);
+        }
+    }
+
+}
+
+static void m2_marked_call_add(m2_marked_calls_t *marked, const char *uniqueid) {
+
+    // this variable is used by m2_log function
+    calldata_t *cd = NULL;
+
+    m2_marked_call_t *call = NULL;
+    time_t now = time(NULL);
+
+    if (!strlen(uniqueid)) return;
+
+    pthread_mutex_lock(&marked->lock);
+
+    m2_marked_calls_expire(marked, now);
+
+    HASH_FIND_STR(marked->calls, uniqueid, call);
+    if (call == NULL) {
+        if ((call = (m2_marked_call_t *) malloc(sizeof(m2_marked_call_t))) == NULL) {
+            pthread_mutex_unlock(&marked->lock);
+            m2_log(M2_ERROR, "Failed to remember call [%s]\n", uniqueid);
+            return;
+        }
+        strlcpy(call->uniqueid, uniqueid, sizeof(call->uniqueid));
+        HASH_ADD_STR(marked->calls, uniqueid, call);
+    }
+    call->timestamp = now;
+
+    pthread_mutex_unlock(&marked->lock);
+
+}
+
+// expired entry is not found even if it was not cleaned yet
+
+static int m2_marked_call_check(m2_marked_calls_t *marked, const char *uniqueid) {
+
+    m2_marked_call_t *call = NULL;
+    int found = 0;
+
+    if (!strlen(uniqueid)) return 0;
+
+    pthread_mutex_lock(&marked->lock);
+    HASH_FIND_STR(marked->calls, uniqueid, call);
+    if (call && time(NULL) - call->timestamp <= marked->expire) {
+        found = 1;
+    }
+    pthread_mutex_unlock(&marked->lock);
+
+    return found;
+
+}
+
+static void m2_marked_call_remove(m2_marked_calls_t *marked, const char *uniqueid) {
+
+    m2_marked_call_t *call = NULL;
+
+    pthread_mutex_lock(&marked->lock);
+    HASH_FIND_STR(marked->calls, uniqueid, call);
+    if (call) {
+        HASH_DEL(marked->calls, call);
+        free(call);
+    }
+    pthread_mutex_unlock(&marked->lock);
+
+}
+
+static int m2_hedged_call_check(const char *uniqueid) {
+
+    return m2_marked_call_check(&m2_hedged_calls, uniqueid);
+
+}
+
+static int m2_shadow_call_check(const char *uniqueid) {
+
+    return m2_marked_call_check(&m2_shadow_calls, uniqueid);
+
+}
+
+// shadow call is finished, its CDR was skipped
+
+static void m2_shadow_call_remove(const char *uniqueid) {
+
+    m2_marked_call_remove(&m2_shadow_calls, uniqueid);
+
+}
+
+
 /*
     Read channel variables and store them in the calldata structure
 */
@@ -699,6 +834,8 @@ static int m2_read_variables(REQUEST *request, calldata_t *cd) {
     char server_id_str[10] = "";
     char proxy_op_ip[256] = "";
     char proxy_op_port_str[10] = "";
+    char hedged_str[10] = "";
+    char shadow_str[10] = "";
     int proxy_op_port = 0;
     struct timeb tp;
     ftime(&tp);
@@ -738,6 +875,8 @@ static int m2_read_variables(REQUEST *request, calldata_t *cd) {
     m2_radius_get_attribute_value_by_name(request, "freeswitch-proxy-op-port", proxy_op_port_str, sizeof(proxy_op_port_str), M2_CISCO_AVP);
     m2_radius_get_attribute_value_by_name(request, "freeswitch-pai", cd->originator_pai, sizeof(cd->originator_pai), M2_CISCO_AVP);
     m2_radius_get_attribute_value_by_name(request, "freeswitch-lnp", cd->lnp, sizeof(cd->lnp), M2_CISCO_AVP);
+    m2_radius_get_attribute_value_by_name(request, "freeswitch-hedged", hedged_str, sizeof(hedged_str), M2_CISCO_AVP);
+    m2_radius_get_attribute_value_by_name(request, "freeswitch-shadow", shadow_str, sizeof(shadow_str), M2_CISCO_AVP);
 
     // Special case. Do not change 33
     // database field calls.uniqueid is 33 char length (leftover from MOR system) but real unqiueid is longer
@@ -756,6 +895,12 @@ static int m2_read_variables(REQUEST *request, calldata_t *cd) {
         cd->op->port = atoi(op_port_str);
     }
 
+    if (strcmp(shadow_str, "1") == 0) {
+        m2_marked_call_add(&m2_shadow_calls, cd->uniqueid);
+    } else if (strcmp(hedged_str, "1") == 0) {
+        m2_marked_call_add(&m2_hedged_calls, cd->uniqueid);
+    }
+
     if (strlen(cd->originator_pai)) {
         m2_parse_header_number_part(cd->originator_pai, cd->originator_pai_number, sizeof(cd->originator_pai_number));
     }
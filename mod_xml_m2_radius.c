@@ -24,17 +24,935 @@
 #include <switch.h>
 #include <switch_event.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/random.h>
 #include <freeradius-client.h>
 
-#define M2_VERSION "0.0.29"
+#define M2_VERSION "0.0.30"
+
+// radius connection types (each one has its own pool of radius client handles)
+
+typedef enum {
+    M2_RADIUS_CONN_AUTH = 0,
+    M2_RADIUS_CONN_ACCT_START,
+    M2_RADIUS_CONN_ACCT_STOP,
+    M2_RADIUS_CONN_ACCT_START_SECONDARY,
+    M2_RADIUS_CONN_ACCT_STOP_SECONDARY,
+    M2_RADIUS_CONN_AUTH_SECONDARY,
+    M2_RADIUS_CONN_COUNT
+} m2_radius_conn_t;
+
+static const char *m2_radius_conn_names[M2_RADIUS_CONN_COUNT] = {
+    "auth",
+    "acct_start",
+    "acct_stop",
+    "acct_start_secondary",
+    "acct_stop_secondary",
+    "auth_secondary"
+};
+
+// value transformations applied before channel variable is sent to radius
+
+typedef enum {
+    M2_RADIUS_TRANSFORM_NONE = 0,
+    M2_RADIUS_TRANSFORM_CODEC_LIST
+} m2_radius_transform_t;
+
+// one attribute-value pair from <fields> section, resolved against the dictionary
+
+typedef struct {
+    char *name;
+    int attr_num;
+    int vend_num;
+    int type;
+    char *variable;
+    char *format;
+    char *prefix;
+    char *suffix;
+    m2_radius_transform_t transform;
+    int cisco_avpair;
+    int warn_missing;
+} m2_radius_attr_t;
+
+// compiled <fields> section
+
+typedef struct {
+    m2_radius_attr_t *attrs;
+    int count;
+} m2_radius_attr_plan_t;
+
+// multiplexed transport: request waiting for reply, socket with 256 identifiers, transport to one server
+
+#define M2_RADIUS_PACKET_MAX 4096
+#define M2_RADIUS_TRANSPORT_MAX_SOCKETS 64
+#define M2_RADIUS_MIN_RTO 50000
+#define M2_RADIUS_TRANSPORT_IDLE_WAIT 1000
+
+typedef struct m2_radius_request_s {
+    unsigned char packet[M2_RADIUS_PACKET_MAX];
+    int length;
+    unsigned char vector[16];
+    int tries;
+    int retries;
+    switch_time_t rto;
+    switch_time_t max_rto;
+    switch_time_t next_send;
+    int result;
+    int done;
+    unsigned char reply[M2_RADIUS_PACKET_MAX];
+    int reply_length;
+    switch_mutex_t *mutex;
+    switch_thread_cond_t *cond;
+    struct m2_radius_request_s *waiter;
+    void *sock;
+    uint8_t id;
+    struct m2_radius_request_s *next;
+} m2_radius_request_t;
+
+typedef struct {
+    int fd;
+    uint8_t next_id;
+    int in_flight;
+    m2_radius_request_t *pending[256];
+} m2_radius_transport_socket_t;
+
+typedef struct {
+    switch_mutex_t *mutex;
+    char label[512];
+    char secret[256];
+    struct sockaddr_in addr;
+    uint32_t nas_ip;
+    m2_radius_transport_socket_t *sockets;
+    int socket_count;
+    int max_sockets;
+    int wake_fd[2];
+    switch_time_t next_deadline;
+    uint64_t retransmits;
+    uint64_t bad_replies;
+    int running;
+    switch_thread_t *thread;
+} m2_radius_transport_t;
+
+// per-source negative cache and token bucket in front of authentication
+
+#define M2_RADIUS_SOURCE_TABLE_SIZE 4096
+
+typedef struct {
+    char ip[64];
+    char cause[16];
+    switch_time_t reject_until;
+    double tokens;
+    switch_time_t tokens_time;
+} m2_radius_source_t;
+
+// device known to the module, ip is "dynamic" for devices which register
+
+typedef struct {
+    char id[32];
+    char ip[64];
+    int gateway;
+} m2_radius_device_t;
+
+// keys of sharded calls in progress, used to keep keys on their shard during rebalance
+
+#define M2_RADIUS_SHARD_KEY_TABLE_SIZE 16384
+
+typedef struct {
+    uint32_t key;
+    int shard;
+    int calls;
+    switch_time_t updated;
+} m2_radius_shard_key_t;
+
+// local IPC with rating core on the same host, layout must match m2_ipc.c in the core
+
+#define M2_RADIUS_IPC_MAGIC 0x4d324950
+#define M2_RADIUS_IPC_VERSION 1
+#define M2_RADIUS_IPC_SLOTS 1024
+#define M2_RADIUS_IPC_PAYLOAD 4096
+#define M2_RADIUS_IPC_LOST -100
+
+typedef enum {
+    M2_RADIUS_IPC_SLOT_FREE,
+    M2_RADIUS_IPC_SLOT_WRITING,
+    M2_RADIUS_IPC_SLOT_REQUEST,
+    M2_RADIUS_IPC_SLOT_PROCESSING,
+    M2_RADIUS_IPC_SLOT_REPLY,
+    M2_RADIUS_IPC_SLOT_ABANDONED
+} m2_radius_ipc_slot_state_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t payload;
+    volatile uint32_t generation;
+    uint32_t reserved;
+} m2_radius_ipc_header_t;
+
+typedef struct {
+    volatile uint32_t state;
+    uint32_t code;
+    uint32_t length;
+    uint32_t reserved;
+    unsigned char data[M2_RADIUS_IPC_PAYLOAD];
+} m2_radius_ipc_slot_t;
+
+// radius server of one connection type with its own handles and health stats (times in microseconds)
+
+typedef struct {
+    char name[512];
+    char label[512];
+    rc_handle **idle;
+    int *idle_timeout;
+    int idle_count;
+    int created;
+    int timeout;
+    int active;
+    switch_time_t srtt;
+    switch_time_t rttvar;
+    switch_time_t dead_until;
+    int failures;
+    uint64_t requests;
+    uint64_t timeouts;
+    uint64_t errors;
+    int shard;
+    m2_radius_transport_t *transport;
+} m2_radius_server_t;
+
+// pool of pre-initialized radius client handles for one connection type
+// (recent RTTs of all servers are kept to calculate hedge delay)
+
+#define M2_RADIUS_RTT_RING 128
+#define M2_RADIUS_MAX_SHARDS 64
+
+typedef struct {
+    switch_mutex_t *mutex;
+    switch_xml_t conf_xml;
+    m2_radius_attr_plan_t *plan;
+    int auth;
+    int secondary_connection;
+    m2_radius_server_t *servers;
+    int server_count;
+    int shards[M2_RADIUS_MAX_SHARDS];
+    int shard_count;
+    int max_timeout;
+    int retries;
+    int deadtime;
+    char secret[256];
+    int avpair_attr;
+    int command_code_attr;
+    int credit_time_attr;
+    switch_time_t rtt_ring[M2_RADIUS_RTT_RING];
+    uint64_t rtt_count;
+    switch_time_t hedge_delay;
+    int max;
+    int created;
+} m2_radius_handle_pool_t;
+
+// Access-Accept decoded for one call (strings are allocated from session pool)
+
+#define M2_RADIUS_REPLY_MAX 256
+
+typedef struct {
+    const char *name;
+    const char *value;
+} m2_radius_reply_var_t;
+
+typedef struct {
+    const char *routes[M2_RADIUS_REPLY_MAX];
+    int route_count;
+    const char *terminators[M2_RADIUS_REPLY_MAX];
+    int terminator_count;
+    m2_radius_reply_var_t vars[M2_RADIUS_REPLY_MAX];
+    int var_count;
+} m2_radius_reply_t;
+
+// one route of the reply, split for m2_bridge
+
+typedef struct {
+    char callerid_number[128];
+    char callerid_name[128];
+    char destination[256];
+    char host[256];
+    int timeout;
+    int ringing_timeout;
+} m2_radius_route_t;
+
+// set of handle pools built from one configuration, owns its copy of connection sections (replaced as a whole on reload)
+
+typedef struct {
+    switch_memory_pool_t *pool;
+    switch_xml_t auth_conf;
+    switch_xml_t acct_start_conf;
+    switch_xml_t acct_stop_conf;
+    m2_radius_handle_pool_t *conn[M2_RADIUS_CONN_COUNT];
+    int refs;
+    int retired;
+} m2_radius_handles_t;
+
+// accounting packet prepared from channel data and waiting to be sent, interim update is sent over acct start connection
+
+typedef enum {
+    M2_RADIUS_ACCT_STOP = 0,
+    M2_RADIUS_ACCT_START,
+    M2_RADIUS_ACCT_INTERIM
+} m2_radius_acct_kind_t;
+
+typedef struct m2_radius_acct_job_s {
+    int acctstart;
+    int interim;
+    int node;
+    int failed;
+    int secondary;
+    int shard;
+    m2_radius_handles_t *handles;
+    VALUE_PAIR *send;
+    char uuid[256];
+    char channel_uuid[256];
+    char call_uuid[256];
+    char acct_type[16];
+    switch_time_t enqueue_time;
+    switch_time_t due_time;
+    struct m2_radius_acct_job_s *next;
+} m2_radius_acct_job_t;
+
+// request copied to shadow core with digest of the primary reply
+
+typedef struct {
+    int result;
+    int route_count;
+    uint32_t route_hash;
+    char timeout[32];
+    char cause[16];
+} m2_radius_shadow_digest_t;
+
+typedef struct {
+    m2_radius_conn_t conn;
+    m2_radius_handles_t *handles;
+    VALUE_PAIR *send;
+    int sampled;
+    char uuid[256];
+    char acct_type[16];
+    m2_radius_shadow_digest_t primary;
+} m2_radius_shadow_job_t;
+
+// accounting sender thread with its own queue, packets that do not fit into the queue wait in the overflow list until the thread moves them to spool
+
+typedef struct {
+    int id;
+    switch_queue_t *queue;
+    switch_thread_t *thread;
+    switch_mutex_t *overflow_mutex;
+    m2_radius_acct_job_t *overflow_head;
+    m2_radius_acct_job_t *overflow_tail;
+    int overflow_count;
+} m2_radius_acct_sender_t;
+
+// what to do with the call when accounting packet could not be sent
+
+typedef enum {
+    M2_RADIUS_HANGUP_ALWAYS,
+    M2_RADIUS_HANGUP_UNSPOOLED,
+    M2_RADIUS_HANGUP_NEVER
+} m2_radius_hangup_policy_t;
+
+// why the module terminated the call
+
+typedef enum {
+    M2_RADIUS_HANGUP_REASON_BUILD_ERROR,
+    M2_RADIUS_HANGUP_REASON_SEND_ERROR,
+    M2_RADIUS_HANGUP_REASON_SPOOL_FULL,
+    M2_RADIUS_HANGUP_REASON_SECONDARY_ERROR,
+    M2_RADIUS_HANGUP_REASON_COUNT
+} m2_radius_hangup_reason_t;
+
+static const char *m2_radius_hangup_reason_names[M2_RADIUS_HANGUP_REASON_COUNT] = {
+    "packet_build_error",
+    "send_error",
+    "spool_full",
+    "secondary_send_error"
+};
+
+/*
+    Accounting spool file layout
+
+    Header block followed by a ring of records. Records are appended at tail and consumed from head, a record
+    never wraps: when it does not fit before the end of the file, wrap marker is written and the record goes to
+    the beginning. used counts bytes from head to tail including the skipped end of the file.
+    Each record holds packet attributes as: attribute (4 bytes), type (4 bytes), lvalue (4 bytes)
+    and for string attributes lvalue bytes of string value
+*/
+
+#define M2_RADIUS_SPOOL_MAGIC 0x4d325350
+#define M2_RADIUS_SPOOL_RECORD_MAGIC 0x4d325352
+#define M2_RADIUS_SPOOL_WRAP_MAGIC 0x4d325357
+#define M2_RADIUS_SPOOL_VERSION 3
+#define M2_RADIUS_SPOOL_VERSION_LINEAR 2
+#define M2_RADIUS_SPOOL_HEADER_SIZE 4096
+#define M2_RADIUS_SPOOL_MIN_SIZE (1024 * 1024)
+#define M2_RADIUS_SPOOL_MAX_PAYLOAD 8192
+#define M2_RADIUS_SPOOL_ALIGN(x) (((x) + 7) & ~((uint64_t) 7))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t records;
+    uint64_t used;
+} m2_radius_spool_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t length;
+    uint32_t crc;
+    int32_t acctstart;
+    int32_t shard;
+    int64_t enqueue_time;
+    char uuid[64];
+    char channel_uuid[64];
+    char call_uuid[64];
+    char acct_type[16];
+} m2_radius_spool_record_t;
+
+/*
+    Capture file layout
+
+    Header followed by one record per request, in the order replies were received. Record holds send time,
+    round trip time, reply digest (the same one shadow mode compares) and call_uuid, followed by request attributes
+    as they are sent on the wire (without packet header and User-Password). Layout must match m2_radius_replay.c
+*/
+
+#define M2_RADIUS_CAPTURE_MAGIC 0x4d324346
+#define M2_RADIUS_CAPTURE_RECORD_MAGIC 0x4d324352
+#define M2_RADIUS_CAPTURE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t start_time;
+} m2_radius_capture_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t length;
+    int64_t send_time;
+    int64_t rtt;
+    int32_t code;
+    int32_t conn;
+    int32_t result;
+    int32_t route_count;
+    uint32_t route_hash;
+    uint32_t reserved;
+    char timeout[32];
+    char cause[16];
+    char call_uuid[64];
+} m2_radius_capture_record_t;
+
+// settings from <settings> section, parsed into a local copy and published when the whole file is read
+
+typedef struct {
+    int handle_pool_size;
+    int handle_pool_max;
+    int acct_sender_threads;
+    int acct_queue_size;
+    m2_radius_hangup_policy_t acct_fail_hangup;
+    char spool_file[512];
+    uint64_t spool_size;
+    int spool_retry_interval;
+    int hangup_rate;
+    int auth_fail_acct_stop_delay;
+    int multiplexed_transport;
+    int transport_max_sockets;
+    int auth_hedge_percentile;
+    int auth_hedge_min_delay;
+    char ipc_socket[256];
+    int negative_cache_ttl;
+    char negative_cache_causes[256];
+    int source_rate;
+    int stats_event_interval;
+    int shadow_sample;
+    int shadow_threads;
+    int shadow_queue_size;
+    char shard_key[128];
+    int shard_rebalance;
+    int shard_sticky_ttl;
+    int reply_variables;
+    int device_acl;
+    char device_acl_file[512];
+    char device_gateway_file[512];
+    char device_gateway_profile[64];
+    int acct_interim_interval;
+    int acct_interim_jitter;
+    char coa_listen[256];
+    char coa_secret[128];
+    char coa_acl[128];
+    int coa_replay_window;
+    char server_id[32];
+    int acct_heartbeat_interval;
+    int log_level;
+    int log_trace_sample;
+    int bench_enabled;
+    char capture_file[512];
+    uint64_t capture_max_size;
+} m2_radius_settings_t;
 
 // global variables
 
 static struct {
-    switch_xml_t m2_radius_auth_conf;
-    switch_xml_t m2_radius_acct_start_conf;
-    switch_xml_t m2_radius_acct_stop_conf;
-} config = {0};
+    switch_memory_pool_t *pool;
+    switch_mutex_t *mutex;
+    switch_mutex_t *reload_mutex;
+    int handle_pool_size;
+    int handle_pool_max;
+    m2_radius_handles_t *handles;
+    int running;
+    int acct_sender_threads;
+    int acct_queue_size;
+    m2_radius_acct_sender_t *acct_senders;
+    int acct_senders_count;
+    m2_radius_hangup_policy_t acct_fail_hangup;
+    char spool_file[512];
+    uint64_t spool_size;
+    int spool_retry_interval;
+    switch_mutex_t *spool_mutex;
+    switch_hash_t *spool_calls;
+    int spool_fd;
+    unsigned char *spool_map;
+    uint64_t spool_map_size;
+    switch_thread_t *spool_thread;
+    int hangup_rate;
+    double hangup_tokens;
+    switch_time_t hangup_tokens_time;
+    int auth_fail_acct_stop_delay;
+    switch_mutex_t *delayed_mutex;
+    m2_radius_acct_job_t *delayed_head;
+    m2_radius_acct_job_t *delayed_tail;
+    int delayed_count;
+    switch_thread_t *delayed_thread;
+    int multiplexed_transport;
+    int transport_max_sockets;
+    int auth_hedge_percentile;
+    int auth_hedge_min_delay;
+    m2_radius_request_t *request_free;
+    char ipc_socket[256];
+    switch_mutex_t *ipc_mutex;
+    int ipc_connected;
+    int ipc_sock;
+    int ipc_request_fd;
+    int ipc_reply_fd;
+    unsigned char *ipc_map;
+    switch_size_t ipc_map_size;
+    int ipc_users;
+    uint32_t ipc_next_slot;
+    m2_radius_request_t *ipc_waiters[M2_RADIUS_IPC_SLOTS];
+    switch_thread_t *ipc_thread;
+    int negative_cache_ttl;
+    char negative_cache_causes[256];
+    int source_rate;
+    switch_mutex_t *source_mutex;
+    m2_radius_source_t *sources;
+    int stats_event_interval;
+    switch_thread_t *stats_thread;
+    int shadow_sample;
+    int shadow_threads;
+    int shadow_queue_size;
+    switch_queue_t *shadow_queue;
+    switch_thread_t **shadow_thread_list;
+    char shard_key[128];
+    int shard_rebalance;
+    int shard_sticky_ttl;
+    switch_mutex_t *shard_mutex;
+    m2_radius_shard_key_t *shard_keys;
+    int reply_variables;
+    int device_acl;
+    int acct_interim_interval;
+    int acct_interim_jitter;
+    char coa_listen[256];
+    char coa_secret[128];
+    char coa_acl[128];
+    int coa_replay_window;
+    char server_id[32];
+    int acct_heartbeat_interval;
+    int log_level;
+    int log_trace_sample;
+    int bench_enabled;
+    char capture_file[512];
+    uint64_t capture_max_size;
+    int coa_sock;
+    switch_thread_t *coa_thread;
+    char node_session_id[64];
+    uint32_t heartbeat_seq;
+    switch_mutex_t *device_mutex;
+    switch_hash_t *devices;
+    switch_hash_t *device_ips;
+    int device_count;
+    int devices_loaded;
+    uint64_t device_sync_count;
+    uint64_t device_sync_changes;
+    switch_time_t device_sync_time;
+    int devices_reload_running;
+    int devices_reload_pending;
+    uint64_t devices_reload_count;
+    switch_time_t devices_reload_time;
+    char device_acl_file[512];
+    char device_gateway_file[512];
+    char device_gateway_profile[64];
+    int devices_acl_pending;
+    int devices_gateways_pending;
+    switch_stream_handle_t devices_gateways_kill;
+    switch_thread_cond_t *devices_cond;
+    switch_thread_t *devices_thread;
+    switch_mutex_t *capture_mutex;
+    int capture_fd;
+    uint64_t capture_size;
+} globals;
+
+/*
+    Metering stats (times in microseconds)
+
+    Same striping as the per-packet timers below: every thread adds to its own stripe with atomic add,
+    so no meter takes a mutex on the call path. Stats commands sum the stripes into a snapshot.
+    All meters are 64 bit and summed word by word, acct_send_time_max is the only maximum
+*/
+
+
+typedef struct {
+    uint64_t acct_send_count[M2_RADIUS_CONN_COUNT];
+    uint64_t acct_send_errors[M2_RADIUS_CONN_COUNT];
+    switch_time_t acct_send_time[M2_RADIUS_CONN_COUNT];
+    switch_time_t acct_send_time_max[M2_RADIUS_CONN_COUNT];
+    switch_time_t acct_total_time[M2_RADIUS_CONN_COUNT];
+    uint64_t acct_queue_overflow;
+    uint64_t spool_appended;
+    uint64_t spool_replayed;
+    uint64_t spool_full;
+    uint64_t spool_corrupted;
+    uint64_t hangups[M2_RADIUS_HANGUP_REASON_COUNT];
+    uint64_t hangups_rate_limited;
+    uint64_t hangups_not_found;
+    uint64_t hedge_fired;
+    uint64_t hedge_won;
+    uint64_t ipc_requests;
+    uint64_t ipc_timeouts;
+    uint64_t ipc_fallbacks;
+    uint64_t ipc_connects;
+    uint64_t negative_cache_added;
+    uint64_t negative_cache_rejects;
+    uint64_t source_rate_rejects;
+    uint64_t shadow_sent;
+    uint64_t shadow_errors;
+    uint64_t shadow_dropped;
+    uint64_t shadow_match;
+    uint64_t shadow_diff_result;
+    uint64_t shadow_diff_routes;
+    uint64_t shadow_diff_timeout;
+    uint64_t shadow_diff_cause;
+    uint64_t shard_sticky;
+    uint64_t bridge_calls;
+    uint64_t bridge_attempts;
+    uint64_t bridge_answered;
+    uint64_t bridge_failed;
+    uint64_t device_acl_rejects;
+    uint64_t interim_sent;
+    uint64_t interim_errors;
+    uint64_t coa_disconnects;
+    uint64_t coa_changes;
+    uint64_t coa_naks;
+    uint64_t coa_bad_auth;
+    uint64_t coa_replays;
+    uint64_t node_sent;
+    uint64_t node_errors;
+    uint64_t capture_records;
+    uint64_t capture_dropped;
+} __attribute__((aligned(64))) m2_radius_meter_t;
+
+/*
+    Per-packet timers (packet build per connection and auth reply parse)
+
+    Every thread writes to its own cache line stripe, so packet encoding never takes a lock and
+    threads don't bounce the same counters. Stripes are summed when stats are shown
+*/
+
+
+#define M2_RADIUS_METER_STRIPES 16
+#define M2_RADIUS_METER_REPLY_PARSE M2_RADIUS_CONN_COUNT
+
+typedef struct {
+    uint64_t count;
+    uint64_t time;
+    uint64_t time_max;
+} m2_radius_op_meter_t;
+
+typedef struct {
+    m2_radius_op_meter_t ops[M2_RADIUS_CONN_COUNT + 1];
+} __attribute__((aligned(64))) m2_radius_meter_stripe_t;
+
+static m2_radius_meter_stripe_t m2_radius_meter_stripes[M2_RADIUS_METER_STRIPES];
+static m2_radius_meter_t m2_radius_meters[M2_RADIUS_METER_STRIPES];
+static uint32_t m2_radius_meter_next_stripe = 0;
+static __thread int m2_radius_meter_stripe = -1;
+
+#define M2_RADIUS_METER_ADD(name, value) __sync_fetch_and_add(&m2_radius_meters[m2_radius_meter_stripe_get()].name, (value))
+#define M2_RADIUS_METER_INC(name) M2_RADIUS_METER_ADD(name, 1)
+
+// more threads than stripes share a stripe, so updates are still atomic (but uncontended in most cases)
+
+static int m2_radius_meter_stripe_get(void) {
+
+    if (m2_radius_meter_stripe < 0) {
+        m2_radius_meter_stripe = (int) (__sync_fetch_and_add(&m2_radius_meter_next_stripe, 1) % M2_RADIUS_METER_STRIPES);
+    }
+
+    return m2_radius_meter_stripe;
+
+}
+
+static void m2_radius_meter_max(switch_time_t *max, switch_time_t value) {
+
+    switch_time_t current = *max;
+
+    while (value > current && !__sync_bool_compare_and_swap(max, current, value)) {
+        current = *max;
+    }
+
+}
+
+// sum of all stripes, read without a lock so the snapshot may be a few updates behind
+
+static void m2_radius_meter_snapshot(m2_radius_meter_t *total) {
+
+    uint64_t *sum = (uint64_t *) total;
+    int i, j;
+
+    memset(total, 0, sizeof(*total));
+
+    for (i = 0; i < M2_RADIUS_METER_STRIPES; i++) {
+        uint64_t *stripe = (uint64_t *) &m2_radius_meters[i];
+
+        for (j = 0; j < (int) (sizeof(m2_radius_meter_t) / sizeof(uint64_t)); j++) {
+            sum[j] += stripe[j];
+        }
+    }
+
+    for (j = 0; j < M2_RADIUS_CONN_COUNT; j++) {
+        total->acct_send_time_max[j] = 0;
+        for (i = 0; i < M2_RADIUS_METER_STRIPES; i++) {
+            if (m2_radius_meters[i].acct_send_time_max[j] > total->acct_send_time_max[j]) total->acct_send_time_max[j] = m2_radius_meters[i].acct_send_time_max[j];
+        }
+    }
+
+}
+
+static void m2_radius_op_meter_record(int op, switch_time_t time) {
+
+    m2_radius_op_meter_t *m = NULL;
+    uint64_t value = time > 0 ? (uint64_t) time : 0;
+    uint64_t max = 0;
+
+    m = &m2_radius_meter_stripes[m2_radius_meter_stripe_get()].ops[op];
+    __sync_fetch_and_add(&m->count, 1);
+    __sync_fetch_and_add(&m->time, value);
+
+    max = m->time_max;
+    while (value > max && !__sync_bool_compare_and_swap(&m->time_max, max, value)) {
+        max = m->time_max;
+    }
+
+}
+
+static void m2_radius_op_meter_sum(int op, m2_radius_op_meter_t *total) {
+
+    int i;
+
+    memset(total, 0, sizeof(*total));
+
+    for (i = 0; i < M2_RADIUS_METER_STRIPES; i++) {
+        m2_radius_op_meter_t *m = &m2_radius_meter_stripes[i].ops[op];
+
+        total->count += m->count;
+        total->time += m->time;
+        if (m->time_max > total->time_max) total->time_max = m->time_max;
+    }
+
+}
+
+/*
+    Per-call logging
+
+    Every call stage (authentication, accounting) writes one summary line. Attribute dumps and other per-step
+    lines are written only for traced calls: channel variable m2_radius_trace=true or log-trace-sample percent
+    of calls. Level and trace flag are checked before arguments are formatted, disabled line costs one compare.
+    log-level limits per-call lines of the module on top of FreeSWITCH log level
+*/
+
+
+#define m2_radius_log(level, ...) do { if ((level) <= globals.log_level) switch_log_printf(SWITCH_CHANNEL_LOG, level, __VA_ARGS__); } while (0)
+#define m2_radius_trace(trace, ...) do { if ((trace) && SWITCH_LOG_NOTICE <= globals.log_level) switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, __VA_ARGS__); } while (0)
+
+static int m2_radius_trace_enabled(switch_channel_t *channel);
+
+/*
+    Latency histograms of send paths, updated with atomic increments so senders never wait for each other.
+    Buckets are log-linear (HDR style): values below 16 us have own bucket, above that every power of two
+    is split into 8 sub-buckets, so percentiles are accurate to 12.5%
+*/
+
+
+#define M2_RADIUS_HIST_SUB_BUCKETS 8
+#define M2_RADIUS_HIST_LINEAR 16
+#define M2_RADIUS_HIST_BUCKETS (M2_RADIUS_HIST_LINEAR + 28 * M2_RADIUS_HIST_SUB_BUCKETS)
+#define M2_RADIUS_STATS_EVENT "m2_radius::stats"
+
+typedef enum {
+    M2_RADIUS_PATH_AUTH = 0,
+    M2_RADIUS_PATH_ACCT_START,
+    M2_RADIUS_PATH_ACCT_STOP,
+    M2_RADIUS_PATH_SECONDARY,
+    M2_RADIUS_PATH_FAILED,
+    M2_RADIUS_PATH_COUNT
+} m2_radius_path_t;
+
+static const char *m2_radius_path_names[M2_RADIUS_PATH_COUNT] = {
+    "auth",
+    "acct_start",
+    "acct_stop",
+    "secondary",
+    "failed_report"
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[M2_RADIUS_HIST_BUCKETS];
+} m2_radius_histogram_t;
+
+static m2_radius_histogram_t m2_radius_latency[M2_RADIUS_PATH_COUNT];
+
+// histogram bucket of value in microseconds
+
+static int m2_radius_hist_bucket(uint64_t value) {
+
+    int exponent = 0;
+    int bucket = 0;
+
+    if (value < M2_RADIUS_HIST_LINEAR) {
+        return (int) value;
+    }
+
+    exponent = 63 - __builtin_clzll(value);
+    bucket = M2_RADIUS_HIST_LINEAR + (exponent - 4) * M2_RADIUS_HIST_SUB_BUCKETS + (int) ((value >> (exponent - 3)) & (M2_RADIUS_HIST_SUB_BUCKETS - 1));
+
+    return bucket < M2_RADIUS_HIST_BUCKETS ? bucket : M2_RADIUS_HIST_BUCKETS - 1;
+
+}
+
+// highest value that falls into bucket
+
+static uint64_t m2_radius_hist_value(int bucket) {
+
+    int exponent = 0;
+    int sub = 0;
+
+    if (bucket < M2_RADIUS_HIST_LINEAR) {
+        return bucket;
+    }
+
+    exponent = (bucket - M2_RADIUS_HIST_LINEAR) / M2_RADIUS_HIST_SUB_BUCKETS + 4;
+    sub = (bucket - M2_RADIUS_HIST_LINEAR) % M2_RADIUS_HIST_SUB_BUCKETS;
+
+    return ((uint64_t) (M2_RADIUS_HIST_SUB_BUCKETS + sub + 1) << (exponent - 3)) - 1;
+
+}
+
+static void m2_radius_latency_record(m2_radius_path_t path, switch_time_t time, int error) {
+
+    m2_radius_histogram_t *hist = &m2_radius_latency[path];
+    uint64_t value = time > 0 ? (uint64_t) time : 0;
+    uint64_t max = hist->max;
+
+    __sync_fetch_and_add(&hist->count, 1);
+    __sync_fetch_and_add(&hist->sum, value);
+    __sync_fetch_and_add(&hist->buckets[m2_radius_hist_bucket(value)], 1);
+    if (error) {
+        __sync_fetch_and_add(&hist->errors, 1);
+    }
+
+    while (value > max && !__sync_bool_compare_and_swap(&hist->max, max, value)) {
+        max = hist->max;
+    }
+
+}
+
+// percentile (0-1000 per mille) from a snapshot of buckets
+
+static uint64_t m2_radius_hist_percentile(const uint64_t *buckets, uint64_t count, int per_mille) {
+
+    uint64_t rank = (count * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    int i;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    if (rank == 0) rank = 1;
+
+    for (i = 0; i < M2_RADIUS_HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return m2_radius_hist_value(i);
+        }
+    }
+
+    return m2_radius_hist_value(M2_RADIUS_HIST_BUCKETS - 1);
+
+}
+
+typedef struct {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t avg;
+    uint64_t max;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+} m2_radius_latency_summary_t;
+
+static void m2_radius_latency_summary(m2_radius_path_t path, m2_radius_latency_summary_t *summary) {
+
+    m2_radius_histogram_t *hist = &m2_radius_latency[path];
+    uint64_t buckets[M2_RADIUS_HIST_BUCKETS];
+    uint64_t count = 0;
+    int i;
+
+    // buckets are read without lock, count is taken from the snapshot so percentiles are consistent
+    for (i = 0; i < M2_RADIUS_HIST_BUCKETS; i++) {
+        buckets[i] = hist->buckets[i];
+        count += buckets[i];
+    }
+
+    summary->count = count;
+    summary->errors = hist->errors;
+    summary->avg = count ? hist->sum / count : 0;
+    summary->max = hist->max;
+    summary->p50 = m2_radius_hist_percentile(buckets, count, 500);
+    summary->p99 = m2_radius_hist_percentile(buckets, count, 990);
+    summary->p999 = m2_radius_hist_percentile(buckets, count, 999);
+
+}
 
 int use_secondary_connection = 0;
 
@@ -44,9 +962,14 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_xml_m2_radius_load);
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_xml_m2_radius_shutdown);
 SWITCH_MODULE_DEFINITION(mod_xml_m2_radius, mod_xml_m2_radius_load, mod_xml_m2_radius_shutdown, NULL);
 
-// radius client handle initialization
+/*
+    Radius client handle initialization
+
+    server and timeout (if set) override values from the connection section
+*/
+
 
-static rc_handle *m2_radius_init(switch_xml_t conf_xml, int auth, int secondary_connection) {
+static rc_handle *m2_radius_init(switch_xml_t conf_xml, int auth, int secondary_connection, const char *server, int timeout) {
 
     char m2_radius_dictionary[512];
     char m2_radius_deadtime[512];
@@ -102,6 +1025,14 @@ static rc_handle *m2_radius_init(switch_xml_t conf_xml, int auth, int secondary_
         return NULL;
     }
 
+    if (server) {
+        strncpy(m2_radius_server, server, 511);
+    }
+
+    if (timeout > 0) {
+        snprintf(m2_radius_timeout, sizeof(m2_radius_timeout), "%d", timeout);
+    }
+
     rh = rc_config_init(rh);
 
     if (rh == NULL) {
@@ -168,880 +1099,7232 @@ static rc_handle *m2_radius_init(switch_xml_t conf_xml, int auth, int secondary_
 
 
 /*
-    Add params to rc handle
+    Radius client handle pools
+
+    Handles are created (and dictionaries parsed) once at module load and on reload
+    Channel threads borrow a handle for the duration of one request and return it back
 */
 
 
-switch_status_t m2_xml_radius_add_params(switch_core_session_t *session, rc_handle *rh, VALUE_PAIR **send, switch_xml_t xml_conf, char *uuid) {
+static m2_radius_attr_plan_t *m2_radius_attr_plan_compile(switch_memory_pool_t *pool, rc_handle *rh, switch_xml_t xml_conf);
 
-    switch_xml_t param, fields;
-    void *av_value = NULL;
+/*
+    Multiplexed radius transport
 
-    if ((fields = switch_xml_child(xml_conf, "fields")) == NULL) {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to locate a fields section:\n%s\n", uuid, switch_xml_toxml(xml_conf, 1));
-        goto err;
+    Requests to one server share a small set of connected UDP sockets instead of one socket per request.
+    Every socket has 256 radius identifiers, request takes a free identifier and waits on its own
+    condition variable. Transport thread receives replies, matches them by identifier and response
+    authenticator, retransmits requests that were not answered in time and times out the rest.
+    Packets are encoded here, dictionary of the radius client handle is used only to decode replies
+*/
+
+
+static int m2_radius_transport_socket_open(m2_radius_transport_t *transport) {
+
+    m2_radius_transport_socket_t *sock = NULL;
+    int fd = -1;
+
+    if (transport->socket_count >= transport->max_sockets) {
+        return -1;
     }
 
-    if ((param = switch_xml_child(fields, "param")) == NULL) {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to locate a param section:\n%s\n", uuid, switch_xml_toxml(fields, 1));
-        goto err;
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to create socket for %s: %s\n", transport->label, strerror(errno));
+        return -1;
     }
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] ------------------- Adding attribute-value pairs -------------------\n", uuid);
+    if (connect(fd, (struct sockaddr *) &transport->addr, sizeof(transport->addr)) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to connect socket to %s: %s\n", transport->label, strerror(errno));
+        close(fd);
+        return -1;
+    }
 
-    for (; param; param = param->next) {
+    sock = &transport->sockets[transport->socket_count];
+    memset(sock, 0, sizeof(*sock));
+    sock->fd = fd;
+    sock->next_id = (uint8_t) (switch_micro_time_now() & 0xff);
 
-        DICT_ATTR *attribute = NULL;
-        DICT_VENDOR *vendor = NULL;
-        int attr_num = 0, vend_num = 0;
+    return transport->socket_count++;
 
-        char *var = (char *) switch_xml_attr(param, "name");
-        char *vend = (char *) switch_xml_attr(param, "vendor");
-        char *variable = (char *) switch_xml_attr(param, "variable");
-        char *format = (char *) switch_xml_attr(param, "format");
+}
 
-        attribute = rc_dict_findattr(rh, var);
+static void *SWITCH_THREAD_FUNC m2_radius_transport_thread(switch_thread_t *thread, void *obj);
 
-        if (attribute == NULL) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Could not locate attribute '%s' in the configured dictionary\n", uuid, var);
-            goto err;
-        }
+static void m2_radius_transport_wake(m2_radius_transport_t *transport) {
 
-        attr_num = attribute->value;
+    char byte = 0;
 
-        // get vendor id
-        if (vend) {
-            vendor = rc_dict_findvend(rh, vend);
-            if (vendor == NULL) {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Could not locate vendor '%s' in the configured dictionary %p\n", uuid, vend, vend);
-                goto err;
-            }
-            vend_num = vendor->vendorpec;
+    if (transport->wake_fd[1] >= 0 && write(transport->wake_fd[1], &byte, 1) < 0) {
+        // pipe is full, transport thread is going to wake up anyway
+    }
+
+}
+
+// server is "host[:port][:secret]", secret from the connection section is used if it is not set here
+
+static m2_radius_transport_t *m2_radius_transport_create(switch_memory_pool_t *pool, const char *server, const char *label, const char *secret, int auth, int max_sockets) {
+
+    m2_radius_transport_t *transport = NULL;
+    switch_threadattr_t *thd_attr = NULL;
+    struct addrinfo hints, *res = NULL;
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    char host[512] = "";
+    char port[32] = "";
+    char *p = NULL;
+
+    switch_copy_string(host, server, sizeof(host));
+    strcpy(port, auth ? "1812" : "1813");
+
+    if ((p = strchr(host, ':'))) {
+        *p++ = '\0';
+        if (*p && *p != ':') {
+            char *s = strchr(p, ':');
+            if (s) *s = '\0';
+            switch_copy_string(port, p, sizeof(port));
+            p = s ? s + 1 : NULL;
+        } else if (*p == ':') {
+            p++;
         }
+    }
 
-        if (var) {
-            if (session) {
+    transport = switch_core_alloc(pool, sizeof(*transport));
+    transport->wake_fd[0] = transport->wake_fd[1] = -1;
+    switch_mutex_init(&transport->mutex, SWITCH_MUTEX_NESTED, pool);
+    switch_copy_string(transport->label, label, sizeof(transport->label));
+    switch_copy_string(transport->secret, (p && *p) ? p : secret, sizeof(transport->secret));
+    transport->max_sockets = max_sockets;
+    transport->sockets = switch_core_alloc(pool, sizeof(m2_radius_transport_socket_t) * transport->max_sockets);
 
-                if (variable) {
+    if (zstr(transport->secret)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Secret for %s is not set (use host:port:secret or secret param)\n", label);
+        return NULL;
+    }
 
-                    switch_channel_t *channel = switch_core_session_get_channel(session);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
 
-                    if (format == NULL) {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Missing format attribute for %s variable\n", uuid, variable);
-                        goto err;
-                    }
+    if (getaddrinfo(host, port, &hints, &res) != 0 || res == NULL) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to resolve radius server %s\n", label);
+        return NULL;
+    }
 
-                    if (attribute->type == 0) {
-
-                        const char *val = NULL;
-                        char val_string[1000] = "";
-
-                        val = switch_channel_get_variable(channel, variable);
-
-                        if (val) {
-                            strncpy(val_string, val, sizeof(val_string) - 1);
-
-                            if (strcmp(variable, "ep_codec_string") == 0) {
-                                strcpy(val_string, "");
-                                if (strcasestr(val, "PCMU")) strcat(val_string, "PCMU,");
-                                if (strcasestr(val, "PCMA")) strcat(val_string, "PCMA,");
-                                if (strcasestr(val, "GSM")) strcat(val_string, "GSM,");
-                                if (strcasestr(val, "OPUS")) strcat(val_string, "OPUS,");
-                                if (strcasestr(val, "SPEEX")) strcat(val_string, "SPEEX,");
-                                if (strcasestr(val, "LPC")) strcat(val_string, "LPC,");
-                                if (strcasestr(val, "iLBC@30i")) strcat(val_string, "iLBC@30i,");
-                                if (strcasestr(val, "G722")) strcat(val_string, "G722,");
-                                if (strcasestr(val, "G723")) strcat(val_string, "G723,");
-                                if (strcasestr(val, "G726-16")) strcat(val_string, "G726-16,");
-                                if (strcasestr(val, "G729")) strcat(val_string, "G729,");
-                            }
-
-                            av_value = switch_mprintf(format, val_string);
-
-                            if (rc_avpair_add(rh, send, attr_num, av_value, -1, vend_num) == NULL) {
-                                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add option with val '%s' to rh\n", uuid, (char *) av_value);
-                                goto err;
-                            }
-                        }
+    memcpy(&transport->addr, res->ai_addr, sizeof(transport->addr));
+    freeaddrinfo(res);
 
-                        if (av_value) {
-                            if (strcmp(var, "Cisco-AVPair")) {
-                                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] %s=%s\n", uuid, var, (char *) av_value);
-                            } else {
-                                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] %s\n", uuid, (char *) av_value);
-                            }
-                        }
+    if (m2_radius_transport_socket_open(transport) < 0) {
+        return NULL;
+    }
 
-                    } else if (attribute->type == 1) {
-                        const char *str = NULL;
-                        str = switch_channel_get_variable(channel, variable);
-                        if (str) {
-                            int number = atoi(str);
-                            if (rc_avpair_add(rh, send, attr_num, &number, -1, vend_num) == NULL) {
-                                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add option with value '%d' to rh\n", uuid, number);
-                                goto err;
-                            }
-                            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] %s=%d\n", uuid, var, number);
-                        } else {
-                            // Skip warning message for 'billsec' variable
-                            if (strcmp(variable, "billsec")) {
-                                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Failed to parse variable '%s'\n", uuid, variable);
-                            }
-                        }
+    // local address is sent as NAS-IP-Address, the same way radius client library does it
+    if (getsockname(transport->sockets[0].fd, (struct sockaddr *) &local, &local_len) == 0) {
+        transport->nas_ip = ntohl(local.sin_addr.s_addr);
+    }
 
-                    }
-                }
+    // transport thread sleeps in poll until a reply, the next retransmit or a new request with earlier deadline
+    if (pipe(transport->wake_fd) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to create wake up pipe for %s: %s\n", label, strerror(errno));
+        close(transport->sockets[0].fd);
+        return NULL;
+    }
+    fcntl(transport->wake_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(transport->wake_fd[1], F_SETFL, O_NONBLOCK);
+    transport->next_deadline = 0;
 
-            }
-        } else {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] All params must have a name attribute\n", uuid);
-            goto err;
-        }
+    transport->running = 1;
+    switch_threadattr_create(&thd_attr, pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&transport->thread, thd_attr, m2_radius_transport_thread, transport, pool);
 
-        if (av_value != NULL) {
-            free(av_value);
-            av_value = NULL;
-        }
+    return transport;
+
+}
+
+static void m2_radius_transport_destroy(m2_radius_transport_t *transport) {
 
+    switch_status_t status;
+    int i;
+
+    if (transport == NULL) {
+        return;
     }
 
-    return SWITCH_STATUS_SUCCESS;
+    transport->running = 0;
+    m2_radius_transport_wake(transport);
+    if (transport->thread) {
+        switch_thread_join(&status, transport->thread);
+        transport->thread = NULL;
+    }
 
-err:
+    for (i = 0; i < transport->socket_count; i++) {
+        close(transport->sockets[i].fd);
+    }
+    transport->socket_count = 0;
 
-    if (av_value != NULL) {
-        free(av_value);
-        av_value = NULL;
+    for (i = 0; i < 2; i++) {
+        if (transport->wake_fd[i] >= 0) {
+            close(transport->wake_fd[i]);
+            transport->wake_fd[i] = -1;
+        }
     }
 
-    return SWITCH_STATUS_GENERR;
+}
+
+// waiting request objects are reused, they are never freed while module is loaded
+
+static m2_radius_request_t *m2_radius_request_get(void) {
+
+    m2_radius_request_t *request = NULL;
+
+    switch_mutex_lock(globals.mutex);
+    if ((request = globals.request_free)) {
+        globals.request_free = request->next;
+    } else {
+        request = switch_core_alloc(globals.pool, sizeof(*request));
+        switch_mutex_init(&request->mutex, SWITCH_MUTEX_NESTED, globals.pool);
+        switch_thread_cond_create(&request->cond, globals.pool);
+    }
+    switch_mutex_unlock(globals.mutex);
+
+    request->next = NULL;
+    request->waiter = request;
+    request->sock = NULL;
+    request->done = 0;
+    request->tries = 0;
+    request->result = TIMEOUT_RC;
+    request->reply_length = 0;
+
+    return request;
 
 }
 
+static void m2_radius_request_put(m2_radius_request_t *request) {
 
-/*
-    Read configs
-*/
+    switch_mutex_lock(globals.mutex);
+    request->next = globals.request_free;
+    globals.request_free = request;
+    switch_mutex_unlock(globals.mutex);
 
+}
 
-switch_status_t m2_radius_load_config() {
+// random request authenticator (RFC 2865 3: unpredictable, it also hides User-Password) from kernel random source
 
-    switch_xml_t xml, tmp, cfg;
+static int m2_radius_random_vector(m2_radius_transport_t *transport, unsigned char *vector) {
 
-    memset(&config, 0, sizeof(config));
+    ssize_t len = 0;
+    int fd = -1;
 
-    if (!(xml = switch_xml_open_cfg(m2_radius_config, &cfg, NULL))) {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Open of %s failed\n", m2_radius_config);
-        goto err;
+    if (getrandom(vector, 16, 0) == 16) {
+        return 0;
     }
 
-    if ((tmp = switch_xml_dup(switch_xml_child(cfg, "m2_radius_auth"))) != NULL ) {
-        config.m2_radius_auth_conf = tmp;
-    } else {
-        goto err;
+    // kernel without getrandom()
+    if ((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+        len = read(fd, vector, 16);
+        close(fd);
     }
 
-    if ((tmp = switch_xml_dup(switch_xml_child(cfg, "m2_radius_acct_start"))) != NULL ) {
-        config.m2_radius_acct_start_conf = tmp;
-    } else {
-        goto err;
+    if (len != 16) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] No random source for request authenticator to %s\n", transport->label);
+        return -1;
     }
 
-    if ((tmp = switch_xml_dup(switch_xml_child(cfg, "m2_radius_acct_stop"))) != NULL ) {
-        config.m2_radius_acct_stop_conf = tmp;
-    } else {
-        goto err;
+    return 0;
+
+}
+
+// append one attribute, returns new length or -1 if packet is full
+
+static int m2_radius_encode_attr(unsigned char *packet, int length, int attribute, const unsigned char *value, int value_length) {
+
+    int vendor = VENDOR(attribute);
+    int attr = ATTRID(attribute);
+
+    if (vendor) {
+        if (length + 8 + value_length > M2_RADIUS_PACKET_MAX || value_length > 247) {
+            return -1;
+        }
+        packet[length] = PW_VENDOR_SPECIFIC;
+        packet[length + 1] = (unsigned char) (8 + value_length);
+        packet[length + 2] = (unsigned char) ((vendor >> 24) & 0xff);
+        packet[length + 3] = (unsigned char) ((vendor >> 16) & 0xff);
+        packet[length + 4] = (unsigned char) ((vendor >> 8) & 0xff);
+        packet[length + 5] = (unsigned char) (vendor & 0xff);
+        packet[length + 6] = (unsigned char) attr;
+        packet[length + 7] = (unsigned char) (2 + value_length);
+        memcpy(packet + length + 8, value, value_length);
+        return length + 8 + value_length;
     }
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Configuration success\n");
-    if (xml) {
-        switch_xml_free(xml);
-        xml = NULL;
+    if (length + 2 + value_length > M2_RADIUS_PACKET_MAX || value_length > 253) {
+        return -1;
     }
+    packet[length] = (unsigned char) attr;
+    packet[length + 1] = (unsigned char) (2 + value_length);
+    memcpy(packet + length + 2, value, value_length);
 
-    return SWITCH_STATUS_SUCCESS;
+    return length + 2 + value_length;
 
- err:
+}
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Configuration error\n");
-    if (xml) {
-        switch_xml_free(xml);
-        xml = NULL;
+// User-Password hiding (RFC 2865 5.2)
+
+static int m2_radius_encode_password(m2_radius_transport_t *transport, const unsigned char *vector, const char *password, int password_length, unsigned char *out) {
+
+    unsigned char buffer[256 + 16];
+    unsigned char digest[SWITCH_MD5_DIGESTSIZE];
+    switch_size_t secret_length = strlen(transport->secret);
+    int length = 0;
+    int i, j;
+
+    if (password_length < 0) password_length = 0;
+    length = (password_length + 15) & ~15;
+    if (length == 0) length = 16;
+    if (length > 128) length = 128;
+    if (password_length > length) password_length = length;
+
+    memset(out, 0, length);
+    memcpy(out, password, password_length);
+    memcpy(buffer, transport->secret, secret_length);
+
+    for (i = 0; i < length; i += 16) {
+        memcpy(buffer + secret_length, i ? out + i - 16 : vector, 16);
+        switch_md5(digest, buffer, secret_length + 16);
+        for (j = 0; j < 16; j++) {
+            out[i + j] ^= digest[j];
+        }
     }
 
-    return SWITCH_STATUS_GENERR;
+    return length;
 
 }
 
+static int m2_radius_encode_packet(m2_radius_transport_t *transport, m2_radius_request_t *request, int code, uint8_t id, VALUE_PAIR *send) {
 
-static switch_status_t m2_radius_send_acct_packet(int acctstart, int failed, switch_core_session_t *session, char *leg_a_uuid, int hangupcause) {
+    unsigned char *packet = request->packet;
+    unsigned char value[256];
+    int length = 20;
+    int has_nas = 0;
+    int has_delay = 0;
+    VALUE_PAIR *vp = NULL;
 
-    int result = 0;
-    rc_handle *rh = NULL;
-    VALUE_PAIR *send = NULL;
-    switch_xml_t conf_xml = config.m2_radius_acct_start_conf;
-    char acct_type[128] = "start";
-    uint32_t service = PW_STATUS_START;
-    switch_call_cause_t cause;
-    switch_caller_profile_t *profile;
-    switch_time_t callstartdate = 0;
-    switch_time_t callanswerdate = 0;
-    switch_time_t callenddate = 0;
-    switch_time_t calltransferdate = 0;
-    switch_time_t billusec = 0;
-    switch_time_exp_t tm;
-    char buffer[256] = "";
-    switch_call_cause_t cause_q850;
-    char uuid[256] = "";
-    int sent_to_secondary_connection = 0;
-    int init_secondary_connection = 0;
-    char system_cmd[256] = "";
-    const char *endpoint_disposition = NULL;
+    packet[0] = (unsigned char) code;
+    packet[1] = id;
 
-    if (leg_a_uuid && strlen(leg_a_uuid)) {
-        strcpy(uuid, leg_a_uuid);
+    if (code == PW_ACCESS_REQUEST) {
+        if (m2_radius_random_vector(transport, request->vector) < 0) {
+            return -1;
+        }
+        memcpy(packet + 4, request->vector, 16);
+    } else {
+        memset(packet + 4, 0, 16);
     }
 
-    if (!acctstart) {
-        strcpy(acct_type, "stop");
-        conf_xml = config.m2_radius_acct_stop_conf;
-        service = PW_STATUS_STOP;
-    }
+    for (vp = send; vp; vp = vp->next) {
+        int value_length = 0;
 
-    if (session) {
+        if (vp->attribute == PW_NAS_IP_ADDRESS || vp->attribute == PW_NAS_IDENTIFIER) has_nas = 1;
+        if (vp->attribute == PW_ACCT_DELAY_TIME) has_delay = 1;
 
-        const char *val = NULL;
-        const char *val_uuid = NULL;
-        const char *val_partner_uuid = NULL;
-        switch_channel_t *channel;
+        if (vp->type == PW_TYPE_STRING) {
+            if (vp->attribute == PW_USER_PASSWORD && code == PW_ACCESS_REQUEST) {
+                value_length = m2_radius_encode_password(transport, request->vector, vp->strvalue, (int) vp->lvalue, value);
+            } else {
+                value_length = (int) vp->lvalue;
+                if (value_length > 253) value_length = 253;
+                memcpy(value, vp->strvalue, value_length);
+            }
+        } else {
+            value[0] = (unsigned char) ((vp->lvalue >> 24) & 0xff);
+            value[1] = (unsigned char) ((vp->lvalue >> 16) & 0xff);
+            value[2] = (unsigned char) ((vp->lvalue >> 8) & 0xff);
+            value[3] = (unsigned char) (vp->lvalue & 0xff);
+            value_length = 4;
+        }
 
-        channel = switch_core_session_get_channel(session);
+        if ((length = m2_radius_encode_attr(packet, length, vp->attribute, value, value_length)) < 0) {
+            return -1;
+        }
+    }
 
-        if (!channel) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] No channel\n", uuid);
-            return 0;
+    if (!has_nas && transport->nas_ip) {
+        value[0] = (unsigned char) ((transport->nas_ip >> 24) & 0xff);
+        value[1] = (unsigned char) ((transport->nas_ip >> 16) & 0xff);
+        value[2] = (unsigned char) ((transport->nas_ip >> 8) & 0xff);
+        value[3] = (unsigned char) (transport->nas_ip & 0xff);
+        if ((length = m2_radius_encode_attr(packet, length, PW_NAS_IP_ADDRESS, value, 4)) < 0) {
+            return -1;
         }
+    }
 
-        val = switch_channel_get_variable(channel, "direction");
-        if (!strlen(uuid)) {
-            val_uuid = switch_channel_get_variable(channel, "uuid");
-            if (val_uuid) {
-                strcpy(uuid, val_uuid);
-            }
+    if (code == PW_ACCOUNTING_REQUEST && !has_delay) {
+        memset(value, 0, 4);
+        if ((length = m2_radius_encode_attr(packet, length, PW_ACCT_DELAY_TIME, value, 4)) < 0) {
+            return -1;
         }
+    }
 
-        if (val != NULL) {
+    packet[2] = (unsigned char) ((length >> 8) & 0xff);
+    packet[3] = (unsigned char) (length & 0xff);
 
-            // check maybe originator cancelled
-            const char *val_hgc= NULL;
-            val_hgc = switch_channel_get_variable(channel, "proto_specific_hangup_cause");
+    // accounting request authenticator (RFC 2866 3)
+    if (code == PW_ACCOUNTING_REQUEST) {
+        unsigned char buffer[M2_RADIUS_PACKET_MAX + 256];
+        switch_size_t secret_length = strlen(transport->secret);
 
-            // if originator cancelled, then send acct stop packet even on legA channel (usually acct stop should be sent from legB channel)
-            if (val_hgc && strcmp(val_hgc, "sip:487") == 0) {
-                failed = 1;
-            }
+        memcpy(buffer, packet, length);
+        memcpy(buffer + length, transport->secret, secret_length);
+        switch_md5(request->vector, buffer, length + secret_length);
+        memcpy(packet + 4, request->vector, 16);
+    }
 
-            // check only legB
-            if (acctstart == 0 && strcmp(val, "outbound")) {
-                endpoint_disposition = switch_channel_get_variable(channel, "endpoint_disposition");
+    request->length = length;
 
-                // if call failed before dialing legB, then allow legA
-                // also allow legA on CODEC NEGOTIATION ERROR because legB does not have any info about this error
-                if (!failed && strcmp(endpoint_disposition, "CODEC NEGOTIATION ERROR") != 0) {
-                    return 0;
-                }
-            }
+    return length;
 
-            val_partner_uuid = switch_channel_get_variable_partner(channel, "uuid");
-            if (val_partner_uuid) {
-                char old_uuid[256] = "";
-                strcpy(old_uuid, uuid);
-                strcpy(uuid, val_partner_uuid);
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Other leg UUID: %s\n", uuid, old_uuid);
-            }
+}
 
-            cause_q850 = switch_channel_get_cause_q850(channel);
-            sprintf(buffer, "%d", cause_q850);
-            switch_channel_set_variable_partner(channel, "m2_q850_hgc", buffer);
+// response authenticator check (RFC 2865 3)
 
-            // if we are doing core recompile, then we need to initialize 2 connections
-            // one to old radius server and another to new radius server
+static int m2_radius_verify_reply(m2_radius_transport_t *transport, m2_radius_request_t *request, const unsigned char *reply, int length) {
 
-            init_secondary_connection_label:
+    unsigned char buffer[M2_RADIUS_PACKET_MAX + 256];
+    unsigned char digest[SWITCH_MD5_DIGESTSIZE];
+    switch_size_t secret_length = strlen(transport->secret);
 
-            if (init_secondary_connection) {
-                sent_to_secondary_connection = 1;
-                rh = m2_radius_init(conf_xml, 0, 1);
-            } else {
-                rh = m2_radius_init(conf_xml, 0, 0);
-            }
+    memcpy(buffer, reply, length);
+    memcpy(buffer + 4, request->vector, 16);
+    memcpy(buffer + length, transport->secret, secret_length);
+    switch_md5(digest, buffer, length + secret_length);
 
-            if (rh == NULL) {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Pointer rh is NULL!\n", uuid);
-                goto acct_err;
-            }
+    return memcmp(digest, reply + 4, 16) == 0;
 
-            if (m2_xml_radius_add_params(session, rh, &send, conf_xml, uuid) != SWITCH_STATUS_SUCCESS ) {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add params to rc_handle\n", uuid);
-                goto acct_err;
-            }
+}
 
-            if (rc_avpair_add(rh, &send, PW_ACCT_STATUS_TYPE, &service, -1, 0) == NULL) {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add option to handle\n", uuid);
-                goto acct_err;
-            }
+// decode reply attributes into value pairs using handle dictionary
 
-            if (!acctstart) {
-                const char *val2 = NULL;
-                const char *val3 = NULL;
-                const char *val4 = NULL;
-                char *new_buffer = NULL;
-                char tmp_buffer[256] = "";
-                char sip_cause_buffer[256] = "";
-                cause = switch_channel_get_cause(channel);
-                new_buffer = switch_mprintf("%s", switch_channel_cause2str(cause));
-                val2 = switch_channel_get_variable(channel, "originate_disposition");
-                val3 = switch_channel_get_variable(channel, "proto_specific_hangup_cause");
-                val4 = switch_channel_get_variable(channel, "last_bridge_proto_specific_hangup_cause");
+static void m2_radius_decode_attrs(rc_handle *rh, const unsigned char *data, int length, VALUE_PAIR **recv, char *msg) {
 
-                if (val2) {
-                    if (cause == 0 && strcmp(new_buffer, "NONE") == 0) {
-                        strcpy(tmp_buffer, val2);
-                    }
-                }
+    int offset = 0;
 
-                if (val3) {
-                    if (strcmp(new_buffer, "CALL_REJECTED") == 0 && strcmp(val3, "sip:603") == 0) {
-                        strcpy(new_buffer, "USER_BUSY");
-                    }
-                }
+    while (offset + 2 <= length) {
+        int attr = data[offset];
+        int attr_length = data[offset + 1];
+        int vendor = 0;
+        const unsigned char *value = data + offset + 2;
+        int value_length = attr_length - 2;
+        int sub_offset = 0;
 
-                if (!strlen(tmp_buffer)) {
-                    if (new_buffer) {
-                        strcpy(tmp_buffer, new_buffer);
-                    }
-                }
+        if (attr_length < 2 || offset + attr_length > length) {
+            break;
+        }
 
-                if (val3) {
-                    sprintf(sip_cause_buffer, "terminator-sip-hangupcause=%s", val3);
-                    if (rc_avpair_add(rh, &send, 1, sip_cause_buffer, -1, 9) == NULL) {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add terminator-sip-hangupcause!\n", uuid);
-                        goto acct_err;
-                    } else {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] %s\n", uuid, sip_cause_buffer);
-                    }
-                }
+        if (attr == PW_VENDOR_SPECIFIC && value_length > 4) {
+            vendor = (value[0] << 24) | (value[1] << 16) | (value[2] << 8) | value[3];
+            sub_offset = 4;
+        }
 
-                if (val4) {
-                    strcpy(sip_cause_buffer, "");
-                    sprintf(sip_cause_buffer, "originator-sip-hangupcause=%s", val4);
-                    if (rc_avpair_add(rh, &send, 1, sip_cause_buffer, -1, 9) == NULL) {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add originator-sip-hangupcause!\n", uuid);
-                        goto acct_err;
-                    } else {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] %s\n", uuid, sip_cause_buffer);
-                    }
+        do {
+            const unsigned char *val = value;
+            int val_length = value_length;
+            int val_attr = attr;
+            DICT_ATTR *da = NULL;
+
+            if (vendor) {
+                if (sub_offset + 2 > value_length || value[sub_offset + 1] < 2 || sub_offset + value[sub_offset + 1] > value_length) {
+                    break;
                 }
+                val_attr = value[sub_offset];
+                val = value + sub_offset + 2;
+                val_length = value[sub_offset + 1] - 2;
+                sub_offset += value[sub_offset + 1];
+            }
 
-                if (rc_avpair_add(rh, &send, 30, (void *)tmp_buffer, -1, 9) == NULL) {
-                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add h323-disconnect-cause: %d\n", uuid, cause);
-                    if (new_buffer) {
-                        free(new_buffer);
-                        new_buffer = NULL;
+            if ((da = rc_dict_getattr(rh, (vendor << 16) | val_attr)) != NULL) {
+                if (da->type == PW_TYPE_STRING) {
+                    char str[AUTH_STRING_LEN + 1];
+                    memcpy(str, val, val_length);
+                    str[val_length] = '\0';
+                    rc_avpair_add(rh, recv, val_attr, str, val_length, vendor);
+                    if (!vendor && val_attr == PW_REPLY_MESSAGE && msg && strlen(msg) + val_length < 4096) {
+                        strncat(msg, str, val_length);
                     }
-                    goto acct_err;
-                } else {
-                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] h323-disconnect-cause = %s\n", uuid, (char *)tmp_buffer);
+                } else if (val_length == 4) {
+                    uint32_t number = ((uint32_t) val[0] << 24) | ((uint32_t) val[1] << 16) | ((uint32_t) val[2] << 8) | (uint32_t) val[3];
+                    rc_avpair_add(rh, recv, val_attr, &number, -1, vendor);
                 }
+            }
+        } while (vendor && sub_offset < value_length);
 
-                if (new_buffer) {
-                    free(new_buffer);
-                    new_buffer = NULL;
-                }
+        offset += attr_length;
+    }
 
-                if (hangupcause) {
-                    new_buffer = switch_mprintf("freeswitch-hangupcause=%d", hangupcause);
-                } else {
-                    new_buffer = switch_mprintf("freeswitch-hangupcause=%d", cause);
-                }
+}
 
-                if (rc_avpair_add(rh, &send, 1, (void *)new_buffer, -1, 9) == NULL) {
-                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add freeswitch-hangupcause: %d\n", uuid, cause);
-                    if (new_buffer) {
-                        free(new_buffer);
-                        new_buffer = NULL;
-                    }
-                    goto acct_err;
-                } else {
-                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] %s\n", uuid, new_buffer);
-                }
+// complete request and wake up the waiting thread (transport mutex is held)
 
-                if (new_buffer) {
-                    free(new_buffer);
-                    new_buffer = NULL;
-                }
+static void m2_radius_request_complete(m2_radius_transport_socket_t *sock, uint8_t id, int result) {
 
-                if (endpoint_disposition && strcmp(endpoint_disposition, "CODEC NEGOTIATION ERROR") == 0) {
-                    if (rc_avpair_add(rh, &send, 1, "freeswitch-endpnt-disp=CODEC_NEGOTIATION_ERROR", -1, 9) == NULL) {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add freeswitch-endpnt-disp=CODEC_NEGOTIATION_ERROR!\n", uuid);
-                        goto acct_err;
-                    } else {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] freeswitch-endpnt-disp=CODEC_NEGOTIATION_ERROR\n", uuid);
-                    }
-                }
-            }
+    m2_radius_request_t *request = sock->pending[id];
 
-            // get time variables
-            profile = switch_channel_get_caller_profile(channel);
+    sock->pending[id] = NULL;
+    sock->in_flight--;
 
-            if (profile) {
+    // waiter is the request itself or the first request of hedged pair
+    switch_mutex_lock(request->waiter->mutex);
+    request->result = result;
+    request->done = 1;
+    switch_thread_cond_signal(request->waiter->cond);
+    switch_mutex_unlock(request->waiter->mutex);
 
-                // calculate billable time
-                callstartdate = profile->times->created;
-                callanswerdate = profile->times->answered;
-                calltransferdate = profile->times->transferred;
-                callenddate = profile->times->hungup;
+}
 
-                if (switch_channel_test_flag(channel, CF_ANSWERED)) {
-                    if (callstartdate && callanswerdate) {
-                        if (callenddate)
-                            billusec = callenddate - callanswerdate;
-                        else if (calltransferdate)
-                            billusec = calltransferdate - callanswerdate;
-                    }
-                } else if (switch_channel_test_flag(channel, CF_TRANSFER)) {
-                    if (callanswerdate && calltransferdate)
-                        billusec = calltransferdate - callanswerdate;
-                }
+static void *SWITCH_THREAD_FUNC m2_radius_transport_thread(switch_thread_t *thread, void *obj) {
+
+    m2_radius_transport_t *transport = (m2_radius_transport_t *) obj;
+    struct pollfd fds[M2_RADIUS_TRANSPORT_MAX_SOCKETS + 1];
+    unsigned char reply[M2_RADIUS_PACKET_MAX];
+    switch_time_t now = 0;
+    switch_time_t next_deadline = 0;
+    int count, wait, i, id;
+
+    while (transport->running) {
+
+        // sleep until a reply, the earliest retransmit or wake up from a new request
+        now = switch_micro_time_now();
+        switch_mutex_lock(transport->mutex);
+        count = transport->socket_count;
+        for (i = 0; i < count; i++) {
+            fds[i].fd = transport->sockets[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        next_deadline = transport->next_deadline;
+        switch_mutex_unlock(transport->mutex);
 
-                if (callstartdate > 0) {
-                    switch_time_exp_lt(&tm, callstartdate);
-                    switch_snprintf(buffer, sizeof(buffer), "%04u-%02u-%02uT%02u:%02u:%02u.%06u%+03d%02d",
-                                    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-                                    tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_usec, tm.tm_gmtoff / 3600, tm.tm_gmtoff % 3600);
-                    if (rc_avpair_add(rh, &send, 25, &buffer, -1, 9) == NULL) {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed adding h323-setup-time: %s\n", uuid, buffer);
-                        goto acct_err;
-                    } else {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] h323-setup-time=%s\n", uuid, (char *) buffer);
-                    }
+        fds[count].fd = transport->wake_fd[0];
+        fds[count].events = POLLIN;
+        fds[count].revents = 0;
+
+        wait = M2_RADIUS_TRANSPORT_IDLE_WAIT;
+        if (next_deadline) {
+            wait = next_deadline > now ? (int) ((next_deadline - now + 999) / 1000) : 0;
+            if (wait > M2_RADIUS_TRANSPORT_IDLE_WAIT) wait = M2_RADIUS_TRANSPORT_IDLE_WAIT;
+        }
+
+        if (poll(fds, count + 1, wait) > 0) {
+            if (fds[count].revents & POLLIN) {
+                while (read(transport->wake_fd[0], reply, sizeof(reply)) > 0);
+            }
+
+            for (i = 0; i < count; i++) {
+                ssize_t len = 0;
+
+                if (!(fds[i].revents & POLLIN)) {
+                    continue;
                 }
 
-                if (callanswerdate > 0) {
-                    switch_time_exp_lt(&tm, callanswerdate);
-                    switch_snprintf(buffer, sizeof(buffer), "%04u-%02u-%02uT%02u:%02u:%02u.%06u%+03d%02d",
-                                    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-                                    tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_usec, tm.tm_gmtoff / 3600, tm.tm_gmtoff % 3600);
-                    if (rc_avpair_add(rh, &send, 28, &buffer, -1, 9) == NULL) {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed adding h323-connect-time: %s\n", uuid, buffer);
-                        goto acct_err;
-                    } else {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] h323-connect-time=%s\n", uuid, (char *) buffer);
+                while ((len = recv(fds[i].fd, reply, sizeof(reply), MSG_DONTWAIT)) >= 20) {
+                    m2_radius_transport_socket_t *sock = &transport->sockets[i];
+                    m2_radius_request_t *request = NULL;
+                    int length = (reply[2] << 8) | reply[3];
+
+                    if (length < 20 || length > len) {
+                        continue;
                     }
-                }
 
-                if (callenddate > 0) {
-                    switch_time_exp_lt(&tm, callenddate);
-                    switch_snprintf(buffer, sizeof(buffer), "%04u-%02u-%02uT%02u:%02u:%02u.%06u%+03d%02d",
-                                    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-                                    tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_usec, tm.tm_gmtoff / 3600, tm.tm_gmtoff % 3600);
-                    if (rc_avpair_add(rh, &send, 29, &buffer, -1, 9) == NULL) {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed adding h323-disconnect-time: %s\n", uuid, buffer);
-                        goto acct_err;
+                    switch_mutex_lock(transport->mutex);
+                    if ((request = sock->pending[reply[1]]) && request->tries > 0 && m2_radius_verify_reply(transport, request, reply, length)) {
+                        memcpy(request->reply, reply, length);
+                        request->reply_length = length;
+                        if (reply[0] == PW_ACCESS_ACCEPT || reply[0] == PW_ACCOUNTING_RESPONSE) {
+                            m2_radius_request_complete(sock, reply[1], OK_RC);
+                        } else if (reply[0] == PW_ACCESS_REJECT) {
+                            m2_radius_request_complete(sock, reply[1], REJECT_RC);
+                        } else {
+                            m2_radius_request_complete(sock, reply[1], BADRESP_RC);
+                        }
                     } else {
-                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] h323-disconnect-time=%s\n", uuid, (char *) buffer);
+                        transport->bad_replies++;
                     }
+                    switch_mutex_unlock(transport->mutex);
                 }
-
             }
+        }
 
-            result = rc_acct(rh, 0, send);
+        // retransmits and timeouts, only when the earliest deadline has passed
+        now = switch_micro_time_now();
+        switch_mutex_lock(transport->mutex);
+        if (transport->next_deadline == 0 || transport->next_deadline > now) {
+            switch_mutex_unlock(transport->mutex);
+            continue;
+        }
 
-            if (!acctstart) {
-                switch_channel_set_variable_partner(channel, "m2_attempt_processed", "true");
+        transport->next_deadline = 0;
+        for (i = 0; i < transport->socket_count; i++) {
+            m2_radius_transport_socket_t *sock = &transport->sockets[i];
+
+            if (sock->in_flight == 0) {
+                continue;
             }
 
-            if (result != OK_RC) {
-                char error_msg[256] = "UNKNOWN_ERROR";
+            for (id = 0; id < 256; id++) {
+                m2_radius_request_t *request = sock->pending[id];
 
-                if (result == BADRESP_RC) {
-                    strcpy(error_msg, "BADRESP_RC");
-                } else if (result == ERROR_RC) {
-                    strcpy(error_msg, "GENERAL_ERROR");
-                } else if (result == TIMEOUT_RC) {
-                    strcpy(error_msg, "TIMEOUT_RC");
-                } else if (result == REJECT_RC) {
-                    strcpy(error_msg, "REJECT_RC");
+                if (request == NULL || request->tries == 0) {
+                    continue;
                 }
 
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Result (RC = %d) %s\n", uuid, result, error_msg);
-                goto acct_err;
-            }
+                if (request->next_send <= now) {
+                    if (request->tries > request->retries) {
+                        m2_radius_request_complete(sock, (uint8_t) id, TIMEOUT_RC);
+                        continue;
+                    }
 
-            if (send) {
-                rc_avpair_free(send);
-                send = NULL;
+                    send(sock->fd, request->packet, request->length, MSG_DONTWAIT);
+                    transport->retransmits++;
+                    request->tries++;
+                    request->rto *= 2;
+                    if (request->rto > request->max_rto) request->rto = request->max_rto;
+                    request->next_send = now + request->rto;
+                }
+
+                if (transport->next_deadline == 0 || request->next_send < transport->next_deadline) {
+                    transport->next_deadline = request->next_send;
+                }
             }
+        }
+        switch_mutex_unlock(transport->mutex);
 
-            if (rh) rc_destroy(rh);
+    }
 
-            if (sent_to_secondary_connection) {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Accounting [%s] successful (secondary connection)\n", uuid, acct_type);
-            } else {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Accounting [%s] successful\n", uuid, acct_type);
+    // module is unloading, nobody should be waiting but do not leave anyone hanging
+    switch_mutex_lock(transport->mutex);
+    for (i = 0; i < transport->socket_count; i++) {
+        for (id = 0; id < 256; id++) {
+            if (transport->sockets[i].pending[id]) {
+                m2_radius_request_complete(&transport->sockets[i], (uint8_t) id, ERROR_RC);
             }
+        }
+    }
+    switch_mutex_unlock(transport->mutex);
 
-            if (acctstart) {
-                switch_channel_set_variable(channel, "m2_channel_answered", "1");
-            }
+    return NULL;
 
-            // if we are doing core recompile, then send one request to secondary radius server (only acct stop)
-            if (sent_to_secondary_connection == 0 && use_secondary_connection) {
-                init_secondary_connection = 1;
-                sent_to_secondary_connection = 1;
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "Sending secondary radius request\n");
-                goto init_secondary_connection_label;
-            }
+}
 
-            return 0;
-        } else {
+// register request in the transport and send it, completion is signaled to waiter (request itself if NULL)
+
+static m2_radius_request_t *m2_radius_transport_start(m2_radius_transport_t *transport, int code, VALUE_PAIR *pairs, switch_time_t rto, switch_time_t max_rto, int retries,
+                                                      m2_radius_request_t *waiter) {
+
+    m2_radius_request_t *request = m2_radius_request_get();
+    m2_radius_transport_socket_t *sock = NULL;
+    int wake = 0;
+    int i = 0;
+    uint8_t id = 0;
+
+    if (waiter) {
+        request->waiter = waiter;
+    }
+
+    // reserve identifier, new socket is opened when all identifiers are in use
+    switch_mutex_lock(transport->mutex);
+    for (i = 0; i < transport->socket_count; i++) {
+        if (transport->sockets[i].in_flight < 256) {
+            break;
+        }
+    }
+    if (i == transport->socket_count) {
+        i = m2_radius_transport_socket_open(transport);
+    }
+    if (i < 0) {
+        switch_mutex_unlock(transport->mutex);
+        m2_radius_request_put(request);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Too many requests in flight to %s\n", transport->label);
+        return NULL;
+    }
+    sock = &transport->sockets[i];
+    while (sock->pending[sock->next_id]) {
+        sock->next_id++;
+    }
+    id = sock->next_id++;
+    sock->pending[id] = request;
+    sock->in_flight++;
+    request->sock = sock;
+    request->id = id;
+    switch_mutex_unlock(transport->mutex);
+
+    if (m2_radius_encode_packet(transport, request, code, id, pairs) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Request to %s is too big\n", transport->label);
+        switch_mutex_lock(transport->mutex);
+        sock->pending[id] = NULL;
+        sock->in_flight--;
+        switch_mutex_unlock(transport->mutex);
+        m2_radius_request_put(request);
+        return NULL;
+    }
+
+    request->rto = rto;
+    request->max_rto = max_rto;
+    request->retries = retries;
+
+    switch_mutex_lock(transport->mutex);
+    request->tries = 1;
+    request->next_send = switch_micro_time_now() + rto;
+    send(sock->fd, request->packet, request->length, MSG_DONTWAIT);
+    if (transport->next_deadline == 0 || request->next_send < transport->next_deadline) {
+        transport->next_deadline = request->next_send;
+        wake = 1;
+    }
+    switch_mutex_unlock(transport->mutex);
+
+    if (wake) {
+        m2_radius_transport_wake(transport);
+    }
+
+    return request;
+
+}
+
+// remove request from the transport if it is still waiting, decode reply and release request, returns result code
+
+static int m2_radius_transport_finish(m2_radius_transport_t *transport, m2_radius_request_t *request, rc_handle *rh, VALUE_PAIR **recv, char *msg) {
+
+    m2_radius_transport_socket_t *sock = (m2_radius_transport_socket_t *) request->sock;
+    int result = 0;
+
+    switch_mutex_lock(transport->mutex);
+    if (sock->pending[request->id] == request) {
+        sock->pending[request->id] = NULL;
+        sock->in_flight--;
+        request->result = TIMEOUT_RC;
+    }
+    switch_mutex_unlock(transport->mutex);
+
+    result = request->result;
+
+    if ((result == OK_RC || result == REJECT_RC) && recv) {
+        m2_radius_decode_attrs(rh, request->reply + 20, request->reply_length - 20, recv, msg);
+    }
+
+    m2_radius_request_put(request);
+
+    return result;
+
+}
+
+// send request and wait for the reply, returns radius client result code
+
+static int m2_radius_transport_request(m2_radius_transport_t *transport, rc_handle *rh, int code, VALUE_PAIR *pairs, VALUE_PAIR **recv, char *msg,
+                                       switch_time_t rto, switch_time_t max_rto, int retries) {
+
+    m2_radius_request_t *request = NULL;
+    switch_time_t deadline = 0;
+
+    if ((request = m2_radius_transport_start(transport, code, pairs, rto, max_rto, retries, NULL)) == NULL) {
+        return ERROR_RC;
+    }
+
+    // transport thread completes the request, deadline only protects against lost thread
+    deadline = switch_micro_time_now() + max_rto * (retries + 2);
+
+    switch_mutex_lock(request->mutex);
+    while (!request->done && switch_micro_time_now() < deadline) {
+        switch_thread_cond_timedwait(request->cond, request->mutex, 1000000);
+    }
+    switch_mutex_unlock(request->mutex);
+
+    return m2_radius_transport_finish(transport, request, rh, recv, msg);
+
+}
+
+
+/*
+    Local IPC transport
+
+    When rating core runs on the same host, it can listen on unix socket (local-ipc-socket). After connect
+    core passes shared memory segment and two eventfds (request and reply wakeups) over the socket.
+    Requests are written to free slots of the shared memory ring as radius attributes without packet header,
+    authenticator and password hiding, core feeds them to authentication/authorization/accounting directly
+    and writes reply attributes back to the same slot. Radius over UDP is used when core is not listening.
+    Unix socket is kept open only to notice that core has gone away
+*/
+
+
+static m2_radius_ipc_slot_t *m2_radius_ipc_slot(int index) {
+
+    return (m2_radius_ipc_slot_t *) (globals.ipc_map + sizeof(m2_radius_ipc_header_t) + (switch_size_t) index * sizeof(m2_radius_ipc_slot_t));
+
+}
+
+// receive shared memory and eventfds from core listener
+
+static int m2_radius_ipc_connect(void) {
+
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg = NULL;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    char byte = 0;
+    int fds[3] = { -1, -1, -1 };
+    int sock = -1;
+    struct stat st;
+    unsigned char *map = NULL;
+    m2_radius_ipc_header_t *header = NULL;
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    switch_copy_string(addr.sun_path, globals.ipc_socket, sizeof(addr.sun_path));
+
+    // core is not running or local listener is not enabled there
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, 0) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Bad handshake from local IPC listener %s\n", globals.ipc_socket);
+        goto err;
+    }
+
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    if (fstat(fds[0], &st) < 0 || (switch_size_t) st.st_size < sizeof(m2_radius_ipc_header_t) + M2_RADIUS_IPC_SLOTS * sizeof(m2_radius_ipc_slot_t)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Local IPC shared memory is too small\n");
+        goto err;
+    }
+
+    if ((map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0)) == MAP_FAILED) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to map local IPC shared memory: %s\n", strerror(errno));
+        map = NULL;
+        goto err;
+    }
+
+    header = (m2_radius_ipc_header_t *) map;
+    if (header->magic != M2_RADIUS_IPC_MAGIC || header->version != M2_RADIUS_IPC_VERSION || header->slots != M2_RADIUS_IPC_SLOTS || header->payload != M2_RADIUS_IPC_PAYLOAD) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Local IPC layout mismatch (version %u, slots %u, payload %u)\n",
+            header->version, header->slots, header->payload);
+        goto err;
+    }
+
+    close(fds[0]);
+
+    switch_mutex_lock(globals.ipc_mutex);
+    globals.ipc_sock = sock;
+    globals.ipc_request_fd = fds[1];
+    globals.ipc_reply_fd = fds[2];
+    globals.ipc_map = map;
+    globals.ipc_map_size = st.st_size;
+    globals.ipc_connected = 1;
+    switch_mutex_unlock(globals.ipc_mutex);
+
+    M2_RADIUS_METER_INC(ipc_connects);
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Connected to local IPC listener %s\n", globals.ipc_socket);
+
+    return 0;
+
+err:
+
+    if (map) munmap(map, st.st_size);
+    if (fds[0] >= 0) close(fds[0]);
+    if (fds[1] >= 0) close(fds[1]);
+    if (fds[2] >= 0) close(fds[2]);
+    close(sock);
+
+    return -1;
+
+}
+
+/*
+    Core has gone away (ipc mutex is held). Requests which core did not pick up are sent over radius instead,
+    requests which core was processing or answered time out, core may have already billed them
+*/
+
+
+static void m2_radius_ipc_lost(void) {
+
+    int i;
+
+    globals.ipc_connected = 0;
+
+    for (i = 0; i < M2_RADIUS_IPC_SLOTS; i++) {
+        m2_radius_request_t *request = globals.ipc_waiters[i];
+
+        if (request) {
+            uint32_t state = m2_radius_ipc_slot(i)->state;
+
+            globals.ipc_waiters[i] = NULL;
+            switch_mutex_lock(request->mutex);
+            request->result = (state == M2_RADIUS_IPC_SLOT_PROCESSING || state == M2_RADIUS_IPC_SLOT_REPLY) ? TIMEOUT_RC : M2_RADIUS_IPC_LOST;
+            request->done = 1;
+            switch_thread_cond_signal(request->cond);
+            switch_mutex_unlock(request->mutex);
+        }
+    }
+
+}
+
+// shared memory is unmapped only when no request is using it (ipc mutex is held)
+
+static void m2_radius_ipc_release(void) {
+
+    if (globals.ipc_connected || globals.ipc_users || globals.ipc_map == NULL) {
+        return;
+    }
+
+    munmap(globals.ipc_map, globals.ipc_map_size);
+    close(globals.ipc_sock);
+    close(globals.ipc_request_fd);
+    close(globals.ipc_reply_fd);
+    globals.ipc_map = NULL;
+
+}
+
+// move replies from shared memory to waiting requests (ipc mutex is held)
+
+static void m2_radius_ipc_collect(void) {
+
+    int i;
+
+    for (i = 0; i < M2_RADIUS_IPC_SLOTS; i++) {
+        m2_radius_request_t *request = globals.ipc_waiters[i];
+        m2_radius_ipc_slot_t *slot = NULL;
+
+        if (request == NULL || (slot = m2_radius_ipc_slot(i))->state != M2_RADIUS_IPC_SLOT_REPLY) {
+            continue;
+        }
+
+        __sync_synchronize();
+
+        globals.ipc_waiters[i] = NULL;
+
+        switch_mutex_lock(request->mutex);
+        if (slot->length <= M2_RADIUS_IPC_PAYLOAD && slot->length + 20 <= sizeof(request->reply)) {
+            memcpy(request->reply + 20, slot->data, slot->length);
+            request->reply_length = 20 + slot->length;
+        }
+        if (slot->code == PW_ACCESS_ACCEPT || slot->code == PW_ACCOUNTING_RESPONSE) {
+            request->result = OK_RC;
+        } else if (slot->code == PW_ACCESS_REJECT) {
+            request->result = REJECT_RC;
+        } else {
+            request->result = BADRESP_RC;
+        }
+        request->done = 1;
+        switch_thread_cond_signal(request->cond);
+        switch_mutex_unlock(request->mutex);
+
+        slot->state = M2_RADIUS_IPC_SLOT_FREE;
+    }
+
+}
+
+static void *SWITCH_THREAD_FUNC m2_radius_ipc_thread(switch_thread_t *thread, void *obj) {
+
+    struct pollfd fds[2];
+    uint64_t counter = 0;
+    switch_time_t next_connect = 0;
+
+    while (globals.running) {
+
+        if (!globals.ipc_connected) {
+            switch_mutex_lock(globals.ipc_mutex);
+            m2_radius_ipc_release();
+            switch_mutex_unlock(globals.ipc_mutex);
+
+            // try to connect once per second, old segment has to be released first
+            if (globals.ipc_map || switch_micro_time_now() < next_connect || m2_radius_ipc_connect() < 0) {
+                if (!globals.ipc_map && switch_micro_time_now() >= next_connect) next_connect = switch_micro_time_now() + 1000000;
+                switch_yield(100000);
+                continue;
+            }
+        }
+
+        fds[0].fd = globals.ipc_reply_fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = globals.ipc_sock;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        if (poll(fds, 2, 100) <= 0) {
+            continue;
+        }
+
+        switch_mutex_lock(globals.ipc_mutex);
+        if (fds[0].revents & POLLIN) {
+            if (read(globals.ipc_reply_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to read local IPC reply eventfd: %s\n", strerror(errno));
+            }
+            m2_radius_ipc_collect();
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius] Local IPC listener %s has gone away, using radius\n", globals.ipc_socket);
+            m2_radius_ipc_lost();
+        }
+        switch_mutex_unlock(globals.ipc_mutex);
+
+    }
+
+    switch_mutex_lock(globals.ipc_mutex);
+    if (globals.ipc_connected) {
+        m2_radius_ipc_lost();
+    }
+    m2_radius_ipc_release();
+    switch_mutex_unlock(globals.ipc_mutex);
+
+    return NULL;
+
+}
+
+/*
+    Send request over local IPC, returns 0 if core is not connected (request should go over radius).
+    Requests that reached the core are not resent over radius on timeout, core may still process them
+*/
+
+
+static int m2_radius_ipc_request(int code, VALUE_PAIR *pairs, rc_handle *rh, VALUE_PAIR **recv, char *msg, switch_time_t timeout, int *result) {
+
+    m2_radius_request_t *request = NULL;
+    m2_radius_ipc_slot_t *slot = NULL;
+    VALUE_PAIR *vp = NULL;
+    switch_time_t deadline = 0;
+    uint64_t counter = 1;
+    int index = -1;
+    int length = 0;
+    int i;
+
+    switch_mutex_lock(globals.ipc_mutex);
+    if (globals.ipc_connected) {
+        for (i = 0; i < M2_RADIUS_IPC_SLOTS; i++) {
+            int n = (globals.ipc_next_slot + i) % M2_RADIUS_IPC_SLOTS;
+            if (globals.ipc_waiters[n] == NULL && m2_radius_ipc_slot(n)->state == M2_RADIUS_IPC_SLOT_FREE) {
+                index = n;
+                break;
+            }
+        }
+    }
+    if (index < 0) {
+        switch_mutex_unlock(globals.ipc_mutex);
+        return 0;
+    }
+    globals.ipc_next_slot = index + 1;
+    slot = m2_radius_ipc_slot(index);
+    slot->state = M2_RADIUS_IPC_SLOT_WRITING;
+    globals.ipc_users++;
+    switch_mutex_unlock(globals.ipc_mutex);
+
+    for (vp = pairs; vp && length >= 0; vp = vp->next) {
+        unsigned char value[256];
+        int value_length = 0;
+
+        if (vp->type == PW_TYPE_STRING) {
+            value_length = (int) vp->lvalue;
+            if (value_length > 253) value_length = 253;
+            memcpy(value, vp->strvalue, value_length);
+        } else {
+            value[0] = (unsigned char) ((vp->lvalue >> 24) & 0xff);
+            value[1] = (unsigned char) ((vp->lvalue >> 16) & 0xff);
+            value[2] = (unsigned char) ((vp->lvalue >> 8) & 0xff);
+            value[3] = (unsigned char) (vp->lvalue & 0xff);
+            value_length = 4;
+        }
+
+        // slot payload has the same size as radius packet
+        length = m2_radius_encode_attr(slot->data, length, vp->attribute, value, value_length);
+    }
+
+    request = m2_radius_request_get();
+
+    switch_mutex_lock(globals.ipc_mutex);
+    if (length < 0 || !globals.ipc_connected) {
+        slot->state = M2_RADIUS_IPC_SLOT_FREE;
+        globals.ipc_users--;
+        switch_mutex_unlock(globals.ipc_mutex);
+        m2_radius_request_put(request);
+        if (length < 0) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Request is too big for local IPC\n");
+        }
+        return 0;
+    }
+    slot->code = code;
+    slot->length = length;
+    globals.ipc_waiters[index] = request;
+    __sync_synchronize();
+    slot->state = M2_RADIUS_IPC_SLOT_REQUEST;
+    if (write(globals.ipc_request_fd, &counter, sizeof(counter)) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to wake up local IPC listener: %s\n", strerror(errno));
+    }
+    switch_mutex_unlock(globals.ipc_mutex);
+
+    deadline = switch_micro_time_now() + timeout;
+
+    switch_mutex_lock(request->mutex);
+    while (!request->done && switch_micro_time_now() < deadline) {
+        switch_thread_cond_timedwait(request->cond, request->mutex, 100000);
+    }
+    switch_mutex_unlock(request->mutex);
+
+    switch_mutex_lock(globals.ipc_mutex);
+    if (globals.ipc_waiters[index] == request) {
+        globals.ipc_waiters[index] = NULL;
+        // take request back if core did not pick it up, otherwise core frees the slot when it is done
+        if (!__sync_bool_compare_and_swap(&slot->state, M2_RADIUS_IPC_SLOT_REQUEST, M2_RADIUS_IPC_SLOT_FREE) &&
+            !__sync_bool_compare_and_swap(&slot->state, M2_RADIUS_IPC_SLOT_PROCESSING, M2_RADIUS_IPC_SLOT_ABANDONED)) {
+            slot->state = M2_RADIUS_IPC_SLOT_FREE;
+        }
+    }
+    globals.ipc_users--;
+    switch_mutex_unlock(globals.ipc_mutex);
+
+    *result = request->result;
+
+    if ((*result == OK_RC || *result == REJECT_RC) && recv) {
+        m2_radius_decode_attrs(rh, request->reply + 20, request->reply_length - 20, recv, msg);
+    }
+
+    m2_radius_request_put(request);
+
+    if (*result == M2_RADIUS_IPC_LOST) {
+        M2_RADIUS_METER_INC(ipc_fallbacks);
+    } else {
+        M2_RADIUS_METER_INC(ipc_requests);
+        if (*result == TIMEOUT_RC) M2_RADIUS_METER_INC(ipc_timeouts);
+    }
+
+    return *result != M2_RADIUS_IPC_LOST;
+
+}
+
+static void m2_radius_ipc_start(void) {
+
+    switch_threadattr_t *thd_attr = NULL;
+
+    switch_mutex_init(&globals.ipc_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+
+    if (zstr(globals.ipc_socket)) {
+        return;
+    }
+
+    switch_threadattr_create(&thd_attr, globals.pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&globals.ipc_thread, thd_attr, m2_radius_ipc_thread, NULL, globals.pool);
+
+}
+
+static void m2_radius_ipc_stop(void) {
+
+    switch_status_t status;
+
+    if (globals.ipc_thread) {
+        switch_thread_join(&status, globals.ipc_thread);
+        globals.ipc_thread = NULL;
+    }
+
+}
+
+
+// read list of servers (param "server" can be repeated) and health settings from the connection section
+
+static int m2_radius_servers_load(switch_memory_pool_t *pool, m2_radius_handle_pool_t *hp) {
+
+    switch_xml_t connection, param;
+    const char *connection_type = hp->secondary_connection ? "m2_radius_secondary_connection" : "m2_radius_connection";
+    int count = 0;
+    int i = 0;
+
+    hp->max_timeout = 5;
+    hp->retries = 3;
+    hp->deadtime = 10;
+
+    if ((connection = switch_xml_child(hp->conf_xml, connection_type)) == NULL) {
+        return 0;
+    }
+
+    for (param = switch_xml_child(connection, "param"); param; param = param->next) {
+        char *var = (char *) switch_xml_attr_soft(param, "name");
+        char *val = (char *) switch_xml_attr_soft(param, "value");
+
+        if (!strcmp(var, "server")) {
+            count++;
+        } else if (!strcmp(var, "timeout")) {
+            hp->max_timeout = atoi(val);
+        } else if (!strcmp(var, "deadtime")) {
+            hp->deadtime = atoi(val);
+        } else if (!strcmp(var, "retries")) {
+            hp->retries = atoi(val);
+        } else if (!strcmp(var, "secret")) {
+            switch_copy_string(hp->secret, val, sizeof(hp->secret));
+        }
+    }
+
+    if (hp->max_timeout < 1) hp->max_timeout = 1;
+    if (hp->retries < 0) hp->retries = 0;
+    // explicit 0 keeps servers alive whatever happens, as before
+    if (hp->deadtime < 0) hp->deadtime = 0;
+
+    // default server
+    if (count == 0) {
+        count = 1;
+    }
+
+    hp->servers = switch_core_alloc(pool, sizeof(m2_radius_server_t) * count);
+    hp->server_count = count;
+
+    for (i = 0; i < count; i++) {
+        strcpy(hp->servers[i].name, "127.0.0.1");
+        strcpy(hp->servers[i].label, "127.0.0.1");
+        hp->servers[i].idle = switch_core_alloc(pool, sizeof(rc_handle *) * hp->max);
+        hp->servers[i].idle_timeout = switch_core_alloc(pool, sizeof(int) * hp->max);
+        hp->servers[i].timeout = hp->max_timeout;
+    }
+
+    i = 0;
+    for (param = switch_xml_child(connection, "param"); param; param = param->next) {
+        char *var = (char *) switch_xml_attr_soft(param, "name");
+        char *val = (char *) switch_xml_attr_soft(param, "value");
+
+        if (!strcmp(var, "server")) {
+            char *secret = NULL;
+
+            // server is host[:port][:secret], secret is not shown in logs and status
+            switch_copy_string(hp->servers[i].name, val, sizeof(hp->servers[i].name));
+            hp->servers[i].shard = atoi(switch_xml_attr_soft(param, "shard"));
+            switch_copy_string(hp->servers[i].label, val, sizeof(hp->servers[i].label));
+            if ((secret = strchr(hp->servers[i].label, ':')) && (secret = strchr(secret + 1, ':'))) {
+                *secret = '\0';
+            }
+            i++;
+        }
+    }
+
+    // list of shards, servers of one shard are alternatives of each other
+    for (i = 0; i < count; i++) {
+        int j;
+
+        if (hp->servers[i].shard <= 0) {
+            hp->servers[i].shard = 0;
+            continue;
+        }
+
+        for (j = 0; j < hp->shard_count && hp->shards[j] != hp->servers[i].shard; j++);
+
+        if (j == hp->shard_count && hp->shard_count < M2_RADIUS_MAX_SHARDS) {
+            hp->shards[hp->shard_count++] = hp->servers[i].shard;
+        }
+    }
+
+    return count;
+
+}
+
+// attribute plan for requests and attribute numbers used to decode replies
+
+static void m2_radius_handle_pool_compile(switch_memory_pool_t *pool, m2_radius_handle_pool_t *hp, rc_handle *rh) {
+
+    DICT_ATTR *da = NULL;
+
+    hp->plan = m2_radius_attr_plan_compile(pool, rh, hp->conf_xml);
+    hp->avpair_attr = (da = rc_dict_findattr(rh, "Cisco-AVPair")) ? da->value : -1;
+    hp->command_code_attr = (da = rc_dict_findattr(rh, "Cisco-Command-Code")) ? da->value : -1;
+    hp->credit_time_attr = (da = rc_dict_findattr(rh, "h323-credit-time")) ? da->value : -1;
+
+}
+
+static m2_radius_handle_pool_t *m2_radius_handle_pool_create(switch_memory_pool_t *pool, m2_radius_settings_t *settings, switch_xml_t conf_xml, int auth, int secondary_connection) {
+
+    m2_radius_handle_pool_t *hp = NULL;
+    m2_radius_server_t *server = NULL;
+    rc_handle *rh = NULL;
+    int i, j;
+
+    if (conf_xml == NULL) {
+        return NULL;
+    }
+
+    // secondary connection is optional
+    if (secondary_connection && switch_xml_child(conf_xml, "m2_radius_secondary_connection") == NULL) {
+        return NULL;
+    }
+
+    hp = switch_core_alloc(pool, sizeof(*hp));
+    switch_mutex_init(&hp->mutex, SWITCH_MUTEX_NESTED, pool);
+    hp->conf_xml = conf_xml;
+    hp->auth = auth;
+    hp->secondary_connection = secondary_connection;
+    hp->max = settings->handle_pool_max;
+
+    m2_radius_servers_load(pool, hp);
+
+    for (j = 0; j < hp->server_count; j++) {
+        server = &hp->servers[j];
+
+        if (settings->multiplexed_transport &&
+            (server->transport = m2_radius_transport_create(pool, server->name, server->label, hp->secret, auth, settings->transport_max_sockets)) == NULL) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Multiplexed transport to %s failed, radius client library will be used\n", server->label);
+        }
+
+        for (i = 0; i < settings->handle_pool_size && i < hp->max; i++) {
+            if ((rh = m2_radius_init(conf_xml, auth, secondary_connection, server->name, server->timeout)) == NULL) {
+                break;
+            }
+            server->idle_timeout[server->idle_count] = server->timeout;
+            server->idle[server->idle_count++] = rh;
+            server->created++;
+            hp->created++;
+        }
+    }
+
+    // compile attribute plan against the dictionary of this connection (all servers share the dictionary)
+    server = &hp->servers[0];
+    if (server->idle_count > 0) {
+        m2_radius_handle_pool_compile(pool, hp, server->idle[0]);
+    } else if ((rh = m2_radius_init(conf_xml, auth, secondary_connection, server->name, server->timeout))) {
+        m2_radius_handle_pool_compile(pool, hp, rh);
+        rc_destroy(rh);
+    }
+
+    return hp;
+
+}
+
+static void m2_radius_handle_pool_destroy(m2_radius_handle_pool_t *hp) {
+
+    int i;
+
+    if (hp == NULL) {
+        return;
+    }
+
+    for (i = 0; i < hp->server_count; i++) {
+        m2_radius_transport_destroy(hp->servers[i].transport);
+    }
+
+    switch_mutex_lock(hp->mutex);
+    for (i = 0; i < hp->server_count; i++) {
+        while (hp->servers[i].idle_count > 0) {
+            rc_destroy(hp->servers[i].idle[--hp->servers[i].idle_count]);
+        }
+    }
+    switch_mutex_unlock(hp->mutex);
+
+}
+
+static void m2_radius_handles_destroy(m2_radius_handles_t *handles);
+
+// connection sections are owned by handles from now on, they are freed together with them.
+// Handles are built with settings which are not applied yet, they are applied only if handles are created
+
+static m2_radius_handles_t *m2_radius_handles_create(m2_radius_settings_t *settings, switch_xml_t auth_conf, switch_xml_t acct_start_conf, switch_xml_t acct_stop_conf) {
+
+    m2_radius_handles_t *handles = NULL;
+    switch_memory_pool_t *pool = NULL;
+    int i;
+
+    if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to create memory pool for radius handles!\n");
+        switch_xml_free(auth_conf);
+        switch_xml_free(acct_start_conf);
+        switch_xml_free(acct_stop_conf);
+        return NULL;
+    }
+
+    handles = switch_core_alloc(pool, sizeof(*handles));
+    handles->pool = pool;
+    handles->auth_conf = auth_conf;
+    handles->acct_start_conf = acct_start_conf;
+    handles->acct_stop_conf = acct_stop_conf;
+
+    handles->conn[M2_RADIUS_CONN_AUTH] = m2_radius_handle_pool_create(pool, settings, auth_conf, 1, 0);
+    handles->conn[M2_RADIUS_CONN_ACCT_START] = m2_radius_handle_pool_create(pool, settings, acct_start_conf, 0, 0);
+    handles->conn[M2_RADIUS_CONN_ACCT_STOP] = m2_radius_handle_pool_create(pool, settings, acct_stop_conf, 0, 0);
+    handles->conn[M2_RADIUS_CONN_ACCT_START_SECONDARY] = m2_radius_handle_pool_create(pool, settings, acct_start_conf, 0, 1);
+    handles->conn[M2_RADIUS_CONN_ACCT_STOP_SECONDARY] = m2_radius_handle_pool_create(pool, settings, acct_stop_conf, 0, 1);
+    handles->conn[M2_RADIUS_CONN_AUTH_SECONDARY] = m2_radius_handle_pool_create(pool, settings, auth_conf, 1, 1);
+
+    // connection without attribute plan can't build a single packet, previous handles stay in use
+    for (i = 0; i < M2_RADIUS_CONN_COUNT; i++) {
+        if (handles->conn[i] && handles->conn[i]->plan == NULL) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Attribute plan [%s] failed to compile, check fields section and dictionary\n", m2_radius_conn_names[i]);
+            m2_radius_handles_destroy(handles);
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < M2_RADIUS_CONN_COUNT; i++) {
+        if (handles->conn[i]) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Radius handle pool [%s] initialized with %d handle(s)\n", m2_radius_conn_names[i], handles->conn[i]->created);
+        }
+    }
+
+    return handles;
+
+}
+
+static void m2_radius_handles_destroy(m2_radius_handles_t *handles) {
+
+    switch_memory_pool_t *pool = NULL;
+    int i;
+
+    if (handles == NULL) {
+        return;
+    }
+
+    for (i = 0; i < M2_RADIUS_CONN_COUNT; i++) {
+        m2_radius_handle_pool_destroy(handles->conn[i]);
+    }
+
+    switch_xml_free(handles->auth_conf);
+    switch_xml_free(handles->acct_start_conf);
+    switch_xml_free(handles->acct_stop_conf);
+
+    pool = handles->pool;
+    switch_core_destroy_memory_pool(&pool);
+
+}
+
+// get reference to the current set of handle pools
+
+static m2_radius_handles_t *m2_radius_handles_acquire(void) {
+
+    m2_radius_handles_t *handles = NULL;
+
+    switch_mutex_lock(globals.mutex);
+    if ((handles = globals.handles)) {
+        handles->refs++;
+    }
+    switch_mutex_unlock(globals.mutex);
+
+    return handles;
+
+}
+
+static void m2_radius_handles_release(m2_radius_handles_t *handles) {
+
+    int destroy = 0;
+
+    if (handles == NULL) {
+        return;
+    }
+
+    switch_mutex_lock(globals.mutex);
+    handles->refs--;
+    if (handles->retired && handles->refs == 0) {
+        destroy = 1;
+    }
+    switch_mutex_unlock(globals.mutex);
+
+    if (destroy) {
+        m2_radius_handles_destroy(handles);
+    }
+
+}
+
+// publish new set of handle pools, old set is destroyed once the last request using it returns
+
+static void m2_radius_handles_swap(m2_radius_handles_t *handles) {
+
+    m2_radius_handles_t *old_handles = NULL;
+    int destroy = 0;
+
+    switch_mutex_lock(globals.mutex);
+    old_handles = globals.handles;
+    globals.handles = handles;
+    if (old_handles) {
+        old_handles->retired = 1;
+        if (old_handles->refs == 0) {
+            destroy = 1;
+        }
+    }
+    switch_mutex_unlock(globals.mutex);
+
+    if (destroy) {
+        m2_radius_handles_destroy(old_handles);
+    }
+
+}
+
+/*
+    Server selection and health
+
+    Server that is not dead and has the lowest smoothed RTT weighted by requests in flight gets the request.
+    Server without RTT samples gets one request at a time so it gets measured, while it is busy it counts as
+    slow as the configured timeout (servers are measured in turn, not all at once). After 3 failures in a row server is
+    dead for deadtime seconds (default 10, 0 never marks servers dead), if all servers are dead the one that will come back first is tried.
+    Timeout of the server adapts to the RTT (srtt + 4 * rttvar, rounded up to seconds as radius
+    client library only supports whole seconds), limited by the configured timeout. Library can't change
+    timeout of existing handle, so idle handles remember their timeout and the matching one is borrowed first
+*/
+
+
+static m2_radius_server_t *m2_radius_server_select(m2_radius_handle_pool_t *hp, int shard, m2_radius_server_t *exclude) {
+
+    m2_radius_server_t *best = NULL;
+    m2_radius_server_t *first_back = NULL;
+    switch_time_t now = switch_micro_time_now();
+    switch_time_t best_score = 0;
+    int i;
+
+    for (i = 0; i < hp->server_count; i++) {
+        m2_radius_server_t *server = &hp->servers[i];
+        switch_time_t srtt = server->srtt ? server->srtt : (switch_time_t) hp->max_timeout * 1000000;
+        switch_time_t score = server->srtt || server->active ? srtt * (server->active + 1) : 0;
+
+        if (server == exclude || (shard && server->shard != shard)) {
+            continue;
+        }
+
+        if (server->dead_until > now) {
+            if (first_back == NULL || server->dead_until < first_back->dead_until) {
+                first_back = server;
+            }
+            continue;
+        }
+
+        if (best == NULL || score < best_score) {
+            best = server;
+            best_score = score;
+        }
+    }
+
+    // shard was removed from configuration, any server is better than none
+    if (best == NULL && first_back == NULL && shard && exclude == NULL) {
+        return m2_radius_server_select(hp, 0, NULL);
+    }
+
+    return best ? best : first_back;
+
+}
+
+// rendezvous (highest random weight) hashing, each shard scores the key and the highest score wins,
+// so adding a shard moves only keys for which the new shard has the highest score
+
+static uint32_t m2_radius_shard_score(uint32_t key, int shard) {
+
+    uint32_t h = key ^ ((uint32_t) shard * 0x9e3779b9);
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+
+}
+
+static int m2_radius_shard_pick(m2_radius_handle_pool_t *hp, uint32_t key) {
+
+    uint32_t best_score = 0;
+    int best = 0;
+    int i;
+
+    for (i = 0; i < hp->shard_count; i++) {
+        uint32_t score = m2_radius_shard_score(key, hp->shards[i]);
+
+        if (best == 0 || score > best_score) {
+            best = hp->shards[i];
+            best_score = score;
+        }
+    }
+
+    return best;
+
+}
+
+static int m2_radius_shard_exists(m2_radius_handle_pool_t *hp, int shard) {
+
+    int i;
+
+    for (i = 0; i < hp->shard_count; i++) {
+        if (hp->shards[i] == shard) {
+            return 1;
+        }
+    }
+
+    return 0;
+
+}
+
+static int m2_radius_rtt_compare(const void *a, const void *b) {
+
+    switch_time_t x = *(const switch_time_t *) a;
+    switch_time_t y = *(const switch_time_t *) b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+
+}
+
+// hedge delay is auth-hedge-percentile of recent RTTs, recalculated every 16 replies (hp mutex is held)
+
+static void m2_radius_hedge_delay_update(m2_radius_handle_pool_t *hp) {
+
+    switch_time_t sorted[M2_RADIUS_RTT_RING];
+    int count = hp->rtt_count < M2_RADIUS_RTT_RING ? (int) hp->rtt_count : M2_RADIUS_RTT_RING;
+    int index = 0;
+
+    memcpy(sorted, hp->rtt_ring, sizeof(switch_time_t) * count);
+    qsort(sorted, count, sizeof(switch_time_t), m2_radius_rtt_compare);
+
+    index = count * globals.auth_hedge_percentile / 100;
+    if (index >= count) index = count - 1;
+
+    hp->hedge_delay = sorted[index];
+    if (hp->hedge_delay < (switch_time_t) globals.auth_hedge_min_delay * 1000) {
+        hp->hedge_delay = (switch_time_t) globals.auth_hedge_min_delay * 1000;
+    }
+
+}
+
+static void m2_radius_server_done(m2_radius_handles_t *handles, m2_radius_conn_t conn, m2_radius_server_t *server, int result, switch_time_t rtt) {
+
+    m2_radius_handle_pool_t *hp = NULL;
+
+    if (server == NULL || handles == NULL || (hp = handles->conn[conn]) == NULL) {
+        return;
+    }
+
+    switch_mutex_lock(hp->mutex);
+
+    server->requests++;
+
+    if (result == OK_RC || result == REJECT_RC) {
+        switch_time_t delta = 0;
+
+        if (server->srtt == 0) {
+            server->srtt = rtt;
+            server->rttvar = rtt / 2;
+        } else {
+            delta = rtt > server->srtt ? rtt - server->srtt : server->srtt - rtt;
+            server->rttvar += (delta - server->rttvar) / 4;
+            server->srtt += (rtt - server->srtt) / 8;
+        }
+
+        hp->rtt_ring[hp->rtt_count % M2_RADIUS_RTT_RING] = rtt;
+        if (++hp->rtt_count % 16 == 0 && hp->auth && globals.auth_hedge_percentile > 0) {
+            m2_radius_hedge_delay_update(hp);
+        }
+
+        server->failures = 0;
+        server->dead_until = 0;
+        server->timeout = (int) ((server->srtt + 4 * server->rttvar + 999999) / 1000000);
+        if (server->timeout < 1) server->timeout = 1;
+        if (server->timeout > hp->max_timeout) server->timeout = hp->max_timeout;
+    } else {
+        if (result == TIMEOUT_RC) {
+            server->timeouts++;
+            // give the server more time until it answers again
+            server->timeout = hp->max_timeout;
+        } else {
+            server->errors++;
+        }
+
+        if (++server->failures >= 3 && hp->server_count > 1 && hp->deadtime > 0) {
+            server->dead_until = switch_micro_time_now() + (switch_time_t) hp->deadtime * 1000000;
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius] Radius server %s [%s] is marked dead for %d s\n", server->label, m2_radius_conn_names[conn], hp->deadtime);
+        }
+    }
+
+    switch_mutex_unlock(hp->mutex);
+
+}
+
+// idle handle with this timeout (0 - any), handle with other timeout is used only when
+// no more handles can be created for the server (hp mutex is held)
+
+static int m2_radius_handle_find(m2_radius_handle_pool_t *hp, m2_radius_server_t *server, int timeout) {
+
+    int i;
+
+    if (server->idle_count == 0) {
+        return -1;
+    }
+
+    for (i = server->idle_count - 1; i >= 0 && timeout; i--) {
+        if (server->idle_timeout[i] == timeout) {
+            return i;
+        }
+    }
+
+    return !timeout || server->created >= hp->max ? server->idle_count - 1 : -1;
+
+}
+
+// borrow handle from the pool (new handle is created if pool is empty)
+// if server is not requested, handle of the first server is returned (to build packets)
+// shard limits selection to servers of that shard (0 - any server)
+
+static rc_handle *m2_radius_handle_get(m2_radius_handles_t *handles, m2_radius_conn_t conn, int shard, m2_radius_server_t **server_out) {
+
+    m2_radius_handle_pool_t *hp = NULL;
+    m2_radius_server_t *server = NULL;
+    rc_handle *rh = NULL;
+    int timeout = 0;
+    int i;
+
+    if (handles == NULL || (hp = handles->conn[conn]) == NULL) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Radius handle pool [%s] is not initialized\n", m2_radius_conn_names[conn]);
+        return NULL;
+    }
+
+    switch_mutex_lock(hp->mutex);
+    if (server_out) {
+        server = m2_radius_server_select(hp, shard, NULL);
+        server->active++;
+    } else {
+        server = &hp->servers[0];
+    }
+    timeout = server->timeout;
+    if ((i = m2_radius_handle_find(hp, server, server_out ? timeout : 0)) >= 0) {
+        rh = server->idle[i];
+        server->idle_count--;
+        server->idle[i] = server->idle[server->idle_count];
+        server->idle_timeout[i] = server->idle_timeout[server->idle_count];
+    }
+    switch_mutex_unlock(hp->mutex);
+
+    if (rh == NULL) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "[m2_radius] Radius handle pool [%s] is empty, creating new handle for %s\n", m2_radius_conn_names[conn], server->label);
+        if ((rh = m2_radius_init(hp->conf_xml, hp->auth, hp->secondary_connection, server->name, timeout))) {
+            switch_mutex_lock(hp->mutex);
+            server->created++;
+            hp->created++;
+            switch_mutex_unlock(hp->mutex);
+        } else if (server_out) {
+            switch_mutex_lock(hp->mutex);
+            server->active--;
+            switch_mutex_unlock(hp->mutex);
+        }
+    }
+
+    if (server_out) {
+        *server_out = rh ? server : NULL;
+    }
+
+    return rh;
+
+}
+
+// return handle to the pool, when the pool is full a handle with outdated timeout is destroyed
+
+static void m2_radius_handle_put(m2_radius_handles_t *handles, m2_radius_conn_t conn, m2_radius_server_t *server, rc_handle *rh) {
+
+    m2_radius_handle_pool_t *hp = NULL;
+    int timeout = 0;
+    int i;
+
+    if (rh == NULL) {
+        return;
+    }
+
+    if (handles == NULL || (hp = handles->conn[conn]) == NULL) {
+        rc_destroy(rh);
+        return;
+    }
+
+    timeout = rc_conf_int(rh, "radius_timeout");
+
+    switch_mutex_lock(hp->mutex);
+    if (server) {
+        server->active--;
+    } else {
+        server = &hp->servers[0];
+    }
+    if (server->idle_count < hp->max) {
+        server->idle_timeout[server->idle_count] = timeout;
+        server->idle[server->idle_count++] = rh;
+        rh = NULL;
+    } else {
+        // keep the handle with current timeout, destroy an outdated one instead
+        for (i = 0; i < server->idle_count && timeout == server->timeout; i++) {
+            if (server->idle_timeout[i] != server->timeout) {
+                rc_handle *outdated = server->idle[i];
+
+                server->idle[i] = rh;
+                server->idle_timeout[i] = timeout;
+                rh = outdated;
+                break;
+            }
+        }
+        server->created--;
+        hp->created--;
+    }
+    switch_mutex_unlock(hp->mutex);
+
+    if (rh) {
+        rc_destroy(rh);
+    }
+
+}
+
+
+/*
+    Hedged authentication
+
+    If there is no reply from the selected server within hedge delay, the same request is sent to the
+    next best server too and the first valid reply (accept or reject) is used. Works only with
+    multiplexed transport, where we can wait for two requests at once. When the hedge wins, the selected
+    server is recorded as timed out here and hedge_won tells the caller not to record it again
+*/
+
+
+// hedge can fire for a request to this server: another server with multiplexed transport and enough RTT samples
+
+static int m2_radius_hedge_possible(m2_radius_handle_pool_t *hp, m2_radius_server_t *server) {
+
+    int i;
+
+    if (hp == NULL || !hp->auth || hp->secondary_connection || globals.auth_hedge_percentile <= 0 || hp->server_count < 2 || hp->hedge_delay <= 0 ||
+        server == NULL || server->transport == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < hp->server_count; i++) {
+        if (&hp->servers[i] != server && hp->servers[i].transport && (server->shard == 0 || hp->servers[i].shard == server->shard)) {
+            return 1;
+        }
+    }
+
+    return 0;
+
+}
+
+static int m2_radius_send_hedged(m2_radius_handles_t *handles, m2_radius_server_t *server, rc_handle *rh, VALUE_PAIR *send, VALUE_PAIR **recv, char *msg,
+                                 switch_time_t rto, switch_time_t max_rto, int *hedge_won) {
+
+    m2_radius_handle_pool_t *hp = handles->conn[M2_RADIUS_CONN_AUTH];
+    m2_radius_server_t *second = NULL;
+    m2_radius_request_t *primary = NULL;
+    m2_radius_request_t *hedge = NULL;
+    m2_radius_request_t *winner = NULL;
+    switch_time_t hedge_time = 0;
+    switch_time_t deadline = 0;
+    int hedge_result = ERROR_RC;
+    int result = ERROR_RC;
+
+    if ((primary = m2_radius_transport_start(server->transport, PW_ACCESS_REQUEST, send, rto, max_rto, hp->retries, NULL)) == NULL) {
+        return ERROR_RC;
+    }
+
+    switch_mutex_lock(hp->mutex);
+    deadline = switch_micro_time_now() + hp->hedge_delay;
+    switch_mutex_unlock(hp->mutex);
+
+    switch_mutex_lock(primary->mutex);
+    while (!primary->done && switch_micro_time_now() < deadline) {
+        switch_thread_cond_timedwait(primary->cond, primary->mutex, deadline - switch_micro_time_now());
+    }
+    switch_mutex_unlock(primary->mutex);
+
+    if (!primary->done) {
+        switch_mutex_lock(hp->mutex);
+        if ((second = m2_radius_server_select(hp, server->shard, server)) && second->transport && second->dead_until <= switch_micro_time_now()) {
+            second->active++;
+        } else {
+            second = NULL;
+        }
+        switch_mutex_unlock(hp->mutex);
+
+        if (second) {
+            hedge_time = switch_micro_time_now();
+            if ((hedge = m2_radius_transport_start(second->transport, PW_ACCESS_REQUEST, send, rto, max_rto, hp->retries, primary))) {
+                M2_RADIUS_METER_INC(hedge_fired);
+            }
+        }
+    }
+
+    // wait for the first valid reply or for both requests to fail
+    deadline = switch_micro_time_now() + max_rto * (hp->retries + 2);
+
+    switch_mutex_lock(primary->mutex);
+    while (switch_micro_time_now() < deadline) {
+        if (primary->done && (primary->result == OK_RC || primary->result == REJECT_RC)) {
+            winner = primary;
+            break;
+        }
+        if (hedge && hedge->done && (hedge->result == OK_RC || hedge->result == REJECT_RC)) {
+            winner = hedge;
+            break;
+        }
+        if (primary->done && (hedge == NULL || hedge->done)) {
+            break;
+        }
+        switch_thread_cond_timedwait(primary->cond, primary->mutex, 1000000);
+    }
+    switch_mutex_unlock(primary->mutex);
+
+    if (hedge) {
+        hedge_result = m2_radius_transport_finish(second->transport, hedge, rh, winner == hedge ? recv : NULL, msg);
+        m2_radius_server_done(handles, M2_RADIUS_CONN_AUTH, second, hedge_result, switch_micro_time_now() - hedge_time);
+    }
+
+    if (second) {
+        switch_mutex_lock(hp->mutex);
+        second->active--;
+        switch_mutex_unlock(hp->mutex);
+    }
+
+    result = m2_radius_transport_finish(server->transport, primary, rh, winner == primary || winner == NULL ? recv : NULL, msg);
+
+    if (winner && winner == hedge) {
+        // no reply from the selected server in time, its late reply (if any) has no RTT to record
+        m2_radius_server_done(handles, M2_RADIUS_CONN_AUTH, server, TIMEOUT_RC, 0);
+        if (hedge_won) {
+            *hedge_won = 1;
+        }
+
+        M2_RADIUS_METER_INC(hedge_won);
+        m2_radius_log(SWITCH_LOG_NOTICE, "[m2_radius] Hedged authentication request answered by %s\n", second->label);
+        return hedge_result;
+    }
+
+    return result;
+
+}
+
+
+/*
+    Send request to selected server, multiplexed transport is used if it is enabled for the server.
+    Retransmit timeout starts at srtt + 4 * rttvar (configured timeout until there are RTT samples).
+    hedge_won (optional) is set when the reply came from the hedge, selected server must not be recorded then
+*/
+
+
+static int m2_radius_send_request(m2_radius_handles_t *handles, m2_radius_conn_t conn, m2_radius_server_t *server, rc_handle *rh, VALUE_PAIR *send, VALUE_PAIR **recv, char *msg,
+                                  int *hedge_won) {
+
+    m2_radius_handle_pool_t *hp = handles->conn[conn];
+    int result = 0;
+
+    // secondary connection copies go to the other core, never to the local one (same for sharded calls)
+    if (globals.ipc_connected && !hp->secondary_connection && !hp->shard_count &&
+        m2_radius_ipc_request(hp->auth ? PW_ACCESS_REQUEST : PW_ACCOUNTING_REQUEST, send, rh, recv, msg, (switch_time_t) hp->max_timeout * (hp->retries + 1) * 1000000, &result)) {
+        return result;
+    }
+
+    if (server && server->transport) {
+        switch_time_t max_rto = (switch_time_t) hp->max_timeout * 1000000;
+        switch_time_t rto = max_rto;
+
+        switch_mutex_lock(hp->mutex);
+        if (server->srtt) {
+            rto = server->srtt + 4 * server->rttvar;
+        }
+        switch_mutex_unlock(hp->mutex);
+
+        if (rto < M2_RADIUS_MIN_RTO) rto = M2_RADIUS_MIN_RTO;
+        if (rto > max_rto) rto = max_rto;
+
+        if (m2_radius_hedge_possible(hp, server)) {
+            return m2_radius_send_hedged(handles, server, rh, send, recv, msg, rto, max_rto, hedge_won);
+        }
+
+        return m2_radius_transport_request(server->transport, rh, hp->auth ? PW_ACCESS_REQUEST : PW_ACCOUNTING_REQUEST, send, recv, msg, rto, max_rto, hp->retries);
+    }
+
+    if (hp->auth) {
+        return rc_auth(rh, 0, send, recv, msg);
+    }
+
+    return rc_acct(rh, 0, send);
+
+}
+
+
+static m2_radius_attr_plan_t *m2_radius_plan_get(m2_radius_handles_t *handles, m2_radius_conn_t conn) {
+
+    if (handles == NULL || handles->conn[conn] == NULL) {
+        return NULL;
+    }
+
+    return handles->conn[conn]->plan;
+
+}
+
+
+/*
+    Compile <fields> section into the attribute plan
+
+    Dictionary lookups, format parsing and transform detection are done here once per handle pool
+    so that per packet we only need to read channel variables and encode attribute-value pairs
+*/
+
+
+static m2_radius_attr_plan_t *m2_radius_attr_plan_compile(switch_memory_pool_t *pool, rc_handle *rh, switch_xml_t xml_conf) {
+
+    switch_xml_t param, fields;
+    m2_radius_attr_plan_t *plan = NULL;
+    int count = 0;
+
+    if ((fields = switch_xml_child(xml_conf, "fields")) == NULL) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to locate a fields section:\n%s\n", switch_xml_toxml(xml_conf, 1));
+        return NULL;
+    }
+
+    if ((param = switch_xml_child(fields, "param")) == NULL) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to locate a param section:\n%s\n", switch_xml_toxml(fields, 1));
+        return NULL;
+    }
+
+    for (; param; param = param->next) {
+        count++;
+    }
+
+    plan = switch_core_alloc(pool, sizeof(*plan));
+    plan->attrs = switch_core_alloc(pool, sizeof(m2_radius_attr_t) * count);
+
+    for (param = switch_xml_child(fields, "param"); param; param = param->next) {
+
+        DICT_ATTR *attribute = NULL;
+        DICT_VENDOR *vendor = NULL;
+        m2_radius_attr_t *attr = NULL;
+        char *ptr = NULL;
+
+        char *var = (char *) switch_xml_attr(param, "name");
+        char *vend = (char *) switch_xml_attr(param, "vendor");
+        char *variable = (char *) switch_xml_attr(param, "variable");
+        char *format = (char *) switch_xml_attr(param, "format");
+
+        if (var == NULL) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] All params must have a name attribute\n");
+            return NULL;
+        }
+
+        attribute = rc_dict_findattr(rh, var);
+
+        if (attribute == NULL) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Could not locate attribute '%s' in the configured dictionary\n", var);
+            return NULL;
+        }
+
+        // get vendor id
+        if (vend) {
+            vendor = rc_dict_findvend(rh, vend);
+            if (vendor == NULL) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Could not locate vendor '%s' in the configured dictionary\n", vend);
+                return NULL;
+            }
+        }
+
+        // params without channel variable are not sent
+        if (variable == NULL) {
+            continue;
+        }
+
+        if (format == NULL) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Missing format attribute for %s variable\n", variable);
+            return NULL;
+        }
+
+        // only string and integer attributes are supported
+        if (attribute->type != PW_TYPE_STRING && attribute->type != PW_TYPE_INTEGER) {
+            continue;
+        }
+
+        attr = &plan->attrs[plan->count++];
+        attr->name = switch_core_strdup(pool, var);
+        attr->attr_num = attribute->value;
+        attr->vend_num = vendor ? vendor->vendorpec : 0;
+        attr->type = attribute->type;
+        attr->variable = switch_core_strdup(pool, variable);
+        attr->format = switch_core_strdup(pool, format);
+        attr->cisco_avpair = strcmp(var, "Cisco-AVPair") == 0;
+        attr->warn_missing = strcmp(variable, "billsec") != 0;
+
+        if (strcmp(variable, "ep_codec_string") == 0) {
+            attr->transform = M2_RADIUS_TRANSFORM_CODEC_LIST;
+        }
+
+        // most formats are "prefix%ssuffix", split them so we don't need printf for every packet
+        if ((ptr = strstr(format, "%s")) && strchr(format, '%') == ptr && strchr(ptr + 2, '%') == NULL) {
+            attr->prefix = switch_core_strdup(pool, format);
+            attr->prefix[ptr - format] = '\0';
+            attr->suffix = switch_core_strdup(pool, ptr + 2);
+        }
+
+    }
+
+    return plan;
+
+}
+
+
+/*
+    Keep only codecs known to M2 core (in this order)
+*/
+
+
+static void m2_radius_filter_codec_list(const char *val, char *buffer, switch_size_t len) {
+
+    static const char *codecs[] = { "PCMU", "PCMA", "GSM", "OPUS", "SPEEX", "LPC", "iLBC@30i", "G722", "G723", "G726-16", "G729", NULL };
+    int i;
+
+    *buffer = '\0';
+
+    for (i = 0; codecs[i]; i++) {
+        if (strcasestr(val, codecs[i])) {
+            strncat(buffer, codecs[i], len - strlen(buffer) - 1);
+            strncat(buffer, ",", len - strlen(buffer) - 1);
+        }
+    }
+
+}
+
+
+/*
+    Add params to rc handle
+
+    Variables are read from the channel of the session, or from vars when there is no session (m2_bench)
+*/
+
+
+switch_status_t m2_xml_radius_add_params(switch_core_session_t *session, switch_event_t *vars, rc_handle *rh, VALUE_PAIR **send, m2_radius_attr_plan_t *plan, m2_radius_conn_t conn, char *uuid) {
+
+    switch_channel_t *channel = NULL;
+    switch_time_t start_time = switch_micro_time_now();
+    switch_time_t run_time = 0;
+    char av_value[1024] = "";
+    int trace = 0;
+    int i;
+
+    if (plan == NULL) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Attribute plan [%s] is not compiled, check fields section\n", uuid, m2_radius_conn_names[conn]);
+        return SWITCH_STATUS_GENERR;
+    }
+
+    if (session == NULL && vars == NULL) {
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    if (session) {
+        channel = switch_core_session_get_channel(session);
+        trace = m2_radius_trace_enabled(channel);
+    }
+
+    m2_radius_trace(trace, "[m2_radius %s] ------------------- Adding attribute-value pairs -------------------\n", uuid);
+
+    for (i = 0; i < plan->count; i++) {
+
+        m2_radius_attr_t *attr = &plan->attrs[i];
+        const char *val = channel ? switch_channel_get_variable(channel, attr->variable) : switch_event_get_header(vars, attr->variable);
+
+        if (attr->type == PW_TYPE_STRING) {
+
+            char val_string[1000] = "";
+
+            if (!val) {
+                continue;
+            }
+
+            if (attr->transform == M2_RADIUS_TRANSFORM_CODEC_LIST) {
+                m2_radius_filter_codec_list(val, val_string, sizeof(val_string));
+                val = val_string;
+            }
+
+            if (attr->prefix) {
+                switch_snprintf(av_value, sizeof(av_value), "%s%s%s", attr->prefix, val, attr->suffix);
+            } else {
+                char *tmp_value = switch_mprintf(attr->format, val);
+                switch_copy_string(av_value, tmp_value, sizeof(av_value));
+                switch_safe_free(tmp_value);
+            }
+
+            if (rc_avpair_add(rh, send, attr->attr_num, av_value, -1, attr->vend_num) == NULL) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add option with val '%s' to rh\n", uuid, av_value);
+                return SWITCH_STATUS_GENERR;
+            }
+
+            if (attr->cisco_avpair) {
+                m2_radius_trace(trace, "[m2_radius %s] %s\n", uuid, av_value);
+            } else {
+                m2_radius_trace(trace, "[m2_radius %s] %s=%s\n", uuid, attr->name, av_value);
+            }
+
+        } else if (attr->type == PW_TYPE_INTEGER) {
+
+            if (val) {
+                int number = atoi(val);
+                if (rc_avpair_add(rh, send, attr->attr_num, &number, -1, attr->vend_num) == NULL) {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add option with value '%d' to rh\n", uuid, number);
+                    return SWITCH_STATUS_GENERR;
+                }
+                m2_radius_trace(trace, "[m2_radius %s] %s=%d\n", uuid, attr->name, number);
+            } else if (attr->warn_missing) {
+                // Skip warning message for 'billsec' variable
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Failed to parse variable '%s'\n", uuid, attr->variable);
+            }
+
+        }
+
+    }
+
+    // saving metering stats
+    run_time = switch_micro_time_now() - start_time;
+    m2_radius_op_meter_record(conn, run_time);
+
+    return SWITCH_STATUS_SUCCESS;
+
+}
+
+
+static void m2_radius_capture_open(const char *path);
+
+/*
+    Publish parsed settings. Settings used to start threads, spool and local IPC are applied only at
+    module load, reload changes only settings that are read per request
+*/
+
+
+static void m2_radius_settings_apply(m2_radius_settings_t *parsed) {
+
+    if (!globals.running) {
+        globals.acct_sender_threads = parsed->acct_sender_threads;
+        globals.acct_queue_size = parsed->acct_queue_size;
+        switch_copy_string(globals.spool_file, parsed->spool_file, sizeof(globals.spool_file));
+        globals.spool_size = parsed->spool_size;
+        switch_copy_string(globals.ipc_socket, parsed->ipc_socket, sizeof(globals.ipc_socket));
+        globals.stats_event_interval = parsed->stats_event_interval;
+        globals.shadow_threads = parsed->shadow_threads;
+        globals.shadow_queue_size = parsed->shadow_queue_size;
+        switch_copy_string(globals.coa_listen, parsed->coa_listen, sizeof(globals.coa_listen));
+        switch_copy_string(globals.coa_secret, parsed->coa_secret, sizeof(globals.coa_secret));
+        switch_copy_string(globals.coa_acl, parsed->coa_acl, sizeof(globals.coa_acl));
+        globals.coa_replay_window = parsed->coa_replay_window;
+        switch_copy_string(globals.server_id, parsed->server_id, sizeof(globals.server_id));
+        globals.acct_heartbeat_interval = parsed->acct_heartbeat_interval;
+    }
+
+    globals.handle_pool_size = parsed->handle_pool_size;
+    globals.handle_pool_max = parsed->handle_pool_max;
+    globals.acct_fail_hangup = parsed->acct_fail_hangup;
+    globals.spool_retry_interval = parsed->spool_retry_interval;
+    globals.hangup_rate = parsed->hangup_rate;
+    globals.auth_fail_acct_stop_delay = parsed->auth_fail_acct_stop_delay;
+    globals.multiplexed_transport = parsed->multiplexed_transport;
+    globals.transport_max_sockets = parsed->transport_max_sockets;
+    globals.auth_hedge_percentile = parsed->auth_hedge_percentile;
+    globals.auth_hedge_min_delay = parsed->auth_hedge_min_delay;
+    globals.negative_cache_ttl = parsed->negative_cache_ttl;
+    globals.source_rate = parsed->source_rate;
+    globals.shadow_sample = parsed->shadow_sample;
+    globals.shard_rebalance = parsed->shard_rebalance;
+    globals.shard_sticky_ttl = parsed->shard_sticky_ttl;
+    globals.reply_variables = parsed->reply_variables;
+    globals.device_acl = parsed->device_acl;
+    globals.acct_interim_interval = parsed->acct_interim_interval;
+    globals.acct_interim_jitter = parsed->acct_interim_jitter;
+    globals.log_level = parsed->log_level;
+    globals.log_trace_sample = parsed->log_trace_sample;
+    globals.bench_enabled = parsed->bench_enabled;
+    globals.capture_max_size = parsed->capture_max_size;
+    if (strcmp(globals.capture_file, parsed->capture_file)) {
+        m2_radius_capture_open(parsed->capture_file);
+    }
+
+    // cause list and shard key are read under their mutexes
+    switch_mutex_lock(globals.source_mutex);
+    switch_copy_string(globals.negative_cache_causes, parsed->negative_cache_causes, sizeof(globals.negative_cache_causes));
+    switch_mutex_unlock(globals.source_mutex);
+
+    switch_mutex_lock(globals.shard_mutex);
+    switch_copy_string(globals.shard_key, parsed->shard_key, sizeof(globals.shard_key));
+    switch_mutex_unlock(globals.shard_mutex);
+
+    // generated files are written by device thread
+    switch_mutex_lock(globals.device_mutex);
+    switch_copy_string(globals.device_acl_file, parsed->device_acl_file, sizeof(globals.device_acl_file));
+    switch_copy_string(globals.device_gateway_file, parsed->device_gateway_file, sizeof(globals.device_gateway_file));
+    switch_copy_string(globals.device_gateway_profile, parsed->device_gateway_profile, sizeof(globals.device_gateway_profile));
+    switch_mutex_unlock(globals.device_mutex);
+
+}
+
+
+/*
+    Read configs
+*/
+
+
+switch_status_t m2_radius_load_config() {
+
+    switch_xml_t xml = NULL, cfg, settings, param;
+    switch_xml_t auth_conf = NULL, acct_start_conf = NULL, acct_stop_conf = NULL;
+    m2_radius_handles_t *handles = NULL;
+    m2_radius_settings_t parsed;
+
+    // RELOADXML event and m2_recompile can run at the same time
+    switch_mutex_lock(globals.reload_mutex);
+
+    memset(&parsed, 0, sizeof(parsed));
+
+    // default values
+    parsed.handle_pool_size = 4;
+    parsed.handle_pool_max = 64;
+    parsed.acct_sender_threads = 0;
+    parsed.acct_queue_size = 10000;
+    parsed.acct_fail_hangup = M2_RADIUS_HANGUP_UNSPOOLED;
+    parsed.spool_file[0] = '\0';
+    parsed.spool_size = 64 * 1024 * 1024;
+    parsed.spool_retry_interval = 5;
+    parsed.hangup_rate = 20;
+    parsed.auth_fail_acct_stop_delay = 5;
+    parsed.multiplexed_transport = 0;
+    parsed.transport_max_sockets = 16;
+    parsed.auth_hedge_percentile = 0;
+    parsed.auth_hedge_min_delay = 20;
+    parsed.ipc_socket[0] = '\0';
+    parsed.negative_cache_ttl = 30;
+    switch_copy_string(parsed.negative_cache_causes, "311", sizeof(parsed.negative_cache_causes));
+    parsed.source_rate = 0;
+    parsed.stats_event_interval = 0;
+    parsed.shadow_sample = 0;
+    parsed.shadow_threads = 2;
+    parsed.shadow_queue_size = 1000;
+    switch_copy_string(parsed.shard_key, "source-ip", sizeof(parsed.shard_key));
+    parsed.shard_rebalance = 0;
+    parsed.shard_sticky_ttl = 14400;
+    parsed.reply_variables = 1;
+    parsed.device_acl = 0;
+    switch_copy_string(parsed.device_gateway_profile, "external", sizeof(parsed.device_gateway_profile));
+    parsed.acct_interim_interval = 0;
+    parsed.acct_interim_jitter = 10;
+    parsed.coa_listen[0] = '\0';
+    parsed.coa_secret[0] = '\0';
+    parsed.coa_acl[0] = '\0';
+    parsed.coa_replay_window = 300;
+    parsed.server_id[0] = '\0';
+    parsed.acct_heartbeat_interval = 0;
+    parsed.log_level = SWITCH_LOG_DEBUG;
+    parsed.log_trace_sample = 0;
+    parsed.bench_enabled = 0;
+    parsed.capture_file[0] = '\0';
+    parsed.capture_max_size = (uint64_t) 1024 * 1024 * 1024;
+
+    if (!(xml = switch_xml_open_cfg(m2_radius_config, &cfg, NULL))) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Open of %s failed\n", m2_radius_config);
+        goto err;
+    }
+
+    if ((settings = switch_xml_child(cfg, "settings"))) {
+        for (param = switch_xml_child(settings, "param"); param; param = param->next) {
+
+            char *var = (char *) switch_xml_attr_soft(param, "name");
+            char *val = (char *) switch_xml_attr_soft(param, "value");
+
+            if (!strcmp(var, "handle-pool-size")) {
+                parsed.handle_pool_size = atoi(val);
+            } else if (!strcmp(var, "handle-pool-max")) {
+                parsed.handle_pool_max = atoi(val);
+            } else if (!strcmp(var, "acct-sender-threads")) {
+                parsed.acct_sender_threads = atoi(val);
+            } else if (!strcmp(var, "acct-queue-size")) {
+                parsed.acct_queue_size = atoi(val);
+            } else if (!strcmp(var, "acct-fail-hangup")) {
+                if (!strcasecmp(val, "always")) {
+                    parsed.acct_fail_hangup = M2_RADIUS_HANGUP_ALWAYS;
+                } else if (!strcasecmp(val, "unspooled")) {
+                    parsed.acct_fail_hangup = M2_RADIUS_HANGUP_UNSPOOLED;
+                } else if (!strcasecmp(val, "never")) {
+                    parsed.acct_fail_hangup = M2_RADIUS_HANGUP_NEVER;
+                } else {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius] Unknown acct-fail-hangup value '%s', using 'unspooled'\n", val);
+                }
+            } else if (!strcmp(var, "acct-spool-file")) {
+                switch_copy_string(parsed.spool_file, val, sizeof(parsed.spool_file));
+            } else if (!strcmp(var, "acct-spool-size")) {
+                parsed.spool_size = (uint64_t) atoll(val) * 1024 * 1024;
+            } else if (!strcmp(var, "acct-spool-retry-interval")) {
+                parsed.spool_retry_interval = atoi(val);
+            } else if (!strcmp(var, "acct-fail-hangup-rate")) {
+                parsed.hangup_rate = atoi(val);
+            } else if (!strcmp(var, "auth-fail-acct-stop-delay")) {
+                parsed.auth_fail_acct_stop_delay = atoi(val);
+            } else if (!strcmp(var, "radius-transport")) {
+                parsed.multiplexed_transport = !strcasecmp(val, "multiplexed");
+            } else if (!strcmp(var, "transport-max-sockets")) {
+                parsed.transport_max_sockets = atoi(val);
+            } else if (!strcmp(var, "auth-hedge-percentile")) {
+                parsed.auth_hedge_percentile = atoi(val);
+            } else if (!strcmp(var, "auth-hedge-min-delay")) {
+                parsed.auth_hedge_min_delay = atoi(val);
+            } else if (!strcmp(var, "local-ipc-socket")) {
+                switch_copy_string(parsed.ipc_socket, val, sizeof(parsed.ipc_socket));
+            } else if (!strcmp(var, "auth-negative-cache-ttl")) {
+                parsed.negative_cache_ttl = atoi(val);
+            } else if (!strcmp(var, "auth-negative-cache-causes")) {
+                switch_copy_string(parsed.negative_cache_causes, val, sizeof(parsed.negative_cache_causes));
+            } else if (!strcmp(var, "auth-source-rate")) {
+                parsed.source_rate = atoi(val);
+            } else if (!strcmp(var, "stats-event-interval")) {
+                parsed.stats_event_interval = atoi(val);
+            } else if (!strcmp(var, "shadow-sample")) {
+                parsed.shadow_sample = atoi(val);
+            } else if (!strcmp(var, "shadow-threads")) {
+                parsed.shadow_threads = atoi(val);
+            } else if (!strcmp(var, "shadow-queue-size")) {
+                parsed.shadow_queue_size = atoi(val);
+            } else if (!strcmp(var, "shard-key")) {
+                switch_copy_string(parsed.shard_key, val, sizeof(parsed.shard_key));
+            } else if (!strcmp(var, "shard-rebalance")) {
+                parsed.shard_rebalance = switch_true(val);
+            } else if (!strcmp(var, "shard-sticky-ttl")) {
+                parsed.shard_sticky_ttl = atoi(val);
+            } else if (!strcmp(var, "auth-reply-variables")) {
+                parsed.reply_variables = switch_true(val);
+            } else if (!strcmp(var, "device-acl")) {
+                parsed.device_acl = switch_true(val);
+            } else if (!strcmp(var, "device-acl-file")) {
+                switch_copy_string(parsed.device_acl_file, val, sizeof(parsed.device_acl_file));
+            } else if (!strcmp(var, "device-gateway-file")) {
+                switch_copy_string(parsed.device_gateway_file, val, sizeof(parsed.device_gateway_file));
+            } else if (!strcmp(var, "device-gateway-profile")) {
+                switch_copy_string(parsed.device_gateway_profile, val, sizeof(parsed.device_gateway_profile));
+            } else if (!strcmp(var, "acct-interim-interval")) {
+                parsed.acct_interim_interval = atoi(val);
+            } else if (!strcmp(var, "acct-interim-jitter")) {
+                parsed.acct_interim_jitter = atoi(val);
+            } else if (!strcmp(var, "coa-listen")) {
+                switch_copy_string(parsed.coa_listen, val, sizeof(parsed.coa_listen));
+            } else if (!strcmp(var, "coa-secret")) {
+                switch_copy_string(parsed.coa_secret, val, sizeof(parsed.coa_secret));
+            } else if (!strcmp(var, "coa-acl")) {
+                switch_copy_string(parsed.coa_acl, val, sizeof(parsed.coa_acl));
+            } else if (!strcmp(var, "coa-replay-window")) {
+                parsed.coa_replay_window = atoi(val);
+            } else if (!strcmp(var, "server-id")) {
+                switch_copy_string(parsed.server_id, val, sizeof(parsed.server_id));
+            } else if (!strcmp(var, "acct-heartbeat-interval")) {
+                parsed.acct_heartbeat_interval = atoi(val);
+            } else if (!strcmp(var, "log-level")) {
+                parsed.log_level = switch_log_str2level(val);
+            } else if (!strcmp(var, "log-trace-sample")) {
+                parsed.log_trace_sample = atoi(val);
+            } else if (!strcmp(var, "bench-enabled")) {
+                parsed.bench_enabled = switch_true(val);
+            } else if (!strcmp(var, "capture-file")) {
+                switch_copy_string(parsed.capture_file, val, sizeof(parsed.capture_file));
+            } else if (!strcmp(var, "capture-max-size")) {
+                parsed.capture_max_size = (uint64_t) atoll(val) * 1024 * 1024;
+            }
+
+        }
+    }
+
+    if (parsed.handle_pool_max < 1) parsed.handle_pool_max = 1;
+    if (parsed.handle_pool_size < 0) parsed.handle_pool_size = 0;
+    if (parsed.handle_pool_size > parsed.handle_pool_max) parsed.handle_pool_size = parsed.handle_pool_max;
+    if (parsed.acct_queue_size < 1) parsed.acct_queue_size = 1;
+    if (parsed.spool_size < M2_RADIUS_SPOOL_MIN_SIZE) parsed.spool_size = M2_RADIUS_SPOOL_MIN_SIZE;
+    if (parsed.spool_retry_interval < 1) parsed.spool_retry_interval = 1;
+    if (parsed.hangup_rate < 0) parsed.hangup_rate = 0;
+    if (parsed.auth_fail_acct_stop_delay < 0) parsed.auth_fail_acct_stop_delay = 0;
+    if (parsed.transport_max_sockets < 1) parsed.transport_max_sockets = 1;
+    if (parsed.auth_hedge_percentile < 0 || parsed.auth_hedge_percentile > 100) parsed.auth_hedge_percentile = 0;
+    if (parsed.auth_hedge_min_delay < 0) parsed.auth_hedge_min_delay = 0;
+    if (parsed.negative_cache_ttl < 0) parsed.negative_cache_ttl = 0;
+    if (parsed.source_rate < 0) parsed.source_rate = 0;
+    if (parsed.stats_event_interval < 0) parsed.stats_event_interval = 0;
+    if (parsed.shadow_sample < 0 || parsed.shadow_sample > 100) parsed.shadow_sample = 0;
+    if (parsed.shadow_threads < 0) parsed.shadow_threads = 0;
+    if (parsed.shadow_queue_size < 1) parsed.shadow_queue_size = 1;
+    if (zstr(parsed.shard_key)) switch_copy_string(parsed.shard_key, "source-ip", sizeof(parsed.shard_key));
+    if (parsed.shard_sticky_ttl < 1) parsed.shard_sticky_ttl = 1;
+    if (parsed.acct_interim_interval < 0) parsed.acct_interim_interval = 0;
+    if (parsed.acct_heartbeat_interval < 0) parsed.acct_heartbeat_interval = 0;
+    if (parsed.log_level == SWITCH_LOG_INVALID) parsed.log_level = SWITCH_LOG_DEBUG;
+    if (parsed.log_trace_sample < 0 || parsed.log_trace_sample > 100) parsed.log_trace_sample = 0;
+    if (parsed.acct_interim_jitter < 0 || parsed.acct_interim_jitter > 50) parsed.acct_interim_jitter = 10;
+    if (parsed.transport_max_sockets > M2_RADIUS_TRANSPORT_MAX_SOCKETS) parsed.transport_max_sockets = M2_RADIUS_TRANSPORT_MAX_SOCKETS;
+
+    if ((auth_conf = switch_xml_dup(switch_xml_child(cfg, "m2_radius_auth"))) == NULL ||
+        (acct_start_conf = switch_xml_dup(switch_xml_child(cfg, "m2_radius_acct_start"))) == NULL ||
+        (acct_stop_conf = switch_xml_dup(switch_xml_child(cfg, "m2_radius_acct_stop"))) == NULL) {
+        if (auth_conf) switch_xml_free(auth_conf);
+        if (acct_start_conf) switch_xml_free(acct_start_conf);
+        goto err;
+    }
+
+    // build radius client handles once, requests will borrow them from the pools.
+    // Handle pools are built with new settings, calls in progress keep using old settings with old handles
+    if ((handles = m2_radius_handles_create(&parsed, auth_conf, acct_start_conf, acct_stop_conf)) == NULL) {
+        goto err;
+    }
+
+    // settings are published only when new handles are usable, failed reload keeps everything as it was
+    m2_radius_settings_apply(&parsed);
+    m2_radius_handles_swap(handles);
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Configuration success\n");
+    if (xml) {
+        switch_xml_free(xml);
+        xml = NULL;
+    }
+
+    switch_mutex_unlock(globals.reload_mutex);
+
+    return SWITCH_STATUS_SUCCESS;
+
+ err:
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Configuration error\n");
+    if (xml) {
+        switch_xml_free(xml);
+        xml = NULL;
+    }
+
+    switch_mutex_unlock(globals.reload_mutex);
+
+    return SWITCH_STATUS_GENERR;
+
+}
+
+
+/*
+    Simple string hash (djb2) used to distribute calls
+*/
+
+
+static uint32_t m2_radius_hash_string(const char *str) {
+
+    uint32_t hash = 5381;
+
+    while (str && *str) {
+        hash = ((hash << 5) + hash) + (unsigned char) *str++;
+    }
+
+    return hash;
+
+}
+
+// both legs have the same call_uuid, so sampled call is traced on both of them
+
+static int m2_radius_trace_enabled(switch_channel_t *channel) {
+
+    const char *val = NULL;
+
+    if (channel == NULL) {
+        return 0;
+    }
+
+    if ((val = switch_channel_get_variable(channel, "m2_radius_trace")) || (val = switch_channel_get_variable_partner(channel, "m2_radius_trace"))) {
+        return switch_true(val);
+    }
+
+    if (globals.log_trace_sample <= 0) {
+        return 0;
+    }
+
+    val = switch_channel_get_variable(channel, "call_uuid");
+
+    return (int) (m2_radius_hash_string(val ? val : switch_channel_get_uuid(channel)) % 100) < globals.log_trace_sample;
+
+}
+
+
+/*
+    Accounting spool
+
+    Accounting packets that could not be delivered are stored in memory mapped spool file
+    and replayed in the same order by the spool thread once radius server is reachable again.
+    Only calls that already have records in the spool are spooled behind them, other calls are sent
+    directly while the spool drains
+*/
+
+
+static uint32_t m2_radius_crc32_table[256];
+
+static void m2_radius_crc32_init(void) {
+
+    uint32_t c;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t) i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+        }
+        m2_radius_crc32_table[i] = c;
+    }
+
+}
+
+static uint32_t m2_radius_crc32(const unsigned char *data, switch_size_t len) {
+
+    uint32_t crc = 0xffffffff;
+    switch_size_t i;
+
+    for (i = 0; i < len; i++) {
+        crc = m2_radius_crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xffffffff;
+
+}
+
+// checksum covers everything in the record after the crc field
+
+static uint32_t m2_radius_spool_record_crc(m2_radius_spool_record_t *record) {
+
+    unsigned char *start = (unsigned char *) &record->acctstart;
+    unsigned char *end = (unsigned char *) record + sizeof(m2_radius_spool_record_t) + record->length;
+
+    return m2_radius_crc32(start, end - start);
+
+}
+
+// write record area or header to disk before it is counted as saved
+
+static void m2_radius_spool_sync(uint64_t offset, uint64_t length) {
+
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t start = offset & ~(page - 1);
+
+    msync(globals.spool_map + start, offset + length - start, MS_SYNC);
+
+}
+
+// bytes from head that can hold records without wrapping (spool_mutex is held)
+
+static uint64_t m2_radius_spool_head_span(m2_radius_spool_header_t *header) {
+
+    return header->tail > header->head ? header->tail - header->head : header->size - header->head;
+
+}
+
+// move head to the beginning of the file when the rest of the file holds no record
+
+static void m2_radius_spool_head_wrap(m2_radius_spool_header_t *header) {
+
+    if (header->used == 0 || header->tail > header->head) {
+        return;
+    }
+
+    if (header->size - header->head < sizeof(m2_radius_spool_record_t) || *(uint32_t *) (globals.spool_map + header->head) == M2_RADIUS_SPOOL_WRAP_MAGIC) {
+        header->used -= header->size - header->head;
+        header->head = M2_RADIUS_SPOOL_HEADER_SIZE;
+    }
+
+}
+
+// remove bytes from head, empty spool starts again from the beginning of the file
+
+static void m2_radius_spool_consume(m2_radius_spool_header_t *header, uint64_t bytes) {
+
+    header->head += bytes;
+    header->used = header->used > bytes ? header->used - bytes : 0;
+
+    if (header->used == 0) {
+        header->head = M2_RADIUS_SPOOL_HEADER_SIZE;
+        header->tail = M2_RADIUS_SPOOL_HEADER_SIZE;
+        header->records = 0;
+        return;
+    }
+
+    m2_radius_spool_head_wrap(header);
+
+}
+
+// size of the record at head, 0 if it is damaged
+
+static uint64_t m2_radius_spool_record_check(m2_radius_spool_header_t *header) {
+
+    m2_radius_spool_record_t *record = (m2_radius_spool_record_t *) (globals.spool_map + header->head);
+    uint64_t span = m2_radius_spool_head_span(header);
+    uint64_t record_size = 0;
+
+    if (span < sizeof(m2_radius_spool_record_t) || record->magic != M2_RADIUS_SPOOL_RECORD_MAGIC || record->length > M2_RADIUS_SPOOL_MAX_PAYLOAD) {
+        return 0;
+    }
+
+    record_size = M2_RADIUS_SPOOL_ALIGN(sizeof(m2_radius_spool_record_t) + record->length);
+
+    if (record_size > span || record->crc != m2_radius_spool_record_crc(record)) {
+        return 0;
+    }
+
+    return record_size;
+
+}
+
+// skip damaged bytes up to the next valid record, returns number of bytes skipped
+
+static uint64_t m2_radius_spool_skip_damaged(m2_radius_spool_header_t *header) {
+
+    uint64_t skipped = 0;
+
+    if (header->used == 0 || m2_radius_spool_record_check(header)) {
+        return 0;
+    }
+
+    while (header->used > 0 && m2_radius_spool_record_check(header) == 0) {
+        m2_radius_spool_consume(header, 8);
+        skipped += 8;
+    }
+
+    if (header->records) header->records--;
+
+    return skipped;
+
+}
+
+// number of spooled records per call, packets of these calls are spooled behind them (spool_mutex is held)
+
+static void m2_radius_spool_call_count(const char *call_uuid, int delta) {
+
+    char key[sizeof(((m2_radius_spool_record_t *) 0)->call_uuid)];
+    int *count = NULL;
+
+    switch_copy_string(key, call_uuid, sizeof(key));
+
+    if ((count = switch_core_hash_find(globals.spool_calls, key))) {
+        *count += delta;
+        if (*count <= 0) {
+            switch_core_hash_delete(globals.spool_calls, key);
+            free(count);
+        }
+    } else if (delta > 0 && (count = malloc(sizeof(int)))) {
+        *count = delta;
+        switch_core_hash_insert(globals.spool_calls, key, count);
+    }
+
+}
+
+// spool_mutex is held
+
+static void m2_radius_spool_calls_clear(void) {
+
+    switch_hash_index_t *hi = NULL;
+    void *val = NULL;
+
+    for (hi = switch_core_hash_first(globals.spool_calls); hi; hi = switch_core_hash_next(&hi)) {
+        switch_core_hash_this(hi, NULL, NULL, &val);
+        free(val);
+    }
+    switch_core_hash_destroy(&globals.spool_calls);
+    switch_core_hash_init(&globals.spool_calls);
+
+}
+
+// count pending records per call, damaged records are left for the spool thread to skip
+
+static void m2_radius_spool_calls_load(m2_radius_spool_header_t *header) {
+
+    m2_radius_spool_header_t cursor = *header;
+    uint64_t record_size = 0;
+
+    while (cursor.used > 0) {
+        m2_radius_spool_skip_damaged(&cursor);
+        if (cursor.used == 0 || (record_size = m2_radius_spool_record_check(&cursor)) == 0) {
+            break;
+        }
+        m2_radius_spool_call_count(((m2_radius_spool_record_t *) (globals.spool_map + cursor.head))->call_uuid, 1);
+        m2_radius_spool_consume(&cursor, record_size);
+    }
+
+}
+
+static switch_status_t m2_radius_spool_open(void) {
+
+    struct stat st;
+    m2_radius_spool_header_t *header = NULL;
+    int new_file = 0;
+
+    globals.spool_fd = -1;
+
+    if (zstr(globals.spool_file)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Accounting spool is disabled\n");
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    m2_radius_crc32_init();
+
+    if ((globals.spool_fd = open(globals.spool_file, O_RDWR | O_CREAT, 0640)) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to open accounting spool %s: %s\n", globals.spool_file, strerror(errno));
+        goto err;
+    }
+
+    if (fstat(globals.spool_fd, &st) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to stat accounting spool %s: %s\n", globals.spool_file, strerror(errno));
+        goto err;
+    }
+
+    // existing spool keeps its size, otherwise pending records would be lost
+    if (st.st_size == 0) {
+        new_file = 1;
+        if (ftruncate(globals.spool_fd, (off_t) globals.spool_size) < 0) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to resize accounting spool %s: %s\n", globals.spool_file, strerror(errno));
+            goto err;
+        }
+        globals.spool_map_size = globals.spool_size;
+    } else {
+        globals.spool_map_size = (uint64_t) st.st_size;
+    }
+
+    if (globals.spool_map_size < M2_RADIUS_SPOOL_MIN_SIZE) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Accounting spool %s is too small\n", globals.spool_file);
+        goto err;
+    }
+
+    globals.spool_map = mmap(NULL, globals.spool_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, globals.spool_fd, 0);
+    if (globals.spool_map == MAP_FAILED) {
+        globals.spool_map = NULL;
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to map accounting spool %s: %s\n", globals.spool_file, strerror(errno));
+        goto err;
+    }
+
+    header = (m2_radius_spool_header_t *) globals.spool_map;
+
+    // spool of the previous version is a ring that never wrapped, pending records are kept
+    if (!new_file && header->magic == M2_RADIUS_SPOOL_MAGIC && header->version == M2_RADIUS_SPOOL_VERSION_LINEAR && header->size == globals.spool_map_size &&
+        header->head >= M2_RADIUS_SPOOL_HEADER_SIZE && header->head <= header->tail && header->tail <= header->size) {
+        header->used = header->tail - header->head;
+        header->version = M2_RADIUS_SPOOL_VERSION;
+        m2_radius_spool_sync(0, M2_RADIUS_SPOOL_HEADER_SIZE);
+    }
+
+    if (!new_file && (header->magic != M2_RADIUS_SPOOL_MAGIC || header->version != M2_RADIUS_SPOOL_VERSION || header->size != globals.spool_map_size ||
+        header->head < M2_RADIUS_SPOOL_HEADER_SIZE || header->head > header->size || header->tail < M2_RADIUS_SPOOL_HEADER_SIZE || header->tail > header->size ||
+        header->used > header->size - M2_RADIUS_SPOOL_HEADER_SIZE)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Accounting spool %s header is invalid, spool will be reset\n", globals.spool_file);
+        new_file = 1;
+    }
+
+    if (new_file) {
+        memset(header, 0, sizeof(m2_radius_spool_header_t));
+        header->magic = M2_RADIUS_SPOOL_MAGIC;
+        header->version = M2_RADIUS_SPOOL_VERSION;
+        header->size = globals.spool_map_size;
+        header->head = M2_RADIUS_SPOOL_HEADER_SIZE;
+        header->tail = M2_RADIUS_SPOOL_HEADER_SIZE;
+        m2_radius_spool_sync(0, M2_RADIUS_SPOOL_HEADER_SIZE);
+    }
+
+    switch_mutex_init(&globals.spool_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+    switch_core_hash_init(&globals.spool_calls);
+    m2_radius_spool_calls_load(header);
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Accounting spool %s opened, size: %llu, pending records: %llu, used: %llu\n", globals.spool_file,
+        (unsigned long long) globals.spool_map_size, (unsigned long long) header->records, (unsigned long long) header->used);
+
+    return SWITCH_STATUS_SUCCESS;
+
+err:
+
+    if (globals.spool_fd >= 0) {
+        close(globals.spool_fd);
+        globals.spool_fd = -1;
+    }
+
+    return SWITCH_STATUS_FALSE;
+
+}
+
+static void m2_radius_spool_close(void) {
+
+    if (globals.spool_map) {
+        switch_mutex_lock(globals.spool_mutex);
+        msync(globals.spool_map, globals.spool_map_size, MS_SYNC);
+        munmap(globals.spool_map, globals.spool_map_size);
+        globals.spool_map = NULL;
+        m2_radius_spool_calls_clear();
+        switch_core_hash_destroy(&globals.spool_calls);
+        switch_mutex_unlock(globals.spool_mutex);
+    }
+
+    if (globals.spool_fd >= 0) {
+        close(globals.spool_fd);
+        globals.spool_fd = -1;
+    }
+
+}
+
+// are there any records waiting to be replayed
+
+static int m2_radius_spool_pending(void) {
+
+    int pending = 0;
+
+    if (globals.spool_map == NULL) {
+        return 0;
+    }
+
+    switch_mutex_lock(globals.spool_mutex);
+    if (globals.spool_map) {
+        pending = ((m2_radius_spool_header_t *) globals.spool_map)->used > 0;
+    }
+    switch_mutex_unlock(globals.spool_mutex);
+
+    return pending;
+
+}
+
+// are there records of this call waiting to be replayed, its next packet must go behind them
+
+static int m2_radius_spool_call_pending(const char *call_uuid) {
+
+    char key[sizeof(((m2_radius_spool_record_t *) 0)->call_uuid)];
+    int pending = 0;
+
+    if (globals.spool_map == NULL) {
+        return 0;
+    }
+
+    switch_copy_string(key, call_uuid, sizeof(key));
+
+    switch_mutex_lock(globals.spool_mutex);
+    if (globals.spool_map) {
+        pending = switch_core_hash_find(globals.spool_calls, key) != NULL;
+    }
+    switch_mutex_unlock(globals.spool_mutex);
+
+    return pending;
+
+}
+
+static switch_status_t m2_radius_spool_append(m2_radius_acct_job_t *job) {
+
+    unsigned char payload[M2_RADIUS_SPOOL_MAX_PAYLOAD];
+    uint32_t length = 0;
+    uint64_t record_size = 0;
+    uint64_t offset = 0;
+    uint64_t skipped = 0;
+    m2_radius_spool_header_t *header = NULL;
+    m2_radius_spool_record_t *record = NULL;
+    VALUE_PAIR *vp = NULL;
+    int wrapped = 0;
+
+    if (globals.spool_map == NULL) {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    // serialize attributes before taking the lock
+    for (vp = job->send; vp; vp = vp->next) {
+        uint32_t fields[3];
+        uint32_t value_length = vp->type == PW_TYPE_STRING ? vp->lvalue : 0;
+
+        if (length + sizeof(fields) + value_length > sizeof(payload)) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Accounting [%s] packet is too big for spool\n", job->uuid, job->acct_type);
+            return SWITCH_STATUS_FALSE;
+        }
+
+        fields[0] = (uint32_t) vp->attribute;
+        fields[1] = (uint32_t) vp->type;
+        fields[2] = vp->lvalue;
+        memcpy(payload + length, fields, sizeof(fields));
+        length += sizeof(fields);
+
+        if (value_length) {
+            memcpy(payload + length, vp->strvalue, value_length);
+            length += value_length;
+        }
+    }
+
+    record_size = M2_RADIUS_SPOOL_ALIGN(sizeof(m2_radius_spool_record_t) + length);
+
+    switch_mutex_lock(globals.spool_mutex);
+
+    if (globals.spool_map == NULL) {
+        switch_mutex_unlock(globals.spool_mutex);
+        return SWITCH_STATUS_FALSE;
+    }
+
+    header = (m2_radius_spool_header_t *) globals.spool_map;
+
+    if (header->used == 0) {
+        header->head = M2_RADIUS_SPOOL_HEADER_SIZE;
+        header->tail = M2_RADIUS_SPOOL_HEADER_SIZE;
+    }
+
+    // record goes to tail, or to the beginning of the file when the end of the file is too short
+    offset = header->tail;
+    wrapped = header->tail < header->head || (header->tail == header->head && header->used > 0);
+
+    if (!wrapped && header->tail + record_size > header->size) {
+        wrapped = 1;
+        skipped = header->size - header->tail;
+        offset = M2_RADIUS_SPOOL_HEADER_SIZE;
+    }
+
+    if (wrapped && offset + record_size > header->head) {
+        switch_mutex_unlock(globals.spool_mutex);
+        M2_RADIUS_METER_INC(spool_full);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Accounting spool is full, [%s] packet is lost\n", job->uuid, job->acct_type);
+        return SWITCH_STATUS_FALSE;
+    }
+
+    record = (m2_radius_spool_record_t *) (globals.spool_map + offset);
+    memset(record, 0, sizeof(m2_radius_spool_record_t));
+    record->magic = M2_RADIUS_SPOOL_RECORD_MAGIC;
+    record->length = length;
+    record->acctstart = job->acctstart;
+    record->shard = job->shard;
+    record->enqueue_time = job->enqueue_time;
+    switch_copy_string(record->uuid, job->uuid, sizeof(record->uuid));
+    switch_copy_string(record->channel_uuid, job->channel_uuid, sizeof(record->channel_uuid));
+    switch_copy_string(record->call_uuid, job->call_uuid, sizeof(record->call_uuid));
+    switch_copy_string(record->acct_type, job->acct_type, sizeof(record->acct_type));
+    memcpy((unsigned char *) record + sizeof(m2_radius_spool_record_t), payload, length);
+    record->crc = m2_radius_spool_record_crc(record);
+    m2_radius_spool_sync(offset, record_size);
+
+    if (skipped >= sizeof(uint32_t)) {
+        *(uint32_t *) (globals.spool_map + header->tail) = M2_RADIUS_SPOOL_WRAP_MAGIC;
+        m2_radius_spool_sync(header->tail, sizeof(uint32_t));
+    }
+
+    // record is on disk, now it can be counted
+    header->tail = offset + record_size;
+    header->used += skipped + record_size;
+    header->records++;
+    m2_radius_spool_sync(0, sizeof(m2_radius_spool_header_t));
+
+    m2_radius_spool_call_count(job->call_uuid, 1);
+
+    switch_mutex_unlock(globals.spool_mutex);
+
+    M2_RADIUS_METER_INC(spool_appended);
+
+    return SWITCH_STATUS_SUCCESS;
+
+}
+
+
+/*
+    Traffic capture
+
+    When capture-file is set every authentication and accounting request of a call sent to the primary rating
+    server is appended to the capture file together with send time, round trip time and reply digest.
+    m2_radius_replay sends the capture to a test core and compares the replies. Writing stops when the file
+    reaches capture-max-size, records that did not fit are counted as dropped
+*/
+
+
+static void m2_radius_shadow_digest(m2_radius_handle_pool_t *hp, VALUE_PAIR *recv, int result, m2_radius_shadow_digest_t *digest);
+
+// close current capture file and open the new one (empty path only closes it)
+
+static void m2_radius_capture_open(const char *path) {
+
+    m2_radius_capture_header_t header;
+    struct stat st;
+    int fd = -1;
+
+    switch_mutex_lock(globals.capture_mutex);
+
+    if (globals.capture_fd >= 0) {
+        close(globals.capture_fd);
+        globals.capture_fd = -1;
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Capture file %s closed\n", globals.capture_file);
+    }
+
+    switch_copy_string(globals.capture_file, path, sizeof(globals.capture_file));
+
+    if (zstr(path)) {
+        switch_mutex_unlock(globals.capture_mutex);
+        return;
+    }
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0640)) < 0 || fstat(fd, &st) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to open capture file %s: %s\n", path, strerror(errno));
+        goto err;
+    }
+
+    // existing capture is continued, header is written only to a new file
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        header.magic = M2_RADIUS_CAPTURE_MAGIC;
+        header.version = M2_RADIUS_CAPTURE_VERSION;
+        header.start_time = switch_micro_time_now();
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to write capture file %s header: %s\n", path, strerror(errno));
+            goto err;
+        }
+        st.st_size = sizeof(header);
+    }
+
+    globals.capture_fd = fd;
+    globals.capture_size = (uint64_t) st.st_size;
+    switch_mutex_unlock(globals.capture_mutex);
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Capturing requests to %s\n", path);
+
+    return;
+
+err:
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    switch_mutex_unlock(globals.capture_mutex);
+
+}
+
+static void m2_radius_capture(m2_radius_handle_pool_t *hp, m2_radius_conn_t conn, VALUE_PAIR *send, VALUE_PAIR *recv, int result, switch_time_t send_time,
+    switch_time_t rtt, const char *call_uuid) {
+
+    unsigned char buffer[sizeof(m2_radius_capture_record_t) + M2_RADIUS_PACKET_MAX];
+    m2_radius_capture_record_t *record = (m2_radius_capture_record_t *) buffer;
+    m2_radius_shadow_digest_t digest;
+    unsigned char value[256];
+    // attributes are encoded the same way as packets of the transport, packet header would be right before them
+    unsigned char *packet = buffer + sizeof(m2_radius_capture_record_t) - 20;
+    int length = 20;
+    int dropped = 0;
+    VALUE_PAIR *vp = NULL;
+
+    if (globals.capture_fd < 0 || hp == NULL || hp->secondary_connection) {
+        return;
+    }
+
+    for (vp = send; vp; vp = vp->next) {
+        int value_length = 4;
+
+        if (vp->attribute == PW_USER_PASSWORD) {
+            continue;
+        }
+
+        if (vp->type == PW_TYPE_STRING) {
+            value_length = vp->lvalue > 253 ? 253 : (int) vp->lvalue;
+            memcpy(value, vp->strvalue, value_length);
+        } else {
+            value[0] = (unsigned char) ((vp->lvalue >> 24) & 0xff);
+            value[1] = (unsigned char) ((vp->lvalue >> 16) & 0xff);
+            value[2] = (unsigned char) ((vp->lvalue >> 8) & 0xff);
+            value[3] = (unsigned char) (vp->lvalue & 0xff);
+        }
+
+        if ((length = m2_radius_encode_attr(packet, length, vp->attribute, value, value_length)) < 0) {
+            return;
+        }
+    }
+
+    m2_radius_shadow_digest(hp, recv, result, &digest);
+
+    memset(record, 0, sizeof(m2_radius_capture_record_t));
+    record->magic = M2_RADIUS_CAPTURE_RECORD_MAGIC;
+    record->length = (uint32_t) (length - 20);
+    record->send_time = send_time;
+    record->rtt = rtt;
+    record->code = hp->auth ? PW_ACCESS_REQUEST : PW_ACCOUNTING_REQUEST;
+    record->conn = conn;
+    record->result = digest.result;
+    record->route_count = digest.route_count;
+    record->route_hash = digest.route_hash;
+    switch_copy_string(record->timeout, digest.timeout, sizeof(record->timeout));
+    switch_copy_string(record->cause, digest.cause, sizeof(record->cause));
+    switch_copy_string(record->call_uuid, call_uuid, sizeof(record->call_uuid));
+
+    length = sizeof(m2_radius_capture_record_t) + record->length;
+
+    // one write per record, records of concurrent calls are never mixed
+    switch_mutex_lock(globals.capture_mutex);
+    if (globals.capture_fd < 0) {
+        switch_mutex_unlock(globals.capture_mutex);
+        return;
+    }
+    if (globals.capture_size + length > globals.capture_max_size || write(globals.capture_fd, buffer, length) != length) {
+        dropped = 1;
+    } else {
+        globals.capture_size += length;
+    }
+    switch_mutex_unlock(globals.capture_mutex);
+
+    if (dropped) {
+        M2_RADIUS_METER_INC(capture_dropped);
+    } else {
+        M2_RADIUS_METER_INC(capture_records);
+    }
+
+}
+
+
+/*
+    Forced hangups are limited to acct-fail-hangup-rate per second (0 = no limit),
+    so radius outage does not tear down all calls on the server at once
+*/
+
+
+static int m2_radius_hangup_allowed(void) {
+
+    switch_time_t now = switch_micro_time_now();
+    int allowed = 0;
+
+    if (globals.hangup_rate <= 0) {
+        return 1;
+    }
+
+    switch_mutex_lock(globals.mutex);
+
+    if (globals.hangup_tokens_time == 0) {
+        globals.hangup_tokens = globals.hangup_rate;
+    } else {
+        globals.hangup_tokens += (double) (now - globals.hangup_tokens_time) * globals.hangup_rate / 1000000;
+        if (globals.hangup_tokens > globals.hangup_rate) globals.hangup_tokens = globals.hangup_rate;
+    }
+    globals.hangup_tokens_time = now;
+
+    if (globals.hangup_tokens >= 1) {
+        globals.hangup_tokens -= 1;
+        allowed = 1;
+    }
+
+    switch_mutex_unlock(globals.mutex);
+
+    return allowed;
+
+}
+
+static void m2_radius_hangup(const char *uuid, m2_radius_hangup_reason_t reason) {
+
+    switch_core_session_t *session = NULL;
+
+    if (!m2_radius_hangup_allowed()) {
+        M2_RADIUS_METER_INC(hangups_rate_limited);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Hangup (%s) skipped, hangup rate limit reached\n", uuid, m2_radius_hangup_reason_names[reason]);
+        return;
+    }
+
+    if ((session = switch_core_session_locate(uuid)) == NULL) {
+        M2_RADIUS_METER_INC(hangups_not_found);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "[m2_radius %s] Hangup (%s) skipped, channel not found\n", uuid, m2_radius_hangup_reason_names[reason]);
+        return;
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Hanging up call with uniqueid: %s (%s)\n", uuid, uuid, m2_radius_hangup_reason_names[reason]);
+
+    // same cause as uuid_kill
+    switch_channel_hangup(switch_core_session_get_channel(session), SWITCH_CAUSE_MANAGER_REQUEST);
+    switch_core_session_rwunlock(session);
+
+    M2_RADIUS_METER_INC(hangups[reason]);
+
+}
+
+
+/*
+    Accounting request could not be delivered
+
+    Depending on acct-fail-hangup policy, call is terminated (legacy behaviour),
+    terminated only if packet could not be saved to the spool, or left alone
+*/
+
+
+static void m2_radius_acct_failed(const char *uuid, const char *acct_type, int spooled, m2_radius_hangup_reason_t reason) {
+
+    if (spooled) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Accounting [%s] error, packet saved to spool\n", uuid, acct_type);
+    } else {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Accounting [%s] error\n", uuid, acct_type);
+    }
+
+    if (globals.acct_fail_hangup == M2_RADIUS_HANGUP_NEVER || (globals.acct_fail_hangup == M2_RADIUS_HANGUP_UNSPOOLED && spooled)) {
+        return;
+    }
+
+    m2_radius_hangup(uuid, reason);
+
+}
+
+
+/*
+    Send accounting packet to one connection, returns radius client result code
+*/
+
+
+static int m2_radius_acct_send_conn(m2_radius_acct_job_t *job, m2_radius_conn_t conn) {
+
+    int result = 0;
+    rc_handle *rh = NULL;
+    m2_radius_server_t *server = NULL;
+    switch_time_t start_time = 0;
+    switch_time_t run_time = 0;
+
+    if ((rh = m2_radius_handle_get(job->handles, conn, job->shard, &server)) == NULL) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Pointer rh is NULL!\n", job->uuid);
+        return ERROR_RC;
+    }
+
+    start_time = switch_micro_time_now();
+    result = m2_radius_send_request(job->handles, conn, server, rh, job->send, NULL, NULL, NULL);
+    run_time = switch_micro_time_now() - start_time;
+    m2_radius_capture(job->handles->conn[conn], conn, job->send, NULL, result, start_time, run_time, job->call_uuid);
+
+    m2_radius_server_done(job->handles, conn, server, result, run_time);
+
+    if (job->secondary) {
+        m2_radius_latency_record(M2_RADIUS_PATH_SECONDARY, run_time, result != OK_RC);
+    } else if (conn == M2_RADIUS_CONN_ACCT_START) {
+        m2_radius_latency_record(M2_RADIUS_PATH_ACCT_START, run_time, result != OK_RC);
+    } else {
+        m2_radius_latency_record(job->failed ? M2_RADIUS_PATH_FAILED : M2_RADIUS_PATH_ACCT_STOP, run_time, result != OK_RC);
+    }
+    m2_radius_handle_put(job->handles, conn, server, rh);
+    rh = NULL;
+
+    // saving metering stats
+    M2_RADIUS_METER_INC(acct_send_count[conn]);
+    M2_RADIUS_METER_ADD(acct_send_time[conn], run_time);
+    m2_radius_meter_max(&m2_radius_meters[m2_radius_meter_stripe_get()].acct_send_time_max[conn], run_time);
+    M2_RADIUS_METER_ADD(acct_total_time[conn], switch_micro_time_now() - job->enqueue_time);
+    if (result != OK_RC) M2_RADIUS_METER_INC(acct_send_errors[conn]);
+
+    if (result != OK_RC) {
+        char error_msg[256] = "UNKNOWN_ERROR";
+
+        if (result == BADRESP_RC) {
+            strcpy(error_msg, "BADRESP_RC");
+        } else if (result == ERROR_RC) {
+            strcpy(error_msg, "GENERAL_ERROR");
+        } else if (result == TIMEOUT_RC) {
+            strcpy(error_msg, "TIMEOUT_RC");
+        } else if (result == REJECT_RC) {
+            strcpy(error_msg, "REJECT_RC");
+        }
+
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Result (RC = %d) %s\n", job->uuid, result, error_msg);
+    }
+
+    return result;
+
+}
+
+
+/*
+    Shadow mode
+
+    Sample of calls (shadow-sample percent, chosen by call_uuid so auth, start and stop of the same call are
+    mirrored together) is sent to the core in m2_radius_secondary_connection section. Copies are sent by shadow
+    threads from a bounded queue, when the queue is full copy is dropped, so shadow core never adds latency to calls.
+    Shadow requests have freeswitch-shadow=1, shadow core does not hang up and does not bill these calls. Replies are
+    compared with the reply of the primary core (result, routes, timeout and cause) and differences are counted.
+    Copies made during core recompile are not shadow traffic, they go through accounting sender queues
+*/
+
+
+static VALUE_PAIR *m2_radius_avpair_copy(VALUE_PAIR *vp) {
+
+    VALUE_PAIR *head = NULL;
+    VALUE_PAIR **tail = &head;
+
+    for (; vp; vp = vp->next) {
+        VALUE_PAIR *copy = malloc(sizeof(VALUE_PAIR));
+
+        if (copy == NULL) {
+            rc_avpair_free(head);
+            return NULL;
+        }
+
+        memcpy(copy, vp, sizeof(VALUE_PAIR));
+        copy->next = NULL;
+        *tail = copy;
+        tail = &copy->next;
+    }
+
+    return head;
+
+}
+
+// the parts of the reply which decide how the call is routed
+
+static void m2_radius_shadow_digest(m2_radius_handle_pool_t *hp, VALUE_PAIR *recv, int result, m2_radius_shadow_digest_t *digest) {
+
+    VALUE_PAIR *vp = NULL;
+    const char *cause = NULL;
+
+    memset(digest, 0, sizeof(*digest));
+    digest->result = result;
+    digest->route_hash = 5381;
+
+    for (vp = recv; vp; vp = vp->next) {
+        if (vp->attribute == hp->command_code_attr && vp->type == PW_TYPE_STRING) {
+            const char *c = vp->strvalue;
+
+            // order of routes matters, so hash them as one list
+            while (*c) {
+                digest->route_hash = ((digest->route_hash << 5) + digest->route_hash) + (unsigned char) *c++;
+            }
+            digest->route_hash = ((digest->route_hash << 5) + digest->route_hash) + '\n';
+            digest->route_count++;
+        } else if (vp->attribute == hp->avpair_attr && vp->type == PW_TYPE_STRING) {
+            if ((cause = strstr(vp->strvalue, "m2_hangupcause="))) {
+                switch_copy_string(digest->cause, cause + strlen("m2_hangupcause="), sizeof(digest->cause));
+            }
+        } else if (vp->attribute == hp->credit_time_attr) {
+            if (vp->type == PW_TYPE_STRING) {
+                switch_copy_string(digest->timeout, vp->strvalue, sizeof(digest->timeout));
+            } else {
+                switch_snprintf(digest->timeout, sizeof(digest->timeout), "%u", (unsigned int) vp->lvalue);
+            }
+        }
+    }
+
+}
+
+static int m2_radius_shadow_sampled(const char *call_uuid) {
+
+    return globals.shadow_sample > 0 && (int) (m2_radius_hash_string(call_uuid) % 100) < globals.shadow_sample;
+
+}
+
+static void m2_radius_shadow_job_free(m2_radius_shadow_job_t *job) {
+
+    if (job->send) {
+        rc_avpair_free(job->send);
+    }
+    m2_radius_handles_release(job->handles);
+    free(job);
+
+}
+
+// copy request to shadow queue, returns without waiting for anything
+
+static void m2_radius_shadow_enqueue(m2_radius_conn_t conn, VALUE_PAIR *send, const char *uuid, const char *acct_type, int sampled,
+                                     m2_radius_shadow_digest_t *primary) {
+
+    m2_radius_shadow_job_t *job = NULL;
+
+    if (!globals.running || globals.shadow_queue == NULL) {
+        return;
+    }
+
+    if ((job = calloc(1, sizeof(*job))) == NULL) {
+        return;
+    }
+
+    job->conn = conn;
+    job->sampled = sampled;
+    job->primary = *primary;
+    switch_copy_string(job->uuid, uuid, sizeof(job->uuid));
+    switch_copy_string(job->acct_type, acct_type, sizeof(job->acct_type));
+
+    if ((job->handles = m2_radius_handles_acquire()) == NULL || job->handles->conn[conn] == NULL || (job->send = m2_radius_avpair_copy(send)) == NULL) {
+        m2_radius_shadow_job_free(job);
+        return;
+    }
+
+    if (switch_queue_trypush(globals.shadow_queue, job) != SWITCH_STATUS_SUCCESS) {
+        M2_RADIUS_METER_INC(shadow_dropped);
+        m2_radius_shadow_job_free(job);
+    }
+
+}
+
+static void m2_radius_shadow_job_send(m2_radius_shadow_job_t *job) {
+
+    m2_radius_handle_pool_t *hp = job->handles->conn[job->conn];
+    m2_radius_shadow_digest_t shadow;
+    m2_radius_server_t *server = NULL;
+    rc_handle *rh = NULL;
+    VALUE_PAIR *recv = NULL;
+    char msg[512 * 10 + 1] = {0};
+    switch_time_t start_time = 0;
+    switch_time_t run_time = 0;
+    int result = ERROR_RC;
+
+    if ((rh = m2_radius_handle_get(job->handles, job->conn, 0, &server))) {
+        if (job->sampled) {
+            rc_avpair_add(rh, &job->send, 1, "freeswitch-shadow=1", -1, 9);
+        }
+
+        start_time = switch_micro_time_now();
+        result = m2_radius_send_request(job->handles, job->conn, server, rh, job->send, hp->auth ? &recv : NULL, hp->auth ? msg : NULL, NULL);
+        run_time = switch_micro_time_now() - start_time;
+
+        m2_radius_server_done(job->handles, job->conn, server, result, run_time);
+        m2_radius_latency_record(M2_RADIUS_PATH_SECONDARY, run_time, result != OK_RC && result != REJECT_RC);
+        m2_radius_shadow_digest(hp, recv, result, &shadow);
+        m2_radius_handle_put(job->handles, job->conn, server, rh);
+    } else {
+        m2_radius_shadow_digest(hp, NULL, result, &shadow);
+    }
+
+    if (recv) {
+        rc_avpair_free(recv);
+    }
+
+    M2_RADIUS_METER_INC(shadow_sent);
+    if (result != OK_RC && result != REJECT_RC) {
+        M2_RADIUS_METER_INC(shadow_errors);
+    } else if (shadow.result != job->primary.result) {
+        M2_RADIUS_METER_INC(shadow_diff_result);
+    } else if (shadow.route_count != job->primary.route_count || shadow.route_hash != job->primary.route_hash || strcmp(shadow.timeout, job->primary.timeout) ||
+               strcmp(shadow.cause, job->primary.cause)) {
+        if (shadow.route_count != job->primary.route_count || shadow.route_hash != job->primary.route_hash) M2_RADIUS_METER_INC(shadow_diff_routes);
+        if (strcmp(shadow.timeout, job->primary.timeout)) M2_RADIUS_METER_INC(shadow_diff_timeout);
+        if (strcmp(shadow.cause, job->primary.cause)) M2_RADIUS_METER_INC(shadow_diff_cause);
+    } else {
+        M2_RADIUS_METER_INC(shadow_match);
+    }
+
+    if (result != OK_RC && result != REJECT_RC) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Shadow [%s] request failed (RC = %d)\n", job->uuid, m2_radius_conn_names[job->conn], result);
+    } else if (shadow.result != job->primary.result || shadow.route_count != job->primary.route_count || shadow.route_hash != job->primary.route_hash ||
+               strcmp(shadow.timeout, job->primary.timeout) || strcmp(shadow.cause, job->primary.cause)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Shadow [%s] reply differs: result %d/%d, routes %d/%d%s, timeout '%s'/'%s', cause '%s'/'%s'\n",
+            job->uuid, m2_radius_conn_names[job->conn], job->primary.result, shadow.result, job->primary.route_count, shadow.route_count,
+            shadow.route_hash != job->primary.route_hash ? " (changed)" : "", job->primary.timeout, shadow.timeout, job->primary.cause, shadow.cause);
+    }
+
+}
+
+static void *SWITCH_THREAD_FUNC m2_radius_shadow_thread(switch_thread_t *thread, void *obj) {
+
+    void *pop = NULL;
+
+    // on shutdown queued copies are dropped, nobody waits for them
+    while (globals.running) {
+
+        if (switch_queue_pop_timeout(globals.shadow_queue, &pop, 500000) != SWITCH_STATUS_SUCCESS || pop == NULL) {
+            continue;
+        }
+
+        m2_radius_shadow_job_send((m2_radius_shadow_job_t *) pop);
+        m2_radius_shadow_job_free((m2_radius_shadow_job_t *) pop);
+        pop = NULL;
+
+    }
+
+    return NULL;
+
+}
+
+static void m2_radius_shadow_start(void) {
+
+    switch_threadattr_t *thd_attr = NULL;
+    int i;
+
+    if (globals.shadow_threads <= 0) {
+        if (globals.shadow_sample > 0) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius] shadow-sample is set but shadow-threads is 0, shadow mode is disabled\n");
+        }
+        return;
+    }
+
+    switch_queue_create(&globals.shadow_queue, globals.shadow_queue_size, globals.pool);
+    globals.shadow_thread_list = switch_core_alloc(globals.pool, sizeof(switch_thread_t *) * globals.shadow_threads);
+
+    for (i = 0; i < globals.shadow_threads; i++) {
+        switch_threadattr_create(&thd_attr, globals.pool);
+        switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+        switch_thread_create(&globals.shadow_thread_list[i], thd_attr, m2_radius_shadow_thread, NULL, globals.pool);
+    }
+
+}
+
+static void m2_radius_shadow_stop(void) {
+
+    switch_status_t status;
+    void *pop = NULL;
+    int i;
+
+    if (globals.shadow_queue == NULL) {
+        return;
+    }
+
+    for (i = 0; i < globals.shadow_threads; i++) {
+        switch_thread_join(&status, globals.shadow_thread_list[i]);
+    }
+
+    while (switch_queue_trypop(globals.shadow_queue, &pop) == SWITCH_STATUS_SUCCESS && pop) {
+        m2_radius_shadow_job_free((m2_radius_shadow_job_t *) pop);
+        pop = NULL;
+    }
+
+    globals.shadow_queue = NULL;
+
+}
+
+
+static void m2_radius_acct_secondary_dispatch(m2_radius_acct_job_t *job);
+
+/*
+    Accounting packet was accepted by the main radius server
+*/
+
+
+static void m2_radius_acct_job_sent(m2_radius_acct_job_t *job) {
+
+    m2_radius_conn_t conn = job->acctstart ? M2_RADIUS_CONN_ACCT_START_SECONDARY : M2_RADIUS_CONN_ACCT_STOP_SECONDARY;
+    m2_radius_shadow_digest_t primary;
+    int sampled = m2_radius_shadow_sampled(job->call_uuid);
+
+    m2_radius_log(SWITCH_LOG_NOTICE, "[m2_radius %s] Accounting [%s] successful\n", job->uuid, job->acct_type);
+
+    if (job->interim || job->node) {
+        if (job->node) {
+            M2_RADIUS_METER_INC(node_sent);
+        } else {
+            M2_RADIUS_METER_INC(interim_sent);
+        }
+    } else if (job->acctstart) {
+        switch_core_session_t *session = NULL;
+        if ((session = switch_core_session_locate(job->channel_uuid))) {
+            switch_channel_set_variable(switch_core_session_get_channel(session), "m2_channel_answered", "1");
+            switch_core_session_rwunlock(session);
+        }
+    }
+
+    // during core recompile the other core must see every accounting packet in order, sampled call is only mirrored
+    if (use_secondary_connection) {
+        m2_radius_acct_secondary_dispatch(job);
+    } else if (sampled) {
+        m2_radius_shadow_digest(job->handles->conn[conn], NULL, OK_RC, &primary);
+        m2_radius_shadow_enqueue(conn, job->send, job->uuid, job->acct_type, sampled, &primary);
+    }
+
+}
+
+
+/*
+    Send accounting packet prepared by m2_radius_send_acct_packet
+
+    Called directly (synchronous mode) or from accounting sender threads
+*/
+
+
+static int m2_radius_acct_job_send(m2_radius_acct_job_t *job) {
+
+    int spooled = 0;
+
+    // copy for the other core during recompile, it is not spooled, failure is handled as before shadow mode
+    if (job->secondary) {
+        if (m2_radius_acct_send_conn(job, job->acctstart ? M2_RADIUS_CONN_ACCT_START_SECONDARY : M2_RADIUS_CONN_ACCT_STOP_SECONDARY) != OK_RC) {
+            m2_radius_acct_failed(job->uuid, job->acct_type, 0, M2_RADIUS_HANGUP_REASON_SECONDARY_ERROR);
+            return 1;
+        }
+        m2_radius_log(SWITCH_LOG_NOTICE, "[m2_radius %s] Accounting [%s] successful (secondary connection)\n", job->uuid, job->acct_type);
+        return 0;
+    }
+
+    // interim update and server status are replaced by the next one, they are never spooled and never hang up the call
+    if (job->interim || job->node) {
+        if ((job->node ? m2_radius_spool_pending() : m2_radius_spool_call_pending(job->call_uuid)) ||
+            m2_radius_acct_send_conn(job, M2_RADIUS_CONN_ACCT_START) != OK_RC) {
+            if (job->node) {
+                M2_RADIUS_METER_INC(node_errors);
+            } else {
+                M2_RADIUS_METER_INC(interim_errors);
+            }
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Accounting [%s] not delivered, waiting for the next update\n", job->uuid, job->acct_type);
+            return 0;
+        }
+        m2_radius_acct_job_sent(job);
+        return 0;
+    }
+
+    // older packets of this call are still waiting in the spool, keep the order
+    if (m2_radius_spool_call_pending(job->call_uuid)) {
+        if (m2_radius_spool_append(job) == SWITCH_STATUS_SUCCESS) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Accounting spool is not empty, [%s] packet saved to spool\n", job->uuid, job->acct_type);
+            return 0;
+        }
+        m2_radius_acct_failed(job->uuid, job->acct_type, 0, M2_RADIUS_HANGUP_REASON_SPOOL_FULL);
+        return 1;
+    }
+
+    if (m2_radius_acct_send_conn(job, job->acctstart ? M2_RADIUS_CONN_ACCT_START : M2_RADIUS_CONN_ACCT_STOP) != OK_RC) {
+        spooled = m2_radius_spool_append(job) == SWITCH_STATUS_SUCCESS;
+        m2_radius_acct_failed(job->uuid, job->acct_type, spooled, M2_RADIUS_HANGUP_REASON_SEND_ERROR);
+        return spooled ? 0 : 1;
+    }
+
+    m2_radius_acct_job_sent(job);
+
+    return 0;
+
+}
+
+static void m2_radius_acct_job_free(m2_radius_acct_job_t *job) {
+
+    if (job == NULL) {
+        return;
+    }
+
+    if (job->send) {
+        rc_avpair_free(job->send);
+        job->send = NULL;
+    }
+
+    m2_radius_handles_release(job->handles);
+    free(job);
+
+}
+
+// copy of accepted packet for secondary radius server goes to the same sender queue as the packets of its call.
+// Called from the sender thread of the call, so the copy is sent right away if that queue is full
+
+static void m2_radius_acct_secondary_dispatch(m2_radius_acct_job_t *job) {
+
+    m2_radius_conn_t conn = job->acctstart ? M2_RADIUS_CONN_ACCT_START_SECONDARY : M2_RADIUS_CONN_ACCT_STOP_SECONDARY;
+    m2_radius_acct_job_t *copy = NULL;
+
+    if ((copy = calloc(1, sizeof(m2_radius_acct_job_t))) == NULL) {
+        m2_radius_acct_failed(job->uuid, job->acct_type, 0, M2_RADIUS_HANGUP_REASON_SECONDARY_ERROR);
+        return;
+    }
+
+    copy->acctstart = job->acctstart;
+    copy->interim = job->interim;
+    copy->node = job->node;
+    copy->secondary = 1;
+    copy->enqueue_time = switch_micro_time_now();
+    switch_copy_string(copy->uuid, job->uuid, sizeof(copy->uuid));
+    switch_copy_string(copy->channel_uuid, job->channel_uuid, sizeof(copy->channel_uuid));
+    switch_copy_string(copy->call_uuid, job->call_uuid, sizeof(copy->call_uuid));
+    switch_copy_string(copy->acct_type, job->acct_type, sizeof(copy->acct_type));
+
+    if ((copy->handles = m2_radius_handles_acquire()) == NULL || copy->handles->conn[conn] == NULL || (copy->send = m2_radius_avpair_copy(job->send)) == NULL) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Secondary connection is not available\n", job->uuid);
+        m2_radius_acct_failed(job->uuid, job->acct_type, 0, M2_RADIUS_HANGUP_REASON_SECONDARY_ERROR);
+        m2_radius_acct_job_free(copy);
+        return;
+    }
+
+    if (globals.acct_senders_count > 0 && globals.running) {
+        m2_radius_acct_sender_t *sender = &globals.acct_senders[m2_radius_hash_string(copy->call_uuid) % globals.acct_senders_count];
+
+        if (switch_queue_trypush(sender->queue, copy) == SWITCH_STATUS_SUCCESS) {
+            return;
+        }
+    }
+
+    m2_radius_acct_job_send(copy);
+    m2_radius_acct_job_free(copy);
+
+}
+
+
+/*
+    Accounting spool replay
+
+    Records are replayed one by one from the head of the spool, next record is taken only when
+    previous one was accepted by the main radius server. On error we wait for acct-spool-retry-interval
+*/
+
+
+// remove record from the head of the spool
+
+static void m2_radius_spool_pop(uint64_t record_size, const char *call_uuid) {
+
+    m2_radius_spool_header_t *header = NULL;
+
+    switch_mutex_lock(globals.spool_mutex);
+
+    if (globals.spool_map) {
+        header = (m2_radius_spool_header_t *) globals.spool_map;
+
+        if (header->records) header->records--;
+        m2_radius_spool_consume(header, record_size);
+        m2_radius_spool_sync(0, sizeof(m2_radius_spool_header_t));
+
+        m2_radius_spool_call_count(call_uuid, -1);
+        if (header->used == 0) {
+            m2_radius_spool_calls_clear();
+        }
+    }
+
+    switch_mutex_unlock(globals.spool_mutex);
+
+}
+
+// replay first record from the spool, returns SWITCH_STATUS_SUCCESS if next record can be replayed right away
+
+static switch_status_t m2_radius_spool_replay_one(void) {
+
+    m2_radius_spool_header_t *header = NULL;
+    m2_radius_spool_record_t *record = NULL;
+    m2_radius_acct_job_t *job = NULL;
+    rc_handle *rh = NULL;
+    m2_radius_conn_t conn;
+    uint64_t record_size = 0;
+    uint64_t skipped = 0;
+    uint32_t offset = 0;
+    unsigned char *payload = NULL;
+    switch_status_t status = SWITCH_STATUS_FALSE;
+
+    // copy record out of the map, senders can append to the spool while we are sending
+    switch_mutex_lock(globals.spool_mutex);
+
+    if (globals.spool_map == NULL) {
+        switch_mutex_unlock(globals.spool_mutex);
+        return SWITCH_STATUS_FALSE;
+    }
+
+    header = (m2_radius_spool_header_t *) globals.spool_map;
+
+    // damaged bytes are skipped up to the next valid record, records behind them are still replayed
+    if ((skipped = m2_radius_spool_skip_damaged(header))) {
+        m2_radius_spool_sync(0, sizeof(m2_radius_spool_header_t));
+        if (header->used == 0) {
+            m2_radius_spool_calls_clear();
+        }
+    }
+
+    if (header->used > 0 && (record_size = m2_radius_spool_record_check(header)) > 0 && (record = malloc(record_size))) {
+        memcpy(record, globals.spool_map + header->head, record_size);
+    }
+
+    switch_mutex_unlock(globals.spool_mutex);
+
+    if (skipped) {
+        M2_RADIUS_METER_INC(spool_corrupted);
+
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Accounting spool %s has damaged record, %llu bytes skipped\n", globals.spool_file,
+            (unsigned long long) skipped);
+    }
+
+    if (record == NULL) {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    // rebuild accounting packet
+    if ((job = calloc(1, sizeof(m2_radius_acct_job_t))) == NULL) {
+        goto end;
+    }
+
+    job->acctstart = record->acctstart;
+    job->shard = record->shard;
+    job->enqueue_time = switch_micro_time_now();
+    switch_copy_string(job->uuid, record->uuid, sizeof(job->uuid));
+    switch_copy_string(job->channel_uuid, record->channel_uuid, sizeof(job->channel_uuid));
+    switch_copy_string(job->call_uuid, record->call_uuid, sizeof(job->call_uuid));
+    switch_copy_string(job->acct_type, record->acct_type, sizeof(job->acct_type));
+
+    if ((job->handles = m2_radius_handles_acquire()) == NULL) {
+        goto end;
+    }
+
+    conn = job->acctstart ? M2_RADIUS_CONN_ACCT_START : M2_RADIUS_CONN_ACCT_STOP;
+
+    if ((rh = m2_radius_handle_get(job->handles, conn, 0, NULL)) == NULL) {
+        goto end;
+    }
+
+    payload = (unsigned char *) record + sizeof(m2_radius_spool_record_t);
+
+    while (offset < record->length) {
+        uint32_t fields[3];
+        char value[AUTH_STRING_LEN + 1] = "";
+        void *pval = &fields[2];
+        int len = -1;
+
+        if (offset + sizeof(fields) > record->length) {
+            break;
+        }
+
+        memcpy(fields, payload + offset, sizeof(fields));
+        offset += sizeof(fields);
+
+        if (fields[1] == PW_TYPE_STRING) {
+            if (fields[2] > AUTH_STRING_LEN || offset + fields[2] > record->length) {
+                break;
+            }
+            memcpy(value, payload + offset, fields[2]);
+            offset += fields[2];
+            pval = value;
+            len = (int) fields[2];
+        }
+
+        if (rc_avpair_add(rh, &job->send, ATTRID(fields[0]), pval, len, VENDOR(fields[0])) == NULL) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to restore attribute %u from accounting spool\n", job->uuid, fields[0]);
+        }
+    }
+
+    m2_radius_handle_put(job->handles, conn, NULL, rh);
+    rh = NULL;
+
+    // checksum was fine but attributes can't be decoded, drop only this record
+    if (offset != record->length) {
+        M2_RADIUS_METER_INC(spool_corrupted);
+
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Accounting [%s] spool record is damaged, record is dropped\n", job->uuid, job->acct_type);
+        m2_radius_spool_pop(record_size, record->call_uuid);
+        status = SWITCH_STATUS_SUCCESS;
+        goto end;
+    }
+
+    if (m2_radius_acct_send_conn(job, conn) != OK_RC) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Accounting [%s] replay from spool failed, will retry in %d s\n", job->uuid, job->acct_type, globals.spool_retry_interval);
+        goto end;
+    }
+
+    m2_radius_spool_pop(record_size, record->call_uuid);
+
+    M2_RADIUS_METER_INC(spool_replayed);
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Accounting [%s] replayed from spool after %lld s\n", job->uuid, job->acct_type,
+        (long long) ((job->enqueue_time - record->enqueue_time) / 1000000));
+
+    m2_radius_acct_job_sent(job);
+
+    status = SWITCH_STATUS_SUCCESS;
+
+end:
+
+    m2_radius_acct_job_free(job);
+    free(record);
+
+    return status;
+
+}
+
+static void *SWITCH_THREAD_FUNC m2_radius_spool_thread(switch_thread_t *thread, void *obj) {
+
+    int i;
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "[m2_radius] Accounting spool thread started\n");
+
+    while (globals.running) {
+
+        while (globals.running && m2_radius_spool_replay_one() == SWITCH_STATUS_SUCCESS);
+
+        for (i = 0; i < globals.spool_retry_interval * 10 && globals.running; i++) {
+            switch_yield(100000);
+        }
+
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "[m2_radius] Accounting spool thread stopped\n");
+
+    return NULL;
+
+}
+
+static void m2_radius_spool_start(void) {
+
+    switch_threadattr_t *thd_attr = NULL;
+
+    if (globals.spool_map == NULL) {
+        return;
+    }
+
+    switch_threadattr_create(&thd_attr, globals.pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&globals.spool_thread, thd_attr, m2_radius_spool_thread, NULL, globals.pool);
+
+}
+
+static void m2_radius_spool_stop(void) {
+
+    switch_status_t status;
+
+    if (globals.spool_thread) {
+        switch_thread_join(&status, globals.spool_thread);
+        globals.spool_thread = NULL;
+    }
+
+    m2_radius_spool_close();
+
+}
+
+
+/*
+    Accounting sender threads
+
+    Each thread has its own queue, accounting packets are distributed by call_uuid
+    so acct start and acct stop for the same call are always sent in order by the same thread.
+
+    Channel threads never wait for a free place in the queue. When the queue is full, acct start and acct stop
+    are put to the overflow list of the sender and the next packets for this sender follow them there.
+    Before taking the next packet the sender moves everything still in its queue and then the overflow list
+    to the spool, in this order, so the spool thread delivers them later with the per call order kept.
+    Without spool (or when spool is full) these packets are sent by the sender one by one as before.
+*/
+
+
+// move queued packets and the overflow list to spool, queue is older than the overflow list
+
+static void m2_radius_acct_sender_spill(m2_radius_acct_sender_t *sender) {
+
+    m2_radius_acct_job_t *head = NULL;
+    m2_radius_acct_job_t *tail = NULL;
+    m2_radius_acct_job_t *job = NULL;
+    void *pop = NULL;
+    int spooled = 0;
+    int total = 0;
+
+    // new packets go to the overflow list while the lock is held, so nothing newer can get into the queue before the list is taken
+    switch_mutex_lock(sender->overflow_mutex);
+
+    while (switch_queue_trypop(sender->queue, &pop) == SWITCH_STATUS_SUCCESS) {
+        if (pop == NULL) {
+            continue;
+        }
+        job = (m2_radius_acct_job_t *) pop;
+        job->next = NULL;
+        if (tail) {
+            tail->next = job;
+        } else {
+            head = job;
+        }
+        tail = job;
+        pop = NULL;
+    }
+
+    if (tail) {
+        tail->next = sender->overflow_head;
+    } else {
+        head = sender->overflow_head;
+    }
+
+    sender->overflow_head = NULL;
+    sender->overflow_tail = NULL;
+    __sync_lock_test_and_set(&sender->overflow_count, 0);
+
+    switch_mutex_unlock(sender->overflow_mutex);
+
+    while (head) {
+
+        job = head;
+        head = head->next;
+        job->next = NULL;
+        total++;
+
+        // interim update, server status and secondary copy are never spooled, they are handled as usual
+        if (!job->interim && !job->node && !job->secondary && m2_radius_spool_append(job) == SWITCH_STATUS_SUCCESS) {
+            spooled++;
+        } else {
+            m2_radius_acct_job_send(job);
+        }
+
+        m2_radius_acct_job_free(job);
+
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius] Accounting queue %d was full, %d of %d packet(s) saved to spool\n", sender->id, spooled, total);
+
+}
+
+
+static void *SWITCH_THREAD_FUNC m2_radius_acct_sender_thread(switch_thread_t *thread, void *obj) {
+
+    m2_radius_acct_sender_t *sender = (m2_radius_acct_sender_t *) obj;
+    void *pop = NULL;
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "[m2_radius] Accounting sender thread %d started\n", sender->id);
+
+    // on shutdown send everything that is still queued
+    while (globals.running || switch_queue_size(sender->queue) > 0 || __sync_fetch_and_add(&sender->overflow_count, 0) > 0) {
+
+        if (__sync_fetch_and_add(&sender->overflow_count, 0) > 0) {
+            m2_radius_acct_sender_spill(sender);
+            continue;
+        }
+
+        if (switch_queue_pop_timeout(sender->queue, &pop, 500000) != SWITCH_STATUS_SUCCESS || pop == NULL) {
+            continue;
+        }
+
+        m2_radius_acct_job_send((m2_radius_acct_job_t *) pop);
+        m2_radius_acct_job_free((m2_radius_acct_job_t *) pop);
+        pop = NULL;
+
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "[m2_radius] Accounting sender thread %d stopped\n", sender->id);
+
+    return NULL;
+
+}
+
+static void m2_radius_acct_senders_start(void) {
+
+    switch_threadattr_t *thd_attr = NULL;
+    int i;
+
+    if (globals.acct_sender_threads <= 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Accounting packets will be sent synchronously\n");
+        if (globals.acct_interim_interval > 0) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius] Interim updates need acct-sender-threads, they are disabled\n");
+        }
+        return;
+    }
+
+    globals.acct_senders = switch_core_alloc(globals.pool, sizeof(m2_radius_acct_sender_t) * globals.acct_sender_threads);
+
+    for (i = 0; i < globals.acct_sender_threads; i++) {
+        m2_radius_acct_sender_t *sender = &globals.acct_senders[i];
+
+        sender->id = i;
+        switch_queue_create(&sender->queue, globals.acct_queue_size, globals.pool);
+        switch_mutex_init(&sender->overflow_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+
+        switch_threadattr_create(&thd_attr, globals.pool);
+        switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+        switch_thread_create(&sender->thread, thd_attr, m2_radius_acct_sender_thread, sender, globals.pool);
+    }
+
+    globals.acct_senders_count = globals.acct_sender_threads;
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Started %d accounting sender thread(s), queue size %d\n", globals.acct_senders_count, globals.acct_queue_size);
+
+}
+
+static void m2_radius_acct_senders_stop(void) {
+
+    switch_status_t status;
+    int i;
+
+    for (i = 0; i < globals.acct_senders_count; i++) {
+        switch_thread_join(&status, globals.acct_senders[i].thread);
+    }
+
+    globals.acct_senders_count = 0;
+
+}
+
+// total number of accounting packets waiting in the queues
+
+static int m2_radius_acct_queue_depth(void) {
+
+    int depth = 0;
+    int i;
+
+    for (i = 0; i < globals.acct_senders_count; i++) {
+        depth += switch_queue_size(globals.acct_senders[i].queue) + __sync_fetch_and_add(&globals.acct_senders[i].overflow_count, 0);
+    }
+
+    return depth;
+
+}
+
+// send packet now or hand it over to the sender thread
+
+static int m2_radius_acct_job_dispatch(m2_radius_acct_job_t *job) {
+
+    int res = 0;
+
+    if (globals.acct_senders_count > 0 && globals.running) {
+        m2_radius_acct_sender_t *sender = &globals.acct_senders[m2_radius_hash_string(job->call_uuid) % globals.acct_senders_count];
+
+        // packets already waiting in the overflow list must not be overtaken
+        if (__sync_fetch_and_add(&sender->overflow_count, 0) == 0 && switch_queue_trypush(sender->queue, job) == SWITCH_STATUS_SUCCESS) {
+            return 0;
+        }
+
+        // interim update and heartbeat come from the scheduler thread which must not wait, the next one replaces them
+        if (job->interim || job->node) {
+            M2_RADIUS_METER_INC(acct_queue_overflow);
+            if (job->node) {
+                M2_RADIUS_METER_INC(node_errors);
+            } else {
+                M2_RADIUS_METER_INC(interim_errors);
+            }
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Accounting queue is full, [%s] packet dropped\n", job->uuid, job->acct_type);
+            m2_radius_acct_job_free(job);
+            return 1;
+        }
+
+        // queue is full: do not wait, sender thread moves the queue and the overflow list to spool in order
+        switch_mutex_lock(sender->overflow_mutex);
+
+        if (sender->overflow_head == NULL && switch_queue_trypush(sender->queue, job) == SWITCH_STATUS_SUCCESS) {
+            switch_mutex_unlock(sender->overflow_mutex);
+            return 0;
+        }
+
+        job->next = NULL;
+        if (sender->overflow_tail) {
+            sender->overflow_tail->next = job;
+        } else {
+            sender->overflow_head = job;
+        }
+        sender->overflow_tail = job;
+        __sync_fetch_and_add(&sender->overflow_count, 1);
+
+        switch_mutex_unlock(sender->overflow_mutex);
+
+        M2_RADIUS_METER_INC(acct_queue_overflow);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Accounting queue is full, [%s] packet goes to spool\n", job->uuid, job->acct_type);
+
+        return 0;
+    }
+
+    res = m2_radius_acct_job_send(job);
+    m2_radius_acct_job_free(job);
+
+    return res;
+
+}
+
+
+/*
+    Delayed accounting packets
+
+    Packet is built right away from channel data and kept in the list until its time comes,
+    so channel thread does not have to wait. All packets have the same delay, so new packets are
+    appended to the tail and the list stays ordered by due time
+*/
+
+
+static int m2_radius_acct_job_delay(m2_radius_acct_job_t *job, int delay) {
+
+    if (!globals.running || globals.delayed_thread == NULL) {
+        return m2_radius_acct_job_dispatch(job);
+    }
+
+    job->due_time = switch_micro_time_now() + (switch_time_t) delay * 1000000;
+    job->next = NULL;
+
+    switch_mutex_lock(globals.delayed_mutex);
+    if (globals.delayed_tail) {
+        globals.delayed_tail->next = job;
+    } else {
+        globals.delayed_head = job;
+    }
+    globals.delayed_tail = job;
+    globals.delayed_count++;
+    switch_mutex_unlock(globals.delayed_mutex);
+
+    return 0;
+
+}
+
+// take first packet from the list if it is due (or any packet when flush is set)
+
+static m2_radius_acct_job_t *m2_radius_acct_job_delayed_pop(int flush) {
+
+    m2_radius_acct_job_t *job = NULL;
+
+    switch_mutex_lock(globals.delayed_mutex);
+    if (globals.delayed_head && (flush || globals.delayed_head->due_time <= switch_micro_time_now())) {
+        job = globals.delayed_head;
+        globals.delayed_head = job->next;
+        if (globals.delayed_head == NULL) {
+            globals.delayed_tail = NULL;
+        }
+        globals.delayed_count--;
+        job->next = NULL;
+    }
+    switch_mutex_unlock(globals.delayed_mutex);
+
+    return job;
+
+}
+
+static void *SWITCH_THREAD_FUNC m2_radius_acct_delayed_thread(switch_thread_t *thread, void *obj) {
+
+    m2_radius_acct_job_t *job = NULL;
+
+    while (globals.running) {
+
+        while ((job = m2_radius_acct_job_delayed_pop(0))) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Sending delayed accounting [%s] request now\n", job->uuid, job->acct_type);
+            m2_radius_acct_job_dispatch(job);
+        }
+
+        switch_yield(100000);
+
+    }
+
+    // module is unloading, do not wait for the delay
+    while ((job = m2_radius_acct_job_delayed_pop(1))) {
+        m2_radius_acct_job_dispatch(job);
+    }
+
+    return NULL;
+
+}
+
+static void m2_radius_acct_delayed_start(void) {
+
+    switch_threadattr_t *thd_attr = NULL;
+
+    switch_mutex_init(&globals.delayed_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+
+    switch_threadattr_create(&thd_attr, globals.pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&globals.delayed_thread, thd_attr, m2_radius_acct_delayed_thread, NULL, globals.pool);
+
+}
+
+static void m2_radius_acct_delayed_stop(void) {
+
+    switch_status_t status;
+
+    if (globals.delayed_thread) {
+        switch_thread_join(&status, globals.delayed_thread);
+        globals.delayed_thread = NULL;
+    }
+
+}
+
+
+static switch_status_t m2_radius_send_acct_packet(m2_radius_acct_kind_t kind, int failed, switch_core_session_t *session, char *leg_a_uuid, int hangupcause, int delay) {
+
+    rc_handle *rh = NULL;
+    m2_radius_handles_t *handles = NULL;
+    m2_radius_conn_t conn = M2_RADIUS_CONN_ACCT_START;
+    m2_radius_acct_job_t *job = NULL;
+    VALUE_PAIR *send = NULL;
+    char acct_type[128] = "start";
+    uint32_t service = PW_STATUS_START;
+    switch_call_cause_t cause;
+    switch_caller_profile_t *profile;
+    switch_time_t callstartdate = 0;
+    switch_time_t callanswerdate = 0;
+    switch_time_t callenddate = 0;
+    switch_time_t calltransferdate = 0;
+    switch_time_t billusec = 0;
+    switch_time_exp_t tm;
+    char buffer[256] = "";
+    switch_call_cause_t cause_q850;
+    char uuid[256] = "";
+    const char *endpoint_disposition = NULL;
+    int acctstart = kind != M2_RADIUS_ACCT_STOP;
+    int interim = kind == M2_RADIUS_ACCT_INTERIM;
+    int trace = 0;
+
+    if (leg_a_uuid && strlen(leg_a_uuid)) {
+        strcpy(uuid, leg_a_uuid);
+    }
+
+    // interim update is built like accounting start and goes over the same connection
+    if (interim) {
+        strcpy(acct_type, "interim");
+        service = PW_STATUS_ALIVE;
+    }
+
+    if (!acctstart) {
+        strcpy(acct_type, "stop");
+        service = PW_STATUS_STOP;
+        conn = M2_RADIUS_CONN_ACCT_STOP;
+    }
+
+    if (session) {
+
+        const char *val = NULL;
+        const char *val_uuid = NULL;
+        const char *val_partner_uuid = NULL;
+        switch_channel_t *channel;
+
+        channel = switch_core_session_get_channel(session);
+
+        if (!channel) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] No channel\n", uuid);
+            return 0;
+        }
+
+        trace = m2_radius_trace_enabled(channel);
+
+        val = switch_channel_get_variable(channel, "direction");
+        if (!strlen(uuid)) {
+            val_uuid = switch_channel_get_variable(channel, "uuid");
+            if (val_uuid) {
+                strcpy(uuid, val_uuid);
+            }
+        }
+
+        if (val != NULL) {
+
+            // check maybe originator cancelled
+            const char *val_hgc= NULL;
+            val_hgc = switch_channel_get_variable(channel, "proto_specific_hangup_cause");
+
+            // if originator cancelled, then send acct stop packet even on legA channel (usually acct stop should be sent from legB channel)
+            if (val_hgc && strcmp(val_hgc, "sip:487") == 0) {
+                failed = 1;
+            }
+
+            // check only legB
+            if (acctstart == 0 && strcmp(val, "outbound")) {
+                endpoint_disposition = switch_channel_get_variable(channel, "endpoint_disposition");
+
+                // if call failed before dialing legB, then allow legA
+                // also allow legA on CODEC NEGOTIATION ERROR because legB does not have any info about this error
+                if (!failed && strcmp(endpoint_disposition, "CODEC NEGOTIATION ERROR") != 0) {
+                    return 0;
+                }
+            }
+
+            val_partner_uuid = switch_channel_get_variable_partner(channel, "uuid");
+            if (val_partner_uuid) {
+                char old_uuid[256] = "";
+                strcpy(old_uuid, uuid);
+                strcpy(uuid, val_partner_uuid);
+                m2_radius_trace(trace, "[m2_radius %s] Other leg UUID: %s\n", uuid, old_uuid);
+            }
+
+            cause_q850 = switch_channel_get_cause_q850(channel);
+            sprintf(buffer, "%d", cause_q850);
+            switch_channel_set_variable_partner(channel, "m2_q850_hgc", buffer);
+
+            handles = m2_radius_handles_acquire();
+            rh = m2_radius_handle_get(handles, conn, 0, NULL);
+
+            if (rh == NULL) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Pointer rh is NULL!\n", uuid);
+                goto acct_err;
+            }
+
+            if (m2_xml_radius_add_params(session, NULL, rh, &send, m2_radius_plan_get(handles, conn), conn, uuid) != SWITCH_STATUS_SUCCESS ) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add params to rc_handle\n", uuid);
+                goto acct_err;
+            }
+
+            if (rc_avpair_add(rh, &send, PW_ACCT_STATUS_TYPE, &service, -1, 0) == NULL) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add option to handle\n", uuid);
+                goto acct_err;
+            }
+
+            if (!acctstart) {
+                const char *val2 = NULL;
+                const char *val3 = NULL;
+                const char *val4 = NULL;
+                char *new_buffer = NULL;
+                char tmp_buffer[256] = "";
+                char sip_cause_buffer[256] = "";
+                cause = switch_channel_get_cause(channel);
+                new_buffer = switch_mprintf("%s", switch_channel_cause2str(cause));
+                val2 = switch_channel_get_variable(channel, "originate_disposition");
+                val3 = switch_channel_get_variable(channel, "proto_specific_hangup_cause");
+                val4 = switch_channel_get_variable(channel, "last_bridge_proto_specific_hangup_cause");
+
+                if (val2) {
+                    if (cause == 0 && strcmp(new_buffer, "NONE") == 0) {
+                        strcpy(tmp_buffer, val2);
+                    }
+                }
+
+                if (val3) {
+                    if (strcmp(new_buffer, "CALL_REJECTED") == 0 && strcmp(val3, "sip:603") == 0) {
+                        strcpy(new_buffer, "USER_BUSY");
+                    }
+                }
+
+                if (!strlen(tmp_buffer)) {
+                    if (new_buffer) {
+                        strcpy(tmp_buffer, new_buffer);
+                    }
+                }
+
+                if (val3) {
+                    sprintf(sip_cause_buffer, "terminator-sip-hangupcause=%s", val3);
+                    if (rc_avpair_add(rh, &send, 1, sip_cause_buffer, -1, 9) == NULL) {
+                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add terminator-sip-hangupcause!\n", uuid);
+                        goto acct_err;
+                    } else {
+                        m2_radius_trace(trace, "[m2_radius %s] %s\n", uuid, sip_cause_buffer);
+                    }
+                }
+
+                if (val4) {
+                    strcpy(sip_cause_buffer, "");
+                    sprintf(sip_cause_buffer, "originator-sip-hangupcause=%s", val4);
+                    if (rc_avpair_add(rh, &send, 1, sip_cause_buffer, -1, 9) == NULL) {
+                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add originator-sip-hangupcause!\n", uuid);
+                        goto acct_err;
+                    } else {
+                        m2_radius_trace(trace, "[m2_radius %s] %s\n", uuid, sip_cause_buffer);
+                    }
+                }
+
+                if (rc_avpair_add(rh, &send, 30, (void *)tmp_buffer, -1, 9) == NULL) {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add h323-disconnect-cause: %d\n", uuid, cause);
+                    if (new_buffer) {
+                        free(new_buffer);
+                        new_buffer = NULL;
+                    }
+                    goto acct_err;
+                } else {
+                    m2_radius_trace(trace, "[m2_radius %s] h323-disconnect-cause = %s\n", uuid, (char *)tmp_buffer);
+                }
+
+                if (new_buffer) {
+                    free(new_buffer);
+                    new_buffer = NULL;
+                }
+
+                if (hangupcause) {
+                    new_buffer = switch_mprintf("freeswitch-hangupcause=%d", hangupcause);
+                } else {
+                    new_buffer = switch_mprintf("freeswitch-hangupcause=%d", cause);
+                }
+
+                if (rc_avpair_add(rh, &send, 1, (void *)new_buffer, -1, 9) == NULL) {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add freeswitch-hangupcause: %d\n", uuid, cause);
+                    if (new_buffer) {
+                        free(new_buffer);
+                        new_buffer = NULL;
+                    }
+                    goto acct_err;
+                } else {
+                    m2_radius_trace(trace, "[m2_radius %s] %s\n", uuid, new_buffer);
+                }
+
+                if (new_buffer) {
+                    free(new_buffer);
+                    new_buffer = NULL;
+                }
+
+                if (endpoint_disposition && strcmp(endpoint_disposition, "CODEC NEGOTIATION ERROR") == 0) {
+                    if (rc_avpair_add(rh, &send, 1, "freeswitch-endpnt-disp=CODEC_NEGOTIATION_ERROR", -1, 9) == NULL) {
+                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add freeswitch-endpnt-disp=CODEC_NEGOTIATION_ERROR!\n", uuid);
+                        goto acct_err;
+                    } else {
+                        m2_radius_trace(trace, "[m2_radius %s] freeswitch-endpnt-disp=CODEC_NEGOTIATION_ERROR\n", uuid);
+                    }
+                }
+            }
+
+            // get time variables
+            profile = switch_channel_get_caller_profile(channel);
+
+            if (profile) {
+
+                // calculate billable time
+                callstartdate = profile->times->created;
+                callanswerdate = profile->times->answered;
+                calltransferdate = profile->times->transferred;
+                callenddate = profile->times->hungup;
+
+                if (switch_channel_test_flag(channel, CF_ANSWERED)) {
+                    if (callstartdate && callanswerdate) {
+                        if (callenddate)
+                            billusec = callenddate - callanswerdate;
+                        else if (calltransferdate)
+                            billusec = calltransferdate - callanswerdate;
+                        else if (interim)
+                            billusec = switch_micro_time_now() - callanswerdate;
+                    }
+                } else if (switch_channel_test_flag(channel, CF_TRANSFER)) {
+                    if (callanswerdate && calltransferdate)
+                        billusec = calltransferdate - callanswerdate;
+                }
+
+                if (callstartdate > 0) {
+                    switch_time_exp_lt(&tm, callstartdate);
+                    switch_snprintf(buffer, sizeof(buffer), "%04u-%02u-%02uT%02u:%02u:%02u.%06u%+03d%02d",
+                                    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                                    tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_usec, tm.tm_gmtoff / 3600, tm.tm_gmtoff % 3600);
+                    if (rc_avpair_add(rh, &send, 25, &buffer, -1, 9) == NULL) {
+                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed adding h323-setup-time: %s\n", uuid, buffer);
+                        goto acct_err;
+                    } else {
+                        m2_radius_trace(trace, "[m2_radius %s] h323-setup-time=%s\n", uuid, (char *) buffer);
+                    }
+                }
+
+                if (callanswerdate > 0) {
+                    switch_time_exp_lt(&tm, callanswerdate);
+                    switch_snprintf(buffer, sizeof(buffer), "%04u-%02u-%02uT%02u:%02u:%02u.%06u%+03d%02d",
+                                    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                                    tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_usec, tm.tm_gmtoff / 3600, tm.tm_gmtoff % 3600);
+                    if (rc_avpair_add(rh, &send, 28, &buffer, -1, 9) == NULL) {
+                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed adding h323-connect-time: %s\n", uuid, buffer);
+                        goto acct_err;
+                    } else {
+                        m2_radius_trace(trace, "[m2_radius %s] h323-connect-time=%s\n", uuid, (char *) buffer);
+                    }
+                }
+
+                if (callenddate > 0) {
+                    switch_time_exp_lt(&tm, callenddate);
+                    switch_snprintf(buffer, sizeof(buffer), "%04u-%02u-%02uT%02u:%02u:%02u.%06u%+03d%02d",
+                                    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                                    tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_usec, tm.tm_gmtoff / 3600, tm.tm_gmtoff % 3600);
+                    if (rc_avpair_add(rh, &send, 29, &buffer, -1, 9) == NULL) {
+                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed adding h323-disconnect-time: %s\n", uuid, buffer);
+                        goto acct_err;
+                    } else {
+                        m2_radius_trace(trace, "[m2_radius %s] h323-disconnect-time=%s\n", uuid, (char *) buffer);
+                    }
+                }
+
+                if (interim) {
+                    uint32_t session_time = (uint32_t) (billusec / 1000000);
+
+                    if (rc_avpair_add(rh, &send, PW_ACCT_SESSION_TIME, &session_time, -1, 0) == NULL) {
+                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed adding Acct-Session-Time: %u\n", uuid, session_time);
+                        goto acct_err;
+                    } else {
+                        m2_radius_trace(trace, "[m2_radius %s] Acct-Session-Time=%u\n", uuid, session_time);
+                    }
+                }
+
+            }
+
+            m2_radius_handle_put(handles, conn, NULL, rh);
+            rh = NULL;
+
+            if (!acctstart) {
+                switch_channel_set_variable_partner(channel, "m2_attempt_processed", "true");
+            }
+
+            // from here packet does not depend on the channel anymore, it can be sent from any thread
+            if ((job = malloc(sizeof(*job))) == NULL) {
+                goto acct_err;
+            }
+
+            memset(job, 0, sizeof(*job));
+            job->acctstart = acctstart;
+            job->interim = interim;
+            job->failed = failed;
+            job->handles = handles;
+            job->send = send;
+            job->enqueue_time = switch_micro_time_now();
+            switch_copy_string(job->uuid, uuid, sizeof(job->uuid));
+            switch_copy_string(job->acct_type, acct_type, sizeof(job->acct_type));
+            switch_copy_string(job->channel_uuid, switch_core_session_get_uuid(session), sizeof(job->channel_uuid));
+
+            // accounting goes to the core which authorized the call (variable is set on the A leg)
+            if ((val = switch_channel_get_variable(channel, "m2_radius_shard")) || (val = switch_channel_get_variable_partner(channel, "m2_radius_shard"))) {
+                job->shard = atoi(val);
+            }
+
+            // both call legs have the same call_uuid, so start and stop of the same call end up in the same queue
+            if ((val = switch_channel_get_variable(channel, "call_uuid"))) {
+                switch_copy_string(job->call_uuid, val, sizeof(job->call_uuid));
+            } else {
+                switch_copy_string(job->call_uuid, uuid, sizeof(job->call_uuid));
+            }
+
+            if (delay > 0) {
+                return m2_radius_acct_job_delay(job, delay);
+            }
+
+            return m2_radius_acct_job_dispatch(job);
+
+        } else {
             switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] No val\n", uuid);
         }
-    } else {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] No session\n", uuid);
+    } else {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] No session\n", uuid);
+    }
+
+    acct_err:
+
+    if (send) {
+        rc_avpair_free(send);
+        send = NULL;
+    }
+
+    m2_radius_handle_put(handles, conn, NULL, rh);
+    m2_radius_handles_release(handles);
+
+    if (interim) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Accounting [%s] packet could not be built\n", uuid, acct_type);
+        return 1;
+    }
+
+    m2_radius_acct_failed(uuid, acct_type, 0, M2_RADIUS_HANGUP_REASON_BUILD_ERROR);
+
+    return 1;
+
+}
+
+/*
+    Interim accounting updates
+
+    Answered calls report their current billsec to the rating server every acct-interim-interval seconds,
+    so the core can keep accrued price of each call up to date instead of re-pricing all active calls.
+    Rating server can set its own interval for the call (interim_interval) or ask for the first update
+    at given billsec (interim_deadline) in Access-Accept. Every interval is spread by acct-interim-jitter
+    percent, so calls answered at the same moment do not report at the same moment. Updates are only queued to
+    accounting sender threads (dropped when the queue is full), so they are disabled without acct-sender-threads
+*/
+
+
+#define M2_RADIUS_INTERIM_GROUP "m2_radius_interim"
+
+// option from channel variable or from the reply if reply variables are not set on the channel
+
+static int m2_radius_interim_option(switch_channel_t *channel, const char *name) {
+
+    m2_radius_reply_t *reply = NULL;
+    const char *val = NULL;
+    int i;
+
+    if ((val = switch_channel_get_variable(channel, name))) {
+        return atoi(val);
+    }
+
+    if ((reply = switch_channel_get_private(channel, "m2_radius_reply"))) {
+        for (i = 0; i < reply->var_count; i++) {
+            if (!strcmp(reply->vars[i].name, name)) {
+                return atoi(reply->vars[i].value);
+            }
+        }
+    }
+
+    return 0;
+
+}
+
+static int m2_radius_interim_interval(switch_channel_t *channel) {
+
+    int interval = m2_radius_interim_option(channel, "m2_interim_interval");
+
+    return interval > 0 ? interval : globals.acct_interim_interval;
+
+}
+
+static int m2_radius_interim_jitter(int interval) {
+
+    int range = interval * globals.acct_interim_jitter / 100;
+
+    if (range > 0) {
+        interval += (rand() % (2 * range + 1)) - range;
+    }
+
+    return interval > 0 ? interval : 1;
+
+}
+
+SWITCH_STANDARD_SCHED_FUNC(m2_radius_interim_task) {
+
+    switch_core_session_t *session = NULL;
+    switch_channel_t *channel = NULL;
+    const char *uuid = (const char *) task->cmd_arg;
+    int interval = 0;
+
+    if (!globals.running || (session = switch_core_session_locate(uuid)) == NULL) {
+        return;
+    }
+
+    channel = switch_core_session_get_channel(session);
+
+    // task is not rescheduled, so it ends together with the call
+    if (switch_channel_up(channel) && switch_channel_test_flag(channel, CF_ANSWERED)) {
+        m2_radius_send_acct_packet(M2_RADIUS_ACCT_INTERIM, 0, session, (char *) uuid, 0, 0);
+        if ((interval = m2_radius_interim_interval(channel)) > 0) {
+            task->runtime = switch_epoch_time_now(NULL) + m2_radius_interim_jitter(interval);
+        }
+    }
+
+    switch_core_session_rwunlock(session);
+
+}
+
+// called after accounting start of the call
+
+static void m2_radius_interim_schedule(switch_core_session_t *session, const char *uuid) {
+
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    int interval = m2_radius_interim_interval(channel);
+    int deadline = m2_radius_interim_option(channel, "m2_interim_deadline");
+    int first = 0;
+    uint32_t task_id = 0;
+    char buffer[32] = "";
+
+    // interim task runs on the scheduler thread, it only builds the packet and leaves sending to sender threads
+    if (globals.acct_senders_count == 0) {
+        return;
+    }
+
+    if (deadline > 0) {
+        first = deadline;
+    } else if (interval > 0) {
+        first = m2_radius_interim_jitter(interval);
+    } else {
+        return;
+    }
+
+    task_id = switch_scheduler_add_task(switch_epoch_time_now(NULL) + first, m2_radius_interim_task, "m2_radius_interim", M2_RADIUS_INTERIM_GROUP, 0, strdup(uuid), SSHF_FREE_ARG);
+    switch_snprintf(buffer, sizeof(buffer), "%u", task_id);
+    switch_channel_set_variable(channel, "m2_radius_interim_task", buffer);
+
+    m2_radius_trace(m2_radius_trace_enabled(channel), "[m2_radius %s] First interim update in %d s\n", uuid, first);
+
+}
+
+static void m2_radius_interim_cancel(switch_channel_t *channel) {
+
+    const char *val = NULL;
+
+    if ((val = switch_channel_get_variable(channel, "m2_radius_interim_task"))) {
+        switch_scheduler_del_task_id((uint32_t) strtoul(val, NULL, 10));
+    }
+
+}
+
+
+/*
+    Dynamic authorization (RFC 5176)
+
+    Rating server can end a call with Disconnect-Request or change its time limit with CoA-Request
+    instead of running uuid_kill over event socket for every call. Call is found by Acct-Session-Id
+    or call-id AVPair (uuid sent in accounting), CoA-Request must carry new time limit in Session-Timeout
+    (seconds from now). Scheduled hangup of the call is replaced, so the limit is enforced here even if
+    rating server goes away. Listener is started only if coa-listen is set, requests are accepted from
+    addresses allowed by coa-acl (any address if not set) and must be signed with coa-secret.
+
+    Route time limit is scheduled by m2_bridge on the B leg when it answers, id of the task is kept in
+    m2_radius_hangup_task on both legs. CoA-Request removes only this task (other scheduled tasks of the call, like
+    sched_broadcast or sched_transfer from dialplan, stay) and schedules the new one on the leg named in the request.
+    Replays are discarded (RFC 5176 3.5): request with Event-Timestamp
+    further than coa-replay-window seconds (default 300, 0 disables the check) from now is dropped, and a request
+    repeating the authenticator of a recent one gets the same reply again without being executed twice
+*/
+
+
+#define M2_RADIUS_COA_PORT "3799"
+#define M2_RADIUS_DISCONNECT_REQUEST 40
+#define M2_RADIUS_COA_REQUEST 43
+#define M2_RADIUS_ATTR_SESSION_TIMEOUT 27
+#define M2_RADIUS_ATTR_EVENT_TIMESTAMP 55
+#define M2_RADIUS_ATTR_ERROR_CAUSE 101
+#define M2_RADIUS_COA_RECENT_SIZE 256
+#define M2_RADIUS_ERROR_MISSING_ATTRIBUTE 402
+#define M2_RADIUS_ERROR_INVALID_REQUEST 404
+#define M2_RADIUS_ERROR_SESSION_NOT_FOUND 503
+
+// requests answered recently, used only by listener thread
+static struct {
+    unsigned char authenticator[16];
+    time_t time;
+    int reply_code;
+    int error_cause;
+} m2_radius_coa_recent[M2_RADIUS_COA_RECENT_SIZE];
+static int m2_radius_coa_recent_next = 0;
+
+// request authenticator is md5 of the packet with zero authenticator and the secret
+
+static int m2_radius_coa_verify(const unsigned char *packet, int length) {
+
+    unsigned char buffer[M2_RADIUS_PACKET_MAX + 256];
+    unsigned char digest[SWITCH_MD5_DIGESTSIZE];
+    switch_size_t secret_length = strlen(globals.coa_secret);
+
+    memcpy(buffer, packet, length);
+    memset(buffer + 4, 0, 16);
+    memcpy(buffer + length, globals.coa_secret, secret_length);
+    switch_md5(digest, buffer, length + secret_length);
+
+    return memcmp(digest, packet + 4, 16) == 0;
+
+}
+
+static void m2_radius_coa_reply(int fd, const struct sockaddr_in *addr, const unsigned char *request, int code, int error_cause) {
+
+    unsigned char packet[M2_RADIUS_PACKET_MAX + 256];
+    unsigned char value[4];
+    switch_size_t secret_length = strlen(globals.coa_secret);
+    int length = 20;
+
+    packet[0] = (unsigned char) code;
+    packet[1] = request[1];
+    memcpy(packet + 4, request + 4, 16);
+
+    if (error_cause) {
+        value[0] = (unsigned char) ((error_cause >> 24) & 0xff);
+        value[1] = (unsigned char) ((error_cause >> 16) & 0xff);
+        value[2] = (unsigned char) ((error_cause >> 8) & 0xff);
+        value[3] = (unsigned char) (error_cause & 0xff);
+        length = m2_radius_encode_attr(packet, length, M2_RADIUS_ATTR_ERROR_CAUSE, value, 4);
+    }
+
+    packet[2] = (unsigned char) ((length >> 8) & 0xff);
+    packet[3] = (unsigned char) (length & 0xff);
+
+    // response authenticator (RFC 5176 3.5)
+    memcpy(packet + length, globals.coa_secret, secret_length);
+    switch_md5(packet + 4, packet, length + secret_length);
+
+    sendto(fd, packet, length, 0, (const struct sockaddr *) addr, sizeof(*addr));
+
+}
+
+// replaces scheduled hangup of the call, peer_channel is given when legs are not bridged yet
+
+static void m2_radius_hangup_schedule(switch_channel_t *channel, switch_channel_t *peer_channel, const char *uuid, int timeout) {
+
+    const char *val = NULL;
+    uint32_t task_id = 0;
+    char buffer[32] = "";
+
+    if ((val = switch_channel_get_variable(channel, "m2_radius_hangup_task")) || (val = switch_channel_get_variable_partner(channel, "m2_radius_hangup_task"))) {
+        switch_scheduler_del_task_id((uint32_t) strtoul(val, NULL, 10));
+    }
+
+    task_id = switch_ivr_schedule_hangup(switch_epoch_time_now(NULL) + timeout, uuid, SWITCH_CAUSE_ALLOTTED_TIMEOUT, SWITCH_FALSE);
+    switch_snprintf(buffer, sizeof(buffer), "%u", task_id);
+
+    switch_channel_set_variable(channel, "m2_radius_hangup_task", buffer);
+    if (peer_channel) {
+        switch_channel_set_variable(peer_channel, "m2_radius_hangup_task", buffer);
+    } else {
+        switch_channel_set_variable_partner(channel, "m2_radius_hangup_task", buffer);
+    }
+
+}
+
+static void m2_radius_hangup_cancel(switch_channel_t *channel) {
+
+    const char *val = NULL;
+
+    if ((val = switch_channel_get_variable(channel, "m2_radius_hangup_task"))) {
+        switch_scheduler_del_task_id((uint32_t) strtoul(val, NULL, 10));
+    }
+
+}
+
+// returns error cause for NAK or 0 if request was done
+
+static int m2_radius_coa_execute(int code, const char *uuid, int timeout, int has_timeout) {
+
+    switch_core_session_t *session = NULL;
+    switch_channel_t *channel = NULL;
+
+    if (zstr(uuid)) {
+        return M2_RADIUS_ERROR_MISSING_ATTRIBUTE;
+    }
+
+    if (code == M2_RADIUS_COA_REQUEST && !has_timeout) {
+        return M2_RADIUS_ERROR_MISSING_ATTRIBUTE;
+    }
+
+    if ((session = switch_core_session_locate(uuid)) == NULL) {
+        return M2_RADIUS_ERROR_SESSION_NOT_FOUND;
+    }
+
+    channel = switch_core_session_get_channel(session);
+
+    if (code == M2_RADIUS_DISCONNECT_REQUEST || timeout <= 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Disconnect requested by rating server\n", uuid);
+        switch_channel_hangup(channel, SWITCH_CAUSE_MANAGER_REQUEST);
+        M2_RADIUS_METER_INC(coa_disconnects);
+    } else {
+        char buffer[32] = "";
+
+        m2_radius_hangup_schedule(channel, NULL, uuid, timeout);
+        switch_snprintf(buffer, sizeof(buffer), "%d", timeout);
+        switch_channel_set_variable(channel, "m2_coa_timeout", buffer);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Call time limit changed by rating server, hangup in %d s\n", uuid, timeout);
+        M2_RADIUS_METER_INC(coa_changes);
+    }
+
+    switch_core_session_rwunlock(session);
+
+    return 0;
+
+}
+
+static void m2_radius_coa_handle(int fd, const struct sockaddr_in *addr, const unsigned char *packet, int length) {
+
+    char ip[64] = "";
+    char uuid[256] = "";
+    int code = packet[0];
+    int timeout = 0;
+    int has_timeout = 0;
+    int error_cause = 0;
+    int offset = 20;
+    time_t now = switch_epoch_time_now(NULL);
+    time_t event_time = 0;
+    int has_event_time = 0;
+    int i;
+
+    inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+
+    if (length < 20 || ((packet[2] << 8) | packet[3]) < 20 || ((packet[2] << 8) | packet[3]) > length || (code != M2_RADIUS_DISCONNECT_REQUEST && code != M2_RADIUS_COA_REQUEST)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius] Bad dynamic authorization packet from %s\n", ip);
+        return;
+    }
+
+    length = (packet[2] << 8) | packet[3];
+
+    if (!zstr(globals.coa_acl) && !switch_check_network_list_ip(ip, globals.coa_acl)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius] Dynamic authorization request from %s rejected by acl %s\n", ip, globals.coa_acl);
+        return;
+    }
+
+    if (!m2_radius_coa_verify(packet, length)) {
+        M2_RADIUS_METER_INC(coa_bad_auth);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius] Dynamic authorization request from %s has bad authenticator\n", ip);
+        return;
+    }
+
+    while (offset + 2 <= length) {
+        int attr = packet[offset];
+        int attr_length = packet[offset + 1];
+        const unsigned char *value = packet + offset + 2;
+        int value_length = attr_length - 2;
+
+        if (attr_length < 2 || offset + attr_length > length) {
+            error_cause = M2_RADIUS_ERROR_INVALID_REQUEST;
+            break;
+        }
+
+        if (attr == PW_ACCT_SESSION_ID && value_length < (int) sizeof(uuid)) {
+            memcpy(uuid, value, value_length);
+            uuid[value_length] = '\0';
+        } else if (attr == M2_RADIUS_ATTR_SESSION_TIMEOUT && value_length == 4) {
+            timeout = (value[0] << 24) | (value[1] << 16) | (value[2] << 8) | value[3];
+            has_timeout = 1;
+        } else if (attr == M2_RADIUS_ATTR_EVENT_TIMESTAMP && value_length == 4) {
+            event_time = (time_t) (((uint32_t) value[0] << 24) | ((uint32_t) value[1] << 16) | ((uint32_t) value[2] << 8) | (uint32_t) value[3]);
+            has_event_time = 1;
+        } else if (attr == PW_VENDOR_SPECIFIC && value_length > 14 && !memcmp(value, "\0\0\0\x09\x01", 5) && value[5] == value_length - 4) {
+            // Cisco-AVPair call-id=<uuid>
+            if (!*uuid && !strncmp((const char *) value + 6, "call-id=", 8) && value_length - 14 < (int) sizeof(uuid)) {
+                memcpy(uuid, value + 14, value_length - 14);
+                uuid[value_length - 14] = '\0';
+            }
+        }
+
+        offset += attr_length;
+    }
+
+    // replays are silently discarded, retransmission of answered request gets the same reply
+    if (globals.coa_replay_window > 0) {
+        if (has_event_time && (event_time > now + globals.coa_replay_window || event_time < now - globals.coa_replay_window)) {
+            M2_RADIUS_METER_INC(coa_replays);
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Dynamic authorization request from %s discarded, Event-Timestamp is %lld s off\n",
+                uuid, ip, (long long) (now - event_time));
+            return;
+        }
+
+        for (i = 0; i < M2_RADIUS_COA_RECENT_SIZE; i++) {
+            if (m2_radius_coa_recent[i].time && now - m2_radius_coa_recent[i].time <= globals.coa_replay_window &&
+                !memcmp(m2_radius_coa_recent[i].authenticator, packet + 4, 16)) {
+                M2_RADIUS_METER_INC(coa_replays);
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Repeated dynamic authorization request from %s, sending the same reply\n", uuid, ip);
+                m2_radius_coa_reply(fd, addr, packet, m2_radius_coa_recent[i].reply_code, m2_radius_coa_recent[i].error_cause);
+                return;
+            }
+        }
+    }
+
+    if (!error_cause) {
+        error_cause = m2_radius_coa_execute(code, uuid, timeout, has_timeout);
+    }
+
+    if (error_cause) {
+        M2_RADIUS_METER_INC(coa_naks);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] %s from %s refused, error cause %d\n", uuid,
+            code == M2_RADIUS_DISCONNECT_REQUEST ? "Disconnect-Request" : "CoA-Request", ip, error_cause);
+    }
+
+    // ACK is request code + 1, NAK is request code + 2
+    m2_radius_coa_reply(fd, addr, packet, error_cause ? code + 2 : code + 1, error_cause);
+
+    memcpy(m2_radius_coa_recent[m2_radius_coa_recent_next].authenticator, packet + 4, 16);
+    m2_radius_coa_recent[m2_radius_coa_recent_next].time = now;
+    m2_radius_coa_recent[m2_radius_coa_recent_next].reply_code = error_cause ? code + 2 : code + 1;
+    m2_radius_coa_recent[m2_radius_coa_recent_next].error_cause = error_cause;
+    m2_radius_coa_recent_next = (m2_radius_coa_recent_next + 1) % M2_RADIUS_COA_RECENT_SIZE;
+
+}
+
+static void *SWITCH_THREAD_FUNC m2_radius_coa_thread(switch_thread_t *thread, void *obj) {
+
+    unsigned char packet[M2_RADIUS_PACKET_MAX];
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    struct pollfd pfd;
+    int length;
+
+    pfd.fd = globals.coa_sock;
+    pfd.events = POLLIN;
+
+    while (globals.running) {
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+
+        addr_len = sizeof(addr);
+        if ((length = recvfrom(globals.coa_sock, packet, sizeof(packet), 0, (struct sockaddr *) &addr, &addr_len)) <= 0) {
+            continue;
+        }
+
+        m2_radius_coa_handle(globals.coa_sock, &addr, packet, length);
+    }
+
+    return NULL;
+
+}
+
+static void m2_radius_coa_start(void) {
+
+    switch_threadattr_t *thd_attr = NULL;
+    struct addrinfo hints, *res = NULL;
+    char host[256] = "";
+    char port[32] = M2_RADIUS_COA_PORT;
+    char *p = NULL;
+
+    globals.coa_sock = -1;
+
+    if (zstr(globals.coa_listen)) {
+        return;
+    }
+
+    if (zstr(globals.coa_secret)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] coa-secret is not set, dynamic authorization listener is not started\n");
+        return;
+    }
+
+    switch_copy_string(host, globals.coa_listen, sizeof(host));
+    if ((p = strchr(host, ':'))) {
+        *p++ = '\0';
+        switch_copy_string(port, p, sizeof(port));
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(*host ? host : NULL, port, &hints, &res) != 0 || res == NULL) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to resolve coa-listen address %s\n", globals.coa_listen);
+        return;
+    }
+
+    if ((globals.coa_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 || bind(globals.coa_sock, res->ai_addr, res->ai_addrlen) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to bind dynamic authorization listener to %s: %s\n", globals.coa_listen, strerror(errno));
+        if (globals.coa_sock >= 0) {
+            close(globals.coa_sock);
+            globals.coa_sock = -1;
+        }
+        freeaddrinfo(res);
+        return;
+    }
+
+    freeaddrinfo(res);
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Dynamic authorization listener on %s\n", globals.coa_listen);
+
+    switch_threadattr_create(&thd_attr, globals.pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&globals.coa_thread, thd_attr, m2_radius_coa_thread, NULL, globals.pool);
+
+}
+
+static void m2_radius_coa_stop(void) {
+
+    switch_status_t status;
+
+    if (globals.coa_thread) {
+        switch_thread_join(&status, globals.coa_thread);
+        globals.coa_thread = NULL;
+    }
+
+    if (globals.coa_sock >= 0) {
+        close(globals.coa_sock);
+        globals.coa_sock = -1;
+    }
+
+}
+
+
+/*
+    Media server status
+
+    If server-id is set, Accounting-On is sent when module is loaded and Accounting-Off when it is unloaded,
+    so the core can close calls of this server which did not survive the restart. Both are sent only when
+    there are no channels, reload of the module with live calls does not touch them.
+    Every acct-heartbeat-interval seconds uuids of all live channels are sent in one or more Interim-Update
+    packets (freeswitch-heartbeat=<seq>/<part>/<parts> and freeswitch-live-calls=<uuid>,<uuid>,...),
+    calls of this server which are older than the heartbeat and not in the list are closed by the core.
+    With sharding every shard gets its own copy. Heartbeat packets are only queued to accounting sender threads,
+    a part dropped on full queue makes the core drop the whole heartbeat, so it needs acct-sender-threads
+*/
+
+
+#define M2_RADIUS_HEARTBEAT_GROUP "m2_radius_heartbeat"
+#define M2_RADIUS_HEARTBEAT_UUIDS 80
+#define M2_RADIUS_LIVE_CALLS_PREFIX "freeswitch-live-calls="
+
+static int m2_radius_node_avpair(rc_handle *rh, VALUE_PAIR **send, const char *value) {
+
+    return rc_avpair_add(rh, send, 1, (void *) value, -1, 9) != NULL;
+
+}
+
+// one packet to every shard, synchronous send is used at shutdown when sender threads are stopped
+
+static void m2_radius_node_send(uint32_t service, const char *acct_type, const char *heartbeat, char **uuids, int count, int sync) {
+
+    m2_radius_handles_t *handles = m2_radius_handles_acquire();
+    m2_radius_handle_pool_t *hp = handles ? handles->conn[M2_RADIUS_CONN_ACCT_START] : NULL;
+    int shard_count = (hp && hp->shard_count) ? hp->shard_count : 1;
+    char buffer[256] = "";
+    int s, i;
+
+    for (s = 0; hp && s < shard_count; s++) {
+        int shard = hp->shard_count ? hp->shards[s] : 0;
+        m2_radius_acct_job_t *job = NULL;
+        VALUE_PAIR *send = NULL;
+        rc_handle *rh = NULL;
+        int ok = 0;
+
+        if ((rh = m2_radius_handle_get(handles, M2_RADIUS_CONN_ACCT_START, shard, NULL)) == NULL) {
+            break;
+        }
+
+        switch_snprintf(buffer, sizeof(buffer), "freeswitch-server-id=%s", globals.server_id);
+        ok = rc_avpair_add(rh, &send, PW_ACCT_STATUS_TYPE, &service, -1, 0) != NULL &&
+            rc_avpair_add(rh, &send, PW_ACCT_SESSION_ID, globals.node_session_id, -1, 0) != NULL &&
+            m2_radius_node_avpair(rh, &send, buffer);
+
+        if (ok && heartbeat) {
+            switch_snprintf(buffer, sizeof(buffer), "freeswitch-heartbeat=%s", heartbeat);
+            ok = m2_radius_node_avpair(rh, &send, buffer);
+        }
+
+        // uuids are packed into as few attributes as possible, attribute value is limited to 247 bytes
+        for (i = 0; ok && i < count; i++) {
+            size_t length = strlen(buffer);
+
+            if (i == 0 || length + 1 + strlen(uuids[i]) > 247) {
+                if (i > 0) {
+                    ok = m2_radius_node_avpair(rh, &send, buffer);
+                }
+                switch_snprintf(buffer, sizeof(buffer), "%s%s", M2_RADIUS_LIVE_CALLS_PREFIX, uuids[i]);
+            } else {
+                switch_snprintf(buffer + length, sizeof(buffer) - length, ",%s", uuids[i]);
+            }
+        }
+        if (ok && count > 0) {
+            ok = m2_radius_node_avpair(rh, &send, buffer);
+        }
+
+        m2_radius_handle_put(handles, M2_RADIUS_CONN_ACCT_START, NULL, rh);
+
+        if (!ok || (job = malloc(sizeof(*job))) == NULL) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to build [%s] packet\n", acct_type);
+            if (send) {
+                rc_avpair_free(send);
+            }
+            break;
+        }
+
+        memset(job, 0, sizeof(*job));
+        job->acctstart = 1;
+        job->node = 1;
+        job->shard = shard;
+        job->handles = m2_radius_handles_acquire();
+        job->send = send;
+        job->enqueue_time = switch_micro_time_now();
+        switch_snprintf(job->uuid, sizeof(job->uuid), "server %s", globals.server_id);
+        switch_copy_string(job->acct_type, acct_type, sizeof(job->acct_type));
+        // all parts of the heartbeat go through the same sender queue, so they arrive in order
+        switch_copy_string(job->call_uuid, M2_RADIUS_HEARTBEAT_GROUP, sizeof(job->call_uuid));
+
+        if (sync) {
+            m2_radius_acct_job_send(job);
+            m2_radius_acct_job_free(job);
+        } else {
+            m2_radius_acct_job_dispatch(job);
+        }
+    }
+
+    m2_radius_handles_release(handles);
+
+}
+
+static void m2_radius_node_status(uint32_t service, const char *acct_type) {
+
+    if (zstr(globals.server_id)) {
+        return;
+    }
+
+    if (switch_core_session_count() > 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] There are live channels, [%s] is not sent\n", acct_type);
+        return;
+    }
+
+    m2_radius_node_send(service, acct_type, NULL, NULL, 0, service == PW_STATUS_ACCOUNTING_OFF);
+
+}
+
+SWITCH_STANDARD_SCHED_FUNC(m2_radius_heartbeat_task) {
+
+    switch_console_callback_match_t *matches = NULL;
+    switch_console_callback_match_node_t *m = NULL;
+    char **uuids = NULL;
+    char heartbeat[64] = "";
+    int count = 0;
+    int parts = 0;
+    int part = 0;
+    int i = 0;
+
+    if (!globals.running) {
+        return;
+    }
+
+    globals.heartbeat_seq++;
+
+    if ((matches = switch_core_session_findall()) && matches->count > 0) {
+        // empty list would close all calls of this server in the core, so heartbeat is skipped
+        if ((uuids = malloc(sizeof(char *) * matches->count)) == NULL) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Out of memory, heartbeat %u is skipped\n", globals.heartbeat_seq);
+            switch_console_free_matches(&matches);
+            task->runtime = switch_epoch_time_now(NULL) + globals.acct_heartbeat_interval;
+            return;
+        }
+        for (m = matches->head; m && i < matches->count; m = m->next) {
+            uuids[i++] = m->val;
+        }
+        count = i;
+    }
+
+    // empty heartbeat is sent too, it closes all calls of this server in the core
+    parts = count ? (count + M2_RADIUS_HEARTBEAT_UUIDS - 1) / M2_RADIUS_HEARTBEAT_UUIDS : 1;
+    for (part = 1; part <= parts; part++) {
+        int first = (part - 1) * M2_RADIUS_HEARTBEAT_UUIDS;
+        int part_count = count - first < M2_RADIUS_HEARTBEAT_UUIDS ? count - first : M2_RADIUS_HEARTBEAT_UUIDS;
+
+        switch_snprintf(heartbeat, sizeof(heartbeat), "%u/%d/%d", globals.heartbeat_seq, part, parts);
+        m2_radius_node_send(PW_STATUS_ALIVE, "heartbeat", heartbeat, uuids ? uuids + first : NULL, part_count > 0 ? part_count : 0, 0);
+    }
+
+    switch_safe_free(uuids);
+    if (matches) {
+        switch_console_free_matches(&matches);
+    }
+
+    task->runtime = switch_epoch_time_now(NULL) + globals.acct_heartbeat_interval;
+
+}
+
+static void m2_radius_node_start(void) {
+
+    if (zstr(globals.server_id)) {
+        return;
+    }
+
+    switch_snprintf(globals.node_session_id, sizeof(globals.node_session_id), "%s-%ld", globals.server_id, (long) switch_epoch_time_now(NULL));
+    m2_radius_node_status(PW_STATUS_ACCOUNTING_ON, "accounting-on");
+
+    // heartbeat task runs on the scheduler thread, it only builds packets and leaves sending to sender threads
+    if (globals.acct_heartbeat_interval > 0 && globals.acct_senders_count == 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius] Heartbeat needs acct-sender-threads, it is disabled\n");
+    } else if (globals.acct_heartbeat_interval > 0) {
+        switch_scheduler_add_task(switch_epoch_time_now(NULL) + globals.acct_heartbeat_interval, m2_radius_heartbeat_task, "m2_radius_heartbeat",
+            M2_RADIUS_HEARTBEAT_GROUP, 0, NULL, SSHF_NONE);
+    }
+
+}
+
+static void m2_radius_node_stop(void) {
+
+    switch_scheduler_del_task_group(M2_RADIUS_HEARTBEAT_GROUP);
+    m2_radius_node_status(PW_STATUS_ACCOUNTING_OFF, "accounting-off");
+
+}
+
+
+static void m2_radius_shard_call_end(switch_channel_t *channel);
+
+static switch_status_t m2_radius_accounting_stop(switch_core_session_t *session) {
+
+    m2_radius_shard_call_end(switch_core_session_get_channel(session));
+    m2_radius_interim_cancel(switch_core_session_get_channel(session));
+    m2_radius_hangup_cancel(switch_core_session_get_channel(session));
+
+    if (m2_radius_send_acct_packet(M2_RADIUS_ACCT_STOP, 0, session, "", 0, 0)) {
+        return 1;
+    }
+
+    return 0;
+
+}
+
+static void m2_set_codec_variables(char *uuid) {
+
+    switch_core_session_t *session = NULL;
+    switch_channel_t *channel = NULL;
+    const char *read_codec = NULL;
+    const char *direction = NULL;
+    const char *m2_bypass_media_enabled = NULL;
+    char variable_name[128] = "";
+
+    if ((session = switch_core_session_locate(uuid))) {
+        channel = switch_core_session_get_channel(session);
+        m2_bypass_media_enabled = switch_channel_get_variable(channel, "m2_bypass_media_enabled");
+
+        if (m2_bypass_media_enabled && strcmp(m2_bypass_media_enabled, "true") == 0) {
+            m2_radius_trace(m2_radius_trace_enabled(channel), "[m2_radius %s] Bypass media is enabled, codecs cannot be retrieved!\n", uuid);
+            switch_core_session_rwunlock(session);
+            return;
+        }
+
+        direction = switch_channel_get_variable(channel, "direction");
+
+        if (direction && strlen(direction)) {
+            sprintf(variable_name, "m2_%s_codec_read", direction);
+
+            read_codec = switch_channel_get_variable(channel, "read_codec");
+            if (read_codec) {
+                m2_radius_trace(m2_radius_trace_enabled(channel), "[m2_radius %s] %s codec: %s\n", uuid, strcmp(direction, "inbound") == 0 ? "Originator" : "Terminator", read_codec);
+                switch_channel_set_variable(channel, variable_name, read_codec);
+                switch_channel_set_variable_partner(channel, variable_name, read_codec);
+            } else {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Call codec not found!\n", uuid);
+            }
+        } else {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Call direction not found!\n", uuid);
+        }
+
+        switch_core_session_rwunlock(session);
+    } else {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Call session not found!\n", uuid);
+    }
+
+}
+
+static void m2_radius_accounting_start(switch_event_t *event) {
+
+    switch_core_session_t *session = NULL;
+    switch_event_header_t *hp;
+    char uuid[256] = "";
+    char direction[256] = "";
+
+    m2_radius_log(SWITCH_LOG_DEBUG, "[m2_radius] Initializing Accounting start packet\n");
+
+    switch (event->event_id) {
+    case SWITCH_EVENT_LOG:
+        return;
+    default:
+
+        for (hp = event->headers; hp; hp = hp->next) {
+            if (strcmp("Unique-ID", hp->name) == 0) {
+                m2_set_codec_variables(hp->value);
+            } else if (strcmp("Call-Direction", hp->name) == 0) {
+                strcpy(direction, hp->value);
+                if (strcmp(hp->value, "outbound") == 0) {
+                    goto outbound;
+                }
+            }
+        }
+
+        if (!strlen(direction)) {
+            m2_radius_log(SWITCH_LOG_DEBUG, "[m2_radius] Call direction not found\n");
+        }
+
+        return;
+
+        outbound:
+
+        for (hp = event->headers; hp; hp = hp->next) {
+            if (strcmp("Channel-Call-UUID", hp->name) == 0) {
+                strcpy(uuid, hp->value);
+                break;
+            }
+        }
+
+        if (!strlen(uuid)) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Call UUID not found!\n");
+        }
+
+        break;
+    }
+
+    if ((session = switch_core_session_locate(uuid))) {
+        m2_radius_send_acct_packet(M2_RADIUS_ACCT_START, 0, session, uuid, 0, 0);
+        m2_radius_interim_schedule(session, uuid);
+        switch_core_session_rwunlock(session);
+    } else {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Call session not found by uuid (%s)!\n", uuid);
+    }
+
+}
+
+static void m2_xml_radius_reload_event(switch_event_t *event) {
+
+    if (m2_radius_load_config() != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Reload failed\n");
+        return;
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Conf file reloaded\n");
+
+}
+
+
+/*
+    Access-Accept decoding
+
+    Reply is decoded in one pass into the route structure: Cisco-Command-Code values are routes,
+    Cisco-AVPair "terminator=" values are terminators, other "name=value" AVPairs become m2_name variables.
+    Attributes are recognized by number and string values are used as they are, only other attributes
+    are converted to text by the radius client library. Structure is kept on the channel as
+    private "m2_radius_reply" and variables for the dialplan are set from it at the end
+*/
+
+
+static m2_radius_reply_t *m2_radius_reply_parse(switch_core_session_t *session, m2_radius_handle_pool_t *hp, rc_handle *rh, VALUE_PAIR *recv, const char *uuid) {
+
+    m2_radius_reply_t *reply = switch_core_session_alloc(session, sizeof(m2_radius_reply_t));
+    int trace = m2_radius_trace_enabled(switch_core_session_get_channel(session));
+    VALUE_PAIR *vp = NULL;
+
+    for (vp = recv; vp && reply->var_count < M2_RADIUS_REPLY_MAX; vp = vp->next) {
+        m2_radius_reply_var_t *var = &reply->vars[reply->var_count];
+
+        if (vp->attribute == hp->command_code_attr && vp->type == PW_TYPE_STRING) {
+            m2_radius_trace(trace, "[m2_radius %s] Cisco-Command-Code=%s\n", uuid, vp->strvalue);
+            reply->routes[reply->route_count++] = var->value = switch_core_session_strdup(session, vp->strvalue);
+            var->name = switch_core_session_sprintf(session, "m2_route_%d", reply->route_count);
+            reply->var_count++;
+        } else if (vp->attribute == hp->avpair_attr && vp->type == PW_TYPE_STRING) {
+            const char *value = vp->strvalue;
+            const char *eq = strchr(value, '=');
+            const char *terminator = NULL;
+
+            m2_radius_trace(trace, "[m2_radius %s] %s\n", uuid, value);
+
+            if (eq == NULL) {
+                var->name = "Cisco-AVPair";
+                var->value = switch_core_session_strdup(session, value);
+                reply->var_count++;
+            } else if ((terminator = strstr(value, "terminator="))) {
+                reply->terminators[reply->terminator_count++] = var->value = switch_core_session_strdup(session, terminator + strlen("terminator="));
+                var->name = switch_core_session_sprintf(session, "m2_terminator_%d", reply->terminator_count);
+                reply->var_count++;
+            } else if (*(eq + 1) != '\0') {
+                char *name = switch_core_session_alloc(session, (eq - value) + 4);
+
+                memcpy(name, "m2_", 3);
+                memcpy(name + 3, value, eq - value);
+                var->name = name;
+                var->value = switch_core_session_strdup(session, eq + 1);
+                reply->var_count++;
+            }
+        } else {
+            char name[256] = "";
+            char value[256] = "";
+
+            rc_avpair_tostr(rh, vp, name, sizeof(name), value, sizeof(value));
+            m2_radius_trace(trace, "[m2_radius %s] %s=%s\n", uuid, name, value);
+            var->name = switch_core_session_strdup(session, name);
+            var->value = switch_core_session_strdup(session, value);
+            reply->var_count++;
+        }
+    }
+
+    return reply;
+
+}
+
+static void m2_radius_reply_apply(switch_channel_t *channel, m2_radius_reply_t *reply) {
+
+    int i;
+
+    switch_channel_set_private(channel, "m2_radius_reply", reply);
+
+    // m2_bridge reads the reply directly, variables are needed only by dialplan scripts
+    if (!globals.reply_variables) {
+        return;
+    }
+
+    // values come from our own rating server, no need to check them for variable expansion
+    for (i = 0; i < reply->var_count; i++) {
+        switch_channel_set_variable_var_check(channel, reply->vars[i].name, reply->vars[i].value, SWITCH_FALSE);
+    }
+
+}
+
+// m2_hangupcause from Access-Reject
+
+static void m2_radius_reject_parse(switch_channel_t *channel, m2_radius_handle_pool_t *hp, rc_handle *rh, VALUE_PAIR *recv, const char *uuid) {
+
+    int trace = m2_radius_trace_enabled(channel);
+    VALUE_PAIR *vp = NULL;
+    const char *cause = NULL;
+
+    for (vp = recv; vp; vp = vp->next) {
+        if (vp->attribute == hp->avpair_attr && vp->type == PW_TYPE_STRING) {
+            m2_radius_trace(trace, "[m2_radius %s] Got AVP Cisco-AVPair = %s\n", uuid, vp->strvalue);
+            if ((cause = strstr(vp->strvalue, "m2_hangupcause="))) {
+                switch_channel_set_variable(channel, "m2_hangupcause", cause + strlen("m2_hangupcause="));
+            }
+        } else {
+            char name[256] = "";
+            char value[256] = "";
+
+            rc_avpair_tostr(rh, vp, name, sizeof(name), value, sizeof(value));
+            m2_radius_trace(trace, "[m2_radius %s] Got AVP %s = %s\n", uuid, name, value);
+        }
+    }
+
+}
+
+/*
+    Source filter
+
+    Calls from sources that were rejected with one of auth-negative-cache-causes (311 - unknown originator
+    by default) are rejected locally with the same cause for auth-negative-cache-ttl seconds, so scanner floods
+    do not reach rating server. Before that each source has token bucket of auth-source-rate requests per second.
+    Table has fixed size, colliding sources replace each other (it is a cache, not a list of all sources)
+*/
+
+
+static m2_radius_source_t *m2_radius_source_get(const char *ip) {
+
+    m2_radius_source_t *source = &globals.sources[m2_radius_hash_string(ip) % M2_RADIUS_SOURCE_TABLE_SIZE];
+
+    if (strcmp(source->ip, ip)) {
+        memset(source, 0, sizeof(*source));
+        switch_copy_string(source->ip, ip, sizeof(source->ip));
+    }
+
+    return source;
+
+}
+
+// source address as seen by SIP stack
+
+static const char *m2_radius_source_ip(switch_channel_t *channel) {
+
+    const char *ip = NULL;
+
+    if (zstr((ip = switch_channel_get_variable(channel, "sip_received_ip")))) {
+        ip = switch_channel_get_variable(channel, "network_addr");
+    }
+
+    return ip;
+
+}
+
+// returns 1 if call should be rejected locally, cause is set to cached reject cause (empty if rate limited)
+
+static int m2_radius_source_check(const char *ip, char *cause, switch_size_t cause_len) {
+
+    m2_radius_source_t *source = NULL;
+    switch_time_t now = switch_micro_time_now();
+    int reject = 0;
+
+    if (zstr(ip) || (globals.negative_cache_ttl == 0 && globals.source_rate == 0)) {
+        return 0;
+    }
+
+    switch_mutex_lock(globals.source_mutex);
+    source = m2_radius_source_get(ip);
+
+    if (globals.source_rate > 0) {
+        if (source->tokens_time == 0) {
+            source->tokens = globals.source_rate;
+        } else {
+            source->tokens += (double) (now - source->tokens_time) * globals.source_rate / 1000000;
+            if (source->tokens > globals.source_rate) source->tokens = globals.source_rate;
+        }
+        source->tokens_time = now;
+
+        if (source->tokens >= 1) {
+            source->tokens -= 1;
+        } else {
+            *cause = '\0';
+            reject = 1;
+        }
+    }
+
+    if (!reject && source->reject_until > now) {
+        switch_copy_string(cause, source->cause, cause_len);
+        reject = 2;
+    }
+    switch_mutex_unlock(globals.source_mutex);
+
+    if (reject) {
+        if (reject == 1) {
+            M2_RADIUS_METER_INC(source_rate_rejects);
+        } else {
+            M2_RADIUS_METER_INC(negative_cache_rejects);
+        }
+    }
+
+    return reject;
+
+}
+
+// remember reject cause of the source if it is one of cached causes
+
+static void m2_radius_source_rejected(const char *ip, const char *cause) {
+
+    char causes[258] = "";
+    char match[32] = "";
+    m2_radius_source_t *source = NULL;
+
+    if (zstr(ip) || zstr(cause) || globals.negative_cache_ttl == 0 || strlen(cause) >= 16) {
+        return;
+    }
+
+    switch_snprintf(match, sizeof(match), ",%s,", cause);
+
+    switch_mutex_lock(globals.source_mutex);
+    switch_snprintf(causes, sizeof(causes), ",%s,", globals.negative_cache_causes);
+    if (!strstr(causes, match)) {
+        switch_mutex_unlock(globals.source_mutex);
+        return;
+    }
+    source = m2_radius_source_get(ip);
+    switch_copy_string(source->cause, cause, sizeof(source->cause));
+    source->reject_until = switch_micro_time_now() + (switch_time_t) globals.negative_cache_ttl * 1000000;
+    switch_mutex_unlock(globals.source_mutex);
+
+    M2_RADIUS_METER_INC(negative_cache_added);
+
+}
+
+// devices were reloaded, rejected sources may be known now
+
+static void m2_radius_source_flush(void) {
+
+    int i;
+
+    switch_mutex_lock(globals.source_mutex);
+    for (i = 0; i < M2_RADIUS_SOURCE_TABLE_SIZE; i++) {
+        globals.sources[i].reject_until = 0;
+    }
+    switch_mutex_unlock(globals.source_mutex);
+
+}
+
+
+/*
+    Device registry
+
+    m2_device_sync applies a delta of devices in process, items are separated by ';' or new line:
+    "add <device id> <ip>", "update <device id> <ip>", "remove <device id>", leading "full" item replaces whole registry.
+    Devices authenticated by registration have ip "dynamic" and are not part of the ACL. Item ending with "gateway"
+    marks the device as sofia gateway m2_device_<id>. When device-acl is on and the registry was loaded with "full",
+    calls from addresses of no device (and without SIP digest authorization) are rejected locally with cause 311.
+
+    Changes are applied to FreeSWITCH by device thread, API caller does not wait. ACL change rewrites device-acl-file
+    (network list "m2_devices", included in acl.conf.xml) and runs "reloadacl reloadxml". Gateway change rewrites
+    device-gateway-file (included in gateways of device-gateway-profile), kills removed and changed gateways and
+    rescans the profile. m2_reload runs the external script which rebuilds everything, on the same thread
+*/
+
+
+static void m2_radius_device_ip_add(const char *ip) {
+
+    int *count = NULL;
+
+    if (!strcmp(ip, "dynamic")) {
+        return;
+    }
+
+    if ((count = switch_core_hash_find(globals.device_ips, ip))) {
+        (*count)++;
+    } else if ((count = malloc(sizeof(int)))) {
+        *count = 1;
+        switch_core_hash_insert(globals.device_ips, ip, count);
+    }
+
+}
+
+static void m2_radius_device_ip_remove(const char *ip) {
+
+    int *count = NULL;
+
+    if ((count = switch_core_hash_find(globals.device_ips, ip)) && --(*count) == 0) {
+        switch_core_hash_delete(globals.device_ips, ip);
+        free(count);
+    }
+
+}
+
+// device mutex is held
+
+static void m2_radius_devices_clear(void) {
+
+    switch_hash_index_t *hi = NULL;
+    void *val = NULL;
+
+    for (hi = switch_core_hash_first(globals.devices); hi; hi = switch_core_hash_next(&hi)) {
+        switch_core_hash_this(hi, NULL, NULL, &val);
+        free(val);
+    }
+    for (hi = switch_core_hash_first(globals.device_ips); hi; hi = switch_core_hash_next(&hi)) {
+        switch_core_hash_this(hi, NULL, NULL, &val);
+        free(val);
+    }
+
+    switch_core_hash_destroy(&globals.devices);
+    switch_core_hash_destroy(&globals.device_ips);
+    switch_core_hash_init(&globals.devices);
+    switch_core_hash_init(&globals.device_ips);
+    globals.device_count = 0;
+
+}
+
+// write generated configuration to a temporary file and rename it, readers never see half of the file
+
+static int m2_radius_devices_write(const char *path, const char *data) {
+
+    char tmp_path[520] = "";
+    FILE *file = NULL;
+    int ok = 0;
+
+    switch_snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    if ((file = fopen(tmp_path, "w")) == NULL) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to open %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    ok = fputs(data ? data : "", file) >= 0;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp_path, path) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Failed to write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static void m2_radius_devices_api(const char *cmd, const char *arg) {
+
+    switch_stream_handle_t stream = { 0 };
+
+    SWITCH_STANDARD_STREAM(stream);
+    if (switch_api_execute(cmd, arg, NULL, &stream) != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Device sync command failed: %s %s\n", cmd, arg);
+    }
+    switch_safe_free(stream.data);
+
+}
+
+// device mutex is held, generated configuration is returned in acl and gateways streams
+
+static void m2_radius_devices_generate(switch_stream_handle_t *acl, switch_stream_handle_t *gateways) {
+
+    switch_hash_index_t *hi = NULL;
+    const void *key = NULL;
+    void *val = NULL;
+
+    if (acl) {
+        acl->write_function(acl, "<include>\n  <list name=\"m2_devices\" default=\"deny\">\n");
+        for (hi = switch_core_hash_first(globals.device_ips); hi; hi = switch_core_hash_next(&hi)) {
+            switch_core_hash_this(hi, &key, NULL, &val);
+            acl->write_function(acl, "    <node type=\"allow\" cidr=\"%s/%d\"/>\n", (const char *) key, strchr((const char *) key, ':') ? 128 : 32);
+        }
+        acl->write_function(acl, "  </list>\n</include>\n");
+    }
+
+    if (gateways) {
+        gateways->write_function(gateways, "<include>\n");
+        for (hi = switch_core_hash_first(globals.devices); hi; hi = switch_core_hash_next(&hi)) {
+            m2_radius_device_t *device = NULL;
+
+            switch_core_hash_this(hi, NULL, NULL, &val);
+            device = (m2_radius_device_t *) val;
+            if (device->gateway && strcmp(device->ip, "dynamic")) {
+                gateways->write_function(gateways, "  <gateway name=\"m2_device_%s\">\n    <param name=\"proxy\" value=\"%s\"/>\n"
+                    "    <param name=\"register\" value=\"false\"/>\n  </gateway>\n", device->id, device->ip);
+            }
+        }
+        gateways->write_function(gateways, "</include>\n");
+    }
+
+}
+
+// device mutex is held, it is released while FreeSWITCH is reconfigured
+
+static void m2_radius_devices_apply(void) {
+
+    switch_stream_handle_t acl = { 0 };
+    switch_stream_handle_t gateways = { 0 };
+    char acl_file[512] = "";
+    char gateway_file[512] = "";
+    char profile[64] = "";
+    char *kill = globals.devices_gateways_kill.data;
+    char *name = NULL;
+    char *saveptr = NULL;
+    char arg[256] = "";
+    int acl_changed = globals.devices_acl_pending && !zstr(globals.device_acl_file);
+    int gateways_changed = globals.devices_gateways_pending && !zstr(globals.device_gateway_file);
+
+    globals.devices_acl_pending = 0;
+    globals.devices_gateways_pending = 0;
+    memset(&globals.devices_gateways_kill, 0, sizeof(globals.devices_gateways_kill));
+
+    switch_copy_string(acl_file, globals.device_acl_file, sizeof(acl_file));
+    switch_copy_string(gateway_file, globals.device_gateway_file, sizeof(gateway_file));
+    switch_copy_string(profile, globals.device_gateway_profile, sizeof(profile));
+
+    if (acl_changed) {
+        SWITCH_STANDARD_STREAM(acl);
+    }
+    if (gateways_changed) {
+        SWITCH_STANDARD_STREAM(gateways);
+    }
+    m2_radius_devices_generate(acl_changed ? &acl : NULL, gateways_changed ? &gateways : NULL);
+
+    switch_mutex_unlock(globals.device_mutex);
+
+    if (acl_changed && m2_radius_devices_write(acl_file, (char *) acl.data) < 0) {
+        acl_changed = 0;
+    }
+    if (gateways_changed && m2_radius_devices_write(gateway_file, (char *) gateways.data) < 0) {
+        gateways_changed = 0;
+    }
+
+    // new files are read by reloadxml, reloadacl does it before reloading the lists
+    if (acl_changed) {
+        m2_radius_devices_api("reloadacl", "reloadxml");
+    } else if (gateways_changed) {
+        m2_radius_devices_api("reloadxml", "");
+    }
+
+    if (gateways_changed) {
+        for (name = kill ? strtok_r(kill, "\n", &saveptr) : NULL; name; name = strtok_r(NULL, "\n", &saveptr)) {
+            switch_snprintf(arg, sizeof(arg), "profile %s killgw %s", profile, name);
+            m2_radius_devices_api("sofia", arg);
+        }
+        switch_snprintf(arg, sizeof(arg), "profile %s rescan", profile);
+        m2_radius_devices_api("sofia", arg);
+    }
+
+    if (acl_changed || gateways_changed) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Device changes applied:%s%s\n", acl_changed ? " ACL" : "", gateways_changed ? " gateways" : "");
+    }
+
+    switch_safe_free(acl.data);
+    switch_safe_free(gateways.data);
+    switch_safe_free(kill);
+
+    switch_mutex_lock(globals.device_mutex);
+
+}
+
+// full reload with external script and device changes, API caller does not wait for them
+
+static void *SWITCH_THREAD_FUNC m2_radius_devices_thread(switch_thread_t *thread, void *obj) {
+
+    switch_time_t start_time = 0;
+
+    switch_mutex_lock(globals.device_mutex);
+
+    while (globals.running) {
+
+        if (globals.devices_reload_pending) {
+            globals.devices_reload_pending = 0;
+            globals.devices_reload_running = 1;
+            switch_mutex_unlock(globals.device_mutex);
+
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Reloading devices\n");
+            start_time = switch_micro_time_now();
+            system("/usr/local/m2/m2_freeswitch_devices");
+            m2_radius_source_flush();
+
+            switch_mutex_lock(globals.device_mutex);
+            globals.devices_reload_running = 0;
+            globals.devices_reload_time = switch_micro_time_now() - start_time;
+            globals.devices_reload_count++;
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Devices reloaded in %lld ms\n", (long long) (globals.devices_reload_time / 1000));
+            continue;
+        }
+
+        if (globals.devices_acl_pending || globals.devices_gateways_pending) {
+            m2_radius_devices_apply();
+            continue;
+        }
+
+        switch_thread_cond_timedwait(globals.devices_cond, globals.device_mutex, 500000);
+
+    }
+
+    switch_mutex_unlock(globals.device_mutex);
+
+    return NULL;
+
+}
+
+// reload requested while the script is running is done once more after it finishes
+
+static void m2_radius_devices_reload(void) {
+
+    switch_mutex_lock(globals.device_mutex);
+    globals.devices_reload_pending = 1;
+    if (globals.devices_cond) {
+        switch_thread_cond_signal(globals.devices_cond);
+    }
+    switch_mutex_unlock(globals.device_mutex);
+
+}
+
+static void m2_radius_devices_start(void) {
+
+    switch_threadattr_t *thd_attr = NULL;
+
+    switch_thread_cond_create(&globals.devices_cond, globals.pool);
+    switch_threadattr_create(&thd_attr, globals.pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&globals.devices_thread, thd_attr, m2_radius_devices_thread, NULL, globals.pool);
+
+}
+
+static void m2_radius_devices_stop(void) {
+
+    switch_status_t status;
+
+    if (globals.devices_thread == NULL) {
+        return;
+    }
+
+    switch_mutex_lock(globals.device_mutex);
+    switch_thread_cond_signal(globals.devices_cond);
+    switch_mutex_unlock(globals.device_mutex);
+
+    switch_thread_join(&status, globals.devices_thread);
+    globals.devices_thread = NULL;
+
+    switch_safe_free(globals.devices_gateways_kill.data);
+
+}
+
+// device mutex is held, gateway of the device has to be removed from sofia profile
+
+static void m2_radius_device_gateway_kill(m2_radius_device_t *device) {
+
+    if (!device->gateway || !strcmp(device->ip, "dynamic")) {
+        return;
+    }
+
+    if (globals.devices_gateways_kill.data == NULL) {
+        SWITCH_STANDARD_STREAM(globals.devices_gateways_kill);
+    }
+    globals.devices_gateways_kill.write_function(&globals.devices_gateways_kill, "m2_device_%s\n", device->id);
+
+}
+
+static void m2_radius_devices_sync(char *delta, switch_stream_handle_t *stream) {
+
+    int added = 0, updated = 0, removed = 0, unchanged = 0, invalid = 0;
+    int full = 0, gateways = 0;
+    switch_time_t start_time = switch_micro_time_now();
+    switch_time_t run_time = 0;
+    char *item = NULL;
+    char *saveptr = NULL;
+
+    switch_mutex_lock(globals.device_mutex);
+
+    for (item = strtok_r(delta, ";\n", &saveptr); item; item = strtok_r(NULL, ";\n", &saveptr)) {
+        char *argv[4] = { 0 };
+        int argc = switch_separate_string(item, ' ', argv, 4);
+        m2_radius_device_t *device = NULL;
+        int gateway = argc >= 4 && !strcasecmp(argv[3], "gateway");
+
+        if (argc == 1 && !strcasecmp(argv[0], "full")) {
+            switch_hash_index_t *hi = NULL;
+            void *val = NULL;
+
+            for (hi = switch_core_hash_first(globals.devices); hi; hi = switch_core_hash_next(&hi)) {
+                switch_core_hash_this(hi, NULL, NULL, &val);
+                if (((m2_radius_device_t *) val)->gateway) {
+                    m2_radius_device_gateway_kill((m2_radius_device_t *) val);
+                    gateways++;
+                }
+            }
+            m2_radius_devices_clear();
+            globals.devices_loaded = 1;
+            full = 1;
+            continue;
+        }
+
+        if (argc < 2 || strlen(argv[1]) >= sizeof(device->id)) {
+            invalid++;
+            continue;
+        }
+
+        device = switch_core_hash_find(globals.devices, argv[1]);
+
+        if (!strcasecmp(argv[0], "remove")) {
+            if (device) {
+                if (device->gateway) {
+                    m2_radius_device_gateway_kill(device);
+                    gateways++;
+                }
+                m2_radius_device_ip_remove(device->ip);
+                switch_core_hash_delete(globals.devices, argv[1]);
+                free(device);
+                globals.device_count--;
+                removed++;
+            } else {
+                unchanged++;
+            }
+        } else if ((!strcasecmp(argv[0], "add") || !strcasecmp(argv[0], "update")) && argc >= 3 && strlen(argv[2]) < sizeof(device->ip)) {
+            if (device && !strcmp(device->ip, argv[2]) && device->gateway == gateway) {
+                unchanged++;
+            } else if (device) {
+                // gateway with old address has to be killed before rescan adds the new one
+                if (device->gateway) {
+                    m2_radius_device_gateway_kill(device);
+                }
+                if (device->gateway || gateway) {
+                    gateways++;
+                }
+                m2_radius_device_ip_remove(device->ip);
+                switch_copy_string(device->ip, argv[2], sizeof(device->ip));
+                device->gateway = gateway;
+                m2_radius_device_ip_add(device->ip);
+                updated++;
+            } else if ((device = calloc(1, sizeof(*device)))) {
+                switch_copy_string(device->id, argv[1], sizeof(device->id));
+                switch_copy_string(device->ip, argv[2], sizeof(device->ip));
+                device->gateway = gateway;
+                gateways += gateway;
+                switch_core_hash_insert(globals.devices, device->id, device);
+                m2_radius_device_ip_add(device->ip);
+                globals.device_count++;
+                added++;
+            }
+        } else {
+            invalid++;
+        }
+    }
+
+    run_time = switch_micro_time_now() - start_time;
+    globals.device_sync_count++;
+    globals.device_sync_changes += added + updated + removed;
+    globals.device_sync_time = run_time;
+
+    if (full || added || updated || removed) {
+        globals.devices_acl_pending = 1;
+    }
+    if (gateways) {
+        globals.devices_gateways_pending = 1;
+    }
+    if ((full || added || updated || removed || gateways) && globals.devices_cond) {
+        switch_thread_cond_signal(globals.devices_cond);
+    }
+
+    switch_mutex_unlock(globals.device_mutex);
+
+    // rejected sources may belong to added devices now
+    if (added || updated) {
+        m2_radius_source_flush();
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Device sync: added: %d, updated: %d, removed: %d, unchanged: %d, invalid: %d, in %lld us\n",
+        added, updated, removed, unchanged, invalid, (long long) run_time);
+
+    stream->write_function(stream, "+OK added: %d, updated: %d, removed: %d, unchanged: %d, invalid: %d, devices: %d, time: %lld us%s\n", added, updated, removed,
+        unchanged, invalid, globals.device_count, (long long) run_time, gateways ? ", gateways changed" : "");
+
+}
+
+// returns 1 if call comes from address which belongs to no device
+
+static int m2_radius_device_acl_reject(switch_channel_t *channel, const char *ip) {
+
+    int reject = 0;
+
+    if (!globals.device_acl || zstr(ip) || switch_true(switch_channel_get_variable(channel, "sip_authorized"))) {
+        return 0;
+    }
+
+    switch_mutex_lock(globals.device_mutex);
+    reject = globals.devices_loaded && switch_core_hash_find(globals.device_ips, ip) == NULL;
+    switch_mutex_unlock(globals.device_mutex);
+
+    if (reject) {
+        M2_RADIUS_METER_INC(device_acl_rejects);
+    }
+
+    return reject;
+
+}
+
+
+/*
+    Sharding
+
+    Servers of a connection can be split into shards (shard="N" attribute of the server param), every shard is
+    a separate rating core and servers of one shard are alternatives of each other. Call is sent to the shard chosen
+    by rendezvous hash of shard-key (source-ip or name of a channel variable). Chosen shard is kept in m2_radius_shard
+    channel variable, accounting packets of the call (and the spool) follow it.
+    With shard-rebalance on, key which still has calls in progress stays on the shard of these calls, so a new shard
+    can be added without splitting calls of one originator between two cores. Keys move when their calls end
+*/
+
+
+static m2_radius_shard_key_t *m2_radius_shard_key_get(uint32_t key) {
+
+    return &globals.shard_keys[key % M2_RADIUS_SHARD_KEY_TABLE_SIZE];
+
+}
+
+// returns shard for the call (0 if connection is not sharded)
+
+static int m2_radius_shard_select(switch_channel_t *channel, m2_radius_handle_pool_t *hp, const char *uuid) {
+
+    m2_radius_shard_key_t *entry = NULL;
+    const char *key = NULL;
+    char shard_key[128] = "";
+    uint32_t key_hash = 0;
+    int shard = 0;
+    int sticky = 0;
+
+    if (hp == NULL || hp->shard_count == 0) {
+        return 0;
+    }
+
+    switch_mutex_lock(globals.shard_mutex);
+    switch_copy_string(shard_key, globals.shard_key, sizeof(shard_key));
+    switch_mutex_unlock(globals.shard_mutex);
+
+    if (!strcasecmp(shard_key, "source-ip")) {
+        key = m2_radius_source_ip(channel);
+    } else {
+        key = switch_channel_get_variable(channel, shard_key);
+    }
+
+    // calls without key are spread over all shards
+    if (zstr(key)) {
+        key = uuid;
+    }
+
+    key_hash = m2_radius_hash_string(key);
+    shard = m2_radius_shard_pick(hp, key_hash);
+
+    if (globals.shard_rebalance) {
+        switch_mutex_lock(globals.shard_mutex);
+        entry = m2_radius_shard_key_get(key_hash);
+        if (entry->key == key_hash && entry->calls > 0 && entry->shard != shard && m2_radius_shard_exists(hp, entry->shard) &&
+            entry->updated + (switch_time_t) globals.shard_sticky_ttl * 1000000 > switch_micro_time_now()) {
+            shard = entry->shard;
+            sticky = 1;
+        }
+        switch_mutex_unlock(globals.shard_mutex);
+    }
+
+    if (sticky) {
+        M2_RADIUS_METER_INC(shard_sticky);
+    }
+
+    switch_channel_set_variable_printf(channel, "m2_radius_shard", "%d", shard);
+    switch_channel_set_variable_printf(channel, "m2_radius_shard_key", "%u", key_hash);
+
+    m2_radius_trace(m2_radius_trace_enabled(channel), "[m2_radius %s] Shard %d selected for key %s%s\n", uuid, shard, key, sticky ? " (key has calls on this shard)" : "");
+
+    return shard;
+
+}
+
+// authorized call is counted for its key until the channel is reported
+
+static void m2_radius_shard_call_start(switch_channel_t *channel, int shard) {
+
+    m2_radius_shard_key_t *entry = NULL;
+    const char *val = switch_channel_get_variable(channel, "m2_radius_shard_key");
+    switch_time_t now = switch_micro_time_now();
+    uint32_t key_hash = 0;
+
+    if (shard == 0 || zstr(val)) {
+        return;
+    }
+
+    key_hash = (uint32_t) strtoul(val, NULL, 10);
+
+    switch_mutex_lock(globals.shard_mutex);
+    entry = m2_radius_shard_key_get(key_hash);
+    if (entry->key != key_hash || entry->shard != shard) {
+        // slot is used by calls in progress of other key (or of this key on other shard), this call is not tracked
+        if (entry->calls > 0 && entry->updated + (switch_time_t) globals.shard_sticky_ttl * 1000000 > now) {
+            switch_mutex_unlock(globals.shard_mutex);
+            return;
+        }
+        entry->key = key_hash;
+        entry->shard = shard;
+        entry->calls = 0;
+    }
+    entry->calls++;
+    entry->updated = now;
+    switch_mutex_unlock(globals.shard_mutex);
+
+    switch_channel_set_variable(channel, "m2_radius_shard_counted", "1");
+
+}
+
+static void m2_radius_shard_call_end(switch_channel_t *channel) {
+
+    m2_radius_shard_key_t *entry = NULL;
+    const char *val = NULL;
+    uint32_t key_hash = 0;
+
+    if (channel == NULL || !switch_true(switch_channel_get_variable(channel, "m2_radius_shard_counted")) ||
+        zstr((val = switch_channel_get_variable(channel, "m2_radius_shard_key")))) {
+        return;
+    }
+
+    key_hash = (uint32_t) strtoul(val, NULL, 10);
+
+    switch_mutex_lock(globals.shard_mutex);
+    entry = m2_radius_shard_key_get(key_hash);
+    if (entry->key == key_hash && entry->calls > 0) {
+        entry->calls--;
+    }
+    switch_mutex_unlock(globals.shard_mutex);
+
+    switch_channel_set_variable(channel, "m2_radius_shard_counted", NULL);
+
+}
+
+
+SWITCH_STANDARD_APP(m2_radius_auth_handle) {
+
+    switch_channel_t *channel = NULL;
+    int result = 0;
+    VALUE_PAIR *send = NULL, *recv = NULL;
+    m2_radius_reply_t *reply = NULL;
+    char msg[512 * 10 + 1] = {0};
+    uint32_t service = PW_AUTHENTICATE_ONLY;
+    rc_handle *rh = NULL;
+    m2_radius_handles_t *handles = NULL;
+    m2_radius_server_t *server = NULL;
+    switch_time_t auth_start_time = 0;
+    switch_time_t parse_start_time = 0;
+    switch_time_t parse_time = 0;
+    switch_time_t rtt = 0;
+    char uuid[256] = "";
+    char cause[16] = "";
+    int annexb = 0;
+    int trace = 0;
+    const char *val = NULL;
+    const char *source_ip = NULL;
+    int shard = 0;
+    int hedge_won = 0;
+
+    channel = switch_core_session_get_channel(session);
+    trace = m2_radius_trace_enabled(channel);
+    val = switch_channel_get_variable(channel, "uuid");
+    if (val) {
+        strcpy(uuid, val);
+    }
+
+    if (strstr(switch_channel_get_variable(channel, "switch_r_sdp"), "annexb=yes")) {
+        annexb = 1;
+    }
+
+    m2_radius_trace(trace, "[m2_radius %s] Starting authentication\n", uuid);
+
+    if (channel == NULL) {
+        goto auth_err;
+    }
+
+    source_ip = m2_radius_source_ip(channel);
+
+    if (m2_radius_source_check(source_ip, cause, sizeof(cause))) {
+        if (*cause) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Source %s was rejected recently with cause %s, rejecting locally\n", uuid, source_ip, cause);
+            switch_channel_set_variable(channel, "m2_hangupcause", cause);
+        } else {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Source %s exceeded %d requests per second, rejecting locally\n", uuid, source_ip, globals.source_rate);
+        }
+        result = REJECT_RC;
+        goto auth_err;
+    }
+
+    if (m2_radius_device_acl_reject(channel, source_ip)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Source %s does not belong to any device, rejecting locally\n", uuid, source_ip);
+        switch_channel_set_variable(channel, "m2_hangupcause", "311");
+        result = REJECT_RC;
+        goto auth_err;
+    }
+
+    handles = m2_radius_handles_acquire();
+    shard = m2_radius_shard_select(channel, handles ? handles->conn[M2_RADIUS_CONN_AUTH] : NULL, uuid);
+    rh = m2_radius_handle_get(handles, M2_RADIUS_CONN_AUTH, shard, &server);
+
+    if (rh == NULL) {
+        goto auth_err;
+    }
+
+    if (m2_xml_radius_add_params(session, NULL, rh, &send, m2_radius_plan_get(handles, M2_RADIUS_CONN_AUTH), M2_RADIUS_CONN_AUTH, uuid) != SWITCH_STATUS_SUCCESS ) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add params to rc_handle\n", uuid);
+        goto auth_err;
+    }
+
+    if (rc_avpair_add(rh, &send, PW_SERVICE_TYPE, &service, -1, 0) == NULL) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add option to handle\n", uuid);
+        goto auth_err;
+    }
+
+    // if SDP contains Annex B, pass it to radius
+    if (annexb) {
+        if (rc_avpair_add(rh, &send, 1, "freeswitch-annexb=1", -1, 9) == NULL) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add freeswitch-annexb!\n", uuid);
+            goto auth_err;
+        } else {
+            m2_radius_trace(trace, "[m2_radius %s] freeswitch-annexb=1\n", uuid);
+        }
     }
 
-    acct_err:
+    // request can be answered by two rating servers, let them know not to hang up the call when accounting goes to the other one
+    if (m2_radius_hedge_possible(handles->conn[M2_RADIUS_CONN_AUTH], server) && !(globals.ipc_connected && !handles->conn[M2_RADIUS_CONN_AUTH]->shard_count)) {
+        if (rc_avpair_add(rh, &send, 1, "freeswitch-hedged=1", -1, 9) == NULL) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add freeswitch-hedged!\n", uuid);
+            goto auth_err;
+        }
+    }
+
+    auth_start_time = switch_micro_time_now();
+    result = m2_radius_send_request(handles, M2_RADIUS_CONN_AUTH, server, rh, send, &recv, msg, &hedge_won);
+    rtt = switch_micro_time_now() - auth_start_time;
+    if (!hedge_won) {
+        m2_radius_server_done(handles, M2_RADIUS_CONN_AUTH, server, result, rtt);
+    }
+    m2_radius_latency_record(M2_RADIUS_PATH_AUTH, rtt, result != OK_RC && result != REJECT_RC);
+    m2_radius_capture(handles->conn[M2_RADIUS_CONN_AUTH], M2_RADIUS_CONN_AUTH, send, recv, result, auth_start_time, rtt,
+        (val = switch_channel_get_variable(channel, "call_uuid")) ? val : uuid);
+
+    // only answered requests can be compared with shadow core
+    if ((result == OK_RC || result == REJECT_RC) && m2_radius_shadow_sampled((val = switch_channel_get_variable(channel, "call_uuid")) ? val : uuid)) {
+        m2_radius_shadow_digest_t primary;
+
+        m2_radius_shadow_digest(handles->conn[M2_RADIUS_CONN_AUTH], recv, result, &primary);
+        m2_radius_shadow_enqueue(M2_RADIUS_CONN_AUTH_SECONDARY, send, uuid, "auth", 1, &primary);
+    }
+
+    if (result != OK_RC) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Result (RC = %d) %s\n", uuid, result, msg);
+        goto auth_err;
+    }
+
+    // set channel variable with auth result
+    switch_channel_set_variable(channel, "m2_auth_result", "1");
+    m2_radius_shard_call_start(channel, shard);
+
+    m2_radius_trace(trace, "[m2_radius %s] ------------------- Received attribute-value pairs --------------------\n", uuid);
+
+    parse_start_time = switch_micro_time_now();
+    reply = m2_radius_reply_parse(session, handles->conn[M2_RADIUS_CONN_AUTH], rh, recv, uuid);
+    m2_radius_reply_apply(channel, reply);
+    parse_time = switch_micro_time_now() - parse_start_time;
+
+    m2_radius_log(SWITCH_LOG_NOTICE, "[m2_radius %s] Authentication accepted by %s: routes %d, terminators %d, variables %d, rtt %lld us, parsed in %lld us\n", uuid,
+        server ? server->label : "-", reply->route_count, reply->terminator_count, reply->var_count, (long long) rtt, (long long) parse_time);
 
+    // saving metering stats
+    m2_radius_op_meter_record(M2_RADIUS_METER_REPLY_PARSE, parse_time);
+
+    if (recv) {
+        rc_avpair_free(recv);
+        recv = NULL;
+    }
     if (send) {
         rc_avpair_free(send);
         send = NULL;
     }
+    if (rh) {
+        m2_radius_handle_put(handles, M2_RADIUS_CONN_AUTH, server, rh);
+        rh = NULL;
+    }
+    m2_radius_handles_release(handles);
+    handles = NULL;
 
-    if (rh) rc_destroy(rh);
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Accounting [%s] error\n", uuid, acct_type);
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Hanging up call with uniqueid: %s\n", uuid, uuid);
+    return;
 
-    sprintf(system_cmd, "fs_cli -x 'uuid_kill %s'", uuid);
-    system(system_cmd);
+    auth_err:
 
-    return 1;
+    if (result == 2) {
+        // maybe we got m2_hangupcause code? if so, set it to channel variable
+        if (handles && handles->conn[M2_RADIUS_CONN_AUTH]) {
+            m2_radius_reject_parse(channel, handles->conn[M2_RADIUS_CONN_AUTH], rh, recv, uuid);
+            m2_radius_source_rejected(source_ip, switch_channel_get_variable(channel, "m2_hangupcause"));
+        }
+
+        val = channel ? switch_channel_get_variable(channel, "m2_hangupcause") : NULL;
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Authentication rejected by %s: cause %s, rtt %lld us\n", uuid,
+            server ? server->label : "-", val ? val : "-", (long long) rtt);
+
+    } else if (result == -2) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Bad response. Check if radius server is using the same shared secret as FreeSwitch\n", uuid);
+    } else if (result == 1) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to send authentication request to radius server (reason: timeout)\n", uuid);
+    } else {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to send authentication request to radius server (reason: general error)\n", uuid);
+    }
+
+    if (recv) {
+        rc_avpair_free(recv);
+        recv = NULL;
+    }
+    if (send) {
+        rc_avpair_free(send);
+        send = NULL;
+    }
+    if (rh) {
+        m2_radius_handle_put(handles, M2_RADIUS_CONN_AUTH, server, rh);
+        rh = NULL;
+    }
+    m2_radius_handles_release(handles);
+    handles = NULL;
+
+    // If authentication request failed (not due to rejection)
+    // then send acct stop request to radius just in case there is a corresponding call waiting for further messages from
+    if (result != 2) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Preparing to send delayed accounting stop request to radius!\n", uuid);
+        m2_radius_send_acct_packet(M2_RADIUS_ACCT_STOP, 1, session, "", 500, globals.auth_fail_acct_stop_delay);
+    }
 
 }
 
-static switch_status_t m2_radius_accounting_stop(switch_core_session_t *session) {
+SWITCH_STANDARD_APP(m2_radius_report_failed_handle) {
 
-    if (m2_radius_send_acct_packet(0, 0, session, "", 0)) {
-        return 1;
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Call failed, sending Accounting [stop] packet!\n");
+    m2_radius_send_acct_packet(M2_RADIUS_ACCT_STOP, 1, session, "", 0, 0);
+
+}
+
+/*
+    Native bridge
+
+    m2_bridge [sofia profile] dials routes of the Access-Accept kept on the channel (m2_radius_reply) one after another,
+    routes and options are not read back from m2_* variables. Options of the terminator (name_tp_<terminator id> AVPairs)
+    override the same options of the call. Options without native meaning are passed to the leg as m2_<name> variables,
+    options of the terminator also as m2_<name>_tp (e.g. m2_forward_pai_tp). Next route is tried when the attempt fails, unless the caller is gone, Q.850 cause
+    is in reroute_stop_hgc or terminator answered busy/no answer (interpret_busy_as_failed and interpret_noanswer_as_failed
+    make these causes fail over too). Each failed leg sends its own Accounting [stop], if all routes fail the call is
+    reported as failed the same way as m2_radius_report_failed does. Time limit of the route is scheduled here as
+    hangup of the answered leg, so dynamic authorization can find and replace it
+*/
+
+
+// route is "cid number/cid name/destination/ip:port/timeout/ringing timeout", cid name can contain '/'
+
+static int m2_radius_route_parse(const char *value, m2_radius_route_t *route) {
+
+    char buf[1024] = "";
+    char *field[4];
+    char *p = NULL;
+    int i;
+
+    memset(route, 0, sizeof(*route));
+    switch_copy_string(buf, value, sizeof(buf));
+
+    for (i = 0; i < 4; i++) {
+        if ((p = strrchr(buf, '/')) == NULL) {
+            return 0;
+        }
+        *p = '\0';
+        field[i] = p + 1;
     }
 
-    return 0;
+    if ((p = strchr(buf, '/')) == NULL) {
+        return 0;
+    }
+    *p = '\0';
+
+    if (strcmp(buf, "-")) {
+        switch_copy_string(route->callerid_number, buf, sizeof(route->callerid_number));
+    }
+    if (strcmp(p + 1, "-")) {
+        switch_copy_string(route->callerid_name, p + 1, sizeof(route->callerid_name));
+    }
+    switch_copy_string(route->destination, field[3], sizeof(route->destination));
+    switch_copy_string(route->host, field[2], sizeof(route->host));
+    route->timeout = atoi(field[1]);
+    route->ringing_timeout = atoi(field[0]);
+
+    return !zstr(route->destination) && !zstr(route->host);
 
 }
 
-static void m2_set_codec_variables(char *uuid) {
+// option of the terminator if it has one, otherwise option of the call
 
-    switch_core_session_t *session = NULL;
-    switch_channel_t *channel = NULL;
-    const char *read_codec = NULL;
-    const char *direction = NULL;
-    const char *m2_bypass_media_enabled = NULL;
-    char variable_name[128] = "";
+static const char *m2_radius_route_option(m2_radius_reply_t *reply, const char *terminator, const char *name) {
 
-    if ((session = switch_core_session_locate(uuid))) {
-        channel = switch_core_session_get_channel(session);
-        m2_bypass_media_enabled = switch_channel_get_variable(channel, "m2_bypass_media_enabled");
+    char route_name[128] = "";
+    char call_name[128] = "";
+    const char *value = NULL;
+    int i;
 
-        if (m2_bypass_media_enabled && strcmp(m2_bypass_media_enabled, "true") == 0) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Bypass media is enabled, codecs cannot be retrieved!\n", uuid);
-            switch_core_session_rwunlock(session);
-            return;
+    switch_snprintf(call_name, sizeof(call_name), "m2_%s", name);
+    if (terminator) {
+        switch_snprintf(route_name, sizeof(route_name), "m2_%s_tp_%s", name, terminator);
+    }
+
+    for (i = 0; i < reply->var_count; i++) {
+        if (*route_name && !strcmp(reply->vars[i].name, route_name)) {
+            return reply->vars[i].value;
+        }
+        if (value == NULL && !strcmp(reply->vars[i].name, call_name)) {
+            value = reply->vars[i].value;
         }
+    }
 
-        direction = switch_channel_get_variable(channel, "direction");
+    return value;
 
-        if (direction && strlen(direction)) {
-            sprintf(variable_name, "m2_%s_codec_read", direction);
+}
 
-            read_codec = switch_channel_get_variable(channel, "read_codec");
-            if (read_codec) {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] %s codec: %s\n", uuid, strcmp(direction, "inbound") == 0 ? "Originator" : "Terminator", read_codec);
-                switch_channel_set_variable(channel, variable_name, read_codec);
-                switch_channel_set_variable_partner(channel, variable_name, read_codec);
-            } else {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Call codec not found!\n", uuid);
+// options with native meaning, the rest are passed to the leg as m2_<name> variables
+
+static const char *m2_radius_route_native_options[] = {
+    "codecs",
+    "forward_rpid",
+    "disable_q850",
+    "custom_sip_header",
+    "bypass_media",
+    NULL
+};
+
+// values are put in single quotes, so commas are kept. Quotes and braces could end the variable block, such values are not passed
+
+static void m2_radius_dialstring_var(switch_stream_handle_t *stream, switch_core_session_t *session, const char *name, int name_len, const char *value) {
+
+    if (strpbrk(value, "'\"{}") || name_len <= 0 || strcspn(name, "'\"{},= ") < (size_t) name_len) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "[m2_radius %s] Option %.*s='%s' can't be passed to the leg\n",
+            switch_core_session_get_uuid(session), name_len, name, value);
+        return;
+    }
+
+    stream->write_function(stream, ",%.*s='%s'", name_len, name, value);
+
+}
+
+static int m2_radius_route_native_option(const char *name) {
+
+    int i;
+
+    for (i = 0; m2_radius_route_native_options[i]; i++) {
+        if (!strcmp(name, m2_radius_route_native_options[i])) {
+            return 1;
+        }
+    }
+
+    return 0;
+
+}
+
+static char *m2_radius_route_dialstring(switch_core_session_t *session, m2_radius_reply_t *reply, m2_radius_route_t *route, const char *terminator,
+                                        const char *profile, int index) {
+
+    switch_stream_handle_t stream = { 0 };
+    const char *opt = NULL;
+    char *dialstring = NULL;
+    int i;
+
+    SWITCH_STANDARD_STREAM(stream);
+
+    stream.write_function(&stream, "{m2_route_index=%d", index);
+    if (terminator) {
+        stream.write_function(&stream, ",m2_terminator=%s", terminator);
+    }
+    if (route->ringing_timeout > 0) {
+        stream.write_function(&stream, ",call_timeout=%d,leg_timeout=%d", route->ringing_timeout, route->ringing_timeout);
+    }
+    if ((opt = m2_radius_route_option(reply, terminator, "codecs"))) {
+        m2_radius_dialstring_var(&stream, session, "absolute_codec_string", strlen("absolute_codec_string"), opt);
+    }
+    if ((opt = m2_radius_route_option(reply, terminator, "forward_rpid")) && !strcmp(opt, "0")) {
+        stream.write_function(&stream, ",sip_cid_type=none");
+    }
+    if ((opt = m2_radius_route_option(reply, terminator, "disable_q850")) && !strcmp(opt, "1")) {
+        stream.write_function(&stream, ",disable_q850_reason=true");
+    }
+    if ((opt = m2_radius_route_option(reply, terminator, "custom_sip_header")) && strchr(opt, '=')) {
+        char header[128] = "";
+
+        switch_snprintf(header, sizeof(header), "sip_h_%.*s", (int) (strchr(opt, '=') - opt), opt);
+        m2_radius_dialstring_var(&stream, session, header, strlen(header), strchr(opt, '=') + 1);
+    }
+
+    // other options of the call (terminator overrides them), options of this terminator only are passed as m2_<name>_tp
+    for (i = 0; i < reply->var_count; i++) {
+        const char *name = reply->vars[i].name;
+        const char *tp = NULL;
+        char base[128] = "";
+
+        if (strncmp(name, "m2_", 3) || !strncmp(name, "m2_route_", 9) || !strncmp(name, "m2_terminator_", 14)) {
+            continue;
+        }
+
+        if ((tp = strstr(name, "_tp_"))) {
+            switch_snprintf(base, sizeof(base), "%.*s", (int) (tp - name - 3), name + 3);
+            if (terminator && !strcmp(tp + 4, terminator) && !m2_radius_route_native_option(base)) {
+                // option set only for the terminator is passed under the call name too
+                if (!m2_radius_route_option(reply, NULL, base)) {
+                    switch_snprintf(base, sizeof(base), "%.*s", (int) (tp - name), name);
+                    m2_radius_dialstring_var(&stream, session, base, strlen(base), reply->vars[i].value);
+                }
+                switch_snprintf(base, sizeof(base), "%.*s_tp", (int) (tp - name), name);
+                m2_radius_dialstring_var(&stream, session, base, strlen(base), reply->vars[i].value);
             }
+            continue;
+        }
+
+        if (!m2_radius_route_native_option(name + 3) && (opt = m2_radius_route_option(reply, terminator, name + 3))) {
+            m2_radius_dialstring_var(&stream, session, name, strlen(name), opt);
+        }
+    }
+    stream.write_function(&stream, "}sofia/%s/%s@%s", profile, route->destination, route->host);
+
+    if (stream.data) {
+        dialstring = switch_core_session_strdup(session, (char *) stream.data);
+        free(stream.data);
+    }
+
+    return dialstring;
+
+}
+
+// returns 1 if the next route should be tried after this cause
+
+static int m2_radius_route_failover(switch_channel_t *channel, m2_radius_reply_t *reply, const char *terminator, switch_call_cause_t cause) {
+
+    const char *opt = NULL;
+    char match[32] = "";
+
+    if (!switch_channel_ready(channel)) {
+        return 0;
+    }
+
+    // list is sent as ",cause,cause,"
+    switch_snprintf(match, sizeof(match), ",%d,", switch_channel_cause_q850(cause));
+    if ((opt = m2_radius_route_option(reply, terminator, "reroute_stop_hgc")) && strstr(opt, match)) {
+        return 0;
+    }
+
+    if (cause == SWITCH_CAUSE_USER_BUSY) {
+        return (opt = m2_radius_route_option(reply, terminator, "interpret_busy_as_failed")) && !strcmp(opt, "1");
+    }
+
+    if (cause == SWITCH_CAUSE_NO_ANSWER || cause == SWITCH_CAUSE_NO_USER_RESPONSE) {
+        return (opt = m2_radius_route_option(reply, terminator, "interpret_noanswer_as_failed")) && !strcmp(opt, "1");
+    }
+
+    return 1;
+
+}
+
+SWITCH_STANDARD_APP(m2_radius_bridge_handle) {
+
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    switch_call_cause_t cause = SWITCH_CAUSE_NO_ROUTE_DESTINATION;
+    m2_radius_reply_t *reply = NULL;
+    const char *profile = zstr(data) ? "external" : data;
+    const char *uuid = switch_core_session_get_uuid(session);
+    const char *bypass_media = switch_core_session_strdup(session, switch_str_nil(switch_channel_get_variable(channel, "bypass_media")));
+    int attempts = 0;
+    int i;
+
+    M2_RADIUS_METER_INC(bridge_calls);
+
+    if ((reply = switch_channel_get_private(channel, "m2_radius_reply")) == NULL || reply->route_count == 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] No routes to bridge\n", uuid);
+        goto fail;
+    }
+
+    for (i = 0; i < reply->route_count && switch_channel_ready(channel); i++) {
+        const char *terminator = i < reply->terminator_count ? reply->terminators[i] : NULL;
+        switch_core_session_t *peer_session = NULL;
+        m2_radius_route_t route;
+        const char *opt = NULL;
+        char *dialstring = NULL;
+
+        if (!m2_radius_route_parse(reply->routes[i], &route)) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Route %d is invalid: %s\n", uuid, i + 1, reply->routes[i]);
+            continue;
+        }
+
+        if ((dialstring = m2_radius_route_dialstring(session, reply, &route, terminator, profile, i + 1)) == NULL) {
+            continue;
+        }
+
+        // media bypass is decided by variable of the A leg, route without the option gets the value set before m2_bridge
+        if ((opt = m2_radius_route_option(reply, terminator, "bypass_media"))) {
+            switch_channel_set_variable(channel, "bypass_media", !strcmp(opt, "1") ? "true" : "false");
         } else {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Call direction not found!\n", uuid);
+            switch_channel_set_variable(channel, "bypass_media", zstr(bypass_media) ? NULL : bypass_media);
         }
 
-        switch_core_session_rwunlock(session);
-    } else {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Call session not found!\n", uuid);
+        attempts++;
+        M2_RADIUS_METER_INC(bridge_attempts);
+
+        m2_radius_log(SWITCH_LOG_NOTICE, "[m2_radius %s] Bridge attempt %d/%d (terminator %s): %s\n", uuid, i + 1, reply->route_count,
+            terminator ? terminator : "-", dialstring);
+
+        if (switch_ivr_originate(session, &peer_session, &cause, dialstring, route.ringing_timeout > 0 ? route.ringing_timeout : 60, NULL,
+                                 zstr(route.callerid_name) ? NULL : route.callerid_name, zstr(route.callerid_number) ? NULL : route.callerid_number,
+                                 NULL, NULL, SOF_NONE, NULL, NULL) == SWITCH_STATUS_SUCCESS) {
+            M2_RADIUS_METER_INC(bridge_answered);
+
+            switch_channel_set_variable_printf(channel, "m2_bridge_route", "%d", i + 1);
+
+            // time limit of the route counts from answer of the B leg, CoA can replace it later
+            if (route.timeout > 0) {
+                m2_radius_hangup_schedule(switch_core_session_get_channel(peer_session), channel, switch_core_session_get_uuid(peer_session), route.timeout);
+            }
+
+            switch_ivr_multi_threaded_bridge(session, peer_session, NULL, NULL, NULL);
+            switch_core_session_rwunlock(peer_session);
+            return;
+        }
+
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "[m2_radius %s] Bridge attempt %d failed: %s (%d)\n", uuid, i + 1, switch_channel_cause2str(cause),
+            switch_channel_cause_q850(cause));
+        switch_channel_set_variable_printf(channel, "m2_bridge_failed_attempts", "%d", attempts);
+
+        if (!m2_radius_route_failover(channel, reply, terminator, cause)) {
+            break;
+        }
+    }
+
+    fail:
+
+    M2_RADIUS_METER_INC(bridge_failed);
+
+    switch_channel_set_variable(channel, "m2_bridge_cause", switch_channel_cause2str(cause));
+    m2_radius_log(SWITCH_LOG_NOTICE, "[m2_radius %s] All routes failed after %d attempt(s), sending Accounting [stop] packet!\n", uuid, attempts);
+    m2_radius_send_acct_packet(M2_RADIUS_ACCT_STOP, 1, session, "", 0, 0);
+
+    // same as bridge application, dialplan can continue after failure
+    if (!switch_true(switch_channel_get_variable(channel, "continue_on_fail")) && switch_channel_ready(channel)) {
+        switch_channel_hangup(channel, cause);
+    }
+
+}
+
+/*
+    Benchmark
+
+    m2_bench auth|acct|call <cps> <seconds> [concurrency=N] [name=value ...] sends synthetic calls through the same
+    code as real calls: attribute plan, handle pools, transport, hedging and local IPC. Arguments are the channel
+    variables of every call, uuid, call_uuid and sip_call_id are unique per call. "acct" is Accounting [start] and [stop],
+    "call" is authentication followed by both of them. Calls are started on schedule by concurrency sender threads,
+    when all of them wait for replies calls start late and achieved CPS is lower than requested.
+    Requests are real, run it against m2_radius_fake_server or a test core, never against production rating server.
+    Starting a benchmark is refused unless bench-enabled is set to true (it is off by default).
+    Result (latency percentiles of requests and CPU time per call) is written to the log and shown by m2_bench status
+*/
+
+
+#define M2_RADIUS_BENCH_MAX_CALLS 10000000
+#define M2_RADIUS_BENCH_MAX_CONCURRENCY 1024
+
+typedef enum {
+    M2_RADIUS_BENCH_AUTH,
+    M2_RADIUS_BENCH_ACCT,
+    M2_RADIUS_BENCH_CALL
+} m2_radius_bench_mode_t;
+
+static const char *m2_radius_bench_modes[] = { "auth", "acct", "call" };
+
+static struct {
+    switch_mutex_t *mutex;
+    switch_memory_pool_t *pool;
+    switch_thread_t *thread;
+    switch_event_t *vars;
+    int running;
+    volatile int stop;
+    uint32_t run;
+    m2_radius_bench_mode_t mode;
+    int cps;
+    int seconds;
+    int concurrency;
+    int steps;
+    switch_time_t start_time;
+    switch_time_t *latency;
+    switch_time_t sender_cpu;
+    uint64_t total;
+    uint64_t scheduled;
+    uint64_t completed;
+    uint64_t requests;
+    uint64_t ok;
+    uint64_t rejected;
+    uint64_t errors;
+    char result[1024];
+} bench;
+
+static void m2_radius_bench_var_default(switch_event_t *vars, const char *name, const char *value) {
+
+    if (!switch_event_get_header(vars, name)) {
+        switch_event_add_header_string(vars, SWITCH_STACK_BOTTOM, name, value);
+    }
+
+}
+
+static int m2_radius_bench_request(m2_radius_handles_t *handles, m2_radius_conn_t conn, switch_event_t *vars, char *uuid, switch_time_t *rtt) {
+
+    m2_radius_server_t *server = NULL;
+    VALUE_PAIR *send = NULL, *recv = NULL;
+    char msg[512 * 10 + 1] = "";
+    uint32_t service = PW_AUTHENTICATE_ONLY;
+    uint32_t attr = PW_SERVICE_TYPE;
+    rc_handle *rh = NULL;
+    int result = ERROR_RC;
+    int hedge_won = 0;
+
+    if ((rh = m2_radius_handle_get(handles, conn, 0, &server)) == NULL) {
+        return ERROR_RC;
+    }
+
+    if (conn != M2_RADIUS_CONN_AUTH) {
+        service = conn == M2_RADIUS_CONN_ACCT_START ? PW_STATUS_START : PW_STATUS_STOP;
+        attr = PW_ACCT_STATUS_TYPE;
+    }
+
+    if (m2_xml_radius_add_params(NULL, vars, rh, &send, m2_radius_plan_get(handles, conn), conn, uuid) == SWITCH_STATUS_SUCCESS &&
+        rc_avpair_add(rh, &send, attr, &service, -1, 0) != NULL) {
+        switch_time_t start_time = switch_micro_time_now();
+
+        result = m2_radius_send_request(handles, conn, server, rh, send, conn == M2_RADIUS_CONN_AUTH ? &recv : NULL, msg, &hedge_won);
+        *rtt = switch_micro_time_now() - start_time;
+        if (!hedge_won) {
+            m2_radius_server_done(handles, conn, server, result, *rtt);
+        }
+    }
+
+    if (recv) {
+        rc_avpair_free(recv);
+    }
+    if (send) {
+        rc_avpair_free(send);
     }
+    m2_radius_handle_put(handles, conn, server, rh);
+
+    return result;
 
 }
 
-static void m2_radius_accounting_start(switch_event_t *event) {
+static void *SWITCH_THREAD_FUNC m2_radius_bench_sender(switch_thread_t *thread, void *obj) {
+
+    m2_radius_conn_t steps[3];
+    int step_count = 0;
+    struct timespec cpu;
+    char uuid[64] = "";
+    uint64_t index = 0;
+    int i;
 
-    switch_core_session_t *session = NULL;
-    switch_event_header_t *hp;
-    char uuid[256] = "";
-    char direction[256] = "";
+    if (bench.mode != M2_RADIUS_BENCH_ACCT) {
+        steps[step_count++] = M2_RADIUS_CONN_AUTH;
+    }
+    if (bench.mode != M2_RADIUS_BENCH_AUTH) {
+        steps[step_count++] = M2_RADIUS_CONN_ACCT_START;
+        steps[step_count++] = M2_RADIUS_CONN_ACCT_STOP;
+    }
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Initializing Accounting start packet\n");
+    while (!bench.stop) {
+        m2_radius_handles_t *handles = NULL;
+        switch_event_t *vars = NULL;
+        switch_time_t due = 0;
+        int ok = 1;
 
-    switch (event->event_id) {
-    case SWITCH_EVENT_LOG:
-        return;
-    default:
+        switch_mutex_lock(bench.mutex);
+        index = bench.scheduled < bench.total ? bench.scheduled++ : bench.total;
+        switch_mutex_unlock(bench.mutex);
 
-        for (hp = event->headers; hp; hp = hp->next) {
-            if (strcmp("Unique-ID", hp->name) == 0) {
-                m2_set_codec_variables(hp->value);
-            } else if (strcmp("Call-Direction", hp->name) == 0) {
-                strcpy(direction, hp->value);
-                if (strcmp(hp->value, "outbound") == 0) {
-                    goto outbound;
-                }
-            }
+        if (index >= bench.total) {
+            break;
         }
 
-        if (!strlen(direction)) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Call direction not found\n");
+        due = bench.start_time + (switch_time_t) (index * 1000000 / bench.cps);
+        if (due > switch_micro_time_now()) {
+            switch_sleep(due - switch_micro_time_now());
         }
 
-        return;
+        switch_snprintf(uuid, sizeof(uuid), "m2-bench-%u-%llu", bench.run, (unsigned long long) index);
+        switch_event_dup(&vars, bench.vars);
+        switch_event_add_header_string(vars, SWITCH_STACK_TOP, "uuid", uuid);
+        switch_event_add_header_string(vars, SWITCH_STACK_TOP, "call_uuid", uuid);
+        switch_event_add_header_string(vars, SWITCH_STACK_TOP, "sip_call_id", uuid);
 
-        outbound:
+        handles = m2_radius_handles_acquire();
 
-        for (hp = event->headers; hp; hp = hp->next) {
-            if (strcmp("Channel-Call-UUID", hp->name) == 0) {
-                strcpy(uuid, hp->value);
-                break;
+        // rejected call is not accounted, the same as real call
+        for (i = 0; i < step_count && ok; i++) {
+            switch_time_t rtt = 0;
+            int result = m2_radius_bench_request(handles, steps[i], vars, uuid, &rtt);
+
+            bench.latency[index * step_count + i] = rtt;
+
+            switch_mutex_lock(bench.mutex);
+            bench.requests++;
+            if (result == OK_RC) {
+                bench.ok++;
+            } else if (result == REJECT_RC) {
+                bench.rejected++;
+                ok = 0;
+            } else {
+                bench.errors++;
+                ok = 0;
             }
+            switch_mutex_unlock(bench.mutex);
         }
 
-        if (!strlen(uuid)) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Call UUID not found!\n");
-        }
+        m2_radius_handles_release(handles);
+        switch_event_destroy(&vars);
 
-        break;
+        switch_mutex_lock(bench.mutex);
+        bench.completed++;
+        switch_mutex_unlock(bench.mutex);
     }
 
-    if ((session = switch_core_session_locate(uuid))) {
-        m2_radius_send_acct_packet(1, 0, session, uuid, 0);
-        switch_core_session_rwunlock(session);
-    } else {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Call session not found by uuid (%s)!\n", uuid);
-    }
+    // CPU time of this sender: encoding, sending and decoding, without transport threads and other calls
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    switch_mutex_lock(bench.mutex);
+    bench.sender_cpu += (switch_time_t) cpu.tv_sec * 1000000 + cpu.tv_nsec / 1000;
+    switch_mutex_unlock(bench.mutex);
+
+    return NULL;
 
 }
 
-static void m2_xml_radius_reload_event(switch_event_t *event) {
+static switch_time_t m2_radius_bench_rusage_time(const struct rusage *usage) {
 
-    if (m2_radius_load_config() != SWITCH_STATUS_SUCCESS) {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Reload failed\n");
-        return;
+    return (switch_time_t) (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000 + usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+
+}
+
+static void *SWITCH_THREAD_FUNC m2_radius_bench_thread(switch_thread_t *thread, void *obj) {
+
+    switch_thread_t **senders = switch_core_alloc(bench.pool, sizeof(switch_thread_t *) * bench.concurrency);
+    switch_threadattr_t *thd_attr = NULL;
+    switch_status_t status;
+    struct rusage usage_start, usage_end;
+    switch_time_t *sorted = NULL;
+    switch_time_t elapsed = 0;
+    switch_time_t process_cpu = 0;
+    uint64_t count = 0;
+    uint64_t i = 0;
+    int n;
+
+    getrusage(RUSAGE_SELF, &usage_start);
+    bench.start_time = switch_micro_time_now() + 10000;
+
+    for (n = 0; n < bench.concurrency; n++) {
+        switch_threadattr_create(&thd_attr, bench.pool);
+        switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+        switch_thread_create(&senders[n], thd_attr, m2_radius_bench_sender, NULL, bench.pool);
     }
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Conf file reloaded\n");
+    for (n = 0; n < bench.concurrency; n++) {
+        switch_thread_join(&status, senders[n]);
+    }
+
+    getrusage(RUSAGE_SELF, &usage_end);
+    elapsed = switch_micro_time_now() - bench.start_time;
+    process_cpu = m2_radius_bench_rusage_time(&usage_end) - m2_radius_bench_rusage_time(&usage_start);
+
+    // percentiles of answered requests only, timeouts would only show the configured timeout
+    if ((sorted = malloc(sizeof(switch_time_t) * bench.total * bench.steps))) {
+        for (i = 0; i < bench.scheduled * bench.steps; i++) {
+            if (bench.latency[i] > 0) {
+                sorted[count++] = bench.latency[i];
+            }
+        }
+        qsort(sorted, count, sizeof(switch_time_t), m2_radius_rtt_compare);
+    }
+
+    switch_mutex_lock(bench.mutex);
+    switch_snprintf(bench.result, sizeof(bench.result), "Benchmark [%s] %d cps x %d s, concurrency %d: calls %llu/%llu in %.1f s (%.1f cps), "
+        "requests %llu, ok %llu, rejected %llu, errors %llu, latency p50 %lld us, p90 %lld us, p99 %lld us, max %lld us, "
+        "cpu per call %lld us (process), %lld us (senders)",
+        m2_radius_bench_modes[bench.mode], bench.cps, bench.seconds, bench.concurrency,
+        (unsigned long long) bench.completed, (unsigned long long) bench.total, elapsed / 1000000.0, elapsed > 0 ? bench.completed * 1000000.0 / elapsed : 0.0,
+        (unsigned long long) bench.requests, (unsigned long long) bench.ok, (unsigned long long) bench.rejected, (unsigned long long) bench.errors,
+        (long long) (count ? sorted[count / 2] : 0), (long long) (count ? sorted[count * 90 / 100] : 0),
+        (long long) (count ? sorted[count * 99 / 100] : 0), (long long) (count ? sorted[count - 1] : 0),
+        (long long) (bench.completed ? process_cpu / (switch_time_t) bench.completed : 0),
+        (long long) (bench.completed ? bench.sender_cpu / (switch_time_t) bench.completed : 0));
+    bench.running = 0;
+    switch_mutex_unlock(bench.mutex);
+
+    switch_safe_free(sorted);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] %s\n", bench.result);
+
+    return NULL;
 
 }
 
+// previous run must be finished, its pool is destroyed here
 
-SWITCH_STANDARD_APP(m2_radius_auth_handle) {
+static void m2_radius_bench_cleanup(void) {
 
-    switch_channel_t *channel = NULL;
-    int result = 0;
-    VALUE_PAIR *send = NULL, *recv = NULL, *service_vp = NULL;
-    char msg[512 * 10 + 1] = {0};
-    uint32_t service = PW_AUTHENTICATE_ONLY;
-    rc_handle *rh = NULL;
-    char name[256] = "", value[256] = "";
-    int route;
-    int terminator;
-    char uuid[256] = "";
-    int annexb = 0;
-    const char *val = NULL;
+    switch_status_t status;
 
-    channel = switch_core_session_get_channel(session);
-    val = switch_channel_get_variable(channel, "uuid");
-    if (val) {
-        strcpy(uuid, val);
+    if (bench.thread) {
+        switch_thread_join(&status, bench.thread);
+        bench.thread = NULL;
     }
-
-    if (strstr(switch_channel_get_variable(channel, "switch_r_sdp"), "annexb=yes")) {
-        annexb = 1;
+    if (bench.vars) {
+        switch_event_destroy(&bench.vars);
+    }
+    switch_safe_free(bench.latency);
+    if (bench.pool) {
+        switch_core_destroy_memory_pool(&bench.pool);
     }
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Starting authentication\n", uuid);
+}
 
-    if (channel == NULL) {
-        goto auth_err;
-    }
+static void m2_radius_bench_start(char *cmd, switch_stream_handle_t *stream) {
 
-    rh = m2_radius_init(config.m2_radius_auth_conf, 1, 0);
+    char *argv[64] = { 0 };
+    switch_threadattr_t *thd_attr = NULL;
+    int argc = switch_separate_string(cmd, ' ', argv, (sizeof(argv) / sizeof(argv[0])));
+    int mode = -1;
+    int i;
 
-    if (rh == NULL) {
-        goto auth_err;
+    for (i = 0; i < 3; i++) {
+        if (!strcasecmp(argv[0], m2_radius_bench_modes[i])) {
+            mode = i;
+        }
     }
 
-    if (m2_xml_radius_add_params(session, rh, &send, config.m2_radius_auth_conf, uuid) != SWITCH_STATUS_SUCCESS ) {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add params to rc_handle\n", uuid);
-        goto auth_err;
+    if (mode < 0 || argc < 3 || atoi(argv[1]) <= 0 || atoi(argv[2]) <= 0) {
+        stream->write_function(stream, "-USAGE: auth|acct|call <cps> <seconds> [concurrency=N] [name=value ...]\n");
+        return;
     }
 
-    if (rc_avpair_add(rh, &send, PW_SERVICE_TYPE, &service, -1, 0) == NULL) {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add option to handle\n", uuid);
-        goto auth_err;
+    if (!globals.running || globals.handles == NULL) {
+        stream->write_function(stream, "-ERR radius handles are not initialized\n");
+        return;
     }
 
-    // if SDP contains Annex B, pass it to radius
-    if (annexb) {
-        if (rc_avpair_add(rh, &send, 1, "freeswitch-annexb=1", -1, 9) == NULL) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to add freeswitch-annexb!\n", uuid);
-            goto auth_err;
+    switch_mutex_lock(bench.mutex);
+    if (bench.running) {
+        switch_mutex_unlock(bench.mutex);
+        stream->write_function(stream, "-ERR benchmark is already running\n");
+        return;
+    }
+    bench.running = 1;
+    switch_mutex_unlock(bench.mutex);
+
+    m2_radius_bench_cleanup();
+
+    bench.mode = (m2_radius_bench_mode_t) mode;
+    bench.cps = atoi(argv[1]);
+    bench.seconds = atoi(argv[2]);
+    bench.concurrency = 64;
+    bench.steps = mode == M2_RADIUS_BENCH_AUTH ? 1 : (mode == M2_RADIUS_BENCH_ACCT ? 2 : 3);
+    bench.total = (uint64_t) bench.cps * bench.seconds;
+    if (bench.total > M2_RADIUS_BENCH_MAX_CALLS) bench.total = M2_RADIUS_BENCH_MAX_CALLS;
+    bench.scheduled = bench.completed = bench.requests = bench.ok = bench.rejected = bench.errors = 0;
+    bench.sender_cpu = 0;
+    bench.stop = 0;
+    bench.run++;
+    *bench.result = '\0';
+
+    switch_event_create(&bench.vars, SWITCH_EVENT_CLONE);
+    for (i = 3; i < argc; i++) {
+        char *eq = strchr(argv[i], '=');
+
+        if (eq == NULL) {
+            continue;
+        }
+        *eq++ = '\0';
+        if (!strcmp(argv[i], "concurrency")) {
+            bench.concurrency = atoi(eq);
         } else {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] freeswitch-annexb=1\n", uuid);
+            switch_event_add_header_string(bench.vars, SWITCH_STACK_BOTTOM, argv[i], eq);
         }
     }
-
-    result = rc_auth(rh, 0, send, &recv, msg);
-
-    if (result != OK_RC) {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Result (RC = %d) %s\n", uuid, result, msg);
-        goto auth_err;
+    if (bench.concurrency < 1 || bench.concurrency > M2_RADIUS_BENCH_MAX_CONCURRENCY) bench.concurrency = 64;
+
+    m2_radius_bench_var_default(bench.vars, "caller_id_number", "37060000000");
+    m2_radius_bench_var_default(bench.vars, "caller_id_name", "m2 bench");
+    m2_radius_bench_var_default(bench.vars, "destination_number", "37060000001");
+    m2_radius_bench_var_default(bench.vars, "network_addr", "127.0.0.1");
+    m2_radius_bench_var_default(bench.vars, "sip_network_ip", "127.0.0.1");
+    m2_radius_bench_var_default(bench.vars, "sip_network_port", "5060");
+    m2_radius_bench_var_default(bench.vars, "billsec", "60");
+
+    bench.latency = calloc(bench.total * bench.steps, sizeof(switch_time_t));
+    if (bench.latency == NULL || switch_core_new_memory_pool(&bench.pool) != SWITCH_STATUS_SUCCESS) {
+        switch_safe_free(bench.latency);
+        switch_event_destroy(&bench.vars);
+        bench.running = 0;
+        stream->write_function(stream, "-ERR out of memory\n");
+        return;
     }
 
-    // set channel variable with auth result
-    switch_channel_set_variable(channel, "m2_auth_result", "1");
+    switch_threadattr_create(&thd_attr, bench.pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&bench.thread, thd_attr, m2_radius_bench_thread, NULL, bench.pool);
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] ------------------- Received attribute-value pairs --------------------\n", uuid);
+    stream->write_function(stream, "+OK benchmark [%s] started: %llu calls at %d cps, concurrency %d\n", m2_radius_bench_modes[mode],
+        (unsigned long long) bench.total, bench.cps, bench.concurrency);
 
-    service_vp = recv;
-    route = 1;
-    terminator = 1;
-    while (service_vp != NULL) {
-        memset(value, 0, sizeof(value));
-        memset(name, 0, sizeof(value));
-        rc_avpair_tostr(rh, service_vp, name, sizeof(name), value, sizeof(value));
+}
 
-        if (strcmp(name, "Cisco-AVPair")) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] %s=%s\n", uuid, name, value);
-        } else {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] %s\n", uuid, value);
-        }
+static void m2_radius_bench_stop(void) {
 
-        if (strcmp("Cisco-Command-Code", name) == 0) {
-            char new_name[256] = "";
-            sprintf(new_name, "m2_route_%d", route);
-            switch_channel_set_variable(channel, new_name, value);
-            route++;
-        } else if (strcmp("Cisco-AVPair", name) == 0 && strstr(value, "terminator=")) {
-            char new_name[256] = "";
-            sprintf(new_name, "m2_terminator_%d", terminator);
-            switch_channel_set_variable(channel, new_name, strstr(value, "terminator=") + strlen("terminator="));
-            terminator++;
-        } else if (strcmp("Cisco-AVPair", name) == 0 && strstr(value, "=")) {
+    bench.stop = 1;
+    m2_radius_bench_cleanup();
 
-            char *ptr = NULL;
-            char avp_name[256] = "";
-            char tmp_avp_name[256] = "";
-            char avp_value[256] = "";
+}
 
-            ptr = strstr(value, "=");
-            strcpy(avp_value, ptr + 1);
-            strncpy(tmp_avp_name, value, strlen(value) - strlen(ptr));
-            sprintf(avp_name, "m2_%s", tmp_avp_name);
+SWITCH_STANDARD_API(m2_radius_bench) {
 
-            if (strlen(avp_name) && strlen(avp_value)) {
-                switch_channel_set_variable(channel, avp_name, avp_value);
-            }
+    char *args = NULL;
 
+    if (zstr(cmd) || !strcasecmp(cmd, "status")) {
+        switch_mutex_lock(bench.mutex);
+        if (bench.running) {
+            stream->write_function(stream, "Benchmark [%s] is running: calls %llu/%llu, ok %llu, rejected %llu, errors %llu\n", m2_radius_bench_modes[bench.mode],
+                (unsigned long long) bench.completed, (unsigned long long) bench.total, (unsigned long long) bench.ok,
+                (unsigned long long) bench.rejected, (unsigned long long) bench.errors);
+        } else if (*bench.result) {
+            stream->write_function(stream, "%s\n", bench.result);
         } else {
-            switch_channel_set_variable(channel, name, value);
+            stream->write_function(stream, "-USAGE: auth|acct|call <cps> <seconds> [concurrency=N] [name=value ...]|status|stop\n");
         }
-        service_vp = service_vp->next;
+        switch_mutex_unlock(bench.mutex);
+        return SWITCH_STATUS_SUCCESS;
     }
 
-    if (recv) {
-        rc_avpair_free(recv);
-        recv = NULL;
-    }
-    if (send) {
-        rc_avpair_free(send);
-        send = NULL;
-    }
-    if (rh) {
-        rc_destroy(rh);
-        rh = NULL;
+    if (!strcasecmp(cmd, "stop")) {
+        bench.stop = 1;
+        stream->write_function(stream, "+OK\n");
+        return SWITCH_STATUS_SUCCESS;
     }
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Authentication request successfully sent to radius server\n", uuid);
-
-    return;
+    if (!globals.bench_enabled) {
+        stream->write_function(stream, "-ERR benchmark is disabled, set bench-enabled to true in configuration\n");
+        return SWITCH_STATUS_SUCCESS;
+    }
 
-    auth_err:
+    if ((args = strdup(cmd)) == NULL) {
+        stream->write_function(stream, "-ERR out of memory\n");
+        return SWITCH_STATUS_SUCCESS;
+    }
 
-    if (result == 2) {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Radius request rejected\n", uuid);
+    m2_radius_bench_start(args, stream);
+    free(args);
 
-        // maybe we got m2_hangupcause code? if so, set it to channel variable
-        service_vp = recv;
-        while (service_vp != NULL) {
-            rc_avpair_tostr(rh, service_vp, name, sizeof(name), value, sizeof(value));
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Got AVP %s = %s\n", uuid, name, value);
-            if (strcmp("Cisco-AVPair", name) == 0 && strstr(value, "m2_hangupcause=")) {
-                switch_channel_set_variable(channel, "m2_hangupcause", strstr(value, "m2_hangupcause=") + strlen("m2_hangupcause="));
-            }
-            service_vp = service_vp->next;
-        }
+    return SWITCH_STATUS_SUCCESS;
 
-    } else if (result == -2) {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Bad response. Check if radius server is using the same shared secret as FreeSwitch\n", uuid);
-    } else if (result == 1) {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to send authentication request to radius server (reason: timeout)\n", uuid);
-    } else {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius %s] Failed to send authentication request to radius server (reason: general error)\n", uuid);
-    }
+}
 
-    if (recv) {
-        rc_avpair_free(recv);
-        recv = NULL;
-    }
-    if (send) {
-        rc_avpair_free(send);
-        send = NULL;
-    }
-    if (rh) {
-        rc_destroy(rh);
-        rh = NULL;
-    }
+SWITCH_STANDARD_API(m2_radius_reload) {
 
-    // If authentication request failed (not due to rejection)
-    // then send acct stop request to radius just in case there is a corresponding call waiting for further messages from
-    if (result != 2) {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Preparing to send delayed accounting stop request to radius!\n", uuid);
-        sleep(5);
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius %s] Sending now\n", uuid);
-        m2_radius_send_acct_packet(0, 1, session, "", 500);
-    }
+    stream->write_function(stream, "+OK\n");
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CONSOLE, "Reloading devices\n");
+    m2_radius_devices_reload();
+    return SWITCH_STATUS_SUCCESS;
 
 }
 
-SWITCH_STANDARD_APP(m2_radius_report_failed_handle) {
+SWITCH_STANDARD_API(m2_radius_device_sync) {
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "[m2_radius] Call failed, sending Accounting [stop] packet!\n");
-    m2_radius_send_acct_packet(0, 1, session, "", 0);
+    char *delta = NULL;
 
-}
+    if (zstr(cmd)) {
+        stream->write_function(stream, "-USAGE: [full;]add <id> <ip> [gateway];update <id> <ip> [gateway];remove <id> [gateway]\n");
+        return SWITCH_STATUS_SUCCESS;
+    }
 
-SWITCH_STANDARD_API(m2_radius_reload) {
+    if ((delta = strdup(cmd)) == NULL) {
+        stream->write_function(stream, "-ERR out of memory\n");
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    m2_radius_devices_sync(delta, stream);
+    free(delta);
 
-    stream->write_function(stream, "+OK\n");
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CONSOLE, "Reloading devices\n");
-    system("/usr/local/m2/m2_freeswitch_devices");
     return SWITCH_STATUS_SUCCESS;
 
 }
@@ -1078,11 +8361,276 @@ SWITCH_STANDARD_API(m2_radius_recompile) {
 
 }
 
+// all counters as one JSON object, used by "m2_show_status json" and stats event
+
+static void m2_radius_stats_json(switch_stream_handle_t *stream) {
+
+    m2_radius_latency_summary_t summary;
+    m2_radius_meter_t meter;
+    int i;
+
+    m2_radius_meter_snapshot(&meter);
+
+    stream->write_function(stream, "{\"version\":\"%s\",\"latency\":{", M2_VERSION);
+    for (i = 0; i < M2_RADIUS_PATH_COUNT; i++) {
+        m2_radius_latency_summary((m2_radius_path_t) i, &summary);
+        stream->write_function(stream, "%s\"%s\":{\"count\":%llu,\"errors\":%llu,\"avg_us\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu}",
+            i ? "," : "", m2_radius_path_names[i], (unsigned long long) summary.count, (unsigned long long) summary.errors, (unsigned long long) summary.avg,
+            (unsigned long long) summary.p50, (unsigned long long) summary.p99, (unsigned long long) summary.p999, (unsigned long long) summary.max);
+    }
+    stream->write_function(stream, "}");
+
+    stream->write_function(stream, ",\"hedge\":{\"fired\":%llu,\"won\":%llu}", (unsigned long long) meter.hedge_fired, (unsigned long long) meter.hedge_won);
+    stream->write_function(stream, ",\"ipc\":{\"connected\":%s,\"requests\":%llu,\"timeouts\":%llu,\"fallbacks\":%llu}", globals.ipc_connected ? "true" : "false",
+        (unsigned long long) meter.ipc_requests, (unsigned long long) meter.ipc_timeouts, (unsigned long long) meter.ipc_fallbacks);
+    stream->write_function(stream, ",\"source_filter\":{\"cached\":%llu,\"cache_rejects\":%llu,\"rate_rejects\":%llu}", (unsigned long long) meter.negative_cache_added,
+        (unsigned long long) meter.negative_cache_rejects, (unsigned long long) meter.source_rate_rejects);
+    stream->write_function(stream, ",\"shadow\":{\"sample\":%d,\"sent\":%llu,\"errors\":%llu,\"dropped\":%llu,\"match\":%llu,\"diff_result\":%llu,\"diff_routes\":%llu,"
+        "\"diff_timeout\":%llu,\"diff_cause\":%llu}", globals.shadow_sample, (unsigned long long) meter.shadow_sent, (unsigned long long) meter.shadow_errors,
+        (unsigned long long) meter.shadow_dropped, (unsigned long long) meter.shadow_match, (unsigned long long) meter.shadow_diff_result,
+        (unsigned long long) meter.shadow_diff_routes, (unsigned long long) meter.shadow_diff_timeout, (unsigned long long) meter.shadow_diff_cause);
+    stream->write_function(stream, ",\"interim\":{\"interval\":%d,\"sent\":%llu,\"errors\":%llu}", globals.acct_interim_interval,
+        (unsigned long long) meter.interim_sent, (unsigned long long) meter.interim_errors);
+    stream->write_function(stream, ",\"coa\":{\"disconnects\":%llu,\"changes\":%llu,\"naks\":%llu,\"bad_auth\":%llu,\"replays\":%llu}", (unsigned long long) meter.coa_disconnects,
+        (unsigned long long) meter.coa_changes, (unsigned long long) meter.coa_naks, (unsigned long long) meter.coa_bad_auth, (unsigned long long) meter.coa_replays);
+    stream->write_function(stream, ",\"server_status\":{\"sent\":%llu,\"errors\":%llu}", (unsigned long long) meter.node_sent, (unsigned long long) meter.node_errors);
+    stream->write_function(stream, ",\"capture\":{\"records\":%llu,\"dropped\":%llu}", (unsigned long long) meter.capture_records, (unsigned long long) meter.capture_dropped);
+    stream->write_function(stream, ",\"acct_queue\":{\"depth\":%d,\"overflows\":%llu,\"delayed\":%d}", m2_radius_acct_queue_depth(), (unsigned long long) meter.acct_queue_overflow,
+        globals.delayed_count);
+    stream->write_function(stream, ",\"spool\":{\"appended\":%llu,\"replayed\":%llu,\"full\":%llu,\"corrupted\":%llu}", (unsigned long long) meter.spool_appended,
+        (unsigned long long) meter.spool_replayed, (unsigned long long) meter.spool_full, (unsigned long long) meter.spool_corrupted);
+    stream->write_function(stream, ",\"hangups\":{");
+    for (i = 0; i < M2_RADIUS_HANGUP_REASON_COUNT; i++) {
+        stream->write_function(stream, "%s\"%s\":%llu", i ? "," : "", m2_radius_hangup_reason_names[i], (unsigned long long) meter.hangups[i]);
+    }
+    stream->write_function(stream, ",\"rate_limited\":%llu,\"not_found\":%llu}}\n", (unsigned long long) meter.hangups_rate_limited, (unsigned long long) meter.hangups_not_found);
+
+}
+
+// periodic CUSTOM event m2_radius::stats with latency headers and JSON body, interval 0 after reload disables events
+
+static void *SWITCH_THREAD_FUNC m2_radius_stats_thread(switch_thread_t *thread, void *obj) {
+
+    switch_time_t next_event = switch_micro_time_now() + (switch_time_t) globals.stats_event_interval * 1000000;
+
+    while (globals.running) {
+        switch_event_t *event = NULL;
+        switch_stream_handle_t stream = { 0 };
+        m2_radius_latency_summary_t summary;
+        char name[64] = "";
+        char value[32] = "";
+        int interval = globals.stats_event_interval;
+        int i;
+
+        if (interval <= 0 || switch_micro_time_now() < next_event) {
+            switch_yield(100000);
+            continue;
+        }
+        next_event += (switch_time_t) interval * 1000000;
+
+        // events were disabled or interval was changed, do not send missed events one after another
+        if (next_event <= switch_micro_time_now()) {
+            next_event = switch_micro_time_now() + (switch_time_t) interval * 1000000;
+        }
+
+        if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, M2_RADIUS_STATS_EVENT) != SWITCH_STATUS_SUCCESS) {
+            continue;
+        }
+
+        for (i = 0; i < M2_RADIUS_PATH_COUNT; i++) {
+            m2_radius_latency_summary((m2_radius_path_t) i, &summary);
+            switch_snprintf(name, sizeof(name), "%s-count", m2_radius_path_names[i]);
+            switch_snprintf(value, sizeof(value), "%llu", (unsigned long long) summary.count);
+            switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, name, value);
+            switch_snprintf(name, sizeof(name), "%s-errors", m2_radius_path_names[i]);
+            switch_snprintf(value, sizeof(value), "%llu", (unsigned long long) summary.errors);
+            switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, name, value);
+            switch_snprintf(name, sizeof(name), "%s-p99-us", m2_radius_path_names[i]);
+            switch_snprintf(value, sizeof(value), "%llu", (unsigned long long) summary.p99);
+            switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, name, value);
+        }
+
+        SWITCH_STANDARD_STREAM(stream);
+        m2_radius_stats_json(&stream);
+        if (stream.data) {
+            switch_event_add_body(event, "%s", (char *) stream.data);
+            free(stream.data);
+        }
+
+        switch_event_fire(&event);
+    }
+
+    return NULL;
+
+}
+
+static void m2_radius_stats_start(void) {
+
+    switch_threadattr_t *thd_attr = NULL;
+
+    if (globals.stats_event_interval <= 0) {
+        return;
+    }
+
+    switch_threadattr_create(&thd_attr, globals.pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&globals.stats_thread, thd_attr, m2_radius_stats_thread, NULL, globals.pool);
+
+}
+
+static void m2_radius_stats_stop(void) {
+
+    switch_status_t status;
+
+    if (globals.stats_thread) {
+        switch_thread_join(&status, globals.stats_thread);
+        globals.stats_thread = NULL;
+    }
+
+}
+
+
 SWITCH_STANDARD_API(m2_radius_show_version) {
 
+    m2_radius_handles_t *handles = NULL;
+    m2_radius_latency_summary_t summary;
+    m2_radius_op_meter_t op;
+    m2_radius_meter_t meter;
+    int i;
+
+    if (!zstr(cmd) && !strcasecmp(cmd, "json")) {
+        m2_radius_stats_json(stream);
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    m2_radius_meter_snapshot(&meter);
+
     stream->write_function(stream, "+OK\n");
     stream->write_function(stream, "M2 Radius: %s\n", M2_VERSION);
+
+    for (i = 0; i < M2_RADIUS_PATH_COUNT; i++) {
+        m2_radius_latency_summary((m2_radius_path_t) i, &summary);
+        if (summary.count) {
+            stream->write_function(stream, "Latency [%s]: count: %llu, errors: %llu, avg: %llu us, p50: %llu us, p99: %llu us, p999: %llu us, max: %llu us\n",
+                m2_radius_path_names[i], (unsigned long long) summary.count, (unsigned long long) summary.errors, (unsigned long long) summary.avg,
+                (unsigned long long) summary.p50, (unsigned long long) summary.p99, (unsigned long long) summary.p999, (unsigned long long) summary.max);
+        }
+    }
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CONSOLE, "M2 Radius: %s\n", M2_VERSION);
+
+    for (i = 0; i < M2_RADIUS_CONN_COUNT; i++) {
+        m2_radius_op_meter_sum(i, &op);
+        if (op.count) {
+            stream->write_function(stream, "Packet build [%s]: count: %llu, avg: %lld us, max: %lld us\n", m2_radius_conn_names[i],
+                (unsigned long long) op.count, (long long) (op.time / op.count), (long long) op.time_max);
+        }
+    }
+    m2_radius_op_meter_sum(M2_RADIUS_METER_REPLY_PARSE, &op);
+    if (op.count) {
+        stream->write_function(stream, "Reply parse [auth]: count: %llu, avg: %lld us, max: %lld us\n", (unsigned long long) op.count,
+            (long long) (op.time / op.count), (long long) op.time_max);
+    }
+
+    if (globals.auth_hedge_percentile > 0) {
+        stream->write_function(stream, "Auth hedging: percentile: %d, fired: %llu, won: %llu\n", globals.auth_hedge_percentile,
+            (unsigned long long) meter.hedge_fired, (unsigned long long) meter.hedge_won);
+    }
+    if (!zstr(globals.ipc_socket)) {
+        stream->write_function(stream, "Local IPC [%s]: %s, connects: %llu, requests: %llu, timeouts: %llu, fallbacks: %llu\n", globals.ipc_socket,
+            globals.ipc_connected ? "connected" : "not connected", (unsigned long long) meter.ipc_connects, (unsigned long long) meter.ipc_requests,
+            (unsigned long long) meter.ipc_timeouts, (unsigned long long) meter.ipc_fallbacks);
+    }
+    if (globals.negative_cache_ttl > 0 || globals.source_rate > 0) {
+        stream->write_function(stream, "Source filter: negative cache ttl: %d s, rate: %d/s, cached: %llu, cache rejects: %llu, rate rejects: %llu\n",
+            globals.negative_cache_ttl, globals.source_rate, (unsigned long long) meter.negative_cache_added, (unsigned long long) meter.negative_cache_rejects,
+            (unsigned long long) meter.source_rate_rejects);
+    }
+    if (globals.shadow_sample > 0 || use_secondary_connection || meter.shadow_sent) {
+        stream->write_function(stream, "Shadow: sample: %d%%, recompile: %s, sent: %llu, errors: %llu, dropped: %llu, match: %llu, diff result: %llu, diff routes: %llu, "
+            "diff timeout: %llu, diff cause: %llu\n", globals.shadow_sample, use_secondary_connection ? "on" : "off", (unsigned long long) meter.shadow_sent,
+            (unsigned long long) meter.shadow_errors, (unsigned long long) meter.shadow_dropped, (unsigned long long) meter.shadow_match,
+            (unsigned long long) meter.shadow_diff_result, (unsigned long long) meter.shadow_diff_routes, (unsigned long long) meter.shadow_diff_timeout,
+            (unsigned long long) meter.shadow_diff_cause);
+    }
+    if (!zstr(globals.coa_listen)) {
+        stream->write_function(stream, "Dynamic authorization [%s]: %s, disconnects: %llu, changes: %llu, naks: %llu, bad authenticator: %llu, replays: %llu\n", globals.coa_listen,
+            globals.coa_thread ? "listening" : "not listening", (unsigned long long) meter.coa_disconnects, (unsigned long long) meter.coa_changes,
+            (unsigned long long) meter.coa_naks, (unsigned long long) meter.coa_bad_auth, (unsigned long long) meter.coa_replays);
+    }
+    if (!zstr(globals.server_id)) {
+        stream->write_function(stream, "Server status: server id: %s, heartbeat: %d s, sent: %llu, errors: %llu\n", globals.server_id,
+            globals.acct_heartbeat_interval, (unsigned long long) meter.node_sent, (unsigned long long) meter.node_errors);
+    }
+    if (!zstr(globals.capture_file) || meter.capture_records) {
+        stream->write_function(stream, "Capture [%s]: %s, records: %llu, dropped: %llu\n", zstr(globals.capture_file) ? "-" : globals.capture_file,
+            globals.capture_fd >= 0 ? "writing" : "not writing", (unsigned long long) meter.capture_records, (unsigned long long) meter.capture_dropped);
+    }
+    if (globals.acct_interim_interval > 0 || meter.interim_sent) {
+        stream->write_function(stream, "Interim updates: interval: %d s, jitter: %d%%, sent: %llu, errors: %llu\n", globals.acct_interim_interval,
+            globals.acct_interim_jitter, (unsigned long long) meter.interim_sent, (unsigned long long) meter.interim_errors);
+    }
+    switch_mutex_lock(globals.device_mutex);
+    if (globals.device_sync_count || globals.devices_reload_count) {
+        stream->write_function(stream, "Devices: known: %d, acl: %s, syncs: %llu, changes: %llu, last sync: %lld us, full reloads: %llu, last reload: %lld ms%s, acl rejects: %llu\n",
+            globals.device_count, globals.device_acl ? (globals.devices_loaded ? "on" : "on (waiting for full sync)") : "off", (unsigned long long) globals.device_sync_count,
+            (unsigned long long) globals.device_sync_changes, (long long) globals.device_sync_time, (unsigned long long) globals.devices_reload_count,
+            (long long) (globals.devices_reload_time / 1000), globals.devices_reload_running ? " (running)" : "", (unsigned long long) meter.device_acl_rejects);
+    }
+    switch_mutex_unlock(globals.device_mutex);
+    if (meter.bridge_calls) {
+        stream->write_function(stream, "Native bridge: calls: %llu, attempts: %llu, answered: %llu, failed: %llu\n", (unsigned long long) meter.bridge_calls,
+            (unsigned long long) meter.bridge_attempts, (unsigned long long) meter.bridge_answered, (unsigned long long) meter.bridge_failed);
+    }
+    for (i = M2_RADIUS_CONN_ACCT_START; i < M2_RADIUS_CONN_COUNT; i++) {
+        if (meter.acct_send_count[i]) {
+            stream->write_function(stream, "Accounting [%s]: sent: %llu, errors: %llu, send avg: %lld us, send max: %lld us, avg incl. queue: %lld us\n", m2_radius_conn_names[i],
+                (unsigned long long) meter.acct_send_count[i], (unsigned long long) meter.acct_send_errors[i], (long long) (meter.acct_send_time[i] / meter.acct_send_count[i]),
+                (long long) meter.acct_send_time_max[i], (long long) (meter.acct_total_time[i] / meter.acct_send_count[i]));
+        }
+    }
+
+    if ((handles = m2_radius_handles_acquire())) {
+        if (handles->conn[M2_RADIUS_CONN_AUTH] && handles->conn[M2_RADIUS_CONN_AUTH]->shard_count) {
+            stream->write_function(stream, "Sharding: shards: %d, key: %s, rebalance: %s, kept on old shard: %llu\n", handles->conn[M2_RADIUS_CONN_AUTH]->shard_count,
+                globals.shard_key, globals.shard_rebalance ? "on" : "off", (unsigned long long) meter.shard_sticky);
+        }
+        for (i = 0; i < M2_RADIUS_CONN_COUNT; i++) {
+            m2_radius_handle_pool_t *hp = handles->conn[i];
+            switch_time_t now = switch_micro_time_now();
+            int j;
+
+            if (hp == NULL) {
+                continue;
+            }
+
+            switch_mutex_lock(hp->mutex);
+            for (j = 0; j < hp->server_count; j++) {
+                m2_radius_server_t *server = &hp->servers[j];
+                stream->write_function(stream, "Server [%s] %s: %s, shard: %d, requests: %llu, timeouts: %llu, errors: %llu, in flight: %d, srtt: %lld us, rttvar: %lld us, timeout: %d s, handles: %d\n",
+                    m2_radius_conn_names[i], server->label, server->dead_until > now ? "dead" : "alive", server->shard, (unsigned long long) server->requests, (unsigned long long) server->timeouts,
+                    (unsigned long long) server->errors, server->active, (long long) server->srtt, (long long) server->rttvar, server->timeout, server->created);
+                if (server->transport) {
+                    stream->write_function(stream, "Server [%s] %s transport: sockets: %d, retransmits: %llu, bad replies: %llu\n", m2_radius_conn_names[i], server->label,
+                        server->transport->socket_count, (unsigned long long) server->transport->retransmits, (unsigned long long) server->transport->bad_replies);
+                }
+            }
+            switch_mutex_unlock(hp->mutex);
+        }
+        m2_radius_handles_release(handles);
+    }
+
+    stream->write_function(stream, "Accounting queue: threads: %d, depth: %d, overflows: %llu, delayed: %d\n", globals.acct_senders_count, m2_radius_acct_queue_depth(),
+        (unsigned long long) meter.acct_queue_overflow, globals.delayed_count);
+    if (globals.spool_map) {
+        stream->write_function(stream, "Accounting spool: pending: %s, appended: %llu, replayed: %llu, full: %llu, corrupted: %llu\n", m2_radius_spool_pending() ? "yes" : "no",
+            (unsigned long long) meter.spool_appended, (unsigned long long) meter.spool_replayed, (unsigned long long) meter.spool_full, (unsigned long long) meter.spool_corrupted);
+    }
+    stream->write_function(stream, "Forced hangups:");
+    for (i = 0; i < M2_RADIUS_HANGUP_REASON_COUNT; i++) {
+        stream->write_function(stream, " %s: %llu,", m2_radius_hangup_reason_names[i], (unsigned long long) meter.hangups[i]);
+    }
+    stream->write_function(stream, " rate limited: %llu, channel not found: %llu\n", (unsigned long long) meter.hangups_rate_limited, (unsigned long long) meter.hangups_not_found);
+
     return SWITCH_STATUS_SUCCESS;
 
 }
@@ -1110,17 +8658,53 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_xml_m2_radius_load) {
     // connect my internal structure to the blank pointer passed to me
     *module_interface = switch_loadable_module_create_module_interface(pool, modname);
 
+    memset(&globals, 0, sizeof(globals));
+    globals.pool = pool;
+    switch_mutex_init(&globals.mutex, SWITCH_MUTEX_NESTED, globals.pool);
+    switch_mutex_init(&globals.reload_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+    switch_mutex_init(&globals.source_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+    globals.sources = switch_core_alloc(globals.pool, sizeof(m2_radius_source_t) * M2_RADIUS_SOURCE_TABLE_SIZE);
+    switch_mutex_init(&globals.shard_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+    globals.shard_keys = switch_core_alloc(globals.pool, sizeof(m2_radius_shard_key_t) * M2_RADIUS_SHARD_KEY_TABLE_SIZE);
+    switch_mutex_init(&globals.device_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+    switch_mutex_init(&bench.mutex, SWITCH_MUTEX_NESTED, globals.pool);
+    switch_mutex_init(&globals.capture_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+    globals.capture_fd = -1;
+    switch_core_hash_init(&globals.devices);
+    switch_core_hash_init(&globals.device_ips);
+
     if (m2_radius_load_config() != SWITCH_STATUS_SUCCESS) {
         return SWITCH_STATUS_TERM;
     }
 
+    // number of sender threads and spool file are read only at module load
+    globals.running = 1;
+    m2_radius_spool_open();
+    m2_radius_acct_senders_start();
+    m2_radius_spool_start();
+    m2_radius_acct_delayed_start();
+    m2_radius_ipc_start();
+    m2_radius_shadow_start();
+    m2_radius_coa_start();
+    m2_radius_node_start();
+    m2_radius_devices_start();
+
+    if (switch_event_reserve_subclass(M2_RADIUS_STATS_EVENT) != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Couldn't register subclass %s!\n", M2_RADIUS_STATS_EVENT);
+        return SWITCH_STATUS_TERM;
+    }
+    m2_radius_stats_start();
+
     switch_core_add_state_handler(&state_handlers);
     SWITCH_ADD_APP(app_interface, "m2_radius_auth", NULL, NULL, m2_radius_auth_handle, "m2_radius_auth", SAF_SUPPORT_NOMEDIA | SAF_ROUTING_EXEC);
     SWITCH_ADD_APP(app_interface, "m2_radius_report_failed", NULL, NULL, m2_radius_report_failed_handle, "m2_radius_report_failed", SAF_SUPPORT_NOMEDIA | SAF_ROUTING_EXEC);
+    SWITCH_ADD_APP(app_interface, "m2_bridge", "Bridge call over routes from radius reply", NULL, m2_radius_bridge_handle, "[sofia profile]", SAF_SUPPORT_NOMEDIA);
 
     SWITCH_ADD_API(mod_xml_m2_radius_api_interface, "m2_recompile", "m2_radius handle recompile", m2_radius_recompile, "");
     SWITCH_ADD_API(mod_xml_m2_radius_api_interface, "m2_reload", "m2_radius reload device", m2_radius_reload, "");
-    SWITCH_ADD_API(mod_xml_m2_radius_api_interface, "m2_show_status", "m2_radius show version", m2_radius_show_version, "");
+    SWITCH_ADD_API(mod_xml_m2_radius_api_interface, "m2_device_sync", "m2_radius apply device delta", m2_radius_device_sync, "[full;]add|update|remove <id> [<ip>] [gateway]");
+    SWITCH_ADD_API(mod_xml_m2_radius_api_interface, "m2_show_status", "m2_radius show version", m2_radius_show_version, "[json]");
+    SWITCH_ADD_API(mod_xml_m2_radius_api_interface, "m2_bench", "m2_radius synthetic load", m2_radius_bench, "auth|acct|call <cps> <seconds> [concurrency=N] [name=value ...]|status|stop");
 
     if (switch_event_bind(modname, SWITCH_EVENT_CHANNEL_ANSWER, SWITCH_EVENT_SUBCLASS_ANY, m2_radius_accounting_start, NULL) != SWITCH_STATUS_SUCCESS) {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "[m2_radius] Couldn't bind M2 answer event!\n");
@@ -1139,18 +8723,27 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_xml_m2_radius_load) {
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_xml_m2_radius_shutdown) {
 
     switch_core_remove_state_handler(&state_handlers);
-
-    if (config.m2_radius_auth_conf) {
-        switch_xml_free(config.m2_radius_auth_conf);
-    }
-
-    if (config.m2_radius_acct_start_conf) {
-        switch_xml_free(config.m2_radius_acct_start_conf);
-    }
-
-    if (config.m2_radius_acct_stop_conf) {
-        switch_xml_free(config.m2_radius_acct_stop_conf);
-    }
+    switch_event_unbind_callback(m2_radius_accounting_start);
+    switch_event_unbind_callback(m2_xml_radius_reload_event);
+    switch_scheduler_del_task_group(M2_RADIUS_INTERIM_GROUP);
+    m2_radius_bench_stop();
+    m2_radius_node_stop();
+
+    // send what is left in accounting queues
+    globals.running = 0;
+    m2_radius_acct_delayed_stop();
+    m2_radius_acct_senders_stop();
+    m2_radius_spool_stop();
+    m2_radius_shadow_stop();
+    m2_radius_ipc_stop();
+    m2_radius_coa_stop();
+    m2_radius_devices_stop();
+    m2_radius_stats_stop();
+    m2_radius_capture_open("");
+    switch_event_free_subclass(M2_RADIUS_STATS_EVENT);
+
+    // radius handles are destroyed when the last request using them returns
+    m2_radius_handles_swap(NULL);
 
     return SWITCH_STATUS_SUCCESS;
 
@@ -0,0 +1,45 @@
+/*
+    Unit test helpers
+
+    Test includes the source file it tests, so static functions can be called directly.
+    Run with -v to see the module log
+*/
+
+
+#ifndef M2_TEST_H
+#define M2_TEST_H
+
+#include <stdio.h>
+#include <string.h>
+
+extern int m2_test_verbose;
+
+// channel with its own variables, defined in stubs/switch_stubs.c
+struct switch_channel *m2_test_channel_create(const char *uuid);
+
+static int m2_test_checks = 0;
+static int m2_test_failures = 0;
+
+#define M2_TEST_CHECK(expr) do { \
+    m2_test_checks++; \
+    if (!(expr)) { \
+        m2_test_failures++; \
+        fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #expr); \
+    } \
+} while (0)
+
+static void m2_test_init(int argc, char **argv) {
+
+    m2_test_verbose = argc > 1 && !strcmp(argv[1], "-v");
+
+}
+
+static int m2_test_done(const char *name) {
+
+    printf("%s: %d checks, %d failed\n", name, m2_test_checks, m2_test_failures);
+
+    return m2_test_failures ? 1 : 0;
+
+}
+
+#endif
@@ -0,0 +1,53 @@
+/* freeradius-client API used by mod_xml_m2_radius.c, declarations only so unit tests build without the library */
+#ifndef STUB_FREERADIUS_CLIENT_H
+#define STUB_FREERADIUS_CLIENT_H
+#include <stdint.h>
+#include <stddef.h>
+typedef struct rc_handle rc_handle;
+#define AUTH_STRING_LEN 253
+typedef struct value_pair { char name[64]; int attribute; int type; uint32_t lvalue; char strvalue[AUTH_STRING_LEN + 1]; struct value_pair *next; } VALUE_PAIR;
+typedef struct dict_attr { char name[64]; int value; int type; } DICT_ATTR;
+typedef struct dict_vendor { char vendorname[64]; int vendorpec; } DICT_VENDOR;
+enum { OK_RC = 0, BADRESP_RC = 2, ERROR_RC = -1, TIMEOUT_RC = 1, REJECT_RC = 3 };
+enum { PW_TYPE_STRING, PW_TYPE_INTEGER };
+#define PW_ACCESS_REQUEST 1
+#define PW_ACCESS_ACCEPT 2
+#define PW_ACCESS_REJECT 3
+#define PW_ACCOUNTING_REQUEST 4
+#define PW_ACCOUNTING_RESPONSE 5
+#define PW_VENDOR_SPECIFIC 26
+#define PW_ACCT_STATUS_TYPE 40
+#define PW_USER_PASSWORD 2
+#define PW_STATUS_START 1
+#define PW_STATUS_STOP 2
+#define PW_STATUS_ALIVE 3
+#define PW_STATUS_ACCOUNTING_ON 7
+#define PW_STATUS_ACCOUNTING_OFF 8
+#define PW_SERVICE_TYPE 6
+#define PW_NAS_IP_ADDRESS 4
+#define PW_NAS_IDENTIFIER 32
+#define PW_AUTHENTICATE_ONLY 8
+#define PW_ACCT_SESSION_ID 44
+#define PW_ACCT_DELAY_TIME 41
+#define PW_ACCT_SESSION_TIME 46
+#define PW_REPLY_MESSAGE 18
+#define AUTH_SECONDARY 1
+#define VENDOR(x) (((x) >> 16) & 0xffff)
+#define ATTRID(x) ((x) & 0xffff)
+rc_handle *rc_new(void);
+rc_handle *rc_config_init(rc_handle *);
+void rc_destroy(rc_handle *);
+int rc_add_config(rc_handle *, const char *, const char *, const char *, int);
+int rc_read_dictionary(rc_handle *, const char *);
+char *rc_conf_str(rc_handle *, const char *);
+int rc_conf_int(rc_handle *, const char *);
+VALUE_PAIR *rc_avpair_add(rc_handle *, VALUE_PAIR **, int, const void *, int, int);
+void rc_avpair_free(VALUE_PAIR *);
+int rc_avpair_tostr(rc_handle *, VALUE_PAIR *, char *, int, char *, int);
+DICT_ATTR *rc_dict_findattr(rc_handle *, const char *);
+DICT_ATTR *rc_dict_getattr(rc_handle *, int);
+DICT_VENDOR *rc_dict_findvend(rc_handle *, const char *);
+int rc_auth(rc_handle *, uint32_t, VALUE_PAIR *, VALUE_PAIR **, char *);
+int rc_acct(rc_handle *, uint32_t, VALUE_PAIR *);
+void rc_md5_calc(unsigned char *output, const unsigned char *input, size_t inlen);
+#endif
@@ -0,0 +1,36 @@
+/* rlm_m2 core and FreeRADIUS 2 server API used by m2_*.c, just enough for unit tests to build the core sources they include */
+#ifndef STUB_M2_CORE_H
+#define STUB_M2_CORE_H
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+size_t strlcpy(char *dst, const char *src, size_t size);
+#define PW_TYPE_STRING 0
+#define PW_TYPE_INTEGER 1
+#define PW_TYPE_IPADDR 2
+#define T_OP_EQ 11
+#define T_OP_SET 12
+typedef struct value_pair { char name[40]; unsigned int attribute; unsigned int vendor; int type; size_t length; uint32_t lvalue; char strvalue[254]; struct value_pair *next; } VALUE_PAIR;
+#define vp_strvalue strvalue
+#define vp_integer lvalue
+typedef struct radius_packet { int code; VALUE_PAIR *vps; } RADIUS_PACKET;
+typedef struct request { RADIUS_PACKET *packet; RADIUS_PACKET *reply; VALUE_PAIR *config_items; unsigned int number; } REQUEST;
+VALUE_PAIR *pairmake(const char *attribute, const char *value, int operator);
+void pairadd(VALUE_PAIR **first, VALUE_PAIR *add);
+#define M2_WARNING 1
+#define M2_NOTICE 2
+#define M2_ERROR 3
+#define M2_DEBUG 4
+#define M2_CISCO_AVP 1
+#define M2_STANDARD_AVP 2
+typedef struct calldata_s { char uniqueid[256]; REQUEST *radius_auth_request; int bypass_early_media; } calldata_t;
+void m2_test_core_log(calldata_t *cd, int level, const char *fmt, ...) __attribute__((format(printf,3,4)));
+#define m2_log(level, ...) m2_test_core_log(cd, level, __VA_ARGS__)
+double m2_get_current_time(void);
+typedef struct { double attr_index_count_start; double attr_index_count; double attr_index_time; double attr_index_time_max; double attr_index_time_maxps; } m2_meter_t;
+extern m2_meter_t meter;
+static void m2_radius_add_attribute_value_pair(calldata_t *cd, char *attribute, char *value, int attr_type);
+#endif
@@ -0,0 +1,83 @@
+/*
+    Minimal rlm_m2 core runtime for unit tests
+
+    Value pairs are plain string pairs (FreeRADIUS 2 layout), log goes to stderr with -v.
+    Tests of the core link this instead of switch_stubs.c
+*/
+
+
+#include <stdarg.h>
+#include <sys/time.h>
+
+#include "m2_core.h"
+
+
+int m2_test_verbose = 0;
+
+m2_meter_t meter;
+
+void m2_test_core_log(calldata_t *cd, int level, const char *fmt, ...) {
+
+    va_list ap;
+
+    if (!m2_test_verbose) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+}
+
+size_t strlcpy(char *dst, const char *src, size_t size) {
+
+    size_t length = strlen(src);
+
+    if (size) {
+        size_t copy = length < size - 1 ? length : size - 1;
+
+        memcpy(dst, src, copy);
+        dst[copy] = '\0';
+    }
+
+    return length;
+
+}
+
+double m2_get_current_time(void) {
+
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+
+}
+
+VALUE_PAIR *pairmake(const char *attribute, const char *value, int operator) {
+
+    VALUE_PAIR *vp = NULL;
+
+    if ((vp = calloc(1, sizeof(VALUE_PAIR))) == NULL) {
+        return NULL;
+    }
+
+    strlcpy(vp->name, attribute, sizeof(vp->name));
+    strlcpy(vp->strvalue, value, sizeof(vp->strvalue));
+    vp->type = PW_TYPE_STRING;
+    vp->length = strlen(vp->strvalue);
+
+    return vp;
+
+}
+
+void pairadd(VALUE_PAIR **first, VALUE_PAIR *add) {
+
+    while (*first) {
+        first = &(*first)->next;
+    }
+
+    *first = add;
+
+}
@@ -0,0 +1,21 @@
+/*
+    Minimal freeradius-client runtime for unit tests
+
+    Tests do not decode replies with a dictionary, attributes are never found
+*/
+
+
+#include "freeradius-client.h"
+
+
+DICT_ATTR *rc_dict_getattr(rc_handle *rh, int attribute) {
+
+    return NULL;
+
+}
+
+VALUE_PAIR *rc_avpair_add(rc_handle *rh, VALUE_PAIR **list, int attrid, const void *pval, int len, int vendorpec) {
+
+    return NULL;
+
+}
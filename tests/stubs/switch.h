@@ -0,0 +1,241 @@
+/* FreeSWITCH API used by mod_xml_m2_radius.c, declarations only so unit tests build without FreeSWITCH */
+#ifndef STUB_SWITCH_H
+#define STUB_SWITCH_H
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#define SWITCH_THREAD_FUNC
+typedef int64_t switch_time_t;
+typedef int64_t switch_interval_time_t;
+typedef size_t switch_size_t;
+typedef uint16_t switch_port_t;
+typedef int switch_bool_t;
+#define SWITCH_TRUE 1
+#define SWITCH_FALSE 0
+typedef enum { SWITCH_STATUS_SUCCESS, SWITCH_STATUS_FALSE, SWITCH_STATUS_TIMEOUT, SWITCH_STATUS_GENERR, SWITCH_STATUS_TERM, SWITCH_STATUS_NOTFOUND, SWITCH_STATUS_BREAK, SWITCH_STATUS_MEMERR, SWITCH_STATUS_INUSE } switch_status_t;
+typedef enum { SWITCH_LOG_DEBUG10=110, SWITCH_LOG_DEBUG=7, SWITCH_LOG_INFO=6, SWITCH_LOG_NOTICE=5, SWITCH_LOG_WARNING=4, SWITCH_LOG_ERROR=3, SWITCH_LOG_CRIT=2, SWITCH_LOG_ALERT=1, SWITCH_LOG_CONSOLE=0, SWITCH_LOG_INVALID=64 } switch_log_level_t;
+#define SWITCH_CHANNEL_LOG 0, __FILE__, __func__, __LINE__, NULL
+#define SWITCH_CHANNEL_SESSION_LOG(x) 1, __FILE__, __func__, __LINE__, (const char*)(x)
+void switch_log_printf(int channel, const char *file, const char *func, int line, const char *userdata, switch_log_level_t level, const char *fmt, ...) __attribute__((format(printf,7,8)));
+switch_log_level_t switch_log_str2level(const char *str);
+typedef struct switch_xml *switch_xml_t;
+struct switch_xml { char *name; char **attr; char *txt; char *free_path; switch_xml_t next; switch_xml_t sibling; switch_xml_t ordered; switch_xml_t child; switch_xml_t parent; uint32_t flags; switch_bool_t is_switch_xml_root_t; uint32_t refs; };
+switch_xml_t switch_xml_child(switch_xml_t xml, const char *name);
+const char *switch_xml_attr(switch_xml_t xml, const char *attr);
+const char *switch_xml_attr_soft(switch_xml_t xml, const char *attr);
+char *switch_xml_toxml(switch_xml_t xml, switch_bool_t prn_header);
+switch_xml_t switch_xml_open_cfg(const char *file_path, switch_xml_t *node, void *params);
+switch_xml_t switch_xml_dup(switch_xml_t xml);
+void switch_xml_free(switch_xml_t xml);
+typedef struct switch_memory_pool switch_memory_pool_t;
+typedef struct switch_mutex switch_mutex_t;
+typedef struct switch_thread_rwlock switch_thread_rwlock_t;
+typedef struct switch_thread_cond switch_thread_cond_t;
+typedef struct switch_thread switch_thread_t;
+typedef struct switch_threadattr switch_threadattr_t;
+typedef struct switch_queue switch_queue_t;
+typedef struct switch_hash switch_hash_t;
+typedef struct switch_hashtable_iterator switch_hash_index_t;
+typedef void *(*switch_thread_start_t)(switch_thread_t *, void *);
+#define SWITCH_MUTEX_NESTED 1
+#define SWITCH_MUTEX_DEFAULT 0
+switch_status_t switch_mutex_init(switch_mutex_t **lock, unsigned int flags, switch_memory_pool_t *pool);
+switch_status_t switch_mutex_destroy(switch_mutex_t *lock);
+switch_status_t switch_mutex_lock(switch_mutex_t *lock);
+switch_status_t switch_mutex_unlock(switch_mutex_t *lock);
+switch_status_t switch_mutex_trylock(switch_mutex_t *lock);
+switch_status_t switch_thread_rwlock_create(switch_thread_rwlock_t **rwlock, switch_memory_pool_t *pool);
+switch_status_t switch_thread_rwlock_rdlock(switch_thread_rwlock_t *rwlock);
+switch_status_t switch_thread_rwlock_wrlock(switch_thread_rwlock_t *rwlock);
+switch_status_t switch_thread_rwlock_unlock(switch_thread_rwlock_t *rwlock);
+switch_status_t switch_thread_cond_create(switch_thread_cond_t **cond, switch_memory_pool_t *pool);
+switch_status_t switch_thread_cond_wait(switch_thread_cond_t *cond, switch_mutex_t *mutex);
+switch_status_t switch_thread_cond_timedwait(switch_thread_cond_t *cond, switch_mutex_t *mutex, switch_interval_time_t timeout);
+switch_status_t switch_thread_cond_signal(switch_thread_cond_t *cond);
+switch_status_t switch_thread_cond_broadcast(switch_thread_cond_t *cond);
+switch_status_t switch_threadattr_create(switch_threadattr_t **new_attr, switch_memory_pool_t *pool);
+switch_status_t switch_threadattr_stacksize_set(switch_threadattr_t *attr, switch_size_t stacksize);
+switch_status_t switch_threadattr_detach_set(switch_threadattr_t *attr, int32_t on);
+switch_status_t switch_thread_create(switch_thread_t **new_thread, switch_threadattr_t *attr, switch_thread_start_t func, void *data, switch_memory_pool_t *cont);
+switch_status_t switch_thread_join(switch_status_t *retval, switch_thread_t *thd);
+#define SWITCH_THREAD_STACKSIZE 240*1024
+switch_status_t switch_queue_create(switch_queue_t **queue, unsigned int queue_capacity, switch_memory_pool_t *pool);
+switch_status_t switch_queue_push(switch_queue_t *queue, void *data);
+switch_status_t switch_queue_trypush(switch_queue_t *queue, void *data);
+switch_status_t switch_queue_pop(switch_queue_t *queue, void **data);
+switch_status_t switch_queue_pop_timeout(switch_queue_t *queue, void **data, switch_interval_time_t timeout);
+switch_status_t switch_queue_trypop(switch_queue_t *queue, void **data);
+switch_status_t switch_queue_interrupt_all(switch_queue_t *queue);
+switch_status_t switch_queue_term(switch_queue_t *queue);
+unsigned int switch_queue_size(switch_queue_t *queue);
+switch_status_t switch_core_new_memory_pool(switch_memory_pool_t **pool);
+switch_status_t switch_core_destroy_memory_pool(switch_memory_pool_t **pool);
+void *switch_core_alloc(switch_memory_pool_t *pool, switch_size_t size);
+char *switch_core_strdup(switch_memory_pool_t *pool, const char *todup);
+char *switch_core_sprintf(switch_memory_pool_t *pool, const char *fmt, ...);
+typedef struct switch_core_session switch_core_session_t;
+typedef struct switch_channel switch_channel_t;
+void *switch_core_session_alloc(switch_core_session_t *session, switch_size_t memory);
+char *switch_core_session_strdup(switch_core_session_t *session, const char *todup);
+char *switch_core_session_sprintf(switch_core_session_t *session, const char *fmt, ...);
+switch_memory_pool_t *switch_core_session_get_pool(switch_core_session_t *session);
+char *switch_core_session_get_uuid(switch_core_session_t *session);
+switch_core_session_t *switch_core_session_locate(const char *uuid_str);
+void switch_core_session_rwunlock(switch_core_session_t *session);
+switch_status_t switch_core_session_execute_application(switch_core_session_t *session, const char *app, const char *arg);
+switch_status_t switch_core_session_execute_application_get_flags(switch_core_session_t *session, const char *app, const char *arg, int32_t *flags);
+switch_channel_t *switch_core_session_get_channel(switch_core_session_t *session);
+typedef enum { SWITCH_CAUSE_NONE=0, SWITCH_CAUSE_NORMAL_CLEARING=16, SWITCH_CAUSE_USER_BUSY=17, SWITCH_CAUSE_NO_USER_RESPONSE=18, SWITCH_CAUSE_NO_ANSWER=19, SWITCH_CAUSE_CALL_REJECTED=21, SWITCH_CAUSE_NORMAL_TEMPORARY_FAILURE=41, SWITCH_CAUSE_SWITCH_CONGESTION=42, SWITCH_CAUSE_OUTGOING_CALL_BARRED=52, SWITCH_CAUSE_INCOMING_CALL_BARRED=54, SWITCH_CAUSE_BEARERCAPABILITY_NOTAVAIL=58, SWITCH_CAUSE_SERVICE_UNAVAILABLE=63, SWITCH_CAUSE_INCOMPATIBLE_DESTINATION=88, SWITCH_CAUSE_NORMAL_UNSPECIFIED=31, SWITCH_CAUSE_NO_ROUTE_DESTINATION=3, SWITCH_CAUSE_ORIGINATOR_CANCEL=487, SWITCH_CAUSE_ALLOTTED_TIMEOUT=602, SWITCH_CAUSE_SYSTEM_SHUTDOWN=503, SWITCH_CAUSE_MANAGER_REQUEST=503+1, SWITCH_CAUSE_DESTINATION_OUT_OF_ORDER=27, SWITCH_CAUSE_RECOVERY_ON_TIMER_EXPIRE=102 } switch_call_cause_t;
+typedef enum { CF_ANSWERED, CF_TRANSFER, CF_BRIDGED, CF_EARLY_MEDIA } switch_channel_flag_t;
+typedef enum { CS_NEW, CS_INIT, CS_ROUTING, CS_EXECUTE, CS_HANGUP, CS_REPORTING, CS_DESTROY } switch_channel_state_t;
+typedef struct { switch_time_t created; switch_time_t answered; switch_time_t progress; switch_time_t progress_media; switch_time_t hungup; switch_time_t transferred; } switch_channel_timetable_t;
+typedef struct switch_caller_profile { const char *caller_id_number; const char *destination_number; const char *network_addr; switch_channel_timetable_t *times; } switch_caller_profile_t;
+const char *switch_channel_get_variable(switch_channel_t *channel, const char *varname);
+const char *switch_channel_get_variable_dup(switch_channel_t *channel, const char *varname, switch_bool_t dup, int idx);
+const char *switch_channel_get_variable_partner(switch_channel_t *channel, const char *varname);
+switch_status_t switch_channel_set_variable(switch_channel_t *channel, const char *varname, const char *value);
+switch_status_t switch_channel_set_variable_var_check(switch_channel_t *channel, const char *varname, const char *value, switch_bool_t var_check);
+switch_status_t switch_channel_set_variable_printf(switch_channel_t *channel, const char *varname, const char *fmt, ...);
+switch_status_t switch_channel_set_variable_partner(switch_channel_t *channel, const char *varname, const char *value);
+switch_call_cause_t switch_channel_get_cause(switch_channel_t *channel);
+switch_call_cause_t switch_channel_get_cause_q850(switch_channel_t *channel);
+const char *switch_channel_cause2str(switch_call_cause_t cause);
+switch_call_cause_t switch_channel_str2cause(const char *str);
+switch_caller_profile_t *switch_channel_get_caller_profile(switch_channel_t *channel);
+int switch_channel_test_flag(switch_channel_t *channel, switch_channel_flag_t flag);
+switch_channel_state_t switch_channel_get_state(switch_channel_t *channel);
+int switch_channel_up(switch_channel_t *channel);
+int switch_channel_ready(switch_channel_t *channel);
+#define switch_channel_up_nosig(c) switch_channel_up(c)
+#define switch_channel_hangup(channel, hangup_cause) switch_channel_perform_hangup(channel, __FILE__, __func__, __LINE__, hangup_cause)
+switch_channel_state_t switch_channel_perform_hangup(switch_channel_t *channel, const char *file, const char *func, int line, switch_call_cause_t hangup_cause);
+switch_status_t switch_channel_set_private(switch_channel_t *channel, const char *key, const void *private_info);
+void *switch_channel_get_private(switch_channel_t *channel, const char *key);
+const char *switch_channel_get_name(switch_channel_t *channel);
+char *switch_channel_get_uuid(switch_channel_t *channel);
+switch_status_t switch_channel_set_timestamps(switch_channel_t *channel);
+switch_status_t switch_channel_execute_on(switch_channel_t *channel, const char *variable_prefix);
+typedef struct switch_event_header { char *name; char *value; struct switch_event_header *next; } switch_event_header_t;
+typedef enum { SWITCH_EVENT_CUSTOM, SWITCH_EVENT_CHANNEL_ANSWER, SWITCH_EVENT_CHANNEL_HANGUP_COMPLETE, SWITCH_EVENT_RELOADXML, SWITCH_EVENT_LOG, SWITCH_EVENT_HEARTBEAT, SWITCH_EVENT_CLONE, SWITCH_EVENT_ALL } switch_event_types_t;
+typedef struct switch_event { switch_event_types_t event_id; switch_event_header_t *headers; char *subclass_name; char *body; } switch_event_t;
+typedef enum { SWITCH_STACK_BOTTOM, SWITCH_STACK_TOP } switch_stack_t;
+#define SWITCH_EVENT_SUBCLASS_ANY NULL
+typedef void (*switch_event_callback_t)(switch_event_t *);
+typedef struct switch_event_node switch_event_node_t;
+switch_status_t switch_event_bind(const char *id, switch_event_types_t event, const char *subclass_name, switch_event_callback_t callback, void *user_data);
+switch_status_t switch_event_bind_removable(const char *id, switch_event_types_t event, const char *subclass_name, switch_event_callback_t callback, void *user_data, switch_event_node_t **node);
+switch_status_t switch_event_unbind(switch_event_node_t **node);
+switch_status_t switch_event_unbind_callback(switch_event_callback_t callback);
+switch_status_t switch_event_reserve_subclass_detailed(const char *owner, const char *subclass_name);
+#define switch_event_reserve_subclass(s) switch_event_reserve_subclass_detailed(__FILE__, s)
+switch_status_t switch_event_free_subclass_detailed(const char *owner, const char *subclass_name);
+#define switch_event_free_subclass(s) switch_event_free_subclass_detailed(__FILE__, s)
+switch_status_t switch_event_create_subclass_detailed(const char *file, const char *func, int line, switch_event_t **event, switch_event_types_t event_id, const char *subclass_name);
+#define switch_event_create_subclass(e, id, sub) switch_event_create_subclass_detailed(__FILE__, __func__, __LINE__, e, id, sub)
+#define switch_event_create(e, id) switch_event_create_subclass(e, id, NULL)
+switch_status_t switch_event_add_header(switch_event_t *event, switch_stack_t stack, const char *header_name, const char *fmt, ...);
+switch_status_t switch_event_add_header_string(switch_event_t *event, switch_stack_t stack, const char *header_name, const char *data);
+switch_status_t switch_event_add_body(switch_event_t *event, const char *fmt, ...);
+char *switch_event_get_header(switch_event_t *event, const char *header_name);
+switch_status_t switch_event_fire_detailed(const char *file, const char *func, int line, switch_event_t **event, void *user_data);
+#define switch_event_fire(e) switch_event_fire_detailed(__FILE__, __func__, __LINE__, e, NULL)
+void switch_event_destroy(switch_event_t **event);
+switch_status_t switch_event_dup(switch_event_t **event, switch_event_t *todup);
+switch_status_t switch_event_add_header(switch_event_t *event, switch_stack_t stack, const char *header_name, const char *fmt, ...);
+typedef struct switch_stream_handle switch_stream_handle_t;
+typedef switch_status_t (*switch_stream_handle_write_function_t)(switch_stream_handle_t *handle, const char *fmt, ...);
+struct switch_stream_handle { switch_stream_handle_write_function_t write_function; void *data; switch_size_t data_len; };
+typedef struct switch_loadable_module_interface switch_loadable_module_interface_t;
+typedef struct switch_application_interface switch_application_interface_t;
+typedef struct switch_api_interface switch_api_interface_t;
+typedef struct switch_state_handler_table { switch_status_t (*on_init)(switch_core_session_t*); switch_status_t (*on_routing)(switch_core_session_t*); switch_status_t (*on_execute)(switch_core_session_t*); switch_status_t (*on_hangup)(switch_core_session_t*); switch_status_t (*on_exchange_media)(switch_core_session_t*); switch_status_t (*on_soft_execute)(switch_core_session_t*); switch_status_t (*on_consume_media)(switch_core_session_t*); switch_status_t (*on_hibernate)(switch_core_session_t*); switch_status_t (*on_reset)(switch_core_session_t*); switch_status_t (*on_park)(switch_core_session_t*); switch_status_t (*on_reporting)(switch_core_session_t*); } switch_state_handler_table_t;
+int switch_core_add_state_handler(const switch_state_handler_table_t *state_handler);
+void switch_core_remove_state_handler(const switch_state_handler_table_t *state_handler);
+switch_loadable_module_interface_t *switch_loadable_module_create_module_interface(switch_memory_pool_t *pool, const char *name);
+void *switch_loadable_module_create_interface(switch_loadable_module_interface_t *mod, int iname);
+#define SWITCH_MODULE_LOAD_ARGS (switch_loadable_module_interface_t **module_interface, switch_memory_pool_t *pool)
+#define SWITCH_MODULE_SHUTDOWN_ARGS (void)
+#define SWITCH_MODULE_RUNTIME_ARGS (void)
+static const char modname[] = "stub";
+#define SWITCH_MODULE_LOAD_FUNCTION(name) switch_status_t name SWITCH_MODULE_LOAD_ARGS
+#define SWITCH_MODULE_SHUTDOWN_FUNCTION(name) switch_status_t name SWITCH_MODULE_SHUTDOWN_ARGS
+#define SWITCH_MODULE_RUNTIME_FUNCTION(name) switch_status_t name SWITCH_MODULE_RUNTIME_ARGS
+#define SWITCH_MODULE_DEFINITION(name, load, shutdown, runtime) int name##_module_interface = 0
+#define SWITCH_STANDARD_APP(name) static void name (switch_core_session_t *session, const char *data)
+#define SWITCH_STANDARD_API(name) static switch_status_t name (const char *cmd, switch_core_session_t *session, switch_stream_handle_t *stream)
+#define SAF_SUPPORT_NOMEDIA 1
+#define SAF_ROUTING_EXEC 2
+#define SWITCH_ADD_APP(app_int, int_name, short_descript, long_descript, funcptr, syntax_string, app_flags) do { (void)app_int; (void)funcptr; } while(0)
+#define SWITCH_ADD_API(api_int, int_name, descript, funcptr, syntax_string) do { (void)api_int; (void)funcptr; } while(0)
+switch_time_t switch_micro_time_now(void);
+switch_time_t switch_time_now(void);
+time_t switch_epoch_time_now(time_t *t);
+void switch_yield(int ms);
+#define switch_yield(ms) switch_sleep(ms)
+void switch_sleep(switch_interval_time_t t);
+typedef struct { int32_t tm_usec; int32_t tm_sec; int32_t tm_min; int32_t tm_hour; int32_t tm_mday; int32_t tm_mon; int32_t tm_year; int32_t tm_wday; int32_t tm_yday; int32_t tm_isdst; int32_t tm_gmtoff; } switch_time_exp_t;
+switch_status_t switch_time_exp_lt(switch_time_exp_t *result, switch_time_t input);
+int switch_snprintf(char *buf, switch_size_t len, const char *format, ...);
+char *switch_mprintf(const char *zFormat, ...);
+#define zstr(x) (!(x) || *(x) == '\0')
+#define switch_true(x) ((x) && (!strcasecmp(x,"yes") || !strcasecmp(x,"on") || !strcasecmp(x,"true") || atoi(x)))
+#define switch_safe_free(it) if (it) {free(it);it=NULL;}
+#define switch_set_string(_dst, _src) switch_copy_string(_dst, _src, sizeof(_dst))
+char *switch_copy_string(char *dst, const char *src, switch_size_t dst_size);
+int switch_separate_string(char *buf, char delim, char **array, unsigned int arraylen);
+#define SWITCH_MD5_DIGESTSIZE 16
+switch_status_t switch_md5(unsigned char digest[SWITCH_MD5_DIGESTSIZE], const void *input, switch_size_t inputLen);
+typedef struct { char *uuid; } switch_uuid_t;
+typedef uint32_t (*switch_scheduler_func_t)(void *task);
+typedef struct switch_scheduler_task { int64_t created; int64_t runtime; uint32_t cmd_id; uint32_t repeat; char *group; void *cmd_arg; uint32_t task_id; unsigned long hash; } switch_scheduler_task_t;
+#define SWITCH_STANDARD_SCHED_FUNC(name) static void name (switch_scheduler_task_t *task)
+typedef void (*switch_scheduler_func_t2)(switch_scheduler_task_t *task);
+#define SSHF_NONE 0
+#define SSHF_FREE_ARG 2
+#define SSHF_NO_DEL 4
+uint32_t switch_scheduler_add_task(time_t task_runtime, switch_scheduler_func_t2 func, const char *desc, const char *group, uint32_t cmd_id, void *cmd_arg, int flags);
+uint32_t switch_scheduler_del_task_group(const char *group);
+uint32_t switch_scheduler_del_task_id(uint32_t task_id);
+switch_status_t switch_core_hash_init(switch_hash_t **hash);
+switch_status_t switch_core_hash_destroy(switch_hash_t **hash);
+switch_status_t switch_core_hash_insert(switch_hash_t *hash, const char *key, const void *data);
+void *switch_core_hash_find(switch_hash_t *hash, const char *key);
+void *switch_core_hash_delete(switch_hash_t *hash, const char *key);
+switch_hash_index_t *switch_core_hash_first(switch_hash_t *hash);
+switch_hash_index_t *switch_core_hash_next(switch_hash_index_t **hi);
+void switch_core_hash_this(switch_hash_index_t *hi, const void **key, switch_size_t *klen, void **val);
+switch_status_t switch_api_execute(const char *cmd, const char *arg, switch_core_session_t *session, switch_stream_handle_t *stream);
+#define SWITCH_STANDARD_STREAM(s) memset(&s, 0, sizeof(s))
+typedef struct switch_sockaddr switch_sockaddr_t;
+typedef struct switch_socket switch_socket_t;
+switch_status_t switch_ivr_originate(switch_core_session_t *session, switch_core_session_t **bleg, switch_call_cause_t *cause, const char *bridgeto, uint32_t timelimit_sec, const void *table, const char *cid_name_override, const char *cid_num_override, switch_caller_profile_t *caller_profile_override, void *ovars, int flags, void *cancel_cause, void *dh);
+switch_status_t switch_ivr_multi_threaded_bridge(switch_core_session_t *session, switch_core_session_t *peer_session, void *dtmf_callback, void *session_data, void *peer_session_data);
+int switch_core_session_count(void);
+const char *switch_core_get_variable(const char *varname);
+#define SWITCH_UUID_FORMATTED_LENGTH 36
+#define switch_assert(x) ((void)0)
+int switch_atomic_read(volatile int *mem);
+#define SWITCH_EVENT_SUBCLASS_NONE NULL
+typedef struct switch_console_callback_match_node { char *val; struct switch_console_callback_match_node *next; } switch_console_callback_match_node_t;
+typedef struct switch_console_callback_match { switch_console_callback_match_node_t *head; switch_console_callback_match_node_t *end; int count; int dynamic; } switch_console_callback_match_t;
+switch_console_callback_match_t *switch_core_session_findall(void);
+void switch_console_free_matches(switch_console_callback_match_t **matches);
+#endif
+#ifndef SOF_NONE
+#define SOF_NONE 0
+#define SAF_NONE 0
+uint8_t switch_channel_cause_q850(switch_call_cause_t cause);
+#endif
+uint32_t switch_ivr_schedule_hangup(time_t runtime, const char *uuid, switch_call_cause_t cause, switch_bool_t bleg);
+switch_bool_t switch_check_network_list_ip(const char *ip_str, const char *list_name);
+#define switch_str_nil(s) (s ? s : "")
@@ -0,0 +1 @@
+/* event API is declared in switch.h */
@@ -0,0 +1,524 @@
+/*
+    Minimal FreeSWITCH runtime for unit tests
+
+    Only functions reached by the tested code are implemented, tests are linked with --gc-sections
+    so the rest of the module does not need them. Mutexes are pthread mutexes, hash is a plain list
+*/
+
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "switch.h"
+
+
+int m2_test_verbose = 0;
+
+void switch_log_printf(int channel, const char *file, const char *func, int line, const char *userdata, switch_log_level_t level, const char *fmt, ...) {
+
+    va_list ap;
+
+    if (!m2_test_verbose) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+}
+
+struct switch_mutex {
+    pthread_mutex_t mutex;
+};
+
+switch_status_t switch_mutex_init(switch_mutex_t **lock, unsigned int flags, switch_memory_pool_t *pool) {
+
+    pthread_mutexattr_t attr;
+
+    if ((*lock = calloc(1, sizeof(switch_mutex_t))) == NULL) {
+        return SWITCH_STATUS_MEMERR;
+    }
+
+    pthread_mutexattr_init(&attr);
+    if (flags & SWITCH_MUTEX_NESTED) {
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    }
+    pthread_mutex_init(&(*lock)->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    return SWITCH_STATUS_SUCCESS;
+
+}
+
+switch_status_t switch_mutex_lock(switch_mutex_t *lock) {
+
+    return pthread_mutex_lock(&lock->mutex) ? SWITCH_STATUS_FALSE : SWITCH_STATUS_SUCCESS;
+
+}
+
+switch_status_t switch_mutex_unlock(switch_mutex_t *lock) {
+
+    return pthread_mutex_unlock(&lock->mutex) ? SWITCH_STATUS_FALSE : SWITCH_STATUS_SUCCESS;
+
+}
+
+void *switch_core_alloc(switch_memory_pool_t *pool, switch_size_t size) {
+
+    return calloc(1, size);
+
+}
+
+switch_time_t switch_micro_time_now(void) {
+
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (switch_time_t) tv.tv_sec * 1000000 + tv.tv_usec;
+
+}
+
+void switch_sleep(switch_interval_time_t t) {
+
+    usleep((useconds_t) t);
+
+}
+
+char *switch_copy_string(char *dst, const char *src, switch_size_t dst_size) {
+
+    if (dst_size == 0) {
+        return dst;
+    }
+
+    snprintf(dst, dst_size, "%s", src ? src : "");
+
+    return dst;
+
+}
+
+typedef struct switch_hash_entry {
+    char *key;
+    void *val;
+    struct switch_hash_entry *next;
+} switch_hash_entry_t;
+
+struct switch_hash {
+    switch_hash_entry_t *head;
+};
+
+struct switch_hashtable_iterator {
+    switch_hash_entry_t *entry;
+};
+
+switch_status_t switch_core_hash_init(switch_hash_t **hash) {
+
+    *hash = calloc(1, sizeof(switch_hash_t));
+
+    return *hash ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_MEMERR;
+
+}
+
+switch_status_t switch_core_hash_destroy(switch_hash_t **hash) {
+
+    switch_hash_entry_t *entry = NULL;
+
+    if (*hash == NULL) {
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    while ((entry = (*hash)->head)) {
+        (*hash)->head = entry->next;
+        free(entry->key);
+        free(entry);
+    }
+
+    free(*hash);
+    *hash = NULL;
+
+    return SWITCH_STATUS_SUCCESS;
+
+}
+
+switch_status_t switch_core_hash_insert(switch_hash_t *hash, const char *key, const void *data) {
+
+    switch_hash_entry_t *entry = NULL;
+
+    for (entry = hash->head; entry; entry = entry->next) {
+        if (!strcmp(entry->key, key)) {
+            entry->val = (void *) data;
+            return SWITCH_STATUS_SUCCESS;
+        }
+    }
+
+    if ((entry = calloc(1, sizeof(switch_hash_entry_t))) == NULL) {
+        return SWITCH_STATUS_MEMERR;
+    }
+
+    entry->key = strdup(key);
+    entry->val = (void *) data;
+    entry->next = hash->head;
+    hash->head = entry;
+
+    return SWITCH_STATUS_SUCCESS;
+
+}
+
+void *switch_core_hash_find(switch_hash_t *hash, const char *key) {
+
+    switch_hash_entry_t *entry = NULL;
+
+    for (entry = hash->head; entry; entry = entry->next) {
+        if (!strcmp(entry->key, key)) {
+            return entry->val;
+        }
+    }
+
+    return NULL;
+
+}
+
+void *switch_core_hash_delete(switch_hash_t *hash, const char *key) {
+
+    switch_hash_entry_t **entry = NULL;
+    switch_hash_entry_t *found = NULL;
+    void *val = NULL;
+
+    for (entry = &hash->head; *entry; entry = &(*entry)->next) {
+        if (!strcmp((*entry)->key, key)) {
+            found = *entry;
+            *entry = found->next;
+            val = found->val;
+            free(found->key);
+            free(found);
+            break;
+        }
+    }
+
+    return val;
+
+}
+
+switch_hash_index_t *switch_core_hash_first(switch_hash_t *hash) {
+
+    switch_hash_index_t *hi = NULL;
+
+    if (hash->head == NULL || (hi = calloc(1, sizeof(switch_hash_index_t))) == NULL) {
+        return NULL;
+    }
+
+    hi->entry = hash->head;
+
+    return hi;
+
+}
+
+switch_hash_index_t *switch_core_hash_next(switch_hash_index_t **hi) {
+
+    if ((*hi)->entry->next == NULL) {
+        free(*hi);
+        *hi = NULL;
+        return NULL;
+    }
+
+    (*hi)->entry = (*hi)->entry->next;
+
+    return *hi;
+
+}
+
+void switch_core_hash_this(switch_hash_index_t *hi, const void **key, switch_size_t *klen, void **val) {
+
+    if (key) *key = hi->entry->key;
+    if (klen) *klen = strlen(hi->entry->key) + 1;
+    if (val) *val = hi->entry->val;
+
+}
+
+struct switch_thread {
+    pthread_t thread;
+    switch_thread_start_t func;
+    void *data;
+};
+
+struct switch_threadattr {
+    switch_size_t stacksize;
+};
+
+struct switch_thread_cond {
+    pthread_cond_t cond;
+};
+
+static void *switch_thread_run(void *obj) {
+
+    switch_thread_t *thread = (switch_thread_t *) obj;
+
+    return thread->func(thread, thread->data);
+
+}
+
+switch_status_t switch_threadattr_create(switch_threadattr_t **new_attr, switch_memory_pool_t *pool) {
+
+    *new_attr = calloc(1, sizeof(switch_threadattr_t));
+
+    return *new_attr ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_MEMERR;
+
+}
+
+switch_status_t switch_threadattr_stacksize_set(switch_threadattr_t *attr, switch_size_t stacksize) {
+
+    attr->stacksize = stacksize;
+
+    return SWITCH_STATUS_SUCCESS;
+
+}
+
+switch_status_t switch_thread_create(switch_thread_t **new_thread, switch_threadattr_t *attr, switch_thread_start_t func, void *data, switch_memory_pool_t *cont) {
+
+    switch_thread_t *thread = NULL;
+
+    if ((thread = calloc(1, sizeof(switch_thread_t))) == NULL) {
+        return SWITCH_STATUS_MEMERR;
+    }
+
+    thread->func = func;
+    thread->data = data;
+
+    if (pthread_create(&thread->thread, NULL, switch_thread_run, thread)) {
+        free(thread);
+        return SWITCH_STATUS_FALSE;
+    }
+
+    *new_thread = thread;
+
+    return SWITCH_STATUS_SUCCESS;
+
+}
+
+switch_status_t switch_thread_join(switch_status_t *retval, switch_thread_t *thd) {
+
+    pthread_join(thd->thread, NULL);
+    free(thd);
+    *retval = SWITCH_STATUS_SUCCESS;
+
+    return SWITCH_STATUS_SUCCESS;
+
+}
+
+switch_status_t switch_thread_cond_create(switch_thread_cond_t **cond, switch_memory_pool_t *pool) {
+
+    if ((*cond = calloc(1, sizeof(switch_thread_cond_t))) == NULL) {
+        return SWITCH_STATUS_MEMERR;
+    }
+
+    pthread_cond_init(&(*cond)->cond, NULL);
+
+    return SWITCH_STATUS_SUCCESS;
+
+}
+
+switch_status_t switch_thread_cond_wait(switch_thread_cond_t *cond, switch_mutex_t *mutex) {
+
+    return pthread_cond_wait(&cond->cond, &mutex->mutex) ? SWITCH_STATUS_FALSE : SWITCH_STATUS_SUCCESS;
+
+}
+
+switch_status_t switch_thread_cond_timedwait(switch_thread_cond_t *cond, switch_mutex_t *mutex, switch_interval_time_t timeout) {
+
+    struct timespec ts;
+    int res = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000000;
+    ts.tv_nsec += (timeout % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    res = pthread_cond_timedwait(&cond->cond, &mutex->mutex, &ts);
+
+    return res == ETIMEDOUT ? SWITCH_STATUS_TIMEOUT : res ? SWITCH_STATUS_FALSE : SWITCH_STATUS_SUCCESS;
+
+}
+
+switch_status_t switch_thread_cond_signal(switch_thread_cond_t *cond) {
+
+    pthread_cond_signal(&cond->cond);
+
+    return SWITCH_STATUS_SUCCESS;
+
+}
+
+switch_status_t switch_thread_cond_broadcast(switch_thread_cond_t *cond) {
+
+    pthread_cond_broadcast(&cond->cond);
+
+    return SWITCH_STATUS_SUCCESS;
+
+}
+
+// MD5 (RFC 1321), radius authenticators are checked against it
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const int md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_block(uint32_t *h, const unsigned char *block) {
+
+    uint32_t w[16];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[i * 4] | ((uint32_t) block[i * 4 + 1] << 8) | ((uint32_t) block[i * 4 + 2] << 16) | ((uint32_t) block[i * 4 + 3] << 24);
+    }
+
+    for (i = 0; i < 64; i++) {
+        uint32_t f, t;
+        int g;
+
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+
+        t = d;
+        d = c;
+        c = b;
+        f += a + md5_k[i] + w[g];
+        b += (f << md5_r[i]) | (f >> (32 - md5_r[i]));
+        a = t;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+
+}
+
+switch_status_t switch_md5(unsigned char digest[SWITCH_MD5_DIGESTSIZE], const void *input, switch_size_t inputLen) {
+
+    const unsigned char *data = (const unsigned char *) input;
+    uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    unsigned char tail[128];
+    uint64_t bits = (uint64_t) inputLen * 8;
+    switch_size_t offset = 0;
+    switch_size_t rest = 0;
+    switch_size_t tail_length = 0;
+    int i;
+
+    for (offset = 0; offset + 64 <= inputLen; offset += 64) {
+        md5_block(h, data + offset);
+    }
+
+    rest = inputLen - offset;
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + offset, rest);
+    tail[rest] = 0x80;
+    tail_length = rest + 1 + 8 <= 64 ? 64 : 128;
+    for (i = 0; i < 8; i++) {
+        tail[tail_length - 8 + i] = (unsigned char) (bits >> (i * 8));
+    }
+
+    md5_block(h, tail);
+    if (tail_length == 128) {
+        md5_block(h, tail + 64);
+    }
+
+    for (i = 0; i < 16; i++) {
+        digest[i] = (unsigned char) (h[i / 4] >> ((i % 4) * 8));
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+
+}
+
+// channel is a uuid and its variables, tests create it with m2_test_channel_create
+
+struct switch_channel {
+    char uuid[64];
+    switch_hash_t *variables;
+};
+
+switch_channel_t *m2_test_channel_create(const char *uuid) {
+
+    switch_channel_t *channel = NULL;
+
+    if ((channel = calloc(1, sizeof(switch_channel_t))) == NULL) {
+        return NULL;
+    }
+
+    switch_copy_string(channel->uuid, uuid, sizeof(channel->uuid));
+    switch_core_hash_init(&channel->variables);
+
+    return channel;
+
+}
+
+char *switch_channel_get_uuid(switch_channel_t *channel) {
+
+    return channel->uuid;
+
+}
+
+const char *switch_channel_get_variable(switch_channel_t *channel, const char *varname) {
+
+    return switch_core_hash_find(channel->variables, varname);
+
+}
+
+const char *switch_channel_get_variable_partner(switch_channel_t *channel, const char *varname) {
+
+    return NULL;
+
+}
+
+switch_status_t switch_channel_set_variable(switch_channel_t *channel, const char *varname, const char *value) {
+
+    free(switch_core_hash_delete(channel->variables, varname));
+
+    if (value == NULL) {
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    return switch_core_hash_insert(channel->variables, varname, strdup(value));
+
+}
+
+switch_status_t switch_channel_set_variable_printf(switch_channel_t *channel, const char *varname, const char *fmt, ...) {
+
+    char value[1024];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(value, sizeof(value), fmt, ap);
+    va_end(ap);
+
+    return switch_channel_set_variable(channel, varname, value);
+
+}
@@ -0,0 +1,188 @@
+/*
+    Core attribute index tests
+
+    Seed search of the perfect hash over known attribute names, key lookup and index lookups
+    giving the same values as the packet search
+*/
+
+
+#include "m2_core.h"
+#include "../m2_freeradius.c"
+#include "m2_test.h"
+
+
+// m2_active_calls.c is not built here, only START and STOP accounting types are checked
+
+static void m2_interim_update(REQUEST *request) {
+
+}
+
+static void m2_media_server_status(REQUEST *request, int type) {
+
+}
+
+static void test_add(REQUEST *request, const char *attribute, const char *value) {
+
+    pairadd(&request->packet->vps, pairmake(attribute, value, T_OP_EQ));
+
+}
+
+static REQUEST *test_request(unsigned int number) {
+
+    REQUEST *request = calloc(1, sizeof(REQUEST));
+
+    request->packet = calloc(1, sizeof(RADIUS_PACKET));
+    request->number = number;
+
+    test_add(request, "User-Name", "alice");
+    test_add(request, "Calling-Station-Id", "100");
+    test_add(request, "Acct-Status-Type", "Stop");
+    test_add(request, "User-Name", "bob");
+    test_add(request, "Framed-Protocol", "PPP");
+    test_add(request, "Cisco-AVPair", "noequals");
+    test_add(request, "Cisco-AVPair", "call-id=abc@10.0.0.1");
+    test_add(request, "Cisco-AVPair", "freeswitch-src-channel=sofia/internal/100");
+    test_add(request, "Cisco-AVPair", "freeswitch-src-channel=sofia/external/200");
+    test_add(request, "Cisco-AVPair", "freeswitch-hangupcause=16");
+
+    return request;
+
+}
+
+// every known name has its own slot and finds its own key
+
+static void test_seed_search(void) {
+
+    uint32_t seed = 0;
+    int used = 0;
+    size_t i;
+
+    M2_TEST_CHECK(m2_radius_attr_key_find("User-Name", strlen("User-Name"), M2_STANDARD_AVP) == 0);
+    M2_TEST_CHECK(m2_radius_attr_seed != 0);
+
+    for (i = 0; i < M2_RADIUS_ATTR_TABLE_SIZE; i++) {
+        if (m2_radius_attr_table[i]) used++;
+    }
+    M2_TEST_CHECK(used == (int) M2_RADIUS_ATTR_KEY_COUNT);
+
+    for (i = 0; i < M2_RADIUS_ATTR_KEY_COUNT; i++) {
+        const m2_radius_attr_key_t *key = &m2_radius_attr_keys[i];
+        uint32_t slot = m2_radius_attr_hash(key->name, strlen(key->name), key->attr_type, m2_radius_attr_seed);
+
+        M2_TEST_CHECK(m2_radius_attr_table[slot] == (int) i + 1);
+        M2_TEST_CHECK(m2_radius_attr_key_find(key->name, strlen(key->name), key->attr_type) == (int) i);
+    }
+
+    // seed search is deterministic, the first seed that fits is taken
+    seed = m2_radius_attr_seed;
+    m2_radius_attr_table_init();
+    M2_TEST_CHECK(m2_radius_attr_seed == seed);
+    for (i = 1; i < m2_radius_attr_seed; i++) {
+        int slots[M2_RADIUS_ATTR_TABLE_SIZE] = { 0 };
+        size_t k;
+
+        for (k = 0; k < M2_RADIUS_ATTR_KEY_COUNT; k++) {
+            const m2_radius_attr_key_t *key = &m2_radius_attr_keys[k];
+
+            if (slots[m2_radius_attr_hash(key->name, strlen(key->name), key->attr_type, (uint32_t) i)]++) break;
+        }
+        M2_TEST_CHECK(k < M2_RADIUS_ATTR_KEY_COUNT);
+    }
+
+}
+
+static void test_key_find(void) {
+
+    const char *avpair = "call-id=abc@10.0.0.1";
+
+    M2_TEST_CHECK(m2_radius_attr_key_find("Framed-Protocol", strlen("Framed-Protocol"), M2_STANDARD_AVP) == -1);
+    M2_TEST_CHECK(m2_radius_attr_key_find("User-Name", strlen("User-Name"), M2_CISCO_AVP) == -1);
+    M2_TEST_CHECK(m2_radius_attr_key_find("call-id", strlen("call-id"), M2_STANDARD_AVP) == -1);
+    M2_TEST_CHECK(m2_radius_attr_key_find("User-Nam", strlen("User-Nam"), M2_STANDARD_AVP) == -1);
+    M2_TEST_CHECK(m2_radius_attr_key_find("User-Names", strlen("User-Names"), M2_STANDARD_AVP) == -1);
+    M2_TEST_CHECK(m2_radius_attr_key_find("", 0, M2_STANDARD_AVP) == -1);
+
+    // Cisco-AVPair key is the part of the value before '='
+    M2_TEST_CHECK(m2_radius_attr_key_find(avpair, strchr(avpair, '=') - avpair, M2_CISCO_AVP) == 10);
+
+}
+
+// index gives the same value as packet search for every known name, unknown names are still found in the packet
+
+static void test_index_matches_scan(void) {
+
+    REQUEST *request = test_request(1);
+    size_t i;
+
+    for (i = 0; i < M2_RADIUS_ATTR_KEY_COUNT; i++) {
+        char indexed[256] = "";
+        char scanned[256] = "";
+
+        m2_radius_get_attribute_value_by_name(request, (char *) m2_radius_attr_keys[i].name, indexed, sizeof(indexed), m2_radius_attr_keys[i].attr_type);
+        m2_radius_scan_attribute_value(request, (char *) m2_radius_attr_keys[i].name, scanned, sizeof(scanned), m2_radius_attr_keys[i].attr_type);
+        M2_TEST_CHECK(!strcmp(indexed, scanned));
+    }
+
+    {
+        char value[256] = "";
+
+        m2_radius_get_attribute_value_by_name(request, "User-Name", value, sizeof(value), M2_STANDARD_AVP);
+        M2_TEST_CHECK(!strcmp(value, "alice"));
+        m2_radius_get_attribute_value_by_name(request, "freeswitch-src-channel", value, sizeof(value), M2_CISCO_AVP);
+        M2_TEST_CHECK(!strcmp(value, "sofia/internal/100"));
+        m2_radius_get_attribute_value_by_name(request, "call-id", value, sizeof(value), M2_CISCO_AVP);
+        M2_TEST_CHECK(!strcmp(value, "abc@10.0.0.1"));
+        m2_radius_get_attribute_value_by_name(request, "Framed-Protocol", value, sizeof(value), M2_STANDARD_AVP);
+        M2_TEST_CHECK(!strcmp(value, "PPP"));
+    }
+
+    M2_TEST_CHECK(m2_radius_get_accounting_type(request) == 2);
+
+}
+
+// index is built once per request and rebuilt when request structure is reused for another packet
+
+static void test_index_reuse(void) {
+
+    REQUEST *request = test_request(1);
+    char value[256] = "";
+    double count = 0;
+
+    m2_radius_get_attribute_value_by_name(request, "User-Name", value, sizeof(value), M2_STANDARD_AVP);
+    count = meter.attr_index_count;
+    m2_radius_get_attribute_value_by_name(request, "Calling-Station-Id", value, sizeof(value), M2_STANDARD_AVP);
+    m2_radius_get_attribute_value_by_name(request, "call-id", value, sizeof(value), M2_CISCO_AVP);
+    M2_TEST_CHECK(meter.attr_index_count == count);
+
+    // names which are not in the list do not touch the index
+    m2_radius_get_attribute_value_by_name(request, "Framed-Protocol", value, sizeof(value), M2_STANDARD_AVP);
+    M2_TEST_CHECK(meter.attr_index_count == count);
+
+    request->number = 2;
+    strcpy(request->packet->vps->strvalue, "carol");
+    m2_radius_get_attribute_value_by_name(request, "User-Name", value, sizeof(value), M2_STANDARD_AVP);
+    M2_TEST_CHECK(meter.attr_index_count == count + 1);
+    M2_TEST_CHECK(!strcmp(value, "carol"));
+
+    request->packet->vps = request->packet->vps->next;
+    value[0] = '\0';
+    m2_radius_get_attribute_value_by_name(request, "User-Name", value, sizeof(value), M2_STANDARD_AVP);
+    M2_TEST_CHECK(meter.attr_index_count == count + 2);
+    M2_TEST_CHECK(!strcmp(value, "bob"));
+
+    M2_TEST_CHECK(meter.attr_index_count_start == meter.attr_index_count);
+
+}
+
+int main(int argc, char **argv) {
+
+    m2_test_init(argc, argv);
+
+    test_seed_search();
+    test_key_find();
+    test_index_matches_scan();
+    test_index_reuse();
+
+    return m2_test_done("attr_index");
+
+}
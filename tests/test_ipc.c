@@ -0,0 +1,377 @@
+/*
+    Local IPC tests
+
+    Handshake with a listener that plays the rating core (same steps as m2_ipc_accept in m2_ipc.c):
+    shared memory and eventfds passed over unix socket, rejected handshakes and layouts, request round trip
+    through a slot and fallback to radius when the core goes away
+*/
+
+
+#include "../mod_xml_m2_radius.c"
+#include "m2_test.h"
+
+#include <dirent.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+
+
+enum {
+    TEST_CORE_OK,
+    TEST_CORE_NO_FDS,
+    TEST_CORE_BAD_VERSION,
+    TEST_CORE_SMALL
+};
+
+static char socket_path[] = "/tmp/m2_test_ipc_XXXXXX";
+
+static struct {
+    int listen_fd;
+    int client_fd;
+    int shm_fd;
+    int request_fd;
+    int reply_fd;
+    unsigned char *map;
+    size_t map_size;
+    int mode;
+    unsigned char request[M2_RADIUS_IPC_PAYLOAD];
+    uint32_t request_code;
+    uint32_t request_length;
+} core = { .listen_fd = -1, .client_fd = -1, .shm_fd = -1, .request_fd = -1, .reply_fd = -1 };
+
+static int test_open_fds(void) {
+
+    DIR *dir = opendir("/proc/self/fd");
+    int count = 0;
+
+    if (dir == NULL) {
+        return -1;
+    }
+
+    while (readdir(dir)) {
+        count++;
+    }
+    closedir(dir);
+
+    return count;
+
+}
+
+// shared memory, eventfds and listening socket of the core, mode selects what is broken in the handshake
+
+static int test_core_start(int mode) {
+
+    char shm_path[] = "/tmp/m2_test_ipc_shm_XXXXXX";
+    struct sockaddr_un addr;
+    m2_radius_ipc_header_t *header = NULL;
+
+    core.mode = mode;
+    core.map_size = sizeof(m2_radius_ipc_header_t) + M2_RADIUS_IPC_SLOTS * sizeof(m2_radius_ipc_slot_t);
+    if (mode == TEST_CORE_SMALL) {
+        core.map_size = sizeof(m2_radius_ipc_header_t) + (M2_RADIUS_IPC_SLOTS / 2) * sizeof(m2_radius_ipc_slot_t);
+    }
+
+    if ((core.shm_fd = mkstemp(shm_path)) < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+    unlink(shm_path);
+
+    if (ftruncate(core.shm_fd, core.map_size) < 0 ||
+        (core.map = mmap(NULL, core.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, core.shm_fd, 0)) == MAP_FAILED) {
+        perror("shared memory");
+        return -1;
+    }
+
+    header = (m2_radius_ipc_header_t *) core.map;
+    header->magic = M2_RADIUS_IPC_MAGIC;
+    header->version = mode == TEST_CORE_BAD_VERSION ? M2_RADIUS_IPC_VERSION + 1 : M2_RADIUS_IPC_VERSION;
+    header->slots = M2_RADIUS_IPC_SLOTS;
+    header->payload = M2_RADIUS_IPC_PAYLOAD;
+
+    core.request_fd = eventfd(0, EFD_NONBLOCK);
+    core.reply_fd = eventfd(0, EFD_NONBLOCK);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    switch_copy_string(addr.sun_path, socket_path, sizeof(addr.sun_path));
+    unlink(socket_path);
+
+    if (core.request_fd < 0 || core.reply_fd < 0 || (core.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(core.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(core.listen_fd, 4) < 0) {
+        perror("listener");
+        return -1;
+    }
+
+    return 0;
+
+}
+
+// listener goes away first, so that module does not reconnect to it
+
+static void test_core_stop(void) {
+
+    if (core.listen_fd >= 0) close(core.listen_fd);
+    unlink(socket_path);
+    if (core.client_fd >= 0) close(core.client_fd);
+    if (core.map) munmap(core.map, core.map_size);
+    close(core.shm_fd);
+    close(core.request_fd);
+    close(core.reply_fd);
+
+    core.listen_fd = core.client_fd = core.shm_fd = core.request_fd = core.reply_fd = -1;
+    core.map = NULL;
+
+}
+
+// accept one client and pass it shared memory and eventfds (plain byte without descriptors in TEST_CORE_NO_FDS mode)
+
+static void *test_core_accept(void *arg) {
+
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg = NULL;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    char byte = 0;
+    int fds[3];
+
+    if ((core.client_fd = accept(core.listen_fd, NULL, NULL)) < 0) {
+        return NULL;
+    }
+
+    ((m2_radius_ipc_header_t *) core.map)->generation++;
+
+    fds[0] = core.shm_fd;
+    fds[1] = core.request_fd;
+    fds[2] = core.reply_fd;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (core.mode != TEST_CORE_NO_FDS) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+
+    if (sendmsg(core.client_fd, &msg, 0) != 1) {
+        perror("sendmsg");
+    }
+
+    return NULL;
+
+}
+
+// answer one request the way m2_ipc_worker does: take the slot, echo attributes back with accounting response
+
+static void *test_core_worker(void *arg) {
+
+    struct pollfd pfd = { core.request_fd, POLLIN, 0 };
+    uint64_t counter = 1;
+    int i;
+
+    if (poll(&pfd, 1, 2000) <= 0 || read(core.request_fd, &counter, sizeof(counter)) < 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < M2_RADIUS_IPC_SLOTS; i++) {
+        m2_radius_ipc_slot_t *slot = (m2_radius_ipc_slot_t *) (core.map + sizeof(m2_radius_ipc_header_t) + (size_t) i * sizeof(m2_radius_ipc_slot_t));
+
+        if (!__sync_bool_compare_and_swap(&slot->state, M2_RADIUS_IPC_SLOT_REQUEST, M2_RADIUS_IPC_SLOT_PROCESSING)) {
+            continue;
+        }
+
+        core.request_code = slot->code;
+        core.request_length = slot->length;
+        memcpy(core.request, slot->data, slot->length);
+
+        slot->code = PW_ACCOUNTING_RESPONSE;
+        __sync_synchronize();
+        slot->state = M2_RADIUS_IPC_SLOT_REPLY;
+        counter = 1;
+        if (write(core.reply_fd, &counter, sizeof(counter)) < 0) {
+            perror("write");
+        }
+        break;
+    }
+
+    return NULL;
+
+}
+
+static int test_connect(int mode) {
+
+    pthread_t thread;
+    int result = 0;
+
+    if (test_core_start(mode) < 0) {
+        return -2;
+    }
+
+    pthread_create(&thread, NULL, test_core_accept, NULL);
+    result = m2_radius_ipc_connect();
+    pthread_join(thread, NULL);
+
+    return result;
+
+}
+
+static void test_disconnect(void) {
+
+    switch_mutex_lock(globals.ipc_mutex);
+    globals.ipc_connected = 0;
+    m2_radius_ipc_release();
+    switch_mutex_unlock(globals.ipc_mutex);
+
+}
+
+static int test_wait_connected(int connected, int timeout_ms) {
+
+    while (globals.ipc_connected != connected && timeout_ms > 0) {
+        usleep(10000);
+        timeout_ms -= 10;
+    }
+
+    return globals.ipc_connected == connected;
+
+}
+
+static void test_no_listener(void) {
+
+    unlink(socket_path);
+    M2_TEST_CHECK(m2_radius_ipc_connect() < 0);
+    M2_TEST_CHECK(!globals.ipc_connected);
+
+}
+
+// handshake that can not be used is refused and leaves no descriptors behind
+
+static void test_rejected(void) {
+
+    int fds = test_open_fds();
+
+    M2_TEST_CHECK(test_connect(TEST_CORE_NO_FDS) == -1);
+    M2_TEST_CHECK(!globals.ipc_connected && globals.ipc_map == NULL);
+    test_core_stop();
+    M2_TEST_CHECK(test_open_fds() == fds);
+
+    M2_TEST_CHECK(test_connect(TEST_CORE_BAD_VERSION) == -1);
+    M2_TEST_CHECK(!globals.ipc_connected && globals.ipc_map == NULL);
+    test_core_stop();
+    M2_TEST_CHECK(test_open_fds() == fds);
+
+    M2_TEST_CHECK(test_connect(TEST_CORE_SMALL) == -1);
+    M2_TEST_CHECK(!globals.ipc_connected && globals.ipc_map == NULL);
+    test_core_stop();
+    M2_TEST_CHECK(test_open_fds() == fds);
+
+}
+
+// module maps the same segment and holds the same eventfds as the core
+
+static void test_handshake(void) {
+
+    m2_radius_ipc_header_t *header = NULL;
+    uint64_t counter = 1;
+    int fds = test_open_fds();
+
+    M2_TEST_CHECK(test_connect(TEST_CORE_OK) == 0);
+    M2_TEST_CHECK(globals.ipc_connected);
+    M2_TEST_CHECK(globals.ipc_map != NULL && globals.ipc_map_size == core.map_size);
+    if (!globals.ipc_connected) return;
+
+    header = (m2_radius_ipc_header_t *) globals.ipc_map;
+    M2_TEST_CHECK(header->magic == M2_RADIUS_IPC_MAGIC && header->generation == 1);
+    ((m2_radius_ipc_header_t *) core.map)->generation++;
+    M2_TEST_CHECK(header->generation == 2);
+
+    M2_TEST_CHECK(write(globals.ipc_request_fd, &counter, sizeof(counter)) == sizeof(counter));
+    counter = 0;
+    M2_TEST_CHECK(read(core.request_fd, &counter, sizeof(counter)) == sizeof(counter) && counter == 1);
+
+    M2_TEST_CHECK(write(core.reply_fd, &counter, sizeof(counter)) == sizeof(counter));
+    counter = 0;
+    M2_TEST_CHECK(read(globals.ipc_reply_fd, &counter, sizeof(counter)) == sizeof(counter) && counter == 1);
+
+    test_disconnect();
+    test_core_stop();
+    M2_TEST_CHECK(test_open_fds() == fds);
+
+}
+
+// request goes through a slot while core listens, after core goes away requests fall back to radius
+
+static void test_round_trip(void) {
+
+    pthread_t accept_thread, worker_thread;
+    VALUE_PAIR session;
+    int result = 0;
+
+    memset(&session, 0, sizeof(session));
+    session.attribute = PW_ACCT_SESSION_ID;
+    session.type = PW_TYPE_STRING;
+    session.lvalue = 6;
+    strcpy(session.strvalue, "call-1");
+
+    if (test_core_start(TEST_CORE_OK) < 0) {
+        M2_TEST_CHECK(0);
+        return;
+    }
+
+    pthread_create(&accept_thread, NULL, test_core_accept, NULL);
+    globals.running = 1;
+    m2_radius_ipc_start();
+    pthread_join(accept_thread, NULL);
+    M2_TEST_CHECK(test_wait_connected(1, 2000));
+
+    pthread_create(&worker_thread, NULL, test_core_worker, NULL);
+    M2_TEST_CHECK(m2_radius_ipc_request(PW_ACCOUNTING_REQUEST, &session, NULL, NULL, NULL, 2000000, &result) == 1);
+    pthread_join(worker_thread, NULL);
+
+    M2_TEST_CHECK(result == OK_RC);
+    M2_TEST_CHECK(core.request_code == PW_ACCOUNTING_REQUEST);
+    M2_TEST_CHECK(core.request_length == 8 && core.request[0] == PW_ACCT_SESSION_ID && core.request[1] == 8 && !memcmp(core.request + 2, "call-1", 6));
+    M2_TEST_CHECK(m2_radius_ipc_slot(0)->state == M2_RADIUS_IPC_SLOT_FREE);
+
+    test_core_stop();
+    M2_TEST_CHECK(test_wait_connected(0, 2000));
+    M2_TEST_CHECK(m2_radius_ipc_request(PW_ACCOUNTING_REQUEST, &session, NULL, NULL, NULL, 2000000, &result) == 0);
+
+    globals.running = 0;
+    m2_radius_ipc_stop();
+    M2_TEST_CHECK(globals.ipc_map == NULL);
+
+}
+
+int main(int argc, char **argv) {
+
+    int fd = -1;
+
+    if ((fd = mkstemp(socket_path)) < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    m2_test_init(argc, argv);
+    switch_mutex_init(&globals.mutex, SWITCH_MUTEX_NESTED, NULL);
+    switch_mutex_init(&globals.ipc_mutex, SWITCH_MUTEX_NESTED, NULL);
+    switch_copy_string(globals.ipc_socket, socket_path, sizeof(globals.ipc_socket));
+
+    test_no_listener();
+    test_rejected();
+    test_handshake();
+    test_round_trip();
+
+    unlink(socket_path);
+
+    return m2_test_done("ipc");
+
+}
@@ -0,0 +1,240 @@
+/*
+    Shard selection tests
+
+    Rendezvous hash spreads keys evenly, does not depend on the order of shards in configuration and moves
+    only the keys of added or removed shard. With shard-rebalance keys with calls in progress stay on their shard
+*/
+
+
+#include "../mod_xml_m2_radius.c"
+#include "m2_test.h"
+
+
+#define TEST_KEYS 40000
+
+static uint32_t test_key(int i) {
+
+    char ip[32];
+
+    snprintf(ip, sizeof(ip), "10.%d.%d.%d", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+
+    return m2_radius_hash_string(ip);
+
+}
+
+static void test_pool(m2_radius_handle_pool_t *hp, int count, ...) {
+
+    va_list ap;
+    int i;
+
+    memset(hp, 0, sizeof(*hp));
+
+    va_start(ap, count);
+    for (i = 0; i < count; i++) {
+        hp->shards[hp->shard_count++] = va_arg(ap, int);
+    }
+    va_end(ap);
+
+}
+
+static void test_pick_basic(void) {
+
+    m2_radius_handle_pool_t hp, reversed;
+    int i;
+
+    test_pool(&hp, 0);
+    M2_TEST_CHECK(m2_radius_shard_pick(&hp, test_key(1)) == 0);
+
+    test_pool(&hp, 1, 7);
+    for (i = 0; i < 100; i++) {
+        M2_TEST_CHECK(m2_radius_shard_pick(&hp, test_key(i)) == 7);
+    }
+
+    // the same key always lands on the same shard, whatever the order of shards in configuration
+    test_pool(&hp, 4, 1, 2, 3, 4);
+    test_pool(&reversed, 4, 4, 3, 2, 1);
+    for (i = 0; i < 1000; i++) {
+        int shard = m2_radius_shard_pick(&hp, test_key(i));
+
+        M2_TEST_CHECK(shard >= 1 && shard <= 4);
+        M2_TEST_CHECK(m2_radius_shard_pick(&hp, test_key(i)) == shard);
+        M2_TEST_CHECK(m2_radius_shard_pick(&reversed, test_key(i)) == shard);
+    }
+
+    M2_TEST_CHECK(m2_radius_shard_exists(&hp, 3));
+    M2_TEST_CHECK(!m2_radius_shard_exists(&hp, 5));
+
+}
+
+static void test_pick_spread(void) {
+
+    m2_radius_handle_pool_t hp;
+    int counts[5] = { 0 };
+    int i;
+
+    test_pool(&hp, 4, 1, 2, 3, 4);
+    for (i = 0; i < TEST_KEYS; i++) {
+        counts[m2_radius_shard_pick(&hp, test_key(i))]++;
+    }
+
+    M2_TEST_CHECK(counts[0] == 0);
+    for (i = 1; i <= 4; i++) {
+        M2_TEST_CHECK(counts[i] > TEST_KEYS / 5 && counts[i] < TEST_KEYS * 3 / 10);
+    }
+
+}
+
+// new shard takes about its share of keys, all from other shards and nothing moves between old shards
+
+static void test_pick_add_remove(void) {
+
+    m2_radius_handle_pool_t four, five, without_two;
+    int moved = 0;
+    int i;
+
+    test_pool(&four, 4, 1, 2, 3, 4);
+    test_pool(&five, 5, 1, 2, 3, 4, 5);
+    test_pool(&without_two, 4, 1, 3, 4, 5);
+
+    for (i = 0; i < TEST_KEYS; i++) {
+        int before = m2_radius_shard_pick(&four, test_key(i));
+        int after = m2_radius_shard_pick(&five, test_key(i));
+
+        if (before != after) {
+            M2_TEST_CHECK(after == 5);
+            moved++;
+        }
+    }
+
+    M2_TEST_CHECK(moved > TEST_KEYS * 3 / 20 && moved < TEST_KEYS / 4);
+
+    moved = 0;
+    for (i = 0; i < TEST_KEYS; i++) {
+        int before = m2_radius_shard_pick(&five, test_key(i));
+        int after = m2_radius_shard_pick(&without_two, test_key(i));
+
+        if (before != after) {
+            M2_TEST_CHECK(before == 2);
+            moved++;
+        } else {
+            M2_TEST_CHECK(before != 2);
+        }
+    }
+
+    M2_TEST_CHECK(moved > TEST_KEYS * 3 / 20 && moved < TEST_KEYS / 4);
+
+}
+
+// key of the call is source ip, call uuid when there is no key
+
+static void test_select_key(void) {
+
+    m2_radius_handle_pool_t hp;
+    switch_channel_t *channel = m2_test_channel_create("uuid-1");
+    char expected[16];
+
+    test_pool(&hp, 0);
+    switch_channel_set_variable(channel, "network_addr", "10.0.0.1");
+    M2_TEST_CHECK(m2_radius_shard_select(channel, &hp, "uuid-1") == 0);
+    M2_TEST_CHECK(switch_channel_get_variable(channel, "m2_radius_shard") == NULL);
+
+    test_pool(&hp, 4, 1, 2, 3, 4);
+    M2_TEST_CHECK(m2_radius_shard_select(channel, &hp, "uuid-1") == m2_radius_shard_pick(&hp, m2_radius_hash_string("10.0.0.1")));
+    snprintf(expected, sizeof(expected), "%u", m2_radius_hash_string("10.0.0.1"));
+    M2_TEST_CHECK(!strcmp(switch_channel_get_variable(channel, "m2_radius_shard_key"), expected));
+
+    switch_channel_set_variable(channel, "sip_received_ip", "10.0.0.2");
+    M2_TEST_CHECK(m2_radius_shard_select(channel, &hp, "uuid-1") == m2_radius_shard_pick(&hp, m2_radius_hash_string("10.0.0.2")));
+
+    switch_copy_string(globals.shard_key, "m2_originator", sizeof(globals.shard_key));
+    switch_channel_set_variable(channel, "m2_originator", "42");
+    M2_TEST_CHECK(m2_radius_shard_select(channel, &hp, "uuid-1") == m2_radius_shard_pick(&hp, m2_radius_hash_string("42")));
+
+    switch_channel_set_variable(channel, "m2_originator", NULL);
+    M2_TEST_CHECK(m2_radius_shard_select(channel, &hp, "uuid-1") == m2_radius_shard_pick(&hp, m2_radius_hash_string("uuid-1")));
+
+    switch_copy_string(globals.shard_key, "source-ip", sizeof(globals.shard_key));
+
+}
+
+// after a shard is added, key keeps the old shard while its calls are in progress and moves when they end
+
+static void test_select_sticky(void) {
+
+    m2_radius_handle_pool_t hp;
+    switch_channel_t *first = m2_test_channel_create("uuid-1");
+    switch_channel_t *second = m2_test_channel_create("uuid-2");
+    switch_channel_t *third = m2_test_channel_create("uuid-3");
+    m2_radius_meter_t meter;
+    uint32_t key_hash = m2_radius_hash_string("10.0.0.1");
+    int old_shard = 0;
+    int new_shard = 0;
+
+    switch_channel_set_variable(first, "network_addr", "10.0.0.1");
+    switch_channel_set_variable(second, "network_addr", "10.0.0.1");
+    switch_channel_set_variable(third, "network_addr", "10.0.0.1");
+
+    test_pool(&hp, 4, 1, 2, 3, 4);
+    globals.shard_rebalance = 1;
+    old_shard = m2_radius_shard_select(first, &hp, "uuid-1");
+    m2_radius_shard_call_start(first, old_shard);
+    M2_TEST_CHECK(switch_true(switch_channel_get_variable(first, "m2_radius_shard_counted")));
+    M2_TEST_CHECK(m2_radius_shard_key_get(key_hash)->calls == 1);
+
+    // add shards until one of them wins this key
+    for (new_shard = 5; hp.shard_count < M2_RADIUS_MAX_SHARDS; new_shard++) {
+        hp.shards[hp.shard_count++] = new_shard;
+        if (m2_radius_shard_pick(&hp, key_hash) == new_shard) break;
+    }
+    M2_TEST_CHECK(m2_radius_shard_pick(&hp, key_hash) == new_shard);
+
+    M2_TEST_CHECK(m2_radius_shard_select(second, &hp, "uuid-2") == old_shard);
+    m2_radius_meter_snapshot(&meter);
+    M2_TEST_CHECK(meter.shard_sticky == 1);
+
+    // without rebalance the hash decides alone
+    globals.shard_rebalance = 0;
+    M2_TEST_CHECK(m2_radius_shard_select(third, &hp, "uuid-3") == new_shard);
+    globals.shard_rebalance = 1;
+
+    // sticky entry expires after shard-sticky-ttl even if calls were never reported
+    m2_radius_shard_key_get(key_hash)->updated -= (switch_time_t) (globals.shard_sticky_ttl + 1) * 1000000;
+    M2_TEST_CHECK(m2_radius_shard_select(third, &hp, "uuid-3") == new_shard);
+    m2_radius_shard_key_get(key_hash)->updated = switch_micro_time_now();
+
+    // call end is counted once, then the key moves to the new shard
+    m2_radius_shard_call_end(first);
+    m2_radius_shard_call_end(first);
+    M2_TEST_CHECK(m2_radius_shard_key_get(key_hash)->calls == 0);
+    M2_TEST_CHECK(switch_channel_get_variable(first, "m2_radius_shard_counted") == NULL);
+    M2_TEST_CHECK(m2_radius_shard_select(third, &hp, "uuid-3") == new_shard);
+
+    // removed shard is never kept
+    m2_radius_shard_call_start(first, old_shard);
+    hp.shard_count = 0;
+    for (new_shard = 1; new_shard <= 8; new_shard++) {
+        if (new_shard != old_shard) hp.shards[hp.shard_count++] = new_shard;
+    }
+    M2_TEST_CHECK(m2_radius_shard_select(third, &hp, "uuid-3") != old_shard);
+
+    globals.shard_rebalance = 0;
+
+}
+
+int main(int argc, char **argv) {
+
+    m2_test_init(argc, argv);
+    switch_mutex_init(&globals.shard_mutex, SWITCH_MUTEX_NESTED, NULL);
+    globals.shard_keys = switch_core_alloc(NULL, sizeof(m2_radius_shard_key_t) * M2_RADIUS_SHARD_KEY_TABLE_SIZE);
+    globals.shard_sticky_ttl = 14400;
+    switch_copy_string(globals.shard_key, "source-ip", sizeof(globals.shard_key));
+
+    test_pick_basic();
+    test_pick_spread();
+    test_pick_add_remove();
+    test_select_key();
+    test_select_sticky();
+
+    return m2_test_done("shard");
+
+}
@@ -0,0 +1,286 @@
+/*
+    Accounting spool tests
+
+    Ring layout, record checksum, skipping of damaged records, pending calls after restart
+    and migration of version 2 (linear) spool files
+*/
+
+
+#include "../mod_xml_m2_radius.c"
+#include "m2_test.h"
+
+
+static char spool_path[] = "/tmp/m2_test_spool_XXXXXX";
+
+static VALUE_PAIR test_attrs[2];
+
+static void test_job(m2_radius_acct_job_t *job, const char *call_uuid, int acctstart, const char *value) {
+
+    memset(job, 0, sizeof(*job));
+    memset(test_attrs, 0, sizeof(test_attrs));
+
+    test_attrs[0].attribute = 44;
+    test_attrs[0].type = PW_TYPE_STRING;
+    test_attrs[0].lvalue = (uint32_t) strlen(value);
+    switch_copy_string(test_attrs[0].strvalue, value, sizeof(test_attrs[0].strvalue));
+    test_attrs[0].next = &test_attrs[1];
+    test_attrs[1].attribute = 46;
+    test_attrs[1].type = PW_TYPE_INTEGER;
+    test_attrs[1].lvalue = 60;
+
+    job->acctstart = acctstart;
+    job->send = test_attrs;
+    switch_copy_string(job->uuid, call_uuid, sizeof(job->uuid));
+    switch_copy_string(job->call_uuid, call_uuid, sizeof(job->call_uuid));
+    switch_copy_string(job->acct_type, acctstart ? "start" : "stop", sizeof(job->acct_type));
+
+}
+
+static void test_append(const char *call_uuid, int acctstart, const char *value) {
+
+    m2_radius_acct_job_t job;
+
+    test_job(&job, call_uuid, acctstart, value);
+    M2_TEST_CHECK(m2_radius_spool_append(&job) == SWITCH_STATUS_SUCCESS);
+
+}
+
+static m2_radius_spool_header_t *test_header(void) {
+
+    return (m2_radius_spool_header_t *) globals.spool_map;
+
+}
+
+static m2_radius_spool_record_t *test_head_record(void) {
+
+    return (m2_radius_spool_record_t *) (globals.spool_map + test_header()->head);
+
+}
+
+static void test_open(void) {
+
+    switch_copy_string(globals.spool_file, spool_path, sizeof(globals.spool_file));
+    globals.spool_size = M2_RADIUS_SPOOL_MIN_SIZE;
+    M2_TEST_CHECK(m2_radius_spool_open() == SWITCH_STATUS_SUCCESS);
+    M2_TEST_CHECK(globals.spool_map != NULL);
+
+}
+
+// CRC-32 check value from the standard
+
+static void test_crc(void) {
+
+    m2_radius_crc32_init();
+    M2_TEST_CHECK(m2_radius_crc32((const unsigned char *) "123456789", 9) == 0xcbf43926);
+
+}
+
+static void test_append_and_pop(void) {
+
+    m2_radius_spool_record_t *record = NULL;
+    uint64_t record_size = 0;
+
+    unlink(spool_path);
+    test_open();
+
+    test_append("call-1", 1, "session-1");
+    test_append("call-2", 1, "session-2");
+    test_append("call-1", 0, "session-1");
+
+    M2_TEST_CHECK(test_header()->records == 3);
+    M2_TEST_CHECK(m2_radius_spool_pending());
+    M2_TEST_CHECK(m2_radius_spool_call_pending("call-1"));
+    M2_TEST_CHECK(m2_radius_spool_call_pending("call-2"));
+    M2_TEST_CHECK(!m2_radius_spool_call_pending("call-3"));
+
+    // records come back in order with valid checksum and payload
+    record = test_head_record();
+    M2_TEST_CHECK((record_size = m2_radius_spool_record_check(test_header())) > 0);
+    M2_TEST_CHECK(record->crc == m2_radius_spool_record_crc(record));
+    M2_TEST_CHECK(!strcmp(record->call_uuid, "call-1") && record->acctstart == 1);
+    M2_TEST_CHECK(record->length == 3 * sizeof(uint32_t) + strlen("session-1") + 3 * sizeof(uint32_t));
+    M2_TEST_CHECK(!memcmp((unsigned char *) record + sizeof(m2_radius_spool_record_t) + 3 * sizeof(uint32_t), "session-1", strlen("session-1")));
+    m2_radius_spool_pop(record_size, record->call_uuid);
+
+    record = test_head_record();
+    M2_TEST_CHECK((record_size = m2_radius_spool_record_check(test_header())) > 0);
+    M2_TEST_CHECK(!strcmp(record->call_uuid, "call-2"));
+    m2_radius_spool_pop(record_size, record->call_uuid);
+    M2_TEST_CHECK(!m2_radius_spool_call_pending("call-2"));
+    M2_TEST_CHECK(m2_radius_spool_call_pending("call-1"));
+
+    record = test_head_record();
+    M2_TEST_CHECK((record_size = m2_radius_spool_record_check(test_header())) > 0);
+    M2_TEST_CHECK(!strcmp(record->call_uuid, "call-1") && record->acctstart == 0);
+    m2_radius_spool_pop(record_size, record->call_uuid);
+
+    // empty spool starts again from the beginning of the file
+    M2_TEST_CHECK(!m2_radius_spool_pending());
+    M2_TEST_CHECK(!m2_radius_spool_call_pending("call-1"));
+    M2_TEST_CHECK(test_header()->head == M2_RADIUS_SPOOL_HEADER_SIZE && test_header()->tail == M2_RADIUS_SPOOL_HEADER_SIZE);
+
+    m2_radius_spool_close();
+
+}
+
+// full spool refuses new records, after the head moves on records wrap to the beginning of the file
+
+static void test_wrap(void) {
+
+    char value[200];
+    uint64_t record_size = 0;
+    int appended = 0;
+    int popped = 0;
+    int i;
+
+    unlink(spool_path);
+    test_open();
+
+    memset(value, 'x', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+
+    for (;;) {
+        m2_radius_acct_job_t job;
+        char call_uuid[32];
+
+        snprintf(call_uuid, sizeof(call_uuid), "call-%d", appended);
+        test_job(&job, call_uuid, 1, value);
+        if (m2_radius_spool_append(&job) != SWITCH_STATUS_SUCCESS) {
+            break;
+        }
+        appended++;
+    }
+
+    M2_TEST_CHECK(appended > 100);
+    M2_TEST_CHECK((int) test_header()->records == appended);
+
+    for (i = 0; i < 10; i++) {
+        M2_TEST_CHECK((record_size = m2_radius_spool_record_check(test_header())) > 0);
+        m2_radius_spool_pop(record_size, test_head_record()->call_uuid);
+        popped++;
+    }
+
+    test_append("call-wrapped", 1, value);
+    M2_TEST_CHECK(test_header()->tail < test_header()->head);
+
+    // everything is replayed in append order, the wrapped record comes last
+    for (i = popped; i < appended; i++) {
+        char call_uuid[32];
+
+        snprintf(call_uuid, sizeof(call_uuid), "call-%d", i);
+        M2_TEST_CHECK((record_size = m2_radius_spool_record_check(test_header())) > 0);
+        M2_TEST_CHECK(!strcmp(test_head_record()->call_uuid, call_uuid));
+        m2_radius_spool_pop(record_size, test_head_record()->call_uuid);
+    }
+
+    M2_TEST_CHECK(m2_radius_spool_record_check(test_header()) > 0);
+    M2_TEST_CHECK(!strcmp(test_head_record()->call_uuid, "call-wrapped"));
+    M2_TEST_CHECK(test_header()->records == 1);
+
+    m2_radius_spool_close();
+
+}
+
+// damaged record is skipped, records behind it are kept and still counted after restart
+
+static void test_skip_damaged(void) {
+
+    uint64_t skipped = 0;
+    uint64_t first_size = 0;
+
+    unlink(spool_path);
+    test_open();
+
+    test_append("call-1", 1, "session-1");
+    test_append("call-2", 1, "session-2");
+    test_append("call-3", 1, "session-3");
+
+    first_size = m2_radius_spool_record_check(test_header());
+    ((unsigned char *) test_head_record())[sizeof(m2_radius_spool_record_t) + 13] ^= 0xff;
+    M2_TEST_CHECK(m2_radius_spool_record_check(test_header()) == 0);
+
+    m2_radius_spool_close();
+    test_open();
+
+    // pending calls are counted from valid records only
+    M2_TEST_CHECK(!m2_radius_spool_call_pending("call-1"));
+    M2_TEST_CHECK(m2_radius_spool_call_pending("call-2"));
+    M2_TEST_CHECK(m2_radius_spool_call_pending("call-3"));
+
+    skipped = m2_radius_spool_skip_damaged(test_header());
+    M2_TEST_CHECK(skipped == first_size);
+    M2_TEST_CHECK(test_header()->records == 2);
+    M2_TEST_CHECK(m2_radius_spool_record_check(test_header()) > 0);
+    M2_TEST_CHECK(!strcmp(test_head_record()->call_uuid, "call-2"));
+
+    // valid record at head is never skipped
+    M2_TEST_CHECK(m2_radius_spool_skip_damaged(test_header()) == 0);
+
+    m2_radius_spool_close();
+
+}
+
+// version 2 spool had no used counter, records between head and tail are kept
+
+static void test_migrate_linear(void) {
+
+    m2_radius_spool_header_t *header = NULL;
+    uint64_t used = 0;
+
+    unlink(spool_path);
+    test_open();
+
+    test_append("call-1", 1, "session-1");
+    test_append("call-2", 0, "session-2");
+
+    header = test_header();
+    used = header->used;
+    header->version = M2_RADIUS_SPOOL_VERSION_LINEAR;
+    header->used = 0;
+
+    m2_radius_spool_close();
+    test_open();
+
+    header = test_header();
+    M2_TEST_CHECK(header->version == M2_RADIUS_SPOOL_VERSION);
+    M2_TEST_CHECK(header->used == used);
+    M2_TEST_CHECK(header->records == 2);
+    M2_TEST_CHECK(m2_radius_spool_call_pending("call-1"));
+    M2_TEST_CHECK(m2_radius_spool_call_pending("call-2"));
+    M2_TEST_CHECK(!strcmp(test_head_record()->call_uuid, "call-1"));
+
+    // header that does not make sense resets the spool
+    header->head = header->size + 8;
+    m2_radius_spool_close();
+    test_open();
+
+    M2_TEST_CHECK(!m2_radius_spool_pending());
+    M2_TEST_CHECK(!m2_radius_spool_call_pending("call-1"));
+
+    m2_radius_spool_close();
+
+}
+
+int main(int argc, char **argv) {
+
+    int fd = -1;
+
+    if ((fd = mkstemp(spool_path)) < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    m2_test_init(argc, argv);
+
+    test_crc();
+    test_append_and_pop();
+    test_wrap();
+    test_skip_damaged();
+    test_migrate_linear();
+
+    unlink(spool_path);
+
+    return m2_test_done("spool");
+
+}
@@ -0,0 +1,268 @@
+/*
+    Multiplexed transport tests
+
+    Identifier allocation across sockets and reply matching by identifier and response authenticator,
+    against a plain UDP socket on localhost playing the radius server
+*/
+
+
+#include "../mod_xml_m2_radius.c"
+#include "m2_test.h"
+
+
+#define TEST_SECRET "testing123"
+#define TEST_REQUESTS 300
+
+typedef struct {
+    unsigned char packet[M2_RADIUS_PACKET_MAX];
+    int length;
+    struct sockaddr_in from;
+} test_packet_t;
+
+static int server_fd = -1;
+static test_packet_t received[TEST_REQUESTS];
+
+static int test_server_open(void) {
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    server_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (server_fd < 0 || bind(server_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || getsockname(server_fd, (struct sockaddr *) &addr, &addr_len) < 0) {
+        perror("server socket");
+        return -1;
+    }
+
+    return ntohs(addr.sin_port);
+
+}
+
+static int test_server_recv(test_packet_t *packet) {
+
+    socklen_t from_len = sizeof(packet->from);
+    struct pollfd pfd = { server_fd, POLLIN, 0 };
+
+    if (poll(&pfd, 1, 2000) <= 0) {
+        return -1;
+    }
+
+    packet->length = (int) recvfrom(server_fd, packet->packet, sizeof(packet->packet), 0, (struct sockaddr *) &packet->from, &from_len);
+
+    return packet->length;
+
+}
+
+// reply with response authenticator, secret is wrong when bad_auth is set
+
+static void test_server_reply(test_packet_t *request, int code, int bad_auth, int declared_length) {
+
+    unsigned char reply[64 + sizeof(TEST_SECRET)];
+    int length = 20;
+
+    reply[0] = (unsigned char) code;
+    reply[1] = request->packet[1];
+    reply[2] = (unsigned char) (declared_length >> 8);
+    reply[3] = (unsigned char) (declared_length & 0xff);
+    memcpy(reply + 4, request->packet + 4, 16);
+    memcpy(reply + length, TEST_SECRET, strlen(TEST_SECRET));
+    if (bad_auth) reply[length] ^= 1;
+    switch_md5(reply + 4, reply, length + strlen(TEST_SECRET));
+
+    sendto(server_fd, reply, length, 0, (struct sockaddr *) &request->from, sizeof(request->from));
+
+}
+
+static int test_wait_done(m2_radius_request_t *request, int timeout_ms) {
+
+    int done = 0;
+
+    for (;;) {
+        switch_mutex_lock(request->mutex);
+        done = request->done;
+        switch_mutex_unlock(request->mutex);
+        if (done || timeout_ms <= 0) break;
+        usleep(10000);
+        timeout_ms -= 10;
+    }
+
+    return done;
+
+}
+
+static m2_radius_request_t *test_find(m2_radius_transport_t *transport, test_packet_t *packet) {
+
+    struct sockaddr_in local;
+    socklen_t local_len;
+    int i;
+
+    // packet is matched to the socket by its source port, then by identifier
+    for (i = 0; i < transport->socket_count; i++) {
+        local_len = sizeof(local);
+        getsockname(transport->sockets[i].fd, (struct sockaddr *) &local, &local_len);
+        if (local.sin_port == packet->from.sin_port) {
+            return transport->sockets[i].pending[packet->packet[1]];
+        }
+    }
+
+    return NULL;
+
+}
+
+// MD5 check values from RFC 1321
+
+static void test_md5(void) {
+
+    unsigned char digest[SWITCH_MD5_DIGESTSIZE];
+    const unsigned char abc[] = { 0x90, 0x01, 0x50, 0x98, 0x3c, 0xd2, 0x4f, 0xb0, 0xd6, 0x96, 0x3f, 0x7d, 0x28, 0xe1, 0x7f, 0x72 };
+
+    switch_md5(digest, "abc", 3);
+    M2_TEST_CHECK(!memcmp(digest, abc, sizeof(abc)));
+
+}
+
+static void test_transport(int port) {
+
+    m2_radius_transport_t *transport = NULL;
+    m2_radius_request_t *requests[TEST_REQUESTS];
+    int answered[TEST_REQUESTS];
+    VALUE_PAIR session;
+    char server[64];
+    int seen[M2_RADIUS_TRANSPORT_MAX_SOCKETS][256];
+    int i;
+
+    memset(&session, 0, sizeof(session));
+    session.attribute = PW_ACCT_SESSION_ID;
+    session.type = PW_TYPE_STRING;
+    session.lvalue = 6;
+    strcpy(session.strvalue, "call-1");
+
+    snprintf(server, sizeof(server), "127.0.0.1:%d:%s", port, TEST_SECRET);
+    transport = m2_radius_transport_create(NULL, server, "test", "", 0, 4);
+    M2_TEST_CHECK(transport != NULL);
+    if (transport == NULL) return;
+
+    // 256 identifiers per socket, the next request opens the second socket (packets are read one by one, so socket buffer never overflows)
+    for (i = 0; i < TEST_REQUESTS; i++) {
+        requests[i] = m2_radius_transport_start(transport, PW_ACCOUNTING_REQUEST, &session, 10000000, 10000000, 0, NULL);
+        M2_TEST_CHECK(requests[i] != NULL);
+        if (requests[i] == NULL) return;
+        M2_TEST_CHECK(test_server_recv(&received[i]) > 20);
+        M2_TEST_CHECK(test_find(transport, &received[i]) == requests[i]);
+    }
+
+    M2_TEST_CHECK(transport->socket_count == 2);
+    M2_TEST_CHECK(transport->sockets[0].in_flight == 256);
+    M2_TEST_CHECK(transport->sockets[1].in_flight == TEST_REQUESTS - 256);
+
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < TEST_REQUESTS; i++) {
+        m2_radius_transport_socket_t *sock = (m2_radius_transport_socket_t *) requests[i]->sock;
+        int s = (int) (sock - transport->sockets);
+
+        M2_TEST_CHECK(seen[s][requests[i]->id] == 0);
+        seen[s][requests[i]->id] = 1;
+        M2_TEST_CHECK(sock->pending[requests[i]->id] == requests[i]);
+    }
+
+    // reply with wrong authenticator and reply with too short length are ignored, request keeps waiting
+    test_server_reply(&received[0], PW_ACCOUNTING_RESPONSE, 1, 20);
+    test_server_reply(&received[0], PW_ACCOUNTING_RESPONSE, 0, 19);
+    usleep(100000);
+    M2_TEST_CHECK(!test_wait_done(requests[0], 10));
+    M2_TEST_CHECK(transport->bad_replies == 1);
+
+    // correct replies complete exactly the matching requests
+    memset(answered, 0, sizeof(answered));
+    for (i = 0; i < TEST_REQUESTS; i += 2) {
+        test_server_reply(&received[i], PW_ACCOUNTING_RESPONSE, 0, 20);
+        answered[i] = 1;
+    }
+
+    for (i = 0; i < TEST_REQUESTS; i++) {
+        M2_TEST_CHECK(test_wait_done(requests[i], answered[i] ? 1000 : 0) == answered[i]);
+        if (answered[i]) {
+            M2_TEST_CHECK(requests[i]->result == OK_RC);
+        }
+    }
+
+    // duplicate reply for completed request is counted as bad
+    test_server_reply(&received[2], PW_ACCOUNTING_RESPONSE, 0, 20);
+    usleep(100000);
+    M2_TEST_CHECK(transport->bad_replies == 2);
+
+    // finish releases identifiers of both answered and still waiting requests
+    for (i = 0; i < TEST_REQUESTS; i++) {
+        int result = m2_radius_transport_finish(transport, requests[i], NULL, NULL, NULL);
+
+        M2_TEST_CHECK(result == OK_RC || result == TIMEOUT_RC);
+    }
+
+    M2_TEST_CHECK(transport->sockets[0].in_flight == 0);
+    M2_TEST_CHECK(transport->sockets[1].in_flight == 0);
+
+    m2_radius_transport_destroy(transport);
+
+}
+
+// unanswered request is retransmitted with the same identifier and then times out
+
+static void test_timeout(int port) {
+
+    m2_radius_transport_t *transport = NULL;
+    m2_radius_request_t *request = NULL;
+    test_packet_t first, retry;
+    char server[64];
+
+    snprintf(server, sizeof(server), "127.0.0.1:%d", port);
+    transport = m2_radius_transport_create(NULL, server, "test", TEST_SECRET, 0, 1);
+    M2_TEST_CHECK(transport != NULL);
+    if (transport == NULL) return;
+
+    request = m2_radius_transport_start(transport, PW_ACCOUNTING_REQUEST, NULL, 50000, 100000, 1, NULL);
+    M2_TEST_CHECK(request != NULL);
+    if (request == NULL) return;
+
+    M2_TEST_CHECK(test_server_recv(&first) > 0);
+    M2_TEST_CHECK(test_server_recv(&retry) > 0);
+    M2_TEST_CHECK(first.packet[1] == retry.packet[1] && first.length == retry.length && !memcmp(first.packet, retry.packet, first.length));
+
+    M2_TEST_CHECK(test_wait_done(request, 2000));
+    M2_TEST_CHECK(request->result == TIMEOUT_RC);
+    M2_TEST_CHECK(transport->retransmits == 1);
+    M2_TEST_CHECK(transport->sockets[0].in_flight == 0);
+
+    // late reply after timeout does not match anything
+    test_server_reply(&first, PW_ACCOUNTING_RESPONSE, 0, 20);
+    usleep(100000);
+    M2_TEST_CHECK(transport->bad_replies == 1);
+
+    M2_TEST_CHECK(m2_radius_transport_finish(transport, request, NULL, NULL, NULL) == TIMEOUT_RC);
+
+    m2_radius_transport_destroy(transport);
+
+}
+
+int main(int argc, char **argv) {
+
+    int port = 0;
+
+    m2_test_init(argc, argv);
+    switch_mutex_init(&globals.mutex, SWITCH_MUTEX_NESTED, NULL);
+
+    if ((port = test_server_open()) < 0) {
+        return 1;
+    }
+
+    test_md5();
+    test_transport(port);
+    test_timeout(port);
+
+    close(server_fd);
+
+    return m2_test_done("transport");
+
+}